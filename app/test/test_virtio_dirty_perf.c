@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_malloc.h>
+#include <rte_random.h>
+#include <rte_vect.h>
+#include <rte_dev.h>
+
+#include <virtio_api.h>
+#include <virtio_lm.h>
+
+#include "test.h"
+
+/*
+ * Host CPU cost of folding a device dirty map into the vhost log, for the
+ * pull bitmap and bytemap modes. Each pass covers a 4 GB slice of guest
+ * memory and the result is scaled to a 1 TB guest.
+ */
+
+#define DIRTY_PAGE_SIZE 4096
+#define DIRTY_PAGES (1ULL << 20)
+#define DIRTY_GUEST_SCALE ((1ULL << 40) / (DIRTY_PAGES * DIRTY_PAGE_SIZE))
+#define DIRTY_ITERATIONS 64
+
+static const unsigned int dirty_percents[] = { 0, 1, 10, 100 };
+
+static const struct {
+	uint16_t bitwidth;
+	const char *name;
+} dirty_simds[] = {
+	{ RTE_VECT_SIMD_DISABLED, "scalar" },
+	{ RTE_VECT_SIMD_128, "128-bit" },
+	{ RTE_VECT_SIMD_256, "256-bit" },
+	{ RTE_VECT_SIMD_512, "512-bit" },
+};
+
+struct dirty_perf_ctx {
+	uint8_t *pattern; /* Bytemap as written by the device */
+	uint8_t *bytemap;
+	uint64_t *bitmap;
+	uint64_t *log;
+	uint64_t *ref_log;
+};
+
+static void
+dirty_perf_report(const char *mode, uint64_t cycles)
+{
+	uint64_t per_iter = cycles / DIRTY_ITERATIONS;
+
+	printf("  %-16s %10" PRIu64 " cycles/pass, %8.3f ms per 1 TB guest\n",
+	       mode, per_iter,
+	       (double)per_iter * DIRTY_GUEST_SCALE * 1000 / rte_get_tsc_hz());
+}
+
+static void
+dirty_perf_fill(struct dirty_perf_ctx *ctx, unsigned int percent)
+{
+	uint64_t i;
+
+	memset(ctx->bitmap, 0, DIRTY_PAGES / 8);
+	for (i = 0; i < DIRTY_PAGES; i++) {
+		ctx->pattern[i] = rte_rand_max(100) < percent;
+		if (ctx->pattern[i])
+			ctx->bitmap[i / 64] |= rte_cpu_to_le_64(1ULL << (i % 64));
+	}
+}
+
+static int
+dirty_perf_bytemap(struct dirty_perf_ctx *ctx, const char *name)
+{
+	uint64_t cycles = 0, start;
+	unsigned int i;
+
+	memset(ctx->log, 0, DIRTY_PAGES / 8);
+	for (i = 0; i < DIRTY_ITERATIONS; i++) {
+		memcpy(ctx->bytemap, ctx->pattern, DIRTY_PAGES);
+		start = rte_rdtsc_precise();
+		virtio_vdpa_dirty_bytemap_merge(ctx->bytemap, DIRTY_PAGES,
+				ctx->log, 0);
+		cycles += rte_rdtsc_precise() - start;
+	}
+
+	if (memcmp(ctx->log, ctx->ref_log, DIRTY_PAGES / 8)) {
+		printf("%s bytemap merge differs from bitmap merge\n", name);
+		return -1;
+	}
+	for (i = 0; i < DIRTY_PAGES; i++) {
+		if (ctx->bytemap[i]) {
+			printf("%s bytemap merge left page %u dirty\n", name, i);
+			return -1;
+		}
+	}
+
+	dirty_perf_report(name, cycles);
+	return 0;
+}
+
+static int
+test_virtio_dirty_perf(void)
+{
+	uint16_t bitwidth = rte_vect_get_max_simd_bitwidth();
+	struct dirty_perf_ctx ctx;
+	uint64_t cycles, start;
+	char name[32];
+	unsigned int p, s, i;
+	int ret = TEST_SUCCESS;
+	bool forced;
+
+	ctx.pattern = rte_malloc(NULL, DIRTY_PAGES, RTE_CACHE_LINE_SIZE);
+	ctx.bytemap = rte_malloc(NULL, DIRTY_PAGES, RTE_CACHE_LINE_SIZE);
+	ctx.bitmap = rte_malloc(NULL, DIRTY_PAGES / 8, RTE_CACHE_LINE_SIZE);
+	ctx.log = rte_malloc(NULL, DIRTY_PAGES / 8, RTE_CACHE_LINE_SIZE);
+	ctx.ref_log = rte_malloc(NULL, DIRTY_PAGES / 8, RTE_CACHE_LINE_SIZE);
+	if (!ctx.pattern || !ctx.bytemap || !ctx.bitmap || !ctx.log ||
+	    !ctx.ref_log) {
+		printf("Failed to allocate dirty maps\n");
+		ret = TEST_FAILED;
+		goto out;
+	}
+
+	rte_srand(42);
+	for (p = 0; p < RTE_DIM(dirty_percents); p++) {
+		dirty_perf_fill(&ctx, dirty_percents[p]);
+		printf("%u%% pages dirty:\n", dirty_percents[p]);
+
+		memset(ctx.ref_log, 0, DIRTY_PAGES / 8);
+		cycles = 0;
+		for (i = 0; i < DIRTY_ITERATIONS; i++) {
+			start = rte_rdtsc_precise();
+			virtio_vdpa_dirty_bitmap_merge(ctx.bitmap, DIRTY_PAGES,
+					ctx.ref_log, 0);
+			cycles += rte_rdtsc_precise() - start;
+		}
+		dirty_perf_report("bitmap", cycles);
+
+		for (s = 0; s < RTE_DIM(dirty_simds); s++) {
+			/* A width forced on the command line can't be changed */
+			forced = rte_vect_set_max_simd_bitwidth(
+					dirty_simds[s].bitwidth) != 0;
+			snprintf(name, sizeof(name), "bytemap %s",
+				 forced ? "forced" : dirty_simds[s].name);
+			if (dirty_perf_bytemap(&ctx, name)) {
+				ret = TEST_FAILED;
+				break;
+			}
+			if (forced)
+				break;
+		}
+		rte_vect_set_max_simd_bitwidth(bitwidth);
+		if (ret != TEST_SUCCESS)
+			break;
+	}
+
+out:
+	rte_free(ctx.pattern);
+	rte_free(ctx.bytemap);
+	rte_free(ctx.bitmap);
+	rte_free(ctx.log);
+	rte_free(ctx.ref_log);
+	return ret;
+}
+
+REGISTER_TEST_COMMAND(virtio_dirty_perf_autotest, test_virtio_dirty_perf);
@@ -0,0 +1,526 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_ether.h>
+#include <rte_launch.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_memzone.h>
+#include <rte_pci.h>
+#include <rte_pause.h>
+#include <rte_bus_vdev.h>
+
+#include <virtio_api.h>
+#include <virtio_admin.h>
+#include <virtio_lm.h>
+
+#include "test.h"
+
+/*
+ * Device side of VF live migration, in place and without a VM, against
+ * the software PF: its numbers reflect the host side only. The VFs are
+ * migrated concurrently, each on its own lcore when enough are given.
+ * Dirty tracking starts, the map is fetched while the VF runs, then the
+ * VF is frozen, its map fetched again, its state saved and restored back
+ * and the VF resumed. Timings of each phase are printed once done.
+ */
+
+#define LM_PERF_NAME "vdpa_virtio_mi_sw_lm_perf"
+#define LM_PERF_BDF "ffff:fc:00.0"
+#define LM_PERF_NUM_VFS 8
+#define LM_PERF_STATE_SIZE (1024 * 1024)
+#define LM_PERF_ITERS 10
+#define LM_PERF_MEM_GB 4
+
+#define LM_BENCH_PAGE_SIZE 4096
+#define LM_BENCH_GB (1ULL << 30)
+#define LM_BENCH_MAP_WINDOW (1U << 20)
+#define LM_BENCH_CHUNK_SIZE (64 * 1024)
+#define LM_BENCH_NB_CHUNKS 8
+
+enum lm_bench_phase {
+	LM_BENCH_FREEZE,
+	LM_BENCH_FETCH_RUNNING,
+	LM_BENCH_FETCH_FROZEN,
+	LM_BENCH_SAVE,
+	LM_BENCH_RESTORE,
+	LM_BENCH_RESUME,
+	LM_BENCH_STOP_COPY,
+	LM_BENCH_PHASES,
+};
+
+static const char * const lm_bench_phase_names[LM_BENCH_PHASES] = {
+	[LM_BENCH_FREEZE] = "freeze",
+	[LM_BENCH_FETCH_RUNNING] = "dirty fetch/GB, running",
+	[LM_BENCH_FETCH_FROZEN] = "dirty fetch/GB, frozen",
+	[LM_BENCH_SAVE] = "state save",
+	[LM_BENCH_RESTORE] = "state restore",
+	[LM_BENCH_RESUME] = "resume",
+	[LM_BENCH_STOP_COPY] = "stop-copy total",
+};
+
+struct lm_bench_conf {
+	char pf[PCI_PRI_STR_SIZE]; /* PF managed by the virtio_mi driver */
+	uint16_t nb_vfs; /* VFs 1 to nb_vfs are migrated concurrently */
+	uint32_t iters;
+	uint32_t mem_gb; /* Guest memory tracked per VF */
+};
+
+struct lm_bench_stat {
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t n;
+};
+
+struct lm_bench_vf {
+	uint16_t vdev_id;
+	enum virtio_dirty_track_mode mode;
+	const struct rte_memzone *map;
+	uint8_t *state;
+	uint64_t state_cap;
+	uint64_t state_len;
+	uint64_t state_bytes; /* Saved over all iterations */
+	struct lm_bench_stat stats[LM_BENCH_PHASES];
+};
+
+struct lm_bench {
+	const struct lm_bench_conf *conf;
+	struct virtio_vdpa_pf_priv *priv;
+	struct lm_bench_vf *vfs;
+	unsigned int nb_workers;
+	uint32_t barrier_cnt;
+	uint32_t barrier_gen;
+	int error;
+	struct lm_bench_stat wall;
+};
+
+static void
+lm_bench_stat_add(struct lm_bench_stat *stat, uint64_t cycles)
+{
+	if (!stat->n || cycles < stat->min)
+		stat->min = cycles;
+	if (cycles > stat->max)
+		stat->max = cycles;
+	stat->sum += cycles;
+	stat->n++;
+}
+
+static void
+lm_bench_stat_merge(struct lm_bench_stat *to, const struct lm_bench_stat *from)
+{
+	if (!from->n)
+		return;
+	if (!to->n || from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+	to->sum += from->sum;
+	to->n += from->n;
+}
+
+static double
+lm_bench_us(uint64_t cycles)
+{
+	return (double)cycles * 1000000 / rte_get_tsc_hz();
+}
+
+static void
+lm_bench_stat_print(const char *name, const struct lm_bench_stat *stat)
+{
+	if (!stat->n)
+		return;
+	printf("  %-24s %12.1f %12.1f %12.1f\n", name, lm_bench_us(stat->min),
+	       lm_bench_us(stat->sum / stat->n), lm_bench_us(stat->max));
+}
+
+/* Every worker waits for the others, the last one in releases them */
+static void
+lm_bench_barrier(struct lm_bench *b)
+{
+	uint32_t gen = __atomic_load_n(&b->barrier_gen, __ATOMIC_ACQUIRE);
+
+	if (__atomic_add_fetch(&b->barrier_cnt, 1, __ATOMIC_ACQ_REL) ==
+			b->nb_workers) {
+		__atomic_store_n(&b->barrier_cnt, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&b->barrier_gen, gen + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	while (__atomic_load_n(&b->barrier_gen, __ATOMIC_ACQUIRE) == gen)
+		rte_pause();
+}
+
+static uint64_t
+lm_bench_map_len(const struct lm_bench *b, const struct lm_bench_vf *vf)
+{
+	uint64_t pages = b->conf->mem_gb * LM_BENCH_GB / LM_BENCH_PAGE_SIZE;
+
+	return vf->mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP ? pages :
+			RTE_ALIGN_CEIL(pages, 64) / 8;
+}
+
+/* Pull the whole map of the VF, a window at a time */
+static int
+lm_bench_dirty_fetch(struct lm_bench *b, struct lm_bench_vf *vf,
+		enum lm_bench_phase phase)
+{
+	uint64_t map_len = lm_bench_map_len(b, vf);
+	uint64_t off, len, start;
+	int ret;
+
+	start = rte_rdtsc_precise();
+	for (off = 0; off < map_len; off += len) {
+		len = RTE_MIN(map_len - off, (uint64_t)LM_BENCH_MAP_WINDOW);
+		ret = virtio_vdpa_cmd_dirty_page_report_map(b->priv, vf->vdev_id,
+				off, len, 0, vf->map->iova);
+		if (ret) {
+			printf("VF %u dirty map report failed: %d\n",
+			       vf->vdev_id, ret);
+			return -1;
+		}
+	}
+	lm_bench_stat_add(&vf->stats[phase],
+			(rte_rdtsc_precise() - start) / b->conf->mem_gb);
+	return 0;
+}
+
+static int
+lm_bench_dirty_start(struct lm_bench *b, struct lm_bench_vf *vf)
+{
+	uint64_t len = b->conf->mem_gb * LM_BENCH_GB;
+
+	/* Keep the mode that worked last time, bytemap first */
+	if (!virtio_vdpa_cmd_dirty_page_start_track(b->priv, vf->vdev_id,
+			vf->mode, LM_BENCH_PAGE_SIZE, 0, len, 0, NULL))
+		return 0;
+	if (vf->mode == VIRTIO_M_DIRTY_TRACK_PULL_BITMAP)
+		goto err;
+	vf->mode = VIRTIO_M_DIRTY_TRACK_PULL_BITMAP;
+	if (!virtio_vdpa_cmd_dirty_page_start_track(b->priv, vf->vdev_id,
+			vf->mode, LM_BENCH_PAGE_SIZE, 0, len, 0, NULL))
+		return 0;
+err:
+	printf("VF %u can't track %u GB of dirty pages\n", vf->vdev_id,
+	       b->conf->mem_gb);
+	return -1;
+}
+
+static int
+lm_bench_set_status(struct lm_bench *b, struct lm_bench_vf *vf,
+		enum virtio_internal_status s1, enum virtio_internal_status s2)
+{
+	if (virtio_vdpa_cmd_set_status(b->priv, vf->vdev_id, s1) ||
+	    virtio_vdpa_cmd_set_status(b->priv, vf->vdev_id, s2)) {
+		printf("VF %u status change failed\n", vf->vdev_id);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+lm_bench_state_save(struct lm_bench *b, struct lm_bench_vf *vf,
+		struct virtio_vdpa_state_stream *st)
+{
+	struct virtio_admin_migration_get_internal_state_pending_bytes_result res;
+	struct iovec iov[LM_BENCH_NB_CHUNKS];
+	uint64_t start;
+	uint8_t *state;
+	int nb, k;
+
+	start = rte_rdtsc_precise();
+	if (virtio_vdpa_cmd_get_internal_pending_bytes(b->priv, vf->vdev_id,
+			&res)) {
+		printf("VF %u pending state query failed\n", vf->vdev_id);
+		return -1;
+	}
+	if (res.pending_bytes > vf->state_cap) {
+		state = realloc(vf->state, res.pending_bytes);
+		if (!state) {
+			printf("VF %u can't hold %" PRIu64 " state bytes\n",
+			       vf->vdev_id, res.pending_bytes);
+			return -1;
+		}
+		vf->state = state;
+		vf->state_cap = res.pending_bytes;
+	}
+
+	vf->state_len = 0;
+	while ((nb = virtio_vdpa_state_stream_save(st, iov, RTE_DIM(iov))) > 0) {
+		for (k = 0; k < nb; k++) {
+			if (vf->state_len + iov[k].iov_len > vf->state_cap) {
+				printf("VF %u state outgrew %" PRIu64 " bytes\n",
+				       vf->vdev_id, vf->state_cap);
+				return -1;
+			}
+			memcpy(vf->state + vf->state_len, iov[k].iov_base,
+			       iov[k].iov_len);
+			vf->state_len += iov[k].iov_len;
+		}
+		virtio_vdpa_state_stream_release(st, nb);
+	}
+	if (nb < 0) {
+		printf("VF %u state save failed: %d\n", vf->vdev_id, nb);
+		return -1;
+	}
+	lm_bench_stat_add(&vf->stats[LM_BENCH_SAVE], rte_rdtsc_precise() - start);
+	vf->state_bytes += vf->state_len;
+	return 0;
+}
+
+static int
+lm_bench_state_restore(struct lm_bench_vf *vf,
+		struct virtio_vdpa_state_stream *st)
+{
+	struct iovec iov[LM_BENCH_NB_CHUNKS];
+	uint64_t start, off = 0;
+	int nb, k;
+
+	start = rte_rdtsc_precise();
+	while (off < vf->state_len) {
+		nb = virtio_vdpa_state_stream_restore_get(st, iov, RTE_DIM(iov));
+		if (nb <= 0)
+			goto err;
+		for (k = 0; k < nb && off < vf->state_len; k++) {
+			iov[k].iov_len = RTE_MIN(iov[k].iov_len,
+					vf->state_len - off);
+			memcpy(iov[k].iov_base, vf->state + off, iov[k].iov_len);
+			off += iov[k].iov_len;
+		}
+		if (virtio_vdpa_state_stream_restore_put(st, iov, k))
+			goto err;
+	}
+	lm_bench_stat_add(&vf->stats[LM_BENCH_RESTORE],
+			rte_rdtsc_precise() - start);
+	return 0;
+err:
+	printf("VF %u state restore failed\n", vf->vdev_id);
+	return -1;
+}
+
+/* The VF is frozen: last dirty map, state out and back in, then resume */
+static int
+lm_bench_stop_copy(struct lm_bench *b, struct lm_bench_vf *vf)
+{
+	struct virtio_vdpa_state_stream *save, *restore;
+	uint64_t start, t;
+	int ret = -1;
+
+	/* Streams are set up ahead, as a migration would before downtime */
+	save = virtio_vdpa_state_stream_create(b->priv, vf->vdev_id,
+			VIRTIO_VDPA_STATE_SAVE, LM_BENCH_CHUNK_SIZE,
+			LM_BENCH_NB_CHUNKS);
+	restore = virtio_vdpa_state_stream_create(b->priv, vf->vdev_id,
+			VIRTIO_VDPA_STATE_RESTORE, LM_BENCH_CHUNK_SIZE,
+			LM_BENCH_NB_CHUNKS);
+	if (!save || !restore) {
+		printf("VF %u state streams can't be created\n", vf->vdev_id);
+		goto out;
+	}
+
+	start = rte_rdtsc_precise();
+	if (lm_bench_set_status(b, vf, VIRTIO_S_QUIESCED, VIRTIO_S_FREEZED))
+		goto out;
+	lm_bench_stat_add(&vf->stats[LM_BENCH_FREEZE],
+			rte_rdtsc_precise() - start);
+
+	if (lm_bench_dirty_fetch(b, vf, LM_BENCH_FETCH_FROZEN) ||
+	    lm_bench_state_save(b, vf, save) ||
+	    lm_bench_state_restore(vf, restore))
+		goto resume;
+	ret = 0;
+resume:
+	t = rte_rdtsc_precise();
+	if (lm_bench_set_status(b, vf, VIRTIO_S_QUIESCED, VIRTIO_S_RUNNING)) {
+		ret = -1;
+		goto out;
+	}
+	lm_bench_stat_add(&vf->stats[LM_BENCH_RESUME], rte_rdtsc_precise() - t);
+	if (!ret)
+		lm_bench_stat_add(&vf->stats[LM_BENCH_STOP_COPY],
+				rte_rdtsc_precise() - start);
+out:
+	if (save)
+		virtio_vdpa_state_stream_destroy(save);
+	if (restore)
+		virtio_vdpa_state_stream_destroy(restore);
+	return ret;
+}
+
+static int
+lm_bench_migrate(struct lm_bench *b, struct lm_bench_vf *vf)
+{
+	int ret;
+
+	if (lm_bench_dirty_start(b, vf))
+		return -1;
+	ret = lm_bench_dirty_fetch(b, vf, LM_BENCH_FETCH_RUNNING);
+	if (!ret)
+		ret = lm_bench_stop_copy(b, vf);
+	if (virtio_vdpa_cmd_dirty_page_stop_track(b->priv, vf->vdev_id, 0)) {
+		printf("VF %u dirty tracking stop failed\n", vf->vdev_id);
+		ret = -1;
+	}
+	return ret;
+}
+
+/* Worker i migrates VFs i, i + nb_workers... in each iteration */
+static int
+lm_bench_worker(void *arg)
+{
+	struct lm_bench *b = arg;
+	int idx = rte_lcore_index(rte_lcore_id());
+	uint64_t start = 0;
+	uint32_t iter;
+	unsigned int v;
+
+	if (idx < 0 || (unsigned int)idx >= b->nb_workers)
+		return 0;
+
+	for (iter = 0; iter < b->conf->iters; iter++) {
+		lm_bench_barrier(b);
+		if (idx == 0)
+			start = rte_rdtsc_precise();
+		for (v = idx; v < b->conf->nb_vfs; v += b->nb_workers) {
+			if (__atomic_load_n(&b->error, __ATOMIC_RELAXED))
+				break;
+			if (lm_bench_migrate(b, &b->vfs[v]))
+				__atomic_store_n(&b->error, 1, __ATOMIC_RELAXED);
+		}
+		lm_bench_barrier(b);
+		if (idx == 0)
+			lm_bench_stat_add(&b->wall, rte_rdtsc_precise() - start);
+	}
+	return 0;
+}
+
+static void
+lm_bench_report(struct lm_bench *b)
+{
+	struct lm_bench_stat total[LM_BENCH_PHASES];
+	uint64_t state_bytes = 0;
+	unsigned int v, p;
+
+	memset(total, 0, sizeof(total));
+	for (v = 0; v < b->conf->nb_vfs; v++) {
+		for (p = 0; p < LM_BENCH_PHASES; p++)
+			lm_bench_stat_merge(&total[p], &b->vfs[v].stats[p]);
+		state_bytes += b->vfs[v].state_bytes;
+	}
+
+	printf("\nPF %s, %u VF(s) on %u lcore(s), %u GB each, %u iteration(s)\n",
+	       b->conf->pf, b->conf->nb_vfs, b->nb_workers, b->conf->mem_gb,
+	       b->conf->iters);
+	printf("  %-24s %12s %12s %12s\n", "phase", "min us", "avg us",
+	       "max us");
+	for (p = 0; p < LM_BENCH_PHASES; p++)
+		lm_bench_stat_print(lm_bench_phase_names[p], &total[p]);
+	lm_bench_stat_print("all VFs, per iteration", &b->wall);
+	if (total[LM_BENCH_SAVE].n && total[LM_BENCH_SAVE].sum)
+		printf("  state: %" PRIu64 " bytes per VF, %.1f MB/s save\n",
+		       state_bytes / total[LM_BENCH_SAVE].n,
+		       (double)state_bytes * rte_get_tsc_hz() /
+		       total[LM_BENCH_SAVE].sum / (1024 * 1024));
+	printf("  dirty map: %s\n",
+	       b->vfs[0].mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP ?
+	       "bytemap" : "bitmap");
+}
+
+static int
+lm_bench_run(const struct lm_bench_conf *conf)
+{
+	char name[RTE_MEMZONE_NAMESIZE];
+	struct lm_bench b;
+	unsigned int v;
+	int ret = -1;
+
+	memset(&b, 0, sizeof(b));
+	b.conf = conf;
+	if (!conf->nb_vfs || !conf->iters || !conf->mem_gb) {
+		printf("VFs, iterations and memory must not be 0\n");
+		return -1;
+	}
+	b.priv = rte_vdpa_get_mi_by_bdf(conf->pf);
+	if (!b.priv) {
+		printf("PF %s is not managed by the virtio_mi driver\n",
+		       conf->pf);
+		return -1;
+	}
+
+	b.vfs = calloc(conf->nb_vfs, sizeof(*b.vfs));
+	if (!b.vfs)
+		return -1;
+	for (v = 0; v < conf->nb_vfs; v++) {
+		b.vfs[v].vdev_id = v + 1;
+		b.vfs[v].mode = VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP;
+		snprintf(name, sizeof(name), "lm_bench_map%u", v);
+		b.vfs[v].map = rte_memzone_reserve_aligned(name,
+				LM_BENCH_MAP_WINDOW, rte_socket_id(),
+				RTE_MEMZONE_IOVA_CONTIG, RTE_CACHE_LINE_SIZE);
+		if (!b.vfs[v].map) {
+			printf("Failed to reserve dirty map of VF %u\n", v + 1);
+			goto out;
+		}
+	}
+
+	/* The main lcore works too, one lcore per VF at most */
+	b.nb_workers = RTE_MIN(rte_lcore_count(), (unsigned int)conf->nb_vfs);
+	rte_eal_mp_remote_launch(lm_bench_worker, &b, CALL_MAIN);
+	rte_eal_mp_wait_lcore();
+
+	if (b.error)
+		printf("Migration failed, partial results:\n");
+	lm_bench_report(&b);
+	ret = b.error ? -1 : 0;
+out:
+	for (v = 0; v < conf->nb_vfs; v++) {
+		rte_memzone_free(b.vfs[v].map);
+		free(b.vfs[v].state);
+	}
+	free(b.vfs);
+	return ret;
+}
+
+static int
+test_virtio_lm_perf(void)
+{
+	struct lm_bench_conf conf = {
+		.pf = LM_PERF_BDF,
+		.iters = LM_PERF_ITERS,
+		.mem_gb = LM_PERF_MEM_GB,
+	};
+	char args[128];
+	int ret;
+
+	if (rte_eal_iova_mode() != RTE_IOVA_VA) {
+		printf("Software PF needs IOVA as VA\n");
+		return TEST_SKIPPED;
+	}
+
+	snprintf(args, sizeof(args), "addr=%s,num_vfs=%u,state_size=%u",
+		 LM_PERF_BDF, LM_PERF_NUM_VFS, LM_PERF_STATE_SIZE);
+	if (rte_vdev_init(LM_PERF_NAME, args)) {
+		printf("Failed to create %s\n", LM_PERF_NAME);
+		return TEST_FAILED;
+	}
+
+	/* One VF alone, then as many as there are lcores to migrate them */
+	conf.nb_vfs = 1;
+	ret = lm_bench_run(&conf);
+	conf.nb_vfs = RTE_MIN(rte_lcore_count(), (unsigned int)LM_PERF_NUM_VFS);
+	if (!ret && conf.nb_vfs > 1)
+		ret = lm_bench_run(&conf);
+
+	rte_vdev_uninit(LM_PERF_NAME);
+	return ret ? TEST_FAILED : TEST_SUCCESS;
+}
+
+REGISTER_TEST_COMMAND(virtio_lm_perf_autotest, test_virtio_lm_perf);
@@ -0,0 +1,485 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_eal.h>
+#include <rte_ether.h>
+#include <rte_malloc.h>
+#include <rte_bus_vdev.h>
+
+#include <virtio_api.h>
+#include <virtio_admin.h>
+#include <virtio_lm.h>
+#include <sw_pf.h>
+
+#include "test.h"
+
+/*
+ * Live migration admin commands end to end against the software PF: the
+ * driver in common/virtio_mi talks to the device model over a real admin
+ * virtqueue, once with indirect and in order descriptors and once without.
+ */
+
+#define SW_PF_NB 2
+#define SW_PF_NUM_VFS 4
+#define SW_PF_STATE_SIZE 10000
+#define SW_PF_CHUNK_SIZE 4096
+#define SW_PF_NB_CHUNKS 4
+#define SW_PF_PAGE_SIZE 4096
+#define SW_PF_RANGE_PAGES 100
+#define SW_PF_RANGE_ADDR 0x100000ULL
+
+static const struct {
+	const char *name;
+	const char *bdf;
+	uint64_t features_off;
+} sw_pfs[SW_PF_NB] = {
+	{ "vdpa_virtio_mi_sw_test0", "ffff:fe:00.0", 0 },
+	{ "vdpa_virtio_mi_sw_test1", "ffff:fe:01.0",
+	  (1ULL << VIRTIO_F_ADMIN_VQ_INDIRECT_DESC) |
+	  (1ULL << VIRTIO_F_ADMIN_VQ_IN_ORDER) },
+};
+
+#define SW_PF_FEATURES \
+	((1ULL << VIRTIO_F_ADMIN_VQ_INDIRECT_DESC) | \
+	 (1ULL << VIRTIO_F_ADMIN_VQ_IN_ORDER) | \
+	 (1ULL << VIRTIO_F_ADMIN_MIGRATION) | \
+	 (1ULL << VIRTIO_F_ADMIN_MIGRATION_DYNAMIC_INTERNAL_STATE_TRACK) | \
+	 (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BITMAP_TRACK) | \
+	 (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BYTEMAP_TRACK))
+
+static struct virtio_vdpa_pf_priv *privs[SW_PF_NB];
+static uint8_t *state_a, *state_b, *map;
+
+static int
+sw_pf_setup(void)
+{
+	char args[128];
+	unsigned int i;
+
+	if (rte_eal_iova_mode() != RTE_IOVA_VA) {
+		printf("Software PF needs IOVA as VA\n");
+		return TEST_SKIPPED;
+	}
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		snprintf(args, sizeof(args),
+			 "addr=%s,num_vfs=%u,state_size=%u,aq_num=2,features=%#" PRIx64,
+			 sw_pfs[i].bdf, SW_PF_NUM_VFS, SW_PF_STATE_SIZE,
+			 (uint64_t)(SW_PF_FEATURES & ~sw_pfs[i].features_off));
+		if (rte_vdev_init(sw_pfs[i].name, args)) {
+			printf("Failed to create %s\n", sw_pfs[i].name);
+			return TEST_FAILED;
+		}
+		privs[i] = rte_vdpa_get_mi_by_bdf(sw_pfs[i].bdf);
+		if (!privs[i]) {
+			printf("%s is not found as %s\n", sw_pfs[i].name,
+			       sw_pfs[i].bdf);
+			return TEST_FAILED;
+		}
+	}
+
+	state_a = rte_zmalloc(NULL, SW_PF_STATE_SIZE, 0);
+	state_b = rte_zmalloc(NULL, SW_PF_STATE_SIZE, 0);
+	map = rte_zmalloc(NULL, SW_PF_RANGE_PAGES, 0);
+	if (!state_a || !state_b || !map)
+		return TEST_FAILED;
+	return TEST_SUCCESS;
+}
+
+static void
+sw_pf_teardown(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		if (privs[i])
+			rte_vdev_uninit(sw_pfs[i].name);
+		privs[i] = NULL;
+	}
+	rte_free(state_a);
+	rte_free(state_b);
+	rte_free(map);
+	state_a = NULL;
+	state_b = NULL;
+	map = NULL;
+}
+
+static int
+test_sw_pf_identity(void)
+{
+	struct virtio_admin_migration_identity_result id;
+	struct virtio_admin_dirty_page_identity_result dirty_id;
+	unsigned int i;
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_identity(privs[i], &id),
+				"%s identity failed", sw_pfs[i].name);
+		TEST_ASSERT_EQUAL(id.major_ver, 1, "unexpected major version %u",
+				id.major_ver);
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_dirty_page_identity(privs[i],
+				&dirty_id), "%s dirty page identity failed",
+				sw_pfs[i].name);
+		TEST_ASSERT(dirty_id.max_track_ranges > 0,
+				"no dirty page range can be tracked");
+	}
+	return TEST_SUCCESS;
+}
+
+static int
+test_sw_pf_status(void)
+{
+	enum virtio_internal_status status;
+	unsigned int i;
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_get_status(privs[i], 1,
+				&status), "get status failed");
+		TEST_ASSERT_EQUAL(status, VIRTIO_S_RUNNING,
+				"VF should start running, status %d", status);
+
+		/* A running VF can't be frozen without being quiesced */
+		TEST_ASSERT_FAIL(virtio_vdpa_cmd_set_status(privs[i], 1,
+				VIRTIO_S_FREEZED), "running VF frozen");
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_set_status(privs[i], 1,
+				VIRTIO_S_QUIESCED), "quiesce failed");
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_set_status(privs[i], 1,
+				VIRTIO_S_FREEZED), "freeze failed");
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_get_status(privs[i], 1,
+				&status), "get status failed");
+		TEST_ASSERT_EQUAL(status, VIRTIO_S_FREEZED,
+				"VF should be frozen, status %d", status);
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_set_status(privs[i], 1,
+				VIRTIO_S_QUIESCED), "unfreeze failed");
+		TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_set_status(privs[i], 1,
+				VIRTIO_S_RUNNING), "resume failed");
+
+		/* VFs are numbered from 1 */
+		TEST_ASSERT_FAIL(virtio_vdpa_cmd_get_status(privs[i], 0,
+				&status), "vdev_id 0 accepted");
+		TEST_ASSERT_FAIL(virtio_vdpa_cmd_get_status(privs[i],
+				SW_PF_NUM_VFS + 1, &status),
+				"vdev_id beyond the VFs accepted");
+	}
+	return TEST_SUCCESS;
+}
+
+static int
+sw_pf_freeze(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id)
+{
+	if (virtio_vdpa_cmd_set_status(priv, vdev_id, VIRTIO_S_QUIESCED) ||
+	    virtio_vdpa_cmd_set_status(priv, vdev_id, VIRTIO_S_FREEZED))
+		return -1;
+	return 0;
+}
+
+static int
+sw_pf_resume(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id)
+{
+	if (virtio_vdpa_cmd_set_status(priv, vdev_id, VIRTIO_S_QUIESCED) ||
+	    virtio_vdpa_cmd_set_status(priv, vdev_id, VIRTIO_S_RUNNING))
+		return -1;
+	return 0;
+}
+
+static int
+sw_pf_state_save(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint8_t *buf)
+{
+	struct iovec iov[SW_PF_NB_CHUNKS];
+	struct virtio_vdpa_state_stream *st;
+	size_t off = 0;
+	int nb, k;
+
+	st = virtio_vdpa_state_stream_create(priv, vdev_id,
+			VIRTIO_VDPA_STATE_SAVE, SW_PF_CHUNK_SIZE, SW_PF_NB_CHUNKS);
+	if (!st)
+		return -1;
+	while ((nb = virtio_vdpa_state_stream_save(st, iov, RTE_DIM(iov))) > 0) {
+		for (k = 0; k < nb; k++) {
+			if (off + iov[k].iov_len > SW_PF_STATE_SIZE) {
+				nb = -1;
+				break;
+			}
+			memcpy(buf + off, iov[k].iov_base, iov[k].iov_len);
+			off += iov[k].iov_len;
+		}
+		if (nb < 0)
+			break;
+		virtio_vdpa_state_stream_release(st, nb);
+	}
+	virtio_vdpa_state_stream_destroy(st);
+	return nb < 0 || off != SW_PF_STATE_SIZE ? -1 : 0;
+}
+
+static int
+sw_pf_state_restore(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		const uint8_t *buf)
+{
+	struct iovec iov[SW_PF_NB_CHUNKS];
+	struct virtio_vdpa_state_stream *st;
+	size_t off = 0;
+	int nb, k, ret = 0;
+
+	st = virtio_vdpa_state_stream_create(priv, vdev_id,
+			VIRTIO_VDPA_STATE_RESTORE, SW_PF_CHUNK_SIZE, SW_PF_NB_CHUNKS);
+	if (!st)
+		return -1;
+	while (!ret && off < SW_PF_STATE_SIZE) {
+		nb = virtio_vdpa_state_stream_restore_get(st, iov, RTE_DIM(iov));
+		if (nb <= 0) {
+			ret = -1;
+			break;
+		}
+		for (k = 0; k < nb && off < SW_PF_STATE_SIZE; k++) {
+			iov[k].iov_len = RTE_MIN(iov[k].iov_len,
+					SW_PF_STATE_SIZE - off);
+			memcpy(iov[k].iov_base, buf + off, iov[k].iov_len);
+			off += iov[k].iov_len;
+		}
+		ret = virtio_vdpa_state_stream_restore_put(st, iov, k);
+	}
+	/* Chunks left unfilled by the last put were given back */
+	if (!ret && virtio_vdpa_state_stream_restore_get(st, iov,
+			RTE_DIM(iov)) != SW_PF_NB_CHUNKS)
+		ret = -1;
+	virtio_vdpa_state_stream_destroy(st);
+	return ret;
+}
+
+static int
+test_sw_pf_state(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		/* Migrate VF 1 into VF 2, both frozen */
+		TEST_ASSERT_SUCCESS(sw_pf_freeze(privs[i], 1), "freeze VF 1 failed");
+		TEST_ASSERT_SUCCESS(sw_pf_freeze(privs[i], 2), "freeze VF 2 failed");
+		TEST_ASSERT_SUCCESS(sw_pf_state_save(privs[i], 1, state_a),
+				"save VF 1 failed");
+		TEST_ASSERT_SUCCESS(sw_pf_state_save(privs[i], 2, state_b),
+				"save VF 2 failed");
+		TEST_ASSERT(memcmp(state_a, state_b, SW_PF_STATE_SIZE),
+				"VFs start with the same state");
+		TEST_ASSERT_SUCCESS(sw_pf_state_restore(privs[i], 2, state_a),
+				"restore VF 2 failed");
+		TEST_ASSERT_SUCCESS(sw_pf_state_save(privs[i], 2, state_b),
+				"save restored VF 2 failed");
+		TEST_ASSERT_BUFFERS_ARE_EQUAL(state_a, state_b, SW_PF_STATE_SIZE,
+				"restored state differs");
+		TEST_ASSERT_SUCCESS(sw_pf_resume(privs[i], 1), "resume VF 1 failed");
+		TEST_ASSERT_SUCCESS(sw_pf_resume(privs[i], 2), "resume VF 2 failed");
+
+		/* A running VF refuses a restore */
+		TEST_ASSERT_FAIL(virtio_vdpa_cmd_restore_state(privs[i], 2, 0,
+				SW_PF_CHUNK_SIZE, rte_malloc_virt2iova(state_a)),
+				"running VF restored");
+	}
+	return TEST_SUCCESS;
+}
+
+static int
+sw_pf_sink(const void *buf __rte_unused, size_t len,
+		bool last __rte_unused, void *arg)
+{
+	*(uint64_t *)arg += len;
+	return 0;
+}
+
+static int
+test_sw_pf_precopy(void)
+{
+	uint64_t bytes;
+	unsigned int i;
+	int rounds;
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		/* Drain whatever earlier tests left pending */
+		bytes = 0;
+		rounds = virtio_vdpa_state_precopy(privs[i], 3, 0, 8,
+				sw_pf_sink, &bytes);
+		TEST_ASSERT(rounds >= 0, "pre-copy failed: %d", rounds);
+
+		bytes = 0;
+		rounds = virtio_vdpa_state_precopy(privs[i], 3, 0, 8,
+				sw_pf_sink, &bytes);
+		TEST_ASSERT_EQUAL(rounds, 0, "idle VF sent %d deltas", rounds);
+
+		TEST_ASSERT_SUCCESS(virtio_vdpa_sw_pf_vf_run(privs[i], 3, 1000),
+				"VF 3 failed to run");
+		rounds = virtio_vdpa_state_precopy(privs[i], 3, 0, 8,
+				sw_pf_sink, &bytes);
+		TEST_ASSERT_EQUAL(rounds, 1, "expected one delta, got %d", rounds);
+		TEST_ASSERT_EQUAL(bytes, 1000, "delta of %" PRIu64 " bytes",
+				bytes);
+
+		/* Above the threshold nothing is sent */
+		TEST_ASSERT_SUCCESS(virtio_vdpa_sw_pf_vf_run(privs[i], 3, 100),
+				"VF 3 failed to run");
+		bytes = 0;
+		rounds = virtio_vdpa_state_precopy(privs[i], 3, 100, 8,
+				sw_pf_sink, &bytes);
+		TEST_ASSERT_EQUAL(rounds, 0, "delta under threshold sent");
+	}
+	return TEST_SUCCESS;
+}
+
+static int
+sw_pf_dirty_check(struct virtio_vdpa_pf_priv *priv,
+		enum virtio_dirty_track_mode mode)
+{
+	struct virtio_admin_dirty_page_get_map_pending_bytes_result pending;
+	bool bytemap = mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP;
+	uint64_t map_len = bytemap ? SW_PF_RANGE_PAGES :
+			RTE_ALIGN_CEIL(SW_PF_RANGE_PAGES, 64) / 8;
+	/* Four dirty pages, in two bitmap bytes */
+	uint64_t dirty_bytes = bytemap ? 4 : 2;
+	uint64_t page;
+
+	TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_dirty_page_start_track(priv, 4,
+			mode, SW_PF_PAGE_SIZE, SW_PF_RANGE_ADDR,
+			SW_PF_RANGE_PAGES * SW_PF_PAGE_SIZE, 0, NULL),
+			"start tracking failed");
+	TEST_ASSERT_FAIL(virtio_vdpa_cmd_dirty_page_start_track(priv, 4,
+			mode, SW_PF_PAGE_SIZE, SW_PF_RANGE_ADDR,
+			SW_PF_RANGE_PAGES * SW_PF_PAGE_SIZE, 0, NULL),
+			"range tracked twice");
+
+	/* Page 3, and pages 10 to 12 through an unaligned write */
+	TEST_ASSERT_SUCCESS(virtio_vdpa_sw_pf_vf_dirty(priv, 4,
+			SW_PF_RANGE_ADDR + 3 * SW_PF_PAGE_SIZE, 8),
+			"dirty failed");
+	TEST_ASSERT_SUCCESS(virtio_vdpa_sw_pf_vf_dirty(priv, 4,
+			SW_PF_RANGE_ADDR + 10 * SW_PF_PAGE_SIZE + 1,
+			2 * SW_PF_PAGE_SIZE), "dirty failed");
+	/* Outside of the range */
+	TEST_ASSERT_SUCCESS(virtio_vdpa_sw_pf_vf_dirty(priv, 4, 0,
+			SW_PF_PAGE_SIZE), "dirty failed");
+
+	TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_dirty_page_get_map_pending_bytes(
+			priv, 4, SW_PF_RANGE_ADDR, &pending),
+			"get pending bytes failed");
+	TEST_ASSERT_EQUAL(pending.pending_bytes, dirty_bytes,
+			"%" PRIu64 " pending bytes", pending.pending_bytes);
+
+	memset(map, 0xff, SW_PF_RANGE_PAGES);
+	TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_dirty_page_report_map(priv, 4, 0,
+			map_len, SW_PF_RANGE_ADDR, rte_malloc_virt2iova(map)),
+			"report map failed");
+	for (page = 0; page < SW_PF_RANGE_PAGES; page++) {
+		bool dirty = page == 3 || (page >= 10 && page <= 12);
+		bool set = bytemap ? map[page] != 0 :
+				(map[page / 8] >> (page % 8)) & 1;
+
+		TEST_ASSERT_EQUAL(set, dirty, "page %" PRIu64 " is %s", page,
+				set ? "dirty" : "clean");
+	}
+
+	/* Reporting clears the map */
+	TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_dirty_page_get_map_pending_bytes(
+			priv, 4, SW_PF_RANGE_ADDR, &pending),
+			"get pending bytes failed");
+	TEST_ASSERT_EQUAL(pending.pending_bytes, 0, "map not cleared");
+	TEST_ASSERT_FAIL(virtio_vdpa_cmd_dirty_page_report_map(priv, 4, 0,
+			map_len + 1, SW_PF_RANGE_ADDR, rte_malloc_virt2iova(map)),
+			"report beyond the map accepted");
+
+	TEST_ASSERT_SUCCESS(virtio_vdpa_cmd_dirty_page_stop_track(priv, 4,
+			SW_PF_RANGE_ADDR), "stop tracking failed");
+	TEST_ASSERT_FAIL(virtio_vdpa_cmd_dirty_page_get_map_pending_bytes(
+			priv, 4, SW_PF_RANGE_ADDR, &pending),
+			"stopped range still tracked");
+	return TEST_SUCCESS;
+}
+
+static int
+test_sw_pf_dirty(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SW_PF_NB; i++) {
+		TEST_ASSERT_SUCCESS(sw_pf_dirty_check(privs[i],
+				VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP),
+				"%s bytemap tracking failed", sw_pfs[i].name);
+		TEST_ASSERT_SUCCESS(sw_pf_dirty_check(privs[i],
+				VIRTIO_M_DIRTY_TRACK_PULL_BITMAP),
+				"%s bitmap tracking failed", sw_pfs[i].name);
+	}
+	return TEST_SUCCESS;
+}
+
+/*
+ * A queue of a running device is disabled by per-queue reset and set up
+ * again, which fails while it is still enabled.
+ */
+static int
+test_sw_pf_queue_reset(void)
+{
+	struct virtio_pci_dev_vring_info vr_info;
+	struct virtio_pci_dev *vpdev;
+	uint8_t *ring;
+	int ret = TEST_FAILED;
+
+	vpdev = virtio_sw_pf_create("vdpa_virtio_mi_sw_qreset", "");
+	TEST_ASSERT_NOT_NULL(vpdev, "Failed to create a software PF");
+	ring = rte_zmalloc(NULL, 3 * SW_PF_PAGE_SIZE, SW_PF_PAGE_SIZE);
+	if (!ring || virtio_pci_dev_queues_alloc(vpdev, 1))
+		goto out;
+	virtio_pci_dev_features_set(vpdev, vpdev->device_features);
+	virtio_pci_dev_set_status(vpdev, VIRTIO_CONFIG_STATUS_FEATURES_OK);
+	virtio_pci_dev_set_status(vpdev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
+
+	vr_info.desc = (uint64_t)(uintptr_t)ring;
+	vr_info.avail = vr_info.desc + SW_PF_PAGE_SIZE;
+	vr_info.used = vr_info.avail + SW_PF_PAGE_SIZE;
+	vr_info.size = 64;
+	if (virtio_pci_dev_queue_set(vpdev, 0, &vr_info)) {
+		printf("queue set up failed\n");
+		goto out;
+	}
+	if (!virtio_pci_dev_queue_set(vpdev, 0, &vr_info)) {
+		printf("enabled queue set up again\n");
+		goto out;
+	}
+	if (virtio_pci_dev_queue_del(vpdev, 0) ||
+	    virtio_pci_dev_queue_set(vpdev, 0, &vr_info) ||
+	    virtio_pci_dev_queue_del(vpdev, 0)) {
+		printf("queue reset and set up again failed\n");
+		goto out;
+	}
+	ret = TEST_SUCCESS;
+out:
+	virtio_pci_dev_queues_free(vpdev, 1);
+	virtio_pci_dev_free(vpdev);
+	rte_free(ring);
+	return ret;
+}
+
+static struct unit_test_suite virtio_sw_pf_testsuite = {
+	.suite_name = "virtio software PF admin command tests",
+	.setup = sw_pf_setup,
+	.teardown = sw_pf_teardown,
+	.unit_test_cases = {
+		TEST_CASE(test_sw_pf_identity),
+		TEST_CASE(test_sw_pf_status),
+		TEST_CASE(test_sw_pf_state),
+		TEST_CASE(test_sw_pf_precopy),
+		TEST_CASE(test_sw_pf_dirty),
+		TEST_CASE(test_sw_pf_queue_reset),
+		TEST_CASES_END()
+	}
+};
+
+static int
+test_virtio_sw_pf(void)
+{
+	return unit_test_suite_runner(&virtio_sw_pf_testsuite);
+}
+
+REGISTER_TEST_COMMAND(virtio_sw_pf_autotest, test_virtio_sw_pf);
@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ether.h>
+#include <rte_bus_vdev.h>
+
+#include <virtio_api.h>
+#include <virtio_admin.h>
+#include <virtio_lm.h>
+
+#include "test.h"
+
+/*
+ * Driver side cost of the admin queue against the software PF, which runs
+ * each command inline on notify: what is measured is descriptor handling,
+ * completion reaping and locking in common/virtio_mi, not a device.
+ * Synchronous commands give the per command latency, asynchronous ones the
+ * throughput at several depths, and a frozen state save the copy bandwidth.
+ */
+
+#define SW_PERF_NAME "vdpa_virtio_mi_sw_perf"
+#define SW_PERF_BDF "ffff:fd:00.0"
+#define SW_PERF_NUM_VFS 16
+#define SW_PERF_STATE_SIZE (4 * 1024 * 1024)
+#define SW_PERF_CHUNK_SIZE (64 * 1024)
+#define SW_PERF_NB_CHUNKS 8
+#define SW_PERF_CMDS 100000
+#define SW_PERF_SAVES 16
+
+static const uint16_t sw_perf_aq_nums[] = { 1, 4 };
+static const unsigned int sw_perf_depths[] = { 1, 8, 64, 256 };
+
+static void
+sw_perf_report(const char *what, uint64_t cycles, uint64_t cmds)
+{
+	uint64_t hz = rte_get_tsc_hz();
+
+	printf("  %-24s %8" PRIu64 " cycles/cmd, %8.0f kcmd/s\n", what,
+	       cycles / cmds, (double)cmds * hz / cycles / 1000);
+}
+
+/* Every completion counts, failed ones fail the run once all are in */
+struct sw_perf_count {
+	unsigned int completed;
+	unsigned int failed;
+};
+
+static void
+sw_perf_done(struct virtio_vdpa_pf_priv *priv __rte_unused,
+		int token __rte_unused, int status, void *cb_arg)
+{
+	struct sw_perf_count *count = cb_arg;
+
+	count->completed++;
+	if (status != VIRTIO_ADMIN_STATUS_COMMON_OK)
+		count->failed++;
+}
+
+static int
+sw_perf_sync(struct virtio_vdpa_pf_priv *priv)
+{
+	enum virtio_internal_status status;
+	uint64_t start;
+	unsigned int i;
+
+	start = rte_rdtsc_precise();
+	for (i = 0; i < SW_PERF_CMDS; i++) {
+		if (virtio_vdpa_cmd_get_status(priv, i % SW_PERF_NUM_VFS + 1,
+				&status)) {
+			printf("get status failed\n");
+			return -1;
+		}
+	}
+	sw_perf_report("sync get status", rte_rdtsc_precise() - start,
+			SW_PERF_CMDS);
+	return 0;
+}
+
+static int
+sw_perf_async(struct virtio_vdpa_pf_priv *priv, unsigned int depth)
+{
+	struct virtio_admin_migration_get_internal_status_data sd[SW_PERF_NUM_VFS];
+	struct virtio_admin_migration_get_internal_status_result result;
+	struct virtio_vdpa_admin_cmd cmd = {
+		.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL,
+		.cmd = VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATUS,
+		.per_vdev = true,
+		.data_len = sizeof(sd[0]),
+		.result = &result,
+		.result_len = sizeof(result),
+	};
+	struct sw_perf_count count = { 0 };
+	unsigned int submitted = 0, i;
+	char what[32];
+	uint64_t start;
+	int ret;
+
+	for (i = 0; i < SW_PERF_NUM_VFS; i++)
+		sd[i].vdev_id = rte_cpu_to_le_16(i + 1);
+
+	start = rte_rdtsc_precise();
+	while (count.completed < SW_PERF_CMDS) {
+		if (submitted - count.completed >= depth ||
+		    submitted == SW_PERF_CMDS) {
+			if (virtio_vdpa_admin_cmd_poll(priv, UINT16_MAX) < 0)
+				return -1;
+			continue;
+		}
+		cmd.vdev_id = submitted % SW_PERF_NUM_VFS + 1;
+		cmd.data = &sd[cmd.vdev_id - 1];
+		ret = virtio_vdpa_admin_cmd_submit(priv, &cmd, sw_perf_done,
+				&count);
+		if (ret == -EAGAIN) {
+			virtio_vdpa_admin_cmd_poll(priv, UINT16_MAX);
+			continue;
+		}
+		if (ret < 0) {
+			printf("submit failed: %d\n", ret);
+			return -1;
+		}
+		submitted++;
+	}
+	if (count.failed) {
+		printf("%u of %u commands failed\n", count.failed,
+		       count.completed);
+		return -1;
+	}
+	snprintf(what, sizeof(what), "async depth %u", depth);
+	sw_perf_report(what, rte_rdtsc_precise() - start, SW_PERF_CMDS);
+	return 0;
+}
+
+static int
+sw_perf_save(struct virtio_vdpa_pf_priv *priv)
+{
+	struct iovec iov[SW_PERF_NB_CHUNKS];
+	struct virtio_vdpa_state_stream *st;
+	uint64_t start, cycles = 0, bytes = 0;
+	unsigned int i;
+	int nb = 0, k;
+
+	if (virtio_vdpa_cmd_set_status(priv, 1, VIRTIO_S_QUIESCED) ||
+	    virtio_vdpa_cmd_set_status(priv, 1, VIRTIO_S_FREEZED)) {
+		printf("freeze failed\n");
+		return -1;
+	}
+	for (i = 0; i < SW_PERF_SAVES && nb >= 0; i++) {
+		start = rte_rdtsc_precise();
+		st = virtio_vdpa_state_stream_create(priv, 1,
+				VIRTIO_VDPA_STATE_SAVE, SW_PERF_CHUNK_SIZE,
+				SW_PERF_NB_CHUNKS);
+		if (!st) {
+			nb = -1;
+			break;
+		}
+		while ((nb = virtio_vdpa_state_stream_save(st, iov,
+				RTE_DIM(iov))) > 0) {
+			for (k = 0; k < nb; k++)
+				bytes += iov[k].iov_len;
+			virtio_vdpa_state_stream_release(st, nb);
+		}
+		virtio_vdpa_state_stream_destroy(st);
+		cycles += rte_rdtsc_precise() - start;
+	}
+	if (virtio_vdpa_cmd_set_status(priv, 1, VIRTIO_S_QUIESCED) ||
+	    virtio_vdpa_cmd_set_status(priv, 1, VIRTIO_S_RUNNING) || nb < 0) {
+		printf("state save failed\n");
+		return -1;
+	}
+	printf("  %-24s %8.1f MB/s\n", "frozen state save",
+	       (double)bytes * rte_get_tsc_hz() / cycles / (1024 * 1024));
+	return 0;
+}
+
+static int
+test_virtio_sw_pf_perf(void)
+{
+	struct virtio_vdpa_pf_priv *priv;
+	char args[128];
+	unsigned int a, d;
+	int ret = 0;
+
+	if (rte_eal_iova_mode() != RTE_IOVA_VA) {
+		printf("Software PF needs IOVA as VA\n");
+		return TEST_SKIPPED;
+	}
+
+	for (a = 0; a < RTE_DIM(sw_perf_aq_nums) && !ret; a++) {
+		snprintf(args, sizeof(args),
+			 "addr=%s,num_vfs=%u,state_size=%u,aq_num=%u",
+			 SW_PERF_BDF, SW_PERF_NUM_VFS, SW_PERF_STATE_SIZE,
+			 sw_perf_aq_nums[a]);
+		if (rte_vdev_init(SW_PERF_NAME, args)) {
+			printf("Failed to create %s\n", SW_PERF_NAME);
+			return TEST_FAILED;
+		}
+		priv = rte_vdpa_get_mi_by_bdf(SW_PERF_BDF);
+		if (!priv) {
+			rte_vdev_uninit(SW_PERF_NAME);
+			return TEST_FAILED;
+		}
+
+		printf("%u admin queue(s):\n", sw_perf_aq_nums[a]);
+		ret = sw_perf_sync(priv);
+		for (d = 0; d < RTE_DIM(sw_perf_depths) && !ret; d++)
+			ret = sw_perf_async(priv, sw_perf_depths[d]);
+		if (!ret)
+			ret = sw_perf_save(priv);
+		rte_vdev_uninit(SW_PERF_NAME);
+	}
+
+	return ret ? TEST_FAILED : TEST_SUCCESS;
+}
+
+REGISTER_TEST_COMMAND(virtio_sw_pf_perf_autotest, test_virtio_sw_pf_perf);
@@ -3,7 +3,10 @@
  */
 
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <rte_alarm.h>
+#include <rte_cycles.h>
 #include <rte_malloc.h>
 #include <rte_vfio.h>
 
@@ -16,6 +19,23 @@
 #define PAGE_SIZE   (sysconf(_SC_PAGESIZE))
 #endif
 
+#define VIRTIO_PCI_DEV_RESET_TIMEOUT_MS 120000
+#define VIRTIO_PCI_DEV_RESET_POLL_US 1000
+
+static pthread_mutex_t virtio_pci_vfio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+virtio_pci_vfio_lock(void)
+{
+	pthread_mutex_lock(&virtio_pci_vfio_mutex);
+}
+
+void
+virtio_pci_vfio_unlock(void)
+{
+	pthread_mutex_unlock(&virtio_pci_vfio_mutex);
+}
+
 struct virtio_pci_dev *
 virtio_pci_dev_alloc(struct rte_pci_device *pci_dev)
 {
@@ -55,7 +75,8 @@ virtio_pci_dev_alloc(struct rte_pci_device *pci_dev)
 	/* Tell the device that driver known how to drive it. */
 	virtio_pci_dev_set_status(vpdev, VIRTIO_CONFIG_STATUS_DRIVER);
 
-	hw->guest_features = VIRTIO_OPS(hw)->get_features(hw);
+	vpdev->device_features = VIRTIO_OPS(hw)->get_features(hw);
+	hw->guest_features = vpdev->device_features;
 	PMD_INIT_LOG(DEBUG, "Guest_features is 0x%"PRIx64, hw->guest_features);
 	return vpdev;
 
@@ -64,12 +85,56 @@ virtio_pci_dev_alloc(struct rte_pci_device *pci_dev)
 	return NULL;
 }
 
+struct virtio_pci_dev *
+virtio_pci_dev_adopt(struct rte_pci_device *pci_dev, int vfio_dev_fd,
+		uint64_t guest_features)
+{
+	struct virtio_pci_dev *vpdev;
+	struct virtio_hw *hw;
+
+	vpdev = rte_zmalloc("virtio pci device", sizeof(*vpdev), RTE_CACHE_LINE_SIZE);
+	if (vpdev == NULL) {
+		PMD_INIT_LOG(ERR, "Failed to allocate vpdev memory");
+		return NULL;
+	}
+
+	hw = &vpdev->hw;
+	VTPCI_DEV(hw) = pci_dev;
+	vpdev->adopted = true;
+	vpdev->vfio_dev_fd = vfio_dev_fd;
+	if (rte_intr_dev_fd_set(pci_dev->intr_handle, vfio_dev_fd) ||
+	    virtio_pci_dev_init(pci_dev, vpdev)) {
+		PMD_INIT_LOG(ERR, "Failed to take over virtio PCI device %s",
+			     pci_dev->device.name);
+		rte_intr_dev_fd_set(pci_dev->intr_handle, -1);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		rte_free(vpdev);
+		return NULL;
+	}
+
+	vpdev->device_features = VIRTIO_OPS(hw)->get_features(hw);
+	hw->guest_features = guest_features ? guest_features :
+			vpdev->device_features;
+	PMD_INIT_LOG(DEBUG, "Dev %s taken over, guest_features 0x%"PRIx64,
+		     VP_DEV_NAME(vpdev), hw->guest_features);
+	return vpdev;
+}
+
+void
+virtio_pci_dev_release(struct virtio_pci_dev *vpdev)
+{
+	/* Driven by another process now, its BARs and queues stay as they are */
+	rte_free(vpdev);
+}
+
 void
 virtio_pci_dev_free(struct virtio_pci_dev *vpdev)
 {
 	struct virtio_hw *hw;
 
 	hw = &vpdev->hw;
+	/* No alarm may poll the device once freed */
+	virtio_pci_dev_reset_wait(vpdev);
 	if (VIRTIO_OPS(hw)->dev_close(hw))
 		PMD_INIT_LOG(ERR, "Failed to close virtio device %s", VP_DEV_NAME(vpdev));
 	rte_free(vpdev);
@@ -134,6 +199,27 @@ virtio_pci_dev_queues_alloc(struct virtio_pci_dev *vpdev, uint16_t nr_vq)
 	return 0;
 }
 
+int
+virtio_pci_dev_queue_attach(struct virtio_pci_dev *vpdev, uint16_t qid,
+		struct virtio_pci_dev_vring_info *vring_info)
+{
+	struct virtio_hw *hw = &vpdev->hw;
+	struct virtqueue *hw_vq = hw->vqs[qid];
+	int ret;
+
+	if (!VIRTIO_OPS(hw)->attach_queue)
+		return -ENOTSUP;
+	ret = VIRTIO_OPS(hw)->attach_queue(hw, hw_vq);
+	if (ret <= 0)
+		return ret;
+
+	vring_info->desc = hw_vq->vq_ring_mem;
+	vring_info->avail = hw_vq->vq_avail_mem;
+	vring_info->used = hw_vq->vq_used_mem;
+	vring_info->size = hw_vq->vq_nentries;
+	return 1;
+}
+
 uint16_t
 virtio_pci_dev_queue_size_get(struct virtio_pci_dev *vpdev, uint16_t idx)
 {
@@ -145,10 +231,7 @@ virtio_pci_dev_queue_size_get(struct virtio_pci_dev *vpdev, uint16_t idx)
 void
 virtio_pci_dev_features_get(struct virtio_pci_dev *vpdev, uint64_t *features)
 {
-	struct virtio_hw *hw;
-
-	hw = &vpdev->hw;
-	*features = hw->guest_features;
+	*features = vpdev->device_features;
 }
 
 uint64_t
@@ -157,7 +240,9 @@ virtio_pci_dev_features_set(struct virtio_pci_dev *vpdev, uint64_t features)
 	struct virtio_hw *hw;
 
 	hw = &vpdev->hw;
-	return virtio_pci_dev_negotiate_features(hw, features);
+	/* Ring layout and notification format follow the negotiated features */
+	hw->guest_features = virtio_pci_dev_negotiate_features(hw, features);
+	return hw->guest_features;
 }
 
 int
@@ -212,7 +297,7 @@ virtio_pci_dev_queue_set(struct virtio_pci_dev *vpdev,
 	return 0;
 }
 
-void
+int
 virtio_pci_dev_queue_del(struct virtio_pci_dev *vpdev, uint16_t qid)
 {
 	struct virtio_hw *hw;
@@ -221,7 +306,35 @@ virtio_pci_dev_queue_del(struct virtio_pci_dev *vpdev, uint16_t qid)
 	hw = &vpdev->hw;
 	hw_vq = hw->vqs[qid];
 
-	VIRTIO_OPS(hw)->del_queue(hw, hw_vq);
+	return VIRTIO_OPS(hw)->del_queue(hw, hw_vq);
+}
+
+void
+virtio_pci_dev_queue_avail_set(struct virtio_pci_dev *vpdev, uint16_t qid,
+		uint16_t avail_idx, bool wrap)
+{
+	struct virtqueue *hw_vq = vpdev->hw.vqs[qid];
+
+	hw_vq->vq_avail_idx = avail_idx;
+	if (virtio_with_packed_queue(&vpdev->hw))
+		hw_vq->vq_packed.cached_flags = wrap ? VRING_PACKED_DESC_F_AVAIL :
+			VRING_PACKED_DESC_F_USED;
+}
+
+int
+virtio_pci_dev_queue_reset_enable(struct virtio_pci_dev *vpdev, bool enable)
+{
+	struct virtio_hw *hw = &vpdev->hw;
+
+	if (enable && (!virtio_with_feature(hw, VIRTIO_F_RING_RESET) ||
+	    !virtio_pci_dev_queue_reset_probe(vpdev))) {
+		PMD_INIT_LOG(INFO, "Dev %s has no per-queue reset",
+						VP_DEV_NAME(vpdev));
+		vpdev->queue_reset = false;
+		return -ENOTSUP;
+	}
+	vpdev->queue_reset = enable;
+	return 0;
 }
 
 int
@@ -296,93 +409,84 @@ virtio_pci_dev_interrupts_free(struct virtio_pci_dev *vpdev)
 }
 
 int
-virtio_pci_dev_interrupt_enable(struct virtio_pci_dev *vpdev, int fd, int vec)
+virtio_pci_dev_interrupts_set(struct virtio_pci_dev *vpdev, const int *fds,
+		int start, int nvec)
 {
 	struct virtio_hw *hw = &vpdev->hw;
 	struct vfio_irq_set *irq_set;
-	int ret;
+	uint16_t msix_vec, ret_vec;
+	bool bind = false;
+	int ret, i, vec;
 
-	irq_set = rte_zmalloc(NULL, (sizeof(struct vfio_irq_set) + sizeof(int)), 0);
+	if (start < 0 || nvec <= 0)
+		return -EINVAL;
+
+	irq_set = rte_zmalloc(NULL, sizeof(struct vfio_irq_set) + sizeof(int) * nvec, 0);
 	if (irq_set == NULL) {
 		PMD_INIT_LOG(ERR, "Dev %s malloc fail", VP_DEV_NAME(vpdev));
 		return -ENOMEM;
 	}
-	irq_set->argsz = sizeof(struct vfio_irq_set) + sizeof(int);
-	irq_set->count = 1;
+	irq_set->argsz = sizeof(struct vfio_irq_set) + sizeof(int) * nvec;
+	irq_set->count = nvec;
 	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
 			 VFIO_IRQ_SET_ACTION_TRIGGER;
 	irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-	irq_set->start = vec;
-	*(int *)&irq_set->data = fd;
+	irq_set->start = start;
+	for (i = 0; i < nvec; i++) {
+		*((int *)&irq_set->data + i) = fds[i] < 0 ? VFIO_FD_INVALID : fds[i];
+		bind |= fds[i] >= 0;
+	}
 
 	ret = ioctl(vpdev->vfio_dev_fd, VFIO_DEVICE_SET_IRQS, irq_set);
 	rte_free(irq_set);
 	if (ret) {
-		PMD_INIT_LOG(ERR, "Dev %s enabling MSI-X: %s", VP_DEV_NAME(vpdev), strerror(errno));
+		PMD_INIT_LOG(ERR, "Dev %s setting MSI-X vectors %d-%d: %s",
+				VP_DEV_NAME(vpdev), start, start + nvec - 1,
+				strerror(errno));
 		return ret;
 	}
 
-	VIRTIO_OPS(hw)->intr_detect(hw);
-	if (vpdev->msix_status != VIRTIO_MSIX_ENABLED) {
-		PMD_INIT_LOG(ERR, "Dev %s MSI-X not enabled,status: %d",
-							VP_DEV_NAME(vpdev), vpdev->msix_status);
-		return -EINVAL;
+	if (bind) {
+		VIRTIO_OPS(hw)->intr_detect(hw);
+		if (vpdev->msix_status != VIRTIO_MSIX_ENABLED) {
+			PMD_INIT_LOG(ERR, "Dev %s MSI-X not enabled,status: %d",
+								VP_DEV_NAME(vpdev), vpdev->msix_status);
+			return -EINVAL;
+		}
 	}
 
-	if (vec == 0) {
-		if (VIRTIO_OPS(hw)->set_config_irq(hw, 0) ==
-				VIRTIO_MSI_NO_VECTOR) {
-			PMD_INIT_LOG(ERR, "Failed to set config vector");
+	/* Point the config and queues at their vectors in the same pass */
+	for (i = 0; i < nvec; i++) {
+		vec = start + i;
+		msix_vec = fds[i] < 0 ? VIRTIO_MSI_NO_VECTOR : vec;
+		if (vec == 0)
+			ret_vec = VIRTIO_OPS(hw)->set_config_irq(hw, msix_vec);
+		else
+			ret_vec = VIRTIO_OPS(hw)->set_queue_irq(hw, hw->vqs[vec - 1],
+					msix_vec);
+		if (ret_vec != msix_vec) {
+			PMD_INIT_LOG(ERR, "Failed to %s %s %d vector",
+					fds[i] < 0 ? "unset" : "set",
+					vec ? "queue" : "config", vec ? vec - 1 : 0);
 			return -EINVAL;
 		}
-	} else if (VIRTIO_OPS(hw)->set_queue_irq(hw, hw->vqs[vec-1], vec) ==
-					 VIRTIO_MSI_NO_VECTOR) {
-		PMD_INIT_LOG(ERR, "Failed to set queue %d vector", vec-1);
-		return -EINVAL;
 	}
+
 	return 0;
 }
 
 int
-virtio_pci_dev_interrupt_disable(struct virtio_pci_dev *vpdev, int vec)
+virtio_pci_dev_interrupt_enable(struct virtio_pci_dev *vpdev, int fd, int vec)
 {
-	struct virtio_hw *hw = &vpdev->hw;
-	struct vfio_irq_set *irq_set;
-	int ret;
-
-	irq_set = rte_zmalloc(NULL, (sizeof(struct vfio_irq_set) + sizeof(int)), 0);
-	if (irq_set == NULL) {
-		PMD_INIT_LOG(ERR, "Dev %s malloc fail", VP_DEV_NAME(vpdev));
-		return -ENOMEM;
-	}
-	irq_set->argsz = sizeof(struct vfio_irq_set) + sizeof(int);
-	irq_set->count = 1;
-	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
-			 VFIO_IRQ_SET_ACTION_TRIGGER;
-	irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-	irq_set->start = vec;
-	*(int *)&irq_set->data = VFIO_FD_INVALID;
-
-	ret = ioctl(vpdev->vfio_dev_fd, VFIO_DEVICE_SET_IRQS, irq_set);
-	rte_free(irq_set);
-	if (ret) {
-		PMD_INIT_LOG(ERR, "Dev %s disabling MSI-X: %s", VP_DEV_NAME(vpdev), strerror(errno));
-		return ret;
-	}
+	return virtio_pci_dev_interrupts_set(vpdev, &fd, vec, 1);
+}
 
-	if (vec == 0) {
-		if (VIRTIO_OPS(hw)->set_config_irq(hw, VIRTIO_MSI_NO_VECTOR) !=
-				VIRTIO_MSI_NO_VECTOR) {
-			PMD_INIT_LOG(ERR, "Failed to unset config vector");
-			return -EINVAL;
-		}
-	} else if (VIRTIO_OPS(hw)->set_queue_irq(hw, hw->vqs[vec-1], VIRTIO_MSI_NO_VECTOR) !=
-					 VIRTIO_MSI_NO_VECTOR) {
-		PMD_INIT_LOG(ERR, "Failed to unset queue %d vector", vec-1);
-		return -EINVAL;
-	}
+int
+virtio_pci_dev_interrupt_disable(struct virtio_pci_dev *vpdev, int vec)
+{
+	int fd = VFIO_FD_INVALID;
 
-	return 0;
+	return virtio_pci_dev_interrupts_set(vpdev, &fd, vec, 1);
 }
 
 void
@@ -410,10 +514,11 @@ virtio_pci_dev_reset(struct virtio_pci_dev *vpdev)
 	uint32_t retry = 0;
 	struct virtio_hw *hw = &vpdev->hw;
 
+	virtio_pci_dev_reset_wait(vpdev);
 	VIRTIO_OPS(hw)->set_status(hw, VIRTIO_CONFIG_STATUS_RESET);
 	/* Flush status write and wait device ready max 120 seconds. */
 	while (VIRTIO_OPS(hw)->get_status(hw) != VIRTIO_CONFIG_STATUS_RESET) {
-		if (retry++ > 120000) {
+		if (retry++ > VIRTIO_PCI_DEV_RESET_TIMEOUT_MS) {
 			PMD_INIT_LOG(WARNING, "vpdev %s  reset timeout", VP_DEV_NAME(vpdev));
 			break;
 		}
@@ -423,6 +528,104 @@ virtio_pci_dev_reset(struct virtio_pci_dev *vpdev)
 	}
 }
 
+/* The device is usable again once pending is cleared, after cb ran */
+static void
+virtio_pci_dev_reset_complete(struct virtio_pci_dev *vpdev, int status)
+{
+	virtio_pci_dev_reset_cb_t cb = vpdev->reset_cb;
+
+	if (status)
+		PMD_INIT_LOG(WARNING, "vpdev %s  reset failed: %d",
+				VP_DEV_NAME(vpdev), status);
+	vpdev->reset_status = status;
+	vpdev->reset_cb = NULL;
+	if (cb)
+		cb(vpdev, status, vpdev->reset_cb_arg);
+	__atomic_store_n(&vpdev->reset_pending, false, __ATOMIC_RELEASE);
+}
+
+static void
+virtio_pci_dev_reset_alarm(void *arg)
+{
+	struct virtio_pci_dev *vpdev = arg;
+	struct virtio_hw *hw = &vpdev->hw;
+	int ret;
+
+	if (VIRTIO_OPS(hw)->get_status(hw) == VIRTIO_CONFIG_STATUS_RESET) {
+		virtio_pci_dev_reset_complete(vpdev, 0);
+		return;
+	}
+	if (rte_get_timer_cycles() > vpdev->reset_deadline) {
+		virtio_pci_dev_reset_complete(vpdev, -ETIMEDOUT);
+		return;
+	}
+	ret = rte_eal_alarm_set(VIRTIO_PCI_DEV_RESET_POLL_US,
+			virtio_pci_dev_reset_alarm, vpdev);
+	if (ret)
+		virtio_pci_dev_reset_complete(vpdev, ret);
+}
+
+int
+virtio_pci_dev_reset_async(struct virtio_pci_dev *vpdev,
+		virtio_pci_dev_reset_cb_t cb, void *cb_arg)
+{
+	struct virtio_hw *hw = &vpdev->hw;
+	int ret;
+
+	if (virtio_pci_dev_reset_pending(vpdev))
+		return -EBUSY;
+
+	vpdev->reset_cb = cb;
+	vpdev->reset_cb_arg = cb_arg;
+	vpdev->reset_deadline = rte_get_timer_cycles() +
+			rte_get_timer_hz() * VIRTIO_PCI_DEV_RESET_TIMEOUT_MS / 1000;
+	__atomic_store_n(&vpdev->reset_pending, true, __ATOMIC_RELEASE);
+	VIRTIO_OPS(hw)->set_status(hw, VIRTIO_CONFIG_STATUS_RESET);
+	ret = rte_eal_alarm_set(VIRTIO_PCI_DEV_RESET_POLL_US,
+			virtio_pci_dev_reset_alarm, vpdev);
+	if (ret) {
+		PMD_INIT_LOG(ERR, "vpdev %s  failed to arm reset poll: %d",
+				VP_DEV_NAME(vpdev), ret);
+		vpdev->reset_cb = NULL;
+		__atomic_store_n(&vpdev->reset_pending, false, __ATOMIC_RELEASE);
+		return ret;
+	}
+	return 0;
+}
+
+int
+virtio_pci_dev_reset_wait(struct virtio_pci_dev *vpdev)
+{
+	struct virtio_hw *hw = &vpdev->hw;
+	uint32_t retry = 0;
+
+	if (!virtio_pci_dev_reset_pending(vpdev))
+		return vpdev->reset_status;
+
+	/* Take polling over, the alarm may have completed the reset meanwhile */
+	rte_eal_alarm_cancel(virtio_pci_dev_reset_alarm, vpdev);
+	if (!virtio_pci_dev_reset_pending(vpdev))
+		return vpdev->reset_status;
+
+	while (VIRTIO_OPS(hw)->get_status(hw) != VIRTIO_CONFIG_STATUS_RESET) {
+		if (rte_get_timer_cycles() > vpdev->reset_deadline) {
+			virtio_pci_dev_reset_complete(vpdev, -ETIMEDOUT);
+			return -ETIMEDOUT;
+		}
+		if (!(++retry % 1000))
+			PMD_INIT_LOG(INFO, "vpdev %s  resetting", VP_DEV_NAME(vpdev));
+		usleep(VIRTIO_PCI_DEV_RESET_POLL_US);
+	}
+	virtio_pci_dev_reset_complete(vpdev, 0);
+	return 0;
+}
+
+bool
+virtio_pci_dev_reset_pending(struct virtio_pci_dev *vpdev)
+{
+	return __atomic_load_n(&vpdev->reset_pending, __ATOMIC_ACQUIRE);
+}
+
 uint64_t
 virtio_pci_dev_negotiate_features(struct virtio_hw *hw, uint64_t host_features)
 {
@@ -432,7 +635,7 @@ virtio_pci_dev_negotiate_features(struct virtio_hw *hw, uint64_t host_features)
 	 * Limit negotiated features to what the driver, virtqueue, and
 	 * host all support.
 	 */
-	features = host_features & hw->guest_features;
+	features = host_features & virtio_pci_get_dev(hw)->device_features;
 	VIRTIO_OPS(hw)->set_features(hw, features);
 
 	return features;
@@ -51,6 +51,14 @@
  */
 #define VIRTIO_F_NOTIFICATION_DATA 38
 
+/*
+ * This feature indicates that the driver can reset a queue individually.
+ * It shares bit 40 with the pre-standard VIRTIO_F_ADMIN_VQ of admin capable
+ * PFs, so it is only honoured where a driver asks for it explicitly and
+ * the device is seen to reset a queue.
+ */
+#define VIRTIO_F_RING_RESET 40
+
 /*
  * The Guest publishes the used index for which it expects an interrupt
  * at the end of the avail ring. Host should ignore the avail->flags field
@@ -101,13 +109,25 @@
 /* The alignment to use between consumer and producer parts of vring. */
 #define VIRTIO_VRING_ALIGN 4096
 
+struct virtadmin_cmd_slot;
+
 struct virtadmin_ctl {
-	/**< memzone to populate hdr. */
+	/**< memzone to populate hdr, data, result and status of each command. */
 	const struct rte_memzone *virtio_admin_hdr_mz;
-	rte_iova_t virtio_admin_hdr_mem;/**< hdr for each xmit packet */
+	rte_iova_t virtio_admin_hdr_mem;/**< iova of the first command slot */
 	uint16_t port_id;	       /**< Device port identifier. */
 	const struct rte_memzone *mz;   /**< mem zone to populate CTL ring. */
 	rte_spinlock_t lock;	    /**< spinlock for control queue. */
+	struct virtadmin_cmd_slot *slots; /**< per command state, one per slot. */
+	uint16_t *free_slots;	    /**< stack of free slot indexes. */
+	uint16_t nr_slots;	    /**< number of command slots. */
+	uint16_t nr_free_slots;	    /**< number of entries in free_slots. */
+	uint8_t indirect;	    /**< each command uses one indirect descriptor. */
+	uint8_t in_order;	    /**< device completes commands in submission order. */
+	uint16_t *inflight;	    /**< in order: slot indexes in submission order. */
+	uint16_t inflight_prod;	    /**< in order: next inflight entry to fill. */
+	uint16_t inflight_cons;	    /**< in order: oldest inflight entry. */
+	uint16_t inorder_pending;   /**< in order: commands left in the batch being reaped. */
 };
 
 struct virtio_hw {
@@ -138,7 +158,8 @@ struct virtio_ops {
 	uint16_t (*get_queue_num)(struct virtio_hw *hw);
 	uint16_t (*get_queue_size)(struct virtio_hw *hw, uint16_t queue_id);
 	int (*setup_queue)(struct virtio_hw *hw, struct virtqueue *vq);
-	void (*del_queue)(struct virtio_hw *hw, struct virtqueue *vq);
+	int (*del_queue)(struct virtio_hw *hw, struct virtqueue *vq);
+	int (*attach_queue)(struct virtio_hw *hw, struct virtqueue *vq);
 	void (*notify_queue)(struct virtio_hw *hw, struct virtqueue *vq);
 	void (*intr_detect)(struct virtio_hw *hw);
 	int (*dev_close)(struct virtio_hw *hw);
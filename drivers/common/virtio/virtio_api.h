@@ -35,8 +35,31 @@ virtio_pci_dev_queue_notify(struct virtio_pci_dev *vpdev, uint16_t qid)
 	VIRTIO_OPS(&vpdev->hw)->notify_queue(&vpdev->hw, vpdev->hw.vqs[qid]);
 }
 
+/*
+ * EAL VFIO container and PCI mapping calls are not thread safe. Devices
+ * initialized from several threads make them under this lock, which
+ * virtio_pci_dev_alloc() and virtio_pci_dev_free() take when they map
+ * and unmap the device.
+ */
+__rte_internal
+void virtio_pci_vfio_lock(void);
+__rte_internal
+void virtio_pci_vfio_unlock(void);
 __rte_internal
 struct virtio_pci_dev *virtio_pci_dev_alloc(struct rte_pci_device *pci_dev);
+/*
+ * Take over a modern device another process drives, through the VFIO
+ * device fd it handed over: the BARs are mapped from vfio_dev_fd, the
+ * device is neither reset nor written. guest_features are those it
+ * negotiated, 0 if it was not configured. The fd is closed when the
+ * device is freed.
+ */
+__rte_internal
+struct virtio_pci_dev *virtio_pci_dev_adopt(struct rte_pci_device *pci_dev,
+		int vfio_dev_fd, uint64_t guest_features);
+/* Free vpdev and leave the device mapped and running, for another process */
+__rte_internal
+void virtio_pci_dev_release(struct virtio_pci_dev *vpdev);
 __rte_internal
 uint16_t virtio_pci_dev_nr_vq_get(struct virtio_pci_dev *vpdev);
 __rte_internal
@@ -53,12 +76,45 @@ __rte_internal
 uint64_t virtio_pci_dev_features_set(struct virtio_pci_dev *vpdev, uint64_t features);
 __rte_internal
 int virtio_pci_dev_queue_set(struct virtio_pci_dev *vpdev, uint16_t qid, const struct virtio_pci_dev_vring_info *vring_info);
+/*
+ * Read back the rings of a queue set up before the device was adopted, and
+ * prepare it to be notified. Returns 1 if it is enabled, 0 if not.
+ */
 __rte_internal
-void virtio_pci_dev_queue_del(struct virtio_pci_dev *vpdev, uint16_t qid);
+int virtio_pci_dev_queue_attach(struct virtio_pci_dev *vpdev, uint16_t qid,
+		struct virtio_pci_dev_vring_info *vring_info);
+/*
+ * Disable a queue, by per-queue reset once the device runs. Returns
+ * -ETIMEDOUT if the device does not complete the reset.
+ */
+__rte_internal
+int virtio_pci_dev_queue_del(struct virtio_pci_dev *vpdev, uint16_t qid);
+/*
+ * Driver ring position the next notification carries when
+ * VIRTIO_F_NOTIFICATION_DATA is negotiated, wrap only matters when packed.
+ */
+__rte_internal
+void virtio_pci_dev_queue_avail_set(struct virtio_pci_dev *vpdev, uint16_t qid,
+		uint16_t avail_idx, bool wrap);
+/*
+ * Delete queues of a running device by per-queue reset. Needs
+ * VIRTIO_F_RING_RESET negotiated and a device that passes a queue reset
+ * probe, bit 40 alone may mean an admin queue.
+ */
+__rte_internal
+int virtio_pci_dev_queue_reset_enable(struct virtio_pci_dev *vpdev, bool enable);
 __rte_internal
 int virtio_pci_dev_interrupt_enable(struct virtio_pci_dev *vpdev, int fd, int vec);
 __rte_internal
 int virtio_pci_dev_interrupt_disable(struct virtio_pci_dev *vpdev, int vec);
+/*
+ * Bind fds to the nvec MSI-X vectors from start in one VFIO call, a
+ * negative fd unbinds its vector. Vector 0 is the config vector, vector
+ * n belongs to queue n - 1 and is programmed in the device as well.
+ */
+__rte_internal
+int virtio_pci_dev_interrupts_set(struct virtio_pci_dev *vpdev, const int *fds,
+		int start, int nvec);
 __rte_internal
 int virtio_pci_dev_interrupts_num_get(struct virtio_pci_dev *vpdev);
 __rte_internal
@@ -71,6 +127,21 @@ __rte_internal
 uint8_t virtio_pci_dev_get_status(struct virtio_pci_dev *vpdev);
 __rte_internal
 void virtio_pci_dev_reset(struct virtio_pci_dev *vpdev);
+/*
+ * Start a reset and return, the device status is then polled from an EAL
+ * alarm and cb runs on the interrupt thread once the device reads back
+ * as reset, or after the reset timeout. cb must not wait for the reset.
+ * The device must not be used until then but through
+ * virtio_pci_dev_reset_wait(), which completes the reset in the caller
+ * context, cb included.
+ */
+__rte_internal
+int virtio_pci_dev_reset_async(struct virtio_pci_dev *vpdev,
+		virtio_pci_dev_reset_cb_t cb, void *cb_arg);
+__rte_internal
+int virtio_pci_dev_reset_wait(struct virtio_pci_dev *vpdev);
+__rte_internal
+bool virtio_pci_dev_reset_pending(struct virtio_pci_dev *vpdev);
 __rte_internal
 int virtio_pci_dev_notify_area_get(struct virtio_pci_dev *vpdev, uint16_t qid, uint64_t *offset, uint64_t *size);
 __rte_internal
@@ -6,10 +6,17 @@
  #include <fcntl.h>
 #endif
 
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
 #include <rte_io.h>
 #include <rte_bus.h>
+#include <rte_cycles.h>
+#include <rte_vfio.h>
 
 #include "virtio_pci.h"
+#include "virtio_api.h"
 #include "virtio_logs.h"
 #include "virtqueue.h"
 
@@ -22,6 +29,10 @@
 #define PCI_CAP_ID_VNDR		0x09
 #define PCI_CAP_ID_MSIX		0x11
 
+/* Per-queue reset completes well within a second */
+#define VIRTIO_PCI_QUEUE_RESET_RETRIES	1000
+#define VIRTIO_PCI_QUEUE_RESET_USEC	1000
+
 /*
  * The remaining space is defined by each driver as the per-driver
  * configuration space.
@@ -256,7 +267,7 @@ legacy_setup_queue(struct virtio_hw *hw, struct virtqueue *vq)
 	return 0;
 }
 
-static void
+static int
 legacy_del_queue(struct virtio_hw *hw, struct virtqueue *vq)
 {
 	uint32_t src = 0;
@@ -264,6 +275,7 @@ legacy_del_queue(struct virtio_hw *hw, struct virtqueue *vq)
 	rte_pci_ioport_write(VTPCI_IO(hw), &vq->vq_queue_index, 2,
 		VIRTIO_PCI_QUEUE_SEL);
 	rte_pci_ioport_write(VTPCI_IO(hw), &src, 4, VIRTIO_PCI_QUEUE_PFN);
+	return 0;
 }
 
 static void
@@ -285,7 +297,9 @@ legacy_intr_detect(struct virtio_hw *hw)
 static int
 legacy_dev_close(struct virtio_hw *hw)
 {
+	virtio_pci_vfio_lock();
 	rte_pci_unmap_device(VTPCI_DEV(hw));
+	virtio_pci_vfio_unlock();
 	rte_pci_ioport_unmap(VTPCI_IO(hw));
 
 	return 0;
@@ -318,6 +332,14 @@ io_write64_twopart(uint64_t val, uint32_t *lo, uint32_t *hi)
 	rte_write32(val >> 32, hi);
 }
 
+static inline uint64_t
+io_read64_twopart(uint32_t *lo, uint32_t *hi)
+{
+	uint64_t val_lo = rte_read32(lo);
+
+	return val_lo | ((uint64_t)rte_read32(hi) << 32);
+}
+
 static void
 modern_read_dev_config(struct virtio_hw *hw, size_t offset,
 		       void *dst, int length)
@@ -486,6 +508,14 @@ modern_setup_queue(struct virtio_hw *hw, struct virtqueue *vq)
 	used_addr  = vq->vq_used_mem;
 
 	rte_write16(vq->vq_queue_index, &dev->common_cfg->queue_select);
+
+	/* A live queue must be reset before it is programmed again */
+	if (dev->queue_reset && rte_read16(&dev->common_cfg->queue_enable)) {
+		PMD_INIT_LOG(ERR, "queue %u is enabled, reset it first",
+			vq->vq_queue_index);
+		return -EBUSY;
+	}
+
 	rte_write16(vq->vq_nentries, &dev->common_cfg->queue_size);
 
 	io_write64_twopart(desc_addr, &dev->common_cfg->queue_desc_lo,
@@ -511,13 +541,63 @@ modern_setup_queue(struct virtio_hw *hw, struct virtqueue *vq)
 	return 0;
 }
 
-static void
+/*
+ * Take a queue over as another driver instance left it: its notify
+ * address is computed, its rings are read back if it is enabled.
+ * Returns 1 if enabled, 0 otherwise. The queue is not written.
+ */
+static int
+modern_attach_queue(struct virtio_hw *hw, struct virtqueue *vq)
+{
+	struct virtio_pci_dev *dev = virtio_pci_get_dev(hw);
+	uint16_t notify_off;
+
+	rte_write16(vq->vq_queue_index, &dev->common_cfg->queue_select);
+
+	notify_off = rte_read16(&dev->common_cfg->queue_notify_off);
+	vq->notify_addr = (void *)((uint8_t *)dev->notify_base +
+				notify_off * dev->notify_off_multiplier);
+
+	if (!rte_read16(&dev->common_cfg->queue_enable))
+		return 0;
+
+	vq->vq_nentries = rte_read16(&dev->common_cfg->queue_size);
+	vq->vq_ring_mem = io_read64_twopart(&dev->common_cfg->queue_desc_lo,
+					    &dev->common_cfg->queue_desc_hi);
+	vq->vq_avail_mem = io_read64_twopart(&dev->common_cfg->queue_avail_lo,
+					     &dev->common_cfg->queue_avail_hi);
+	vq->vq_used_mem = io_read64_twopart(&dev->common_cfg->queue_used_lo,
+					    &dev->common_cfg->queue_used_hi);
+	return 1;
+}
+
+static int
 modern_del_queue(struct virtio_hw *hw, struct virtqueue *vq)
 {
 	struct virtio_pci_dev *dev = virtio_pci_get_dev(hw);
+	uint32_t retry = 0;
 
 	rte_write16(vq->vq_queue_index, &dev->common_cfg->queue_select);
 
+	/*
+	 * Once the device is running, queue_enable can not be cleared. Reset
+	 * the queue alone instead: queue_reset reads 1 until the device has
+	 * returned the queue fields to defaults, then 0.
+	 */
+	if (dev->queue_reset &&
+	    (modern_get_status(hw) & VIRTIO_CONFIG_STATUS_DRIVER_OK)) {
+		rte_write16(1, &dev->common_cfg->queue_reset);
+		while (rte_read16(&dev->common_cfg->queue_reset) != 0) {
+			if (retry++ > VIRTIO_PCI_QUEUE_RESET_RETRIES) {
+				PMD_INIT_LOG(ERR, "queue %u reset timeout",
+					vq->vq_queue_index);
+				return -ETIMEDOUT;
+			}
+			rte_delay_us_sleep(VIRTIO_PCI_QUEUE_RESET_USEC);
+		}
+		return 0;
+	}
+
 	io_write64_twopart(0, &dev->common_cfg->queue_desc_lo,
 				  &dev->common_cfg->queue_desc_hi);
 	io_write64_twopart(0, &dev->common_cfg->queue_avail_lo,
@@ -526,6 +606,45 @@ modern_del_queue(struct virtio_hw *hw, struct virtqueue *vq)
 				  &dev->common_cfg->queue_used_hi);
 
 	rte_write16(0, &dev->common_cfg->queue_enable);
+	return 0;
+}
+
+/*
+ * Bit 40 is also the pre-standard VIRTIO_F_ADMIN_VQ, so check that the
+ * device resets queues: a reset must bring a shrunk queue_size back to
+ * its default. A live queue is only checked not to be in reset.
+ */
+bool
+virtio_pci_dev_queue_reset_probe(struct virtio_pci_dev *dev)
+{
+	struct virtio_pci_common_cfg *cfg = dev->common_cfg;
+	uint32_t retry = 0;
+	uint16_t size;
+
+	if (!dev->modern || dev->common_cfg_len <
+	    offsetof(struct virtio_pci_common_cfg, queue_reset) + sizeof(uint16_t))
+		return false;
+
+	rte_write16(0, &cfg->queue_select);
+	if (rte_read16(&cfg->queue_reset) != 0)
+		return false;
+	if (rte_read16(&cfg->queue_enable))
+		return true;
+
+	size = rte_read16(&cfg->queue_size);
+	if (size < 2)
+		return false;
+	rte_write16(size / 2, &cfg->queue_size);
+	rte_write16(1, &cfg->queue_reset);
+	while (rte_read16(&cfg->queue_reset) != 0) {
+		if (retry++ > VIRTIO_PCI_QUEUE_RESET_RETRIES)
+			break;
+		rte_delay_us_sleep(VIRTIO_PCI_QUEUE_RESET_USEC);
+	}
+	if (rte_read16(&cfg->queue_size) == size)
+		return true;
+	rte_write16(size, &cfg->queue_size);
+	return false;
 }
 
 static void
@@ -568,10 +687,68 @@ modern_intr_detect(struct virtio_hw *hw)
 	hw->intr_lsc = !!dev->msix_status;
 }
 
+/* Map the BARs through a VFIO device fd that EAL did not open */
+static int
+virtio_pci_vfio_bars_map(struct rte_pci_device *pci_dev, int vfio_dev_fd)
+{
+	struct vfio_region_info reg;
+	void *addr;
+	int i;
+
+	for (i = 0; i < PCI_MAX_RESOURCE; i++) {
+		memset(&reg, 0, sizeof(reg));
+		reg.argsz = sizeof(reg);
+		reg.index = i;
+		if (ioctl(vfio_dev_fd, VFIO_DEVICE_GET_REGION_INFO, &reg)) {
+			PMD_INIT_LOG(ERR, "%s BAR %d region info: %s",
+				pci_dev->device.name, i, strerror(errno));
+			return -errno;
+		}
+		pci_dev->mem_resource[i].addr = NULL;
+		if (!reg.size || !(reg.flags & VFIO_REGION_INFO_FLAG_MMAP))
+			continue;
+		addr = mmap(NULL, reg.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    vfio_dev_fd, reg.offset);
+		if (addr == MAP_FAILED) {
+			PMD_INIT_LOG(ERR, "%s BAR %d mmap: %s",
+				pci_dev->device.name, i, strerror(errno));
+			return -errno;
+		}
+		pci_dev->mem_resource[i].addr = addr;
+		pci_dev->mem_resource[i].len = reg.size;
+	}
+	return 0;
+}
+
+static void
+virtio_pci_vfio_bars_unmap(struct rte_pci_device *pci_dev)
+{
+	int i;
+
+	for (i = 0; i < PCI_MAX_RESOURCE; i++) {
+		if (!pci_dev->mem_resource[i].addr)
+			continue;
+		munmap(pci_dev->mem_resource[i].addr,
+		       pci_dev->mem_resource[i].len);
+		pci_dev->mem_resource[i].addr = NULL;
+	}
+}
+
 static int
 modern_dev_close(struct virtio_hw *hw)
 {
+	struct virtio_pci_dev *dev = virtio_pci_get_dev(hw);
+
+	if (dev->adopted) {
+		virtio_pci_vfio_bars_unmap(VTPCI_DEV(hw));
+		close(dev->vfio_dev_fd);
+		rte_intr_dev_fd_set(VTPCI_DEV(hw)->intr_handle, -1);
+		return 0;
+	}
+
+	virtio_pci_vfio_lock();
 	rte_pci_unmap_device(VTPCI_DEV(hw));
+	virtio_pci_vfio_unlock();
 
 	return 0;
 }
@@ -591,6 +768,7 @@ static const struct virtio_ops virtio_dev_pci_modern_ops = {
 	.get_queue_size = modern_get_queue_size,
 	.setup_queue    = modern_setup_queue,
 	.del_queue      = modern_del_queue,
+	.attach_queue   = modern_attach_queue,
 	.notify_queue   = modern_notify_queue,
 	.intr_detect    = modern_intr_detect,
 	.dev_close      = modern_dev_close,
@@ -643,8 +821,18 @@ virtio_read_caps(struct rte_pci_device *pci_dev, struct virtio_hw *hw)
 	struct virtio_pci_cap cap;
 	int ret;
 
-	if (rte_pci_map_device(pci_dev)) {
+	if (dev->adopted) {
+		ret = virtio_pci_vfio_bars_map(pci_dev,
+				rte_intr_dev_fd_get(pci_dev->intr_handle));
+	} else {
+		virtio_pci_vfio_lock();
+		ret = rte_pci_map_device(pci_dev);
+		virtio_pci_vfio_unlock();
+	}
+	if (ret) {
 		PMD_INIT_LOG(DEBUG, "failed to map pci device!");
+		if (dev->adopted)
+			virtio_pci_vfio_bars_unmap(pci_dev);
 		return -EINVAL;
 	}
 
@@ -709,6 +897,7 @@ virtio_read_caps(struct rte_pci_device *pci_dev, struct virtio_hw *hw)
 		switch (cap.cfg_type) {
 		case VIRTIO_PCI_CAP_COMMON_CFG:
 			dev->common_cfg = get_cfg_addr(pci_dev, &cap);
+			dev->common_cfg_len = cap.length;
 			break;
 		case VIRTIO_PCI_CAP_NOTIFY_CFG:
 			ret = rte_pci_read_config(pci_dev,
@@ -764,6 +953,7 @@ int
 virtio_pci_dev_init(struct rte_pci_device *pci_dev, struct virtio_pci_dev *dev)
 {
 	struct virtio_hw *hw = &dev->hw;
+	int ret;
 
 	RTE_BUILD_BUG_ON(offsetof(struct virtio_pci_dev, hw) != 0);
 
@@ -778,7 +968,13 @@ virtio_pci_dev_init(struct rte_pci_device *pci_dev, struct virtio_pci_dev *dev)
 		if (pci_dev->id.device_id == VIRTIO_PCI_MODERN_DEVICEID_NET)
 			hw->virtio_dev_sp_ops = &virtio_net_dev_pci_modern_ops;
 		else {
-			rte_pci_unmap_device(pci_dev);
+			if (dev->adopted) {
+				virtio_pci_vfio_bars_unmap(pci_dev);
+			} else {
+				virtio_pci_vfio_lock();
+				rte_pci_unmap_device(pci_dev);
+				virtio_pci_vfio_unlock();
+			}
 			PMD_INIT_LOG(ERR, "device id 0x%x not supported", pci_dev->id.device_id);
 			return -EINVAL;
 		}
@@ -786,9 +982,19 @@ virtio_pci_dev_init(struct rte_pci_device *pci_dev, struct virtio_pci_dev *dev)
 		goto msix_detect;
 	}
 
+	/* Only modern devices are taken over */
+	if (dev->adopted) {
+		virtio_pci_vfio_bars_unmap(pci_dev);
+		return -EINVAL;
+	}
+
 	PMD_INIT_LOG(INFO, "trying with legacy virtio pci");
-	if (rte_pci_ioport_map(pci_dev, 0, VTPCI_IO(hw)) < 0) {
+	virtio_pci_vfio_lock();
+	ret = rte_pci_ioport_map(pci_dev, 0, VTPCI_IO(hw));
+	if (ret < 0)
 		rte_pci_unmap_device(pci_dev);
+	virtio_pci_vfio_unlock();
+	if (ret < 0) {
 		if (pci_dev->kdrv == RTE_PCI_KDRV_UNKNOWN &&
 		    (!pci_dev->device.devargs ||
 		     pci_dev->device.devargs->bus !=
@@ -21,6 +21,7 @@ struct virtnet_ctl;
 #define VIRTIO_PCI_VENDORID     0x1AF4
 #define VIRTIO_PCI_LEGACY_DEVICEID_NET 0x1000
 #define VIRTIO_PCI_MODERN_DEVICEID_NET 0x1041
+#define VIRTIO_PCI_MODERN_DEVICEID_BLK 0x1042
 
 /* VirtIO ABI version, this must match exactly. */
 #define VIRTIO_PCI_ABI_VERSION 0
@@ -94,6 +95,8 @@ struct virtio_pci_common_cfg {
 	uint32_t queue_avail_hi;	/* read-write */
 	uint32_t queue_used_lo;		/* read-write */
 	uint32_t queue_used_hi;		/* read-write */
+	uint16_t queue_notify_data;	/* read-only, virtio 1.2 */
+	uint16_t queue_reset;		/* read-write, virtio 1.2 */
 };
 
 enum virtio_msix_status {
@@ -236,6 +239,12 @@ struct virtio_admin_dirty_page_report_map_data {
 		start tracking) */
 };
 
+struct virtio_pci_dev;
+
+/* Completion of an asynchronous reset, status is 0 or a negative errno */
+typedef void (*virtio_pci_dev_reset_cb_t)(struct virtio_pci_dev *vpdev,
+		int status, void *cb_arg);
+
 struct virtio_pci_dev {
 	struct virtio_hw hw;
 	struct virtio_pci_common_cfg *common_cfg;
@@ -247,6 +256,15 @@ struct virtio_pci_dev {
 	int vfio_dev_fd;
 	uint8_t notify_bar;
 	bool modern;
+	uint32_t common_cfg_len;
+	uint64_t device_features; /* Offered, hw.guest_features is negotiated */
+	bool queue_reset; /* Delete queues by per-queue reset */
+	bool adopted; /* BARs mapped from a VFIO device fd handed over */
+	bool reset_pending; /* Asynchronous reset not completed yet */
+	int reset_status; /* Of the last asynchronous reset */
+	uint64_t reset_deadline; /* Timer cycles */
+	virtio_pci_dev_reset_cb_t reset_cb;
+	void *reset_cb_arg;
 };
 
 #define virtio_pci_get_dev(hwp) container_of(hwp, struct virtio_pci_dev, hw)
@@ -271,6 +289,7 @@ struct virtio_pci_internal {
 int virtio_pci_dev_init(struct rte_pci_device *pci_dev, struct virtio_pci_dev *dev);
 void virtio_pci_dev_legacy_ioport_unmap(struct virtio_hw *hw);
 int virtio_pci_dev_legacy_ioport_map(struct virtio_hw *hw);
+bool virtio_pci_dev_queue_reset_probe(struct virtio_pci_dev *dev);
 
 extern const struct virtio_ops legacy_ops;
 extern const struct virtio_ops modern_ops;
@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+#include <string.h>
+#include <rte_common.h>
+#include <rte_bitops.h>
+#include <rte_cpuflags.h>
+#include <rte_vect.h>
+#include <rte_dev.h>
+
+#include <virtio_api.h>
+#include <virtio_lm.h>
+#include "dirty_map.h"
+
+typedef uint64_t (*virtio_dirty_bytemap_merge_t)(uint8_t *bytemap,
+		uint64_t nr_pages, uint64_t *log, uint64_t first_page);
+
+uint64_t
+virtio_dirty_bytemap_merge_scalar(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	uint64_t page, word, mask, dirty = 0;
+	unsigned int i, j;
+
+	for (page = 0; page + 64 <= nr_pages; page += 64) {
+		mask = 0;
+		for (i = 0; i < 64; i += 8) {
+			memcpy(&word, &bytemap[page + i], sizeof(word));
+			if (!word)
+				continue;
+			for (j = 0; j < 8; j++)
+				if (bytemap[page + i + j])
+					mask |= 1ULL << (i + j);
+			memset(&bytemap[page + i], 0, sizeof(word));
+		}
+		virtio_dirty_log_or(log, first_page + page, mask);
+		dirty += __builtin_popcountll(mask);
+	}
+
+	return dirty + virtio_dirty_bytemap_tail(&bytemap[page], nr_pages - page,
+			log, first_page + page);
+}
+
+#ifdef RTE_ARCH_ARM64
+uint64_t
+virtio_dirty_bytemap_merge_neon(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	static const uint8_t weights[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+	};
+	const uint8x16_t w = vld1q_u8(weights);
+	const uint8x16_t zero = vdupq_n_u8(0);
+	uint8x16_t v0, v1, v2, v3, p0, p1;
+	uint64_t page, mask, dirty = 0;
+
+	for (page = 0; page + 64 <= nr_pages; page += 64) {
+		v0 = vld1q_u8(&bytemap[page]);
+		v1 = vld1q_u8(&bytemap[page + 16]);
+		v2 = vld1q_u8(&bytemap[page + 32]);
+		v3 = vld1q_u8(&bytemap[page + 48]);
+		if (!vmaxvq_u8(vorrq_u8(vorrq_u8(v0, v1), vorrq_u8(v2, v3))))
+			continue;
+		/* One weighted bit per byte, then pairwise add down to 64 bits */
+		p0 = vpaddq_u8(vandq_u8(vtstq_u8(v0, v0), w),
+				vandq_u8(vtstq_u8(v1, v1), w));
+		p1 = vpaddq_u8(vandq_u8(vtstq_u8(v2, v2), w),
+				vandq_u8(vtstq_u8(v3, v3), w));
+		p0 = vpaddq_u8(p0, p1);
+		p0 = vpaddq_u8(p0, p0);
+		mask = vgetq_lane_u64(vreinterpretq_u64_u8(p0), 0);
+		vst1q_u8(&bytemap[page], zero);
+		vst1q_u8(&bytemap[page + 16], zero);
+		vst1q_u8(&bytemap[page + 32], zero);
+		vst1q_u8(&bytemap[page + 48], zero);
+		virtio_dirty_log_or(log, first_page + page, mask);
+		dirty += __builtin_popcountll(mask);
+	}
+
+	return dirty + virtio_dirty_bytemap_tail(&bytemap[page], nr_pages - page,
+			log, first_page + page);
+}
+#endif
+
+static virtio_dirty_bytemap_merge_t
+virtio_dirty_bytemap_merge_select(void)
+{
+	uint16_t simd = rte_vect_get_max_simd_bitwidth();
+
+	RTE_SET_USED(simd);
+#ifdef CC_AVX512_SUPPORT
+	if (simd >= RTE_VECT_SIMD_512 &&
+	    rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX512F) == 1 &&
+	    rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX512BW) == 1)
+		return virtio_dirty_bytemap_merge_avx512;
+#endif
+#ifdef CC_AVX2_SUPPORT
+	if (simd >= RTE_VECT_SIMD_256 &&
+	    rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX2) == 1)
+		return virtio_dirty_bytemap_merge_avx2;
+#endif
+#ifdef RTE_ARCH_ARM64
+	if (simd >= RTE_VECT_SIMD_128 &&
+	    rte_cpu_get_flag_enabled(RTE_CPUFLAG_NEON) == 1)
+		return virtio_dirty_bytemap_merge_neon;
+#endif
+	return virtio_dirty_bytemap_merge_scalar;
+}
+
+/* Picked again only when the max SIMD bitwidth it was picked for changes */
+static virtio_dirty_bytemap_merge_t virtio_dirty_bytemap_merge_fn;
+static uint16_t virtio_dirty_bytemap_merge_simd;
+
+static void
+virtio_dirty_bytemap_merge_update(uint16_t simd)
+{
+	__atomic_store_n(&virtio_dirty_bytemap_merge_fn,
+			virtio_dirty_bytemap_merge_select(), __ATOMIC_RELAXED);
+	__atomic_store_n(&virtio_dirty_bytemap_merge_simd, simd,
+			__ATOMIC_RELEASE);
+}
+
+RTE_INIT(virtio_dirty_bytemap_merge_init)
+{
+	virtio_dirty_bytemap_merge_update(rte_vect_get_max_simd_bitwidth());
+}
+
+uint64_t
+virtio_vdpa_dirty_bytemap_merge(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	uint16_t simd = rte_vect_get_max_simd_bitwidth();
+
+	if (simd != __atomic_load_n(&virtio_dirty_bytemap_merge_simd,
+			__ATOMIC_ACQUIRE))
+		virtio_dirty_bytemap_merge_update(simd);
+	return __atomic_load_n(&virtio_dirty_bytemap_merge_fn,
+			__ATOMIC_RELAXED)(bytemap, nr_pages, log, first_page);
+}
+
+uint64_t
+virtio_vdpa_dirty_bitmap_merge(const uint64_t *bitmap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	uint64_t i, mask, dirty = 0;
+
+	for (i = 0; i < nr_pages / 64; i++) {
+		mask = rte_le_to_cpu_64(bitmap[i]);
+		virtio_dirty_log_or(log, first_page + i * 64, mask);
+		dirty += __builtin_popcountll(mask);
+	}
+	if (nr_pages % 64) {
+		mask = rte_le_to_cpu_64(bitmap[i]) &
+			(RTE_BIT64(nr_pages % 64) - 1);
+		virtio_dirty_log_or(log, first_page + i * 64, mask);
+		dirty += __builtin_popcountll(mask);
+	}
+
+	return dirty;
+}
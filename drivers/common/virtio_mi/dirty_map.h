@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#ifndef _VIRTIO_DIRTY_MAP_H_
+#define _VIRTIO_DIRTY_MAP_H_
+
+#include <stdint.h>
+#include <rte_common.h>
+#include <rte_byteorder.h>
+
+/*
+ * Set the 64 page bits of mask in the vhost log starting at page, the log
+ * is a little endian bitmap shared with QEMU so bits are set atomically.
+ */
+static __rte_always_inline void
+virtio_dirty_log_or(uint64_t *log, uint64_t page, uint64_t mask)
+{
+	uint64_t off = page % 64;
+
+	if (!mask)
+		return;
+	__atomic_fetch_or(&log[page / 64], rte_cpu_to_le_64(mask << off),
+			__ATOMIC_RELAXED);
+	if (off && (mask >> (64 - off)))
+		__atomic_fetch_or(&log[page / 64 + 1],
+				rte_cpu_to_le_64(mask >> (64 - off)),
+				__ATOMIC_RELAXED);
+}
+
+/* Fold the pages left after the vector loop, one byte per page */
+static __rte_always_inline uint64_t
+virtio_dirty_bytemap_tail(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	uint64_t mask = 0;
+	uint64_t i;
+
+	for (i = 0; i < nr_pages; i++) {
+		if (bytemap[i]) {
+			mask |= 1ULL << i;
+			bytemap[i] = 0;
+		}
+	}
+	virtio_dirty_log_or(log, first_page, mask);
+
+	return __builtin_popcountll(mask);
+}
+
+uint64_t
+virtio_dirty_bytemap_merge_scalar(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page);
+uint64_t
+virtio_dirty_bytemap_merge_avx2(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page);
+uint64_t
+virtio_dirty_bytemap_merge_avx512(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page);
+uint64_t
+virtio_dirty_bytemap_merge_neon(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page);
+
+#endif /* _VIRTIO_DIRTY_MAP_H_ */
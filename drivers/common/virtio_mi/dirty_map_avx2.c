@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+#include <rte_vect.h>
+
+#include "dirty_map.h"
+
+uint64_t
+virtio_dirty_bytemap_merge_avx2(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t page, mask, dirty = 0;
+	__m256i v0, v1;
+
+	for (page = 0; page + 64 <= nr_pages; page += 64) {
+		v0 = _mm256_loadu_si256((const __m256i *)&bytemap[page]);
+		v1 = _mm256_loadu_si256((const __m256i *)&bytemap[page + 32]);
+		mask = (uint32_t)~_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero)) |
+			(uint64_t)(uint32_t)~_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(v1, zero)) << 32;
+		if (!mask)
+			continue;
+		_mm256_storeu_si256((__m256i *)&bytemap[page], zero);
+		_mm256_storeu_si256((__m256i *)&bytemap[page + 32], zero);
+		virtio_dirty_log_or(log, first_page + page, mask);
+		dirty += __builtin_popcountll(mask);
+	}
+
+	return dirty + virtio_dirty_bytemap_tail(&bytemap[page], nr_pages - page,
+			log, first_page + page);
+}
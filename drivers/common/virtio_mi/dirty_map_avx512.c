@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+#include <rte_vect.h>
+
+#include "dirty_map.h"
+
+uint64_t
+virtio_dirty_bytemap_merge_avx512(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	uint64_t page, mask, dirty = 0;
+	__m512i v;
+
+	for (page = 0; page + 64 <= nr_pages; page += 64) {
+		v = _mm512_loadu_si512((const void *)&bytemap[page]);
+		mask = _mm512_test_epi8_mask(v, v);
+		if (!mask)
+			continue;
+		_mm512_storeu_si512((void *)&bytemap[page], zero);
+		virtio_dirty_log_or(log, first_page + page, mask);
+		dirty += __builtin_popcountll(mask);
+	}
+
+	return dirty + virtio_dirty_bytemap_tail(&bytemap[page], nr_pages - page,
+			log, first_page + page);
+}
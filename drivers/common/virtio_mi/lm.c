@@ -2,9 +2,12 @@
  * Copyright (c) 2022 NVIDIA Corporation & Affiliates
  */
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <net/if.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <rte_malloc.h>
@@ -12,28 +15,105 @@
 #include <rte_errno.h>
 #include <rte_string_fns.h>
 #include <rte_bus_pci.h>
+#include <rte_bus_vdev.h>
 #include <rte_vfio.h>
 #include <rte_kvargs.h>
 #include <rte_eal_paging.h>
 #include <rte_ether.h>
+#include <rte_cycles.h>
+#include <rte_interrupts.h>
 
 #include <virtqueue.h>
 #include <virtio_admin.h>
 #include <virtio_api.h>
 #include <virtio_lm.h>
 
+#include "sw_pf.h"
+
 #define VIRTIO_VDPA_MI_SUPPORTED_NET_FEATURES (1ULL << VIRTIO_F_ADMIN_VQ)
 
 #define VIRTIO_VDPA_MI_SUPPORTED_BLK_FEATURES (1ULL << VIRTIO_F_ADMIN_VQ)
 
+/*
+ * Used when the device offers them, the admin queue works without.
+ * ORDER_PLATFORM picks IO barriers for the admin ring.
+ */
+#define VIRTIO_VDPA_MI_OPTIONAL_FEATURES \
+	((1ULL << VIRTIO_F_VERSION_1) | \
+	 (1ULL << VIRTIO_F_ORDER_PLATFORM) | \
+	 (1ULL << VIRTIO_F_RING_PACKED) | \
+	 (1ULL << VIRTIO_F_ADMIN_VQ_INDIRECT_DESC) | \
+	 (1ULL << VIRTIO_F_ADMIN_VQ_IN_ORDER) | \
+	 (1ULL << VIRTIO_F_ADMIN_MIGRATION_DYNAMIC_INTERNAL_STATE_TRACK))
+
 #define VIRTIO_VDPA_MI_MAX_SGES 32
 
+/* Chunks used to pull state deltas while the VF keeps running */
+#define VIRTIO_VDPA_MI_PRECOPY_CHUNK_SZ (64 * 1024)
+#define VIRTIO_VDPA_MI_PRECOPY_NB_CHUNKS 4
+
+/* Header, data, result and status on top of the caller SGEs */
+#define VIRTIO_VDPA_MI_CMD_MAX_DESCS (VIRTIO_VDPA_MI_MAX_SGES + 4)
+
+/*
+ * Each command owns a DMA-able slot holding header, status, data and result,
+ * followed by its indirect descriptor table.
+ */
+#define VIRTIO_VDPA_MI_CMD_INDIR_OFF \
+	RTE_ALIGN_CEIL(sizeof(struct virtio_admin_ctrl) + VIRTIO_MAX_ADMIN_DATA, 16)
+#define VIRTIO_VDPA_MI_CMD_SLOT_SZ \
+	RTE_ALIGN_CEIL(VIRTIO_VDPA_MI_CMD_INDIR_OFF + \
+			VIRTIO_VDPA_MI_CMD_MAX_DESCS * sizeof(struct vring_desc), \
+			RTE_CACHE_LINE_SIZE)
+#define VIRTIO_VDPA_MI_CMD_POLL_BURST 32
+#define VIRTIO_VDPA_MI_CMD_POLL_USEC 100
+#define VIRTIO_VDPA_MI_CMD_SPIN_USEC 20
+/* Safety net in case a completion interrupt is lost */
+#define VIRTIO_VDPA_MI_CMD_INTR_TIMEOUT_MS 10
+#define VIRTIO_VDPA_MI_CMD_SUBMIT_TIMEOUT_MS 1000
+#define VIRTIO_VDPA_MI_INTR_RETRIES_USEC 1000
+#define VIRTIO_VDPA_MI_INTR_RETRIES 256
+
+#define VIRTIO_VDPA_MI_MAX_ADMIN_QUEUES 8
+/* Tokens carry the admin queue above the slot index */
+#define VIRTIO_VDPA_MI_TOKEN_AQ_SHIFT 16
+#define VIRTIO_VDPA_MI_TOKEN(aq, slot) \
+	((int)(((aq) << VIRTIO_VDPA_MI_TOKEN_AQ_SHIFT) | (slot)))
+
+#define VIRTIO_VDPA_MI_ARG_AQ_WAIT "aq_wait"
+#define VIRTIO_VDPA_MI_ARG_AQ_SPIN_US "aq_spin_us"
+#define VIRTIO_VDPA_MI_ARG_AQ_NUM "aq_num"
+
+enum virtio_vdpa_admin_wait_mode {
+	VIRTIO_VDPA_ADMIN_WAIT_POLL, /* Sleep and poll the used ring */
+	VIRTIO_VDPA_ADMIN_WAIT_INTR, /* Block until the completion interrupt */
+	VIRTIO_VDPA_ADMIN_WAIT_ADAPTIVE, /* Spin aq_spin_usec, then block */
+};
+
 struct virtio_vdpa_pf_priv;
 struct virtio_vdpa_dev_ops {
 	uint64_t (*get_required_features)(void);
 	uint16_t (*get_adminq_idx)(struct virtio_vdpa_pf_priv *priv);
 };
 
+struct virtio_vdpa_mi_devargs {
+	int vdpa;
+	int aq_wait;
+	uint32_t aq_spin_usec;
+	uint32_t aq_num;
+};
+
+struct virtio_vdpa_admin_queue {
+	struct virtio_vdpa_pf_priv *priv;
+	struct virtadmin_ctl *avq;
+	uint16_t id; /* index in priv->aqs */
+	uint16_t qidx; /* virtqueue index */
+	struct rte_intr_handle *intr_handle; /* completion eventfd */
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wait_cond;
+	uint32_t nr_waiters; /* threads blocked on wait_cond */
+} __rte_cache_aligned;
+
 struct virtio_vdpa_pf_priv {
 	TAILQ_ENTRY(virtio_vdpa_pf_priv) next;
 	struct rte_pci_device *pdev;
@@ -41,19 +121,60 @@ struct virtio_vdpa_pf_priv {
 	struct virtio_vdpa_dev_ops *dev_ops;
 	uint64_t device_features;
 	int vfio_dev_fd;
-	uint16_t hw_nr_virtqs; /* number of vq device supported*/
+	uint16_t hw_nr_virtqs; /* number of admin queues in use */
+	struct virtio_vdpa_admin_queue aqs[VIRTIO_VDPA_MI_MAX_ADMIN_QUEUES];
+	uint32_t aq_spin_usec;
+	enum virtio_vdpa_admin_wait_mode aq_wait_mode;
+};
+
+enum {
+	VIRTIO_VDPA_ADMIN_CMD_FREE,
+	VIRTIO_VDPA_ADMIN_CMD_INFLIGHT,
+	VIRTIO_VDPA_ADMIN_CMD_DONE,
+};
+
+struct virtadmin_cmd_slot {
+	virtio_vdpa_admin_cmd_cb cb;
+	void *cb_arg;
+	void *result;
+	uint16_t result_len;
+	uint16_t result_off; /* Offset of the result in the slot data */
+	uint16_t ndescs; /* Ring descriptors used by the command */
+	uint16_t inflight_pos; /* Position in avq->inflight, in order only */
+	uint8_t state;
+	uint8_t status;
+};
+
+struct virtio_vdpa_state_stream {
+	struct virtio_vdpa_pf_priv *priv;
+	const struct rte_memzone *mz; /* nb_chunks IOVA contiguous chunks */
+	enum virtio_vdpa_state_stream_dir dir;
+	uint16_t vdev_id;
+	uint16_t nb_chunks;
+	uint16_t tail; /* oldest chunk owned by the caller */
+	uint16_t nb_busy; /* chunks owned by the caller */
+	uint32_t chunk_size;
+	uint64_t offset; /* next device state offset */
+	uint64_t total; /* device state size, 0 until known */
+	uint64_t bytes;
+	uint64_t start_cycles;
+	int *tokens;
+	uint32_t *chunk_len;
 };
 
-struct sge_iova {
-	rte_iova_t iova;
+static uint32_t virtio_vdpa_state_stream_seq;
+
+struct virtio_vdpa_admin_elem {
+	rte_iova_t addr;
 	uint32_t len;
+	uint16_t flags;
 };
 
-struct virtio_admin_data_ctrl{
-	uint16_t num_in_data;
-	uint16_t num_out_data;
-	struct sge_iova in_data[VIRTIO_VDPA_MI_MAX_SGES];
-	struct sge_iova out_data[VIRTIO_VDPA_MI_MAX_SGES];
+struct virtio_vdpa_admin_cb_info {
+	virtio_vdpa_admin_cmd_cb cb;
+	void *cb_arg;
+	int token;
+	int status;
 };
 
 RTE_LOG_REGISTER(virtio_vdpa_mi_logtype, pmd.vdpa.virtio, NOTICE);
@@ -70,151 +191,668 @@ TAILQ_HEAD(virtio_vdpa_mi_privs, virtio_vdpa_pf_priv) virtio_mi_priv_list =
 						TAILQ_HEAD_INITIALIZER(virtio_mi_priv_list);
 static pthread_mutex_t mi_priv_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static struct virtio_admin_ctrl *
-virtio_vdpa_send_admin_command_split(struct virtadmin_ctl *avq,
-		struct virtio_admin_ctrl *ctrl,
-		struct virtio_admin_data_ctrl *dat_ctrl,
-		int *dlen, int pkt_num)
+static inline struct virtio_admin_ctrl *
+virtio_vdpa_admin_slot_ctrl(struct virtadmin_ctl *avq, uint16_t slot)
+{
+	return (struct virtio_admin_ctrl *)((uint8_t *)avq->virtio_admin_hdr_mz->addr +
+			(size_t)slot * VIRTIO_VDPA_MI_CMD_SLOT_SZ);
+}
+
+static inline rte_iova_t
+virtio_vdpa_admin_slot_iova(struct virtadmin_ctl *avq, uint16_t slot)
+{
+	return avq->virtio_admin_hdr_mem +
+			(rte_iova_t)slot * VIRTIO_VDPA_MI_CMD_SLOT_SZ;
+}
+
+static inline uint16_t
+virtio_vdpa_admin_cmd_ndescs(const struct virtio_vdpa_admin_cmd *cmd)
+{
+	/* Header and status are always present */
+	return 2 + !!cmd->data_len + cmd->num_in_data + cmd->num_out_data +
+			!!cmd->result_len;
+}
+
+/*
+ * Format is enforced by the device:
+ * One device readable descriptor for header;
+ * One device readable descriptor for command data, if any;
+ * Device readable buffers, then device writable buffers;
+ * One device writable descriptor for result, if any;
+ * One device writable descriptor for status.
+ */
+static uint16_t
+virtio_vdpa_admin_cmd_elems(struct virtadmin_ctl *avq, uint16_t slot,
+		const struct virtio_vdpa_admin_cmd *cmd,
+		struct virtio_vdpa_admin_elem *elems)
+{
+	rte_iova_t iova = virtio_vdpa_admin_slot_iova(avq, slot);
+	rte_iova_t data_iova = iova + offsetof(struct virtio_admin_ctrl, data);
+	uint16_t n = 0, k;
+
+	elems[n++] = (struct virtio_vdpa_admin_elem) {
+		iova, sizeof(struct virtio_admin_ctrl_hdr), 0 };
+	if (cmd->data_len)
+		elems[n++] = (struct virtio_vdpa_admin_elem) {
+			data_iova, cmd->data_len, 0 };
+	for (k = 0; k < cmd->num_in_data; k++)
+		elems[n++] = (struct virtio_vdpa_admin_elem) {
+			cmd->in_data[k].iova, cmd->in_data[k].len, 0 };
+	for (k = 0; k < cmd->num_out_data; k++)
+		elems[n++] = (struct virtio_vdpa_admin_elem) {
+			cmd->out_data[k].iova, cmd->out_data[k].len,
+			VRING_DESC_F_WRITE };
+	if (cmd->result_len)
+		elems[n++] = (struct virtio_vdpa_admin_elem) {
+			data_iova + cmd->data_len, cmd->result_len,
+			VRING_DESC_F_WRITE };
+	elems[n++] = (struct virtio_vdpa_admin_elem) {
+		iova + offsetof(struct virtio_admin_ctrl, status),
+		sizeof(virtio_admin_ctrl_ack), VRING_DESC_F_WRITE };
+
+	return n;
+}
+
+static inline void
+virtio_vdpa_admin_desc_fill_split(struct virtqueue *vq, bool in_order,
+		uint16_t *idx, rte_iova_t addr, uint32_t len, uint16_t flags)
+{
+	struct vring_desc *desc = &vq->vq_split.ring.desc[*idx];
+
+	desc->addr = addr;
+	desc->len = len;
+	desc->flags = flags;
+	/* In order chains are laid out back to back, wrapping to 0 */
+	if (in_order)
+		desc->next = *idx + 1 == vq->vq_nentries ? 0 : *idx + 1;
+	*idx = desc->next;
+}
+
+static uint16_t
+virtio_vdpa_admin_enqueue_split(struct virtadmin_ctl *avq, uint16_t slot,
+		const struct virtio_vdpa_admin_elem *elems, uint16_t n)
 {
 	struct virtqueue *vq = virtnet_aq_to_vq(avq);
-	struct virtio_admin_ctrl *result;
-	uint32_t head, i;
-	int k, sum = 0;
+	struct vring_desc *tbl;
+	uint16_t head, i, k, ndescs;
 
 	head = vq->vq_desc_head_idx;
+	i = head;
+
+	if (avq->indirect) {
+		tbl = (struct vring_desc *)((uint8_t *)virtio_vdpa_admin_slot_ctrl(avq, slot) +
+				VIRTIO_VDPA_MI_CMD_INDIR_OFF);
+		for (k = 0; k < n; k++) {
+			tbl[k].addr = elems[k].addr;
+			tbl[k].len = elems[k].len;
+			tbl[k].flags = elems[k].flags |
+					(k + 1 < n ? VRING_DESC_F_NEXT : 0);
+			tbl[k].next = k + 1;
+		}
+		virtio_vdpa_admin_desc_fill_split(vq, avq->in_order, &i,
+				virtio_vdpa_admin_slot_iova(avq, slot) +
+				VIRTIO_VDPA_MI_CMD_INDIR_OFF,
+				n * sizeof(struct vring_desc), VRING_DESC_F_INDIRECT);
+		ndescs = 1;
+	} else {
+		for (k = 0; k < n; k++)
+			virtio_vdpa_admin_desc_fill_split(vq, avq->in_order, &i,
+					elems[k].addr, elems[k].len, elems[k].flags |
+					(k + 1 < n ? VRING_DESC_F_NEXT : 0));
+		ndescs = n;
+	}
 
-	/*
-	 * Format is enforced in qemu code:
-	 * One TX packet for header;
-	 * At least one TX packet per argument;
-	 * One RX packet for ACK.
-	 */
-	vq->vq_split.ring.desc[head].flags = VRING_DESC_F_NEXT;
-	vq->vq_split.ring.desc[head].addr = avq->virtio_admin_hdr_mem;
-	vq->vq_split.ring.desc[head].len = sizeof(struct virtio_admin_ctrl_hdr);
-	vq->vq_free_cnt--;
-	i = vq->vq_split.ring.desc[head].next;
-
-	for (k = 0; k < pkt_num; k++) {
-		vq->vq_split.ring.desc[i].flags = VRING_DESC_F_NEXT;
-		vq->vq_split.ring.desc[i].addr = avq->virtio_admin_hdr_mem
-			+ sizeof(struct virtio_admin_ctrl_hdr)
-			+ sizeof(ctrl->status) + sizeof(uint8_t)*sum;
-		vq->vq_split.ring.desc[i].len = dlen[k];
-		sum += dlen[k];
-		vq->vq_free_cnt--;
-		i = vq->vq_split.ring.desc[i].next;
-	}
-
-	for (k = 0; k < dat_ctrl->num_in_data; k++) {
-		vq->vq_split.ring.desc[i].flags = VRING_DESC_F_NEXT;
-		vq->vq_split.ring.desc[i].addr = dat_ctrl->in_data[k].iova;
-		vq->vq_split.ring.desc[i].len = dat_ctrl->in_data[k].len;
-		vq->vq_free_cnt--;
-		i = vq->vq_split.ring.desc[i].next;
-	}
-
-	for (k = 0; k < dat_ctrl->num_out_data; k++) {
-		vq->vq_split.ring.desc[i].flags = VRING_DESC_F_WRITE | VRING_DESC_F_NEXT;
-		vq->vq_split.ring.desc[i].addr = dat_ctrl->out_data[k].iova;
-		vq->vq_split.ring.desc[i].len = dat_ctrl->out_data[k].len;
-		vq->vq_free_cnt--;
-		i = vq->vq_split.ring.desc[i].next;
-	}
-
-	vq->vq_split.ring.desc[i].flags = VRING_DESC_F_WRITE;
-	vq->vq_split.ring.desc[i].addr = avq->virtio_admin_hdr_mem
-			+ sizeof(struct virtio_admin_ctrl_hdr);
-	vq->vq_split.ring.desc[i].len = sizeof(ctrl->status);
-	vq->vq_free_cnt--;
-
-	vq->vq_desc_head_idx = vq->vq_split.ring.desc[i].next;
+	vq->vq_desc_head_idx = i;
+	vq->vq_free_cnt -= ndescs;
+	vq->vq_descx[head].cookie = &avq->slots[slot];
 
 	vq_update_avail_ring(vq, head);
 	vq_update_avail_idx(vq);
+	return ndescs;
+}
+
+static uint16_t
+virtio_vdpa_admin_enqueue_packed(struct virtadmin_ctl *avq, uint16_t slot,
+		const struct virtio_vdpa_admin_elem *elems, uint16_t n)
+{
+	struct virtqueue *vq = virtnet_aq_to_vq(avq);
+	struct vring_packed_desc *desc = vq->vq_packed.ring.desc;
+	struct vring_packed_desc *tbl;
+	uint16_t head, idx, k, ndescs, flags, head_flags = 0;
+
+	head = vq->vq_avail_idx;
+	idx = head;
+
+	/* The buffer id is the slot, it is unique among inflight commands */
+	if (avq->indirect) {
+		tbl = (struct vring_packed_desc *)((uint8_t *)virtio_vdpa_admin_slot_ctrl(avq, slot) +
+				VIRTIO_VDPA_MI_CMD_INDIR_OFF);
+		for (k = 0; k < n; k++) {
+			tbl[k].addr = elems[k].addr;
+			tbl[k].len = elems[k].len;
+			tbl[k].id = 0;
+			tbl[k].flags = elems[k].flags;
+		}
+		desc[idx].addr = virtio_vdpa_admin_slot_iova(avq, slot) +
+				VIRTIO_VDPA_MI_CMD_INDIR_OFF;
+		desc[idx].len = n * sizeof(struct vring_packed_desc);
+		desc[idx].id = slot;
+		head_flags = VRING_DESC_F_INDIRECT | vq->vq_packed.cached_flags;
+		if (++idx >= vq->vq_nentries) {
+			idx -= vq->vq_nentries;
+			vq->vq_packed.cached_flags ^= VRING_PACKED_DESC_F_AVAIL_USED;
+		}
+		ndescs = 1;
+	} else {
+		for (k = 0; k < n; k++) {
+			desc[idx].addr = elems[k].addr;
+			desc[idx].len = elems[k].len;
+			desc[idx].id = slot;
+			flags = elems[k].flags | vq->vq_packed.cached_flags |
+					(k + 1 < n ? VRING_DESC_F_NEXT : 0);
+			/* Head flags are written last to hand over the whole chain */
+			if (k == 0)
+				head_flags = flags;
+			else
+				desc[idx].flags = flags;
+			if (++idx >= vq->vq_nentries) {
+				idx -= vq->vq_nentries;
+				vq->vq_packed.cached_flags ^=
+					VRING_PACKED_DESC_F_AVAIL_USED;
+			}
+		}
+		ndescs = n;
+	}
+
+	vq->vq_avail_idx = idx;
+	vq->vq_free_cnt -= ndescs;
+	virtqueue_store_flags_packed(&desc[head], head_flags,
+			vq->hw->weak_barriers);
+	return ndescs;
+}
+
+/*
+ * In order devices may report a batch of commands with the last one only,
+ * every older inflight command is then complete as well. The batch is
+ * remembered in inorder_pending so it survives a full done[] array.
+ */
+static uint16_t
+virtio_vdpa_admin_inorder_reap(struct virtadmin_ctl *avq,
+		struct virtadmin_cmd_slot **done, uint16_t n, uint16_t max)
+{
+	struct virtqueue *vq = virtnet_aq_to_vq(avq);
+	struct virtadmin_cmd_slot *slot;
+
+	while (avq->inorder_pending && n < max) {
+		slot = &avq->slots[avq->inflight[avq->inflight_cons]];
+		if (++avq->inflight_cons == avq->nr_slots)
+			avq->inflight_cons = 0;
+		avq->inorder_pending--;
+		vq->vq_free_cnt += slot->ndescs;
+		if (virtio_with_packed_queue(vq->hw)) {
+			vq->vq_used_cons_idx += slot->ndescs;
+			if (vq->vq_used_cons_idx >= vq->vq_nentries) {
+				vq->vq_used_cons_idx -= vq->vq_nentries;
+				vq->vq_packed.used_wrap_counter ^= 1;
+			}
+		}
+		done[n++] = slot;
+	}
 
-	virtqueue_notify(vq);
+	return n;
+}
+
+static inline void
+virtio_vdpa_admin_inorder_batch(struct virtadmin_ctl *avq,
+		struct virtadmin_cmd_slot *last)
+{
+	avq->inorder_pending = (last->inflight_pos + avq->nr_slots -
+			avq->inflight_cons) % avq->nr_slots + 1;
+}
 
-	while (virtqueue_nused(vq) == 0) {
-		usleep(100);
+static uint16_t
+virtio_vdpa_admin_dequeue_split(struct virtadmin_ctl *avq,
+		struct virtadmin_cmd_slot **done, uint16_t max)
+{
+	struct virtqueue *vq = virtnet_aq_to_vq(avq);
+	struct virtadmin_cmd_slot *slot;
+	uint16_t nb_used, n = 0;
+
+	if (avq->in_order) {
+		n = virtio_vdpa_admin_inorder_reap(avq, done, n, max);
+		nb_used = virtqueue_nused(vq);
+		while (n < max && nb_used--) {
+			struct vring_used_elem *uep;
+
+			uep = &vq->vq_split.ring.used->ring[vq->vq_used_cons_idx &
+					(vq->vq_nentries - 1)];
+			vq->vq_used_cons_idx++;
+			virtio_vdpa_admin_inorder_batch(avq,
+					vq->vq_descx[uep->id].cookie);
+			n = virtio_vdpa_admin_inorder_reap(avq, done, n, max);
+		}
+		return n;
 	}
 
-	while (virtqueue_nused(vq)) {
-		uint32_t idx, desc_idx, used_idx;
+	nb_used = RTE_MIN(virtqueue_nused(vq), max);
+	while (n < nb_used) {
+		uint32_t used_idx, head, desc_idx;
 		struct vring_used_elem *uep;
+		struct vq_desc_extra *dxp;
 
 		used_idx = (uint32_t)(vq->vq_used_cons_idx
 				& (vq->vq_nentries - 1));
 		uep = &vq->vq_split.ring.used->ring[used_idx];
-		idx = (uint32_t) uep->id;
-		desc_idx = idx;
-
+		head = (uint32_t)uep->id;
+		dxp = &vq->vq_descx[head];
+		slot = dxp->cookie;
+		done[n++] = slot;
+		dxp->cookie = NULL;
+
+		/* Return the chain to the free list, chains complete out of order */
+		desc_idx = head;
 		while (vq->vq_split.ring.desc[desc_idx].flags &
-		       VRING_DESC_F_NEXT) {
+		       VRING_DESC_F_NEXT)
 			desc_idx = vq->vq_split.ring.desc[desc_idx].next;
-			vq->vq_free_cnt++;
-		}
-
 		vq->vq_split.ring.desc[desc_idx].next = vq->vq_desc_head_idx;
-		vq->vq_desc_head_idx = idx;
-
+		vq->vq_desc_head_idx = head;
+		vq->vq_free_cnt += slot->ndescs;
 		vq->vq_used_cons_idx++;
-		vq->vq_free_cnt++;
 	}
 
-	DRV_LOG(DEBUG, "vq->vq_free_cnt=%d\nvq->vq_desc_head_idx=%d",
+	DRV_LOG(DEBUG, "vq->vq_free_cnt=%d vq->vq_desc_head_idx=%d",
 			vq->vq_free_cnt, vq->vq_desc_head_idx);
+	return n;
+}
+
+static uint16_t
+virtio_vdpa_admin_dequeue_packed(struct virtadmin_ctl *avq,
+		struct virtadmin_cmd_slot **done, uint16_t max)
+{
+	struct virtqueue *vq = virtnet_aq_to_vq(avq);
+	struct vring_packed_desc *desc = vq->vq_packed.ring.desc;
+	struct virtadmin_cmd_slot *slot;
+	uint16_t n = 0;
+
+	if (avq->in_order)
+		n = virtio_vdpa_admin_inorder_reap(avq, done, n, max);
+
+	while (n < max && desc_is_used(&desc[vq->vq_used_cons_idx], vq)) {
+		slot = &avq->slots[desc[vq->vq_used_cons_idx].id];
+		if (avq->in_order) {
+			/* The used descriptor covers the whole batch */
+			virtio_vdpa_admin_inorder_batch(avq, slot);
+			n = virtio_vdpa_admin_inorder_reap(avq, done, n, max);
+			continue;
+		}
+		vq->vq_free_cnt += slot->ndescs;
+		vq->vq_used_cons_idx += slot->ndescs;
+		if (vq->vq_used_cons_idx >= vq->vq_nentries) {
+			vq->vq_used_cons_idx -= vq->vq_nentries;
+			vq->vq_packed.used_wrap_counter ^= 1;
+		}
+		done[n++] = slot;
+	}
+
+	DRV_LOG(DEBUG, "vq->vq_free_cnt=%d vq->vq_used_cons_idx=%d",
+			vq->vq_free_cnt, vq->vq_used_cons_idx);
+	return n;
+}
 
-	result = avq->virtio_admin_hdr_mz->addr;
-	return result;
+static inline void
+virtio_vdpa_admin_slot_put(struct virtadmin_ctl *avq,
+		struct virtadmin_cmd_slot *slot)
+{
+	slot->state = VIRTIO_VDPA_ADMIN_CMD_FREE;
+	slot->cb = NULL;
+	slot->cb_arg = NULL;
+	slot->result = NULL;
+	avq->free_slots[avq->nr_free_slots++] = (uint16_t)(slot - avq->slots);
 }
 
 static int
-virtio_vdpa_send_admin_command(struct virtadmin_ctl *avq,
-		struct virtio_admin_ctrl *ctrl,
-		struct virtio_admin_data_ctrl *dat_ctrl,
-		int *dlen,
-		int pkt_num)
-{
-	virtio_admin_ctrl_ack status = ~0;
-	struct virtio_admin_ctrl *result;
-	struct virtqueue *vq;
+virtio_vdpa_admin_queue_poll(struct virtio_vdpa_admin_queue *aq, uint16_t max)
+{
+	struct virtio_vdpa_pf_priv *priv = aq->priv;
+	struct virtadmin_ctl *avq = aq->avq;
+	struct virtio_vdpa_admin_cb_info cbs[VIRTIO_VDPA_MI_CMD_POLL_BURST];
+	struct virtadmin_cmd_slot *done[VIRTIO_VDPA_MI_CMD_POLL_BURST];
+	struct virtadmin_cmd_slot *slot;
+	struct virtio_admin_ctrl *ctrl;
+	uint16_t n, k, nb_cb, nb_done;
+	int total = 0;
+
+	do {
+		nb_cb = 0;
+		nb_done = 0;
+		rte_spinlock_lock(&avq->lock);
+		if (virtio_with_packed_queue(&priv->vpdev->hw))
+			n = virtio_vdpa_admin_dequeue_packed(avq, done,
+				RTE_MIN(max - total, VIRTIO_VDPA_MI_CMD_POLL_BURST));
+		else
+			n = virtio_vdpa_admin_dequeue_split(avq, done,
+				RTE_MIN(max - total, VIRTIO_VDPA_MI_CMD_POLL_BURST));
+		for (k = 0; k < n; k++) {
+			slot = done[k];
+			ctrl = virtio_vdpa_admin_slot_ctrl(avq, slot - avq->slots);
+			slot->status = ctrl->status;
+			if (slot->result_len)
+				rte_memcpy(slot->result, ctrl->data + slot->result_off,
+					   slot->result_len);
+			if (slot->cb) {
+				cbs[nb_cb].cb = slot->cb;
+				cbs[nb_cb].cb_arg = slot->cb_arg;
+				cbs[nb_cb].token = VIRTIO_VDPA_MI_TOKEN(aq->id,
+						slot - avq->slots);
+				cbs[nb_cb].status = slot->status;
+				nb_cb++;
+				virtio_vdpa_admin_slot_put(avq, slot);
+			} else {
+				__atomic_store_n(&slot->state,
+						VIRTIO_VDPA_ADMIN_CMD_DONE, __ATOMIC_SEQ_CST);
+				nb_done++;
+			}
+		}
+		rte_spinlock_unlock(&avq->lock);
+
+		if (nb_done &&
+		    __atomic_load_n(&aq->nr_waiters, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&aq->wait_lock);
+			pthread_cond_broadcast(&aq->wait_cond);
+			pthread_mutex_unlock(&aq->wait_lock);
+		}
+
+		/* Callbacks may submit new commands, so run them unlocked */
+		for (k = 0; k < nb_cb; k++)
+			cbs[k].cb(priv, cbs[k].token, cbs[k].status, cbs[k].cb_arg);
+		total += n;
+	} while (n == VIRTIO_VDPA_MI_CMD_POLL_BURST && total < max);
+
+	return total;
+}
+
+static int
+virtio_vdpa_admin_cmd_check(struct virtadmin_ctl *avq,
+		const struct virtio_vdpa_admin_cmd *cmd)
+{
+	struct virtqueue *vq = virtnet_aq_to_vq(avq);
+	uint16_t nelems, ndescs;
+
+	nelems = virtio_vdpa_admin_cmd_ndescs(cmd);
+	ndescs = avq->indirect ? 1 : nelems;
+	if (nelems > VIRTIO_VDPA_MI_CMD_MAX_DESCS || ndescs > vq->vq_nentries ||
+	    cmd->data_len + cmd->result_len > VIRTIO_MAX_ADMIN_DATA) {
+		DRV_LOG(ERR, "Admin command class %u cmd %u too large: %u descs, "
+			"data %u, result %u", cmd->class, cmd->cmd, nelems,
+			cmd->data_len, cmd->result_len);
+		return -EINVAL;
+	}
+
+	return 0;
+}
 
-	ctrl->status = status;
+/* Called with the admin queue lock held, the caller rings the doorbell */
+static int
+virtio_vdpa_admin_cmd_post(struct virtio_vdpa_admin_queue *aq,
+		const struct virtio_vdpa_admin_cmd *cmd,
+		virtio_vdpa_admin_cmd_cb cb, void *cb_arg)
+{
+	struct virtio_vdpa_admin_elem elems[VIRTIO_VDPA_MI_CMD_MAX_DESCS];
+	struct virtadmin_ctl *avq = aq->avq;
+	struct virtqueue *vq = virtnet_aq_to_vq(avq);
+	struct virtadmin_cmd_slot *slot;
+	struct virtio_admin_ctrl *ctrl;
+	uint16_t ndescs, nelems, idx;
+
+	nelems = virtio_vdpa_admin_cmd_ndescs(cmd);
+	ndescs = avq->indirect ? 1 : nelems;
+	if (vq->vq_free_cnt < ndescs || avq->nr_free_slots == 0)
+		return -EAGAIN;
+
+	idx = avq->free_slots[--avq->nr_free_slots];
+	slot = &avq->slots[idx];
+	slot->cb = cb;
+	slot->cb_arg = cb_arg;
+	slot->result = cmd->result;
+	slot->result_len = cmd->result_len;
+	slot->result_off = cmd->data_len;
+	slot->state = VIRTIO_VDPA_ADMIN_CMD_INFLIGHT;
+
+	ctrl = virtio_vdpa_admin_slot_ctrl(avq, idx);
+	ctrl->hdr.class = cmd->class;
+	ctrl->hdr.cmd = cmd->cmd;
+	ctrl->status = (virtio_admin_ctrl_ack)~0;
+	if (cmd->data_len)
+		rte_memcpy(ctrl->data, cmd->data, cmd->data_len);
+
+	if (avq->in_order) {
+		slot->inflight_pos = avq->inflight_prod;
+		avq->inflight[avq->inflight_prod] = idx;
+		if (++avq->inflight_prod == avq->nr_slots)
+			avq->inflight_prod = 0;
+	}
+
+	virtio_vdpa_admin_cmd_elems(avq, idx, cmd, elems);
+	if (virtio_with_packed_queue(vq->hw))
+		slot->ndescs = virtio_vdpa_admin_enqueue_packed(avq, idx, elems, nelems);
+	else
+		slot->ndescs = virtio_vdpa_admin_enqueue_split(avq, idx, elems, nelems);
+
+	DRV_LOG(DEBUG, "Admin command class %u cmd %u posted to aq %u slot %u, "
+		"vq->vq_free_cnt = %d", cmd->class, cmd->cmd, aq->id, idx,
+		vq->vq_free_cnt);
+	return VIRTIO_VDPA_MI_TOKEN(aq->id, idx);
+}
 
-	if (!avq) {
+/*
+ * Commands about one VF always use the same admin queue so they stay
+ * ordered, different VFs spread over the queues. Other commands use the
+ * queue of the calling lcore.
+ */
+static struct virtio_vdpa_admin_queue *
+virtio_vdpa_admin_queue_select(struct virtio_vdpa_pf_priv *priv,
+		const struct virtio_vdpa_admin_cmd *cmd)
+{
+	unsigned int lcore;
+
+	if (priv->hw_nr_virtqs == 1)
+		return &priv->aqs[0];
+	if (cmd->per_vdev)
+		return &priv->aqs[cmd->vdev_id % priv->hw_nr_virtqs];
+	lcore = rte_lcore_id();
+	if (lcore == LCORE_ID_ANY)
+		return &priv->aqs[0];
+	return &priv->aqs[lcore % priv->hw_nr_virtqs];
+}
+
+static struct virtio_vdpa_admin_queue *
+virtio_vdpa_admin_token_queue(struct virtio_vdpa_pf_priv *priv, int token,
+		struct virtadmin_cmd_slot **slot)
+{
+	struct virtio_vdpa_admin_queue *aq;
+	uint16_t aq_id, idx;
+
+	if (token < 0)
+		return NULL;
+	aq_id = token >> VIRTIO_VDPA_MI_TOKEN_AQ_SHIFT;
+	idx = token & ((1 << VIRTIO_VDPA_MI_TOKEN_AQ_SHIFT) - 1);
+	if (aq_id >= priv->hw_nr_virtqs)
+		return NULL;
+	aq = &priv->aqs[aq_id];
+	if (!aq->avq || idx >= aq->avq->nr_slots)
+		return NULL;
+	*slot = &aq->avq->slots[idx];
+	return aq;
+}
+
+int
+virtio_vdpa_admin_cmd_submit(struct virtio_vdpa_pf_priv *priv,
+		const struct virtio_vdpa_admin_cmd *cmd,
+		virtio_vdpa_admin_cmd_cb cb, void *cb_arg)
+{
+	struct virtio_vdpa_admin_queue *aq;
+	struct virtadmin_ctl *avq;
+	int ret;
+
+	RTE_VERIFY(priv);
+
+	if (!priv->vpdev->hw.avq) {
 		DRV_LOG(ERR, "Admin queue is not supported");
-		return -1;
+		return -ENOTSUP;
 	}
+	aq = virtio_vdpa_admin_queue_select(priv, cmd);
+	avq = aq->avq;
+
+	ret = virtio_vdpa_admin_cmd_check(avq, cmd);
+	if (ret)
+		return ret;
 
 	rte_spinlock_lock(&avq->lock);
-	vq = virtnet_aq_to_vq(avq);
+	ret = virtio_vdpa_admin_cmd_post(aq, cmd, cb, cb_arg);
+	if (ret >= 0)
+		virtqueue_notify(virtnet_aq_to_vq(avq));
+	rte_spinlock_unlock(&avq->lock);
 
-	DRV_LOG(DEBUG, "vq->vq_desc_head_idx = %d, status = %d, "
-		"vq->hw->avq = %p vq = %p",
-		vq->vq_desc_head_idx, status, vq->hw->avq, vq);
+	return ret;
+}
 
-	if (vq->vq_free_cnt < pkt_num + 2) {
-		rte_spinlock_unlock(&avq->lock);
-		return -1;
-	}
+int
+virtio_vdpa_admin_cmd_poll(struct virtio_vdpa_pf_priv *priv, uint16_t max)
+{
+	uint16_t i;
+	int total = 0;
+
+	RTE_VERIFY(priv);
+
+	if (!priv->vpdev->hw.avq)
+		return -ENOTSUP;
+
+	for (i = 0; i < priv->hw_nr_virtqs && total < max; i++)
+		total += virtio_vdpa_admin_queue_poll(&priv->aqs[i], max - total);
 
-	result = virtio_vdpa_send_admin_command_split(avq, ctrl, dat_ctrl,
-			dlen, pkt_num);
+	return total;
+}
+
+static bool
+virtio_vdpa_admin_slot_done(struct virtadmin_ctl *avq,
+		struct virtadmin_cmd_slot *slot, int *status)
+{
+	bool done = false;
 
+	rte_spinlock_lock(&avq->lock);
+	if (slot->state == VIRTIO_VDPA_ADMIN_CMD_DONE) {
+		*status = slot->status;
+		virtio_vdpa_admin_slot_put(avq, slot);
+		done = true;
+	}
 	rte_spinlock_unlock(&avq->lock);
-	return result->status;
+
+	return done;
+}
+
+static void
+virtio_vdpa_admin_slot_sleep(struct virtio_vdpa_admin_queue *aq,
+		struct virtadmin_cmd_slot *slot)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += VIRTIO_VDPA_MI_CMD_INTR_TIMEOUT_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	/*
+	 * The reaper marks the slot done before it checks for waiters, we
+	 * register as waiter before checking the slot, so one of us sees
+	 * the other and the wakeup can not be lost.
+	 */
+	pthread_mutex_lock(&aq->wait_lock);
+	__atomic_fetch_add(&aq->nr_waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) !=
+			VIRTIO_VDPA_ADMIN_CMD_DONE)
+		pthread_cond_timedwait(&aq->wait_cond, &aq->wait_lock, &ts);
+	__atomic_fetch_sub(&aq->nr_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&aq->wait_lock);
+}
+
+int
+virtio_vdpa_admin_cmd_wait(struct virtio_vdpa_pf_priv *priv, int token)
+{
+	struct virtio_vdpa_admin_queue *aq;
+	struct virtadmin_cmd_slot *slot;
+	struct virtadmin_ctl *avq;
+	uint64_t deadline;
+	int status;
+
+	RTE_VERIFY(priv);
+
+	if (!priv->vpdev->hw.avq)
+		return -ENOTSUP;
+	aq = virtio_vdpa_admin_token_queue(priv, token, &slot);
+	if (!aq)
+		return -EINVAL;
+	avq = aq->avq;
+
+	if (slot->state == VIRTIO_VDPA_ADMIN_CMD_FREE || slot->cb) {
+		DRV_LOG(ERR, "Admin command token %d can not be waited on", token);
+		return -EINVAL;
+	}
+
+	if (priv->aq_wait_mode == VIRTIO_VDPA_ADMIN_WAIT_POLL) {
+		while (1) {
+			virtio_vdpa_admin_queue_poll(aq, UINT16_MAX);
+			if (virtio_vdpa_admin_slot_done(avq, slot, &status))
+				return status;
+			usleep(VIRTIO_VDPA_MI_CMD_POLL_USEC);
+		}
+	}
+
+	/* Short commands complete while spinning, without any interrupt latency */
+	deadline = rte_get_timer_cycles() +
+			(rte_get_timer_hz() * priv->aq_spin_usec) / US_PER_S;
+	do {
+		virtio_vdpa_admin_queue_poll(aq, UINT16_MAX);
+		if (virtio_vdpa_admin_slot_done(avq, slot, &status))
+			return status;
+		rte_pause();
+	} while (rte_get_timer_cycles() < deadline);
+
+	/* Long commands, the interrupt handler reaps the ring and wakes us up */
+	while (1) {
+		virtio_vdpa_admin_slot_sleep(aq, slot);
+		virtio_vdpa_admin_queue_poll(aq, UINT16_MAX);
+		if (virtio_vdpa_admin_slot_done(avq, slot, &status))
+			return status;
+	}
+}
+
+static int
+virtio_vdpa_admin_cmd_exec(struct virtio_vdpa_pf_priv *priv,
+		const struct virtio_vdpa_admin_cmd *cmd)
+{
+	int token;
+
+	/* Ring may be full of other in-flight commands, reap and retry */
+	while ((token = virtio_vdpa_admin_cmd_submit(priv, cmd, NULL, NULL)) ==
+			-EAGAIN) {
+		virtio_vdpa_admin_cmd_poll(priv, UINT16_MAX);
+		usleep(VIRTIO_VDPA_MI_CMD_POLL_USEC);
+	}
+	if (token < 0)
+		return token;
+
+	return virtio_vdpa_admin_cmd_wait(priv, token);
 }
 
 int
 virtio_vdpa_cmd_identity(struct virtio_vdpa_pf_priv *priv,
 		struct virtio_admin_migration_identity_result *result)
 {
-	struct virtio_admin_migration_identity_result *res;
+	struct virtio_admin_migration_identity_result res;
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -224,28 +862,20 @@ virtio_vdpa_cmd_identity(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_MIGRATION_IDENTITY;
-	dlen[0] = 0;
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = hw->avq->virtio_admin_hdr_mem
-				+ sizeof(struct virtio_admin_ctrl_hdr)
-				+ sizeof(ctrl->status);
-	dat_ctrl.out_data[0].len = sizeof(*result);
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_IDENTITY;
+	cmd.result = &res;
+	cmd.result_len = sizeof(res);
 
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 0);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
-		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d", ctrl->hdr.class, ctrl->hdr.cmd, ret);
+		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d", cmd.class, cmd.cmd, ret);
 		return ret;
 	}
 
-	res = (struct virtio_admin_migration_identity_result *)
-			rte_mem_iova2virt(dat_ctrl.out_data[0].iova);
-	result->major_ver = rte_le_to_cpu_16(res->major_ver);
-	result->minor_ver = rte_le_to_cpu_16(res->minor_ver);
-	result->ter_ver   = rte_le_to_cpu_16(res->ter_ver);
+	result->major_ver = rte_le_to_cpu_16(res.major_ver);
+	result->minor_ver = rte_le_to_cpu_16(res.minor_ver);
+	result->ter_ver   = rte_le_to_cpu_16(res.ter_ver);
 
 	return ret;
 }
@@ -254,12 +884,10 @@ int
 virtio_vdpa_cmd_get_status(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
 		enum virtio_internal_status *status)
 {
-	struct virtio_admin_migration_get_internal_status_data *sd;
-	struct virtio_admin_migration_get_internal_status_result *result;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
+	struct virtio_admin_migration_get_internal_status_data sd = {0};
+	struct virtio_admin_migration_get_internal_status_result result;
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	struct virtio_hw *hw;
-	int dlen[1];
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -268,31 +896,26 @@ virtio_vdpa_cmd_get_status(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
 		CMD_LOG(INFO, "host does not support admin queue");
 		return -ENOTSUP;
 	}
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATUS;
-	sd = (struct virtio_admin_migration_get_internal_status_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	dlen[0] = sizeof(*sd);
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = hw->avq->virtio_admin_hdr_mem
-			+ sizeof(struct virtio_admin_ctrl_hdr)
-			+ sizeof(ctrl->status) + dlen[0];
-	dat_ctrl.out_data[0].len = sizeof(*result);
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATUS;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
+	cmd.result = &result;
+	cmd.result_len = sizeof(result);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev_id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
-	result = (struct virtio_admin_migration_get_internal_status_result *)
-			rte_mem_iova2virt(dat_ctrl.out_data[0].iova);
-	result->internal_status = rte_le_to_cpu_16(result->internal_status);
-	RTE_VERIFY(result->internal_status >= VIRTIO_S_INIT);
-	RTE_VERIFY(result->internal_status <= VIRTIO_S_FREEZED);
-	*status = (enum virtio_internal_status)result->internal_status;
+	result.internal_status = rte_le_to_cpu_16(result.internal_status);
+	RTE_VERIFY(result.internal_status >= VIRTIO_S_INIT);
+	RTE_VERIFY(result.internal_status <= VIRTIO_S_FREEZED);
+	*status = (enum virtio_internal_status)result.internal_status;
 
 	return 0;
 }
@@ -301,11 +924,9 @@ int
 virtio_vdpa_cmd_set_status(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
 		enum virtio_internal_status status)
 {
-	struct virtio_admin_migration_modify_internal_status_data *sd;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
+	struct virtio_admin_migration_modify_internal_status_data sd = {0};
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	struct virtio_hw *hw;
-	int dlen[1];
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -315,20 +936,19 @@ virtio_vdpa_cmd_set_status(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_MIGRATION_MODIFY_INTERNAL_STATUS;
-	sd = (struct virtio_admin_migration_modify_internal_status_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	sd->internal_status = rte_cpu_to_le_16((uint16_t)status);
-	dlen[0] = sizeof(*sd);
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 0;
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_MODIFY_INTERNAL_STATUS;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	sd.internal_status = rte_cpu_to_le_16((uint16_t)status);
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
 
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev_id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
@@ -340,11 +960,10 @@ virtio_vdpa_cmd_save_state(struct virtio_vdpa_pf_priv *priv,
 		uint16_t vdev_id, uint64_t offset, uint64_t length,
 		rte_iova_t out_data)
 {
-	struct virtio_admin_migration_save_internal_state_data *sd;
+	struct virtio_admin_migration_save_internal_state_data sd = {0};
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
+	struct virtio_vdpa_admin_sge sge;
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -354,38 +973,150 @@ virtio_vdpa_cmd_save_state(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_MIGRATION_SAVE_INTERNAL_STATE;
-	sd = (struct virtio_admin_migration_save_internal_state_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	sd->offset = rte_cpu_to_le_64(offset);
-	sd->length = rte_cpu_to_le_64(length);
-	dlen[0] = sizeof(*sd);
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = out_data;
-	dat_ctrl.out_data[0].len = length;
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_SAVE_INTERNAL_STATE;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	sd.offset = rte_cpu_to_le_64(offset);
+	sd.length = rte_cpu_to_le_64(length);
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
+	sge.iova = out_data;
+	sge.len = length;
+	cmd.num_out_data = 1;
+	cmd.out_data = &sge;
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev_id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
 	return 0;
 }
 
+static void
+virtio_vdpa_batch_req_cmd(const struct virtio_vdpa_batch_req *req,
+		struct virtio_vdpa_admin_cmd *cmd,
+		struct virtio_admin_migration_modify_internal_status_data *status_data,
+		struct virtio_admin_migration_save_internal_state_data *save_data,
+		struct virtio_vdpa_admin_sge *sge)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd->per_vdev = true;
+	cmd->vdev_id = req->vdev_id;
+	if (req->op == VIRTIO_VDPA_BATCH_SET_STATUS) {
+		cmd->cmd = VIRTIO_ADMIN_PCI_MIGRATION_MODIFY_INTERNAL_STATUS;
+		memset(status_data, 0, sizeof(*status_data));
+		status_data->vdev_id = rte_cpu_to_le_16(req->vdev_id);
+		status_data->internal_status = rte_cpu_to_le_16((uint16_t)req->status);
+		cmd->data = status_data;
+		cmd->data_len = sizeof(*status_data);
+	} else {
+		cmd->cmd = VIRTIO_ADMIN_PCI_MIGRATION_SAVE_INTERNAL_STATE;
+		memset(save_data, 0, sizeof(*save_data));
+		save_data->vdev_id = rte_cpu_to_le_16(req->vdev_id);
+		save_data->offset = rte_cpu_to_le_64(req->offset);
+		save_data->length = rte_cpu_to_le_64(req->length);
+		cmd->data = save_data;
+		cmd->data_len = sizeof(*save_data);
+		sge->iova = req->out_data;
+		sge->len = req->length;
+		cmd->num_out_data = 1;
+		cmd->out_data = sge;
+	}
+}
+
+int
+virtio_vdpa_cmd_batch(struct virtio_vdpa_pf_priv *priv,
+		struct virtio_vdpa_batch_req *reqs, uint16_t nb_reqs)
+{
+	struct virtio_admin_migration_modify_internal_status_data status_data;
+	struct virtio_admin_migration_save_internal_state_data save_data;
+	struct virtio_vdpa_admin_cmd cmd;
+	struct virtio_vdpa_admin_queue *aq;
+	struct virtio_vdpa_admin_sge sge;
+	uint16_t posted = 0, done = 0, i;
+	uint32_t notify_mask;
+	int failed = 0, token;
+	int *tokens;
+
+	RTE_VERIFY(priv);
+
+	if (!virtio_with_feature(&priv->vpdev->hw, VIRTIO_F_ADMIN_VQ)) {
+		CMD_LOG(INFO, "host does not support admin queue");
+		return -ENOTSUP;
+	}
+	if (!priv->vpdev->hw.avq)
+		return -ENOTSUP;
+	if (nb_reqs == 0)
+		return 0;
+
+	tokens = rte_malloc(NULL, sizeof(*tokens) * nb_reqs, 0);
+	if (!tokens) {
+		CMD_LOG(ERR, "Failed to alloc %u batch tokens", nb_reqs);
+		return -ENOMEM;
+	}
+
+	while (done < nb_reqs) {
+		/* Post everything that fits, one doorbell per admin queue */
+		notify_mask = 0;
+		while (posted < nb_reqs) {
+			virtio_vdpa_batch_req_cmd(&reqs[posted], &cmd,
+					&status_data, &save_data, &sge);
+			aq = virtio_vdpa_admin_queue_select(priv, &cmd);
+			token = virtio_vdpa_admin_cmd_check(aq->avq, &cmd);
+			if (!token) {
+				rte_spinlock_lock(&aq->avq->lock);
+				token = virtio_vdpa_admin_cmd_post(aq, &cmd,
+						NULL, NULL);
+				rte_spinlock_unlock(&aq->avq->lock);
+			}
+			if (token == -EAGAIN)
+				break;
+			tokens[posted++] = token;
+			if (token >= 0)
+				notify_mask |= 1U << aq->id;
+		}
+		for (i = 0; i < priv->hw_nr_virtqs; i++)
+			if (notify_mask & (1U << i))
+				virtqueue_notify(virtnet_aq_to_vq(priv->aqs[i].avq));
+
+		if (done == posted) {
+			/* Ring is full of other users' commands */
+			virtio_vdpa_admin_cmd_poll(priv, UINT16_MAX);
+			usleep(VIRTIO_VDPA_MI_CMD_POLL_USEC);
+			continue;
+		}
+
+		/* Reaping the oldest request makes room for the next ones */
+		token = tokens[done];
+		reqs[done].result = token < 0 ? token :
+				virtio_vdpa_admin_cmd_wait(priv, token);
+		if (reqs[done].result) {
+			CMD_LOG(ERR, "Batch request %u op %d failed, status %d, vdev_id: %u",
+					done, reqs[done].op, reqs[done].result,
+					reqs[done].vdev_id);
+			failed++;
+		}
+		done++;
+	}
+
+	rte_free(tokens);
+	return failed;
+}
+
 int
 virtio_vdpa_cmd_restore_state(struct virtio_vdpa_pf_priv *priv,
 		uint16_t vdev_id, uint64_t offset, uint64_t length,
 		rte_iova_t data)
 {
-	struct virtio_admin_migration_restore_internal_state_data *sd;
+	struct virtio_admin_migration_restore_internal_state_data sd = {0};
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
+	struct virtio_vdpa_admin_sge sge;
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -395,22 +1126,23 @@ virtio_vdpa_cmd_restore_state(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_MIGRATION_RESTORE_INTERNAL_STATE;
-	sd = (struct virtio_admin_migration_restore_internal_state_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	sd->offset = rte_cpu_to_le_64(offset);
-	sd->length = rte_cpu_to_le_64(length);
-	dlen[0] = sizeof(*sd);
-	dat_ctrl.num_in_data = 1;
-	dat_ctrl.in_data[0].iova = data;
-	dat_ctrl.in_data[0].len = length;
-	dat_ctrl.num_out_data = 0;
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_RESTORE_INTERNAL_STATE;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	sd.offset = rte_cpu_to_le_64(offset);
+	sd.length = rte_cpu_to_le_64(length);
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
+	sge.iova = data;
+	sge.len = length;
+	cmd.num_in_data = 1;
+	cmd.in_data = &sge;
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev_id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
@@ -422,12 +1154,10 @@ virtio_vdpa_cmd_get_internal_pending_bytes(struct virtio_vdpa_pf_priv *priv,
 		uint16_t vdev_id,
 		struct virtio_admin_migration_get_internal_state_pending_bytes_result *result)
 {
-	struct virtio_admin_migration_get_internal_state_pending_bytes_result *res;
-	struct virtio_admin_migration_get_internal_state_pending_bytes_data *sd;
+	struct virtio_admin_migration_get_internal_state_pending_bytes_result res;
+	struct virtio_admin_migration_get_internal_state_pending_bytes_data sd = {0};
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -437,42 +1167,404 @@ virtio_vdpa_cmd_get_internal_pending_bytes(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATE_PENDING_BYTES;
-	sd = (struct virtio_admin_migration_get_internal_state_pending_bytes_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	dlen[0] = sizeof(*sd);
-
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = hw->avq->virtio_admin_hdr_mem
-			+ sizeof(struct virtio_admin_ctrl_hdr)
-			+ sizeof(ctrl->status) + dlen[0];
-	dat_ctrl.out_data[0].len = sizeof(*result);
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATE_PENDING_BYTES;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
+	cmd.result = &res;
+	cmd.result_len = sizeof(res);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev_id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
+		return ret;
+	}
+
+	result->pending_bytes = rte_le_to_cpu_64(res.pending_bytes);
+
+	return 0;
+}
+
+struct virtio_vdpa_state_stream *
+virtio_vdpa_state_stream_create(struct virtio_vdpa_pf_priv *priv,
+		uint16_t vdev_id, enum virtio_vdpa_state_stream_dir dir,
+		uint32_t chunk_size, uint16_t nb_chunks)
+{
+	struct virtio_vdpa_state_stream *st;
+	char mz_name[RTE_MEMZONE_NAMESIZE];
+
+	RTE_VERIFY(priv);
+
+	if (!chunk_size || !nb_chunks) {
+		CMD_LOG(ERR, "Invalid state stream geometry %u x %u",
+				nb_chunks, chunk_size);
+		rte_errno = EINVAL;
+		return NULL;
+	}
+
+	st = rte_zmalloc(NULL, sizeof(*st) +
+			nb_chunks * (sizeof(*st->tokens) + sizeof(*st->chunk_len)),
+			RTE_CACHE_LINE_SIZE);
+	if (!st) {
+		rte_errno = ENOMEM;
+		return NULL;
+	}
+	st->tokens = (int *)(st + 1);
+	st->chunk_len = (uint32_t *)(st->tokens + nb_chunks);
+
+	snprintf(mz_name, sizeof(mz_name), "virtio_vdpa_st%u",
+		 __atomic_fetch_add(&virtio_vdpa_state_stream_seq, 1,
+				    __ATOMIC_RELAXED));
+	st->mz = rte_memzone_reserve_aligned(mz_name,
+			(size_t)chunk_size * nb_chunks,
+			priv->pdev->device.numa_node, RTE_MEMZONE_IOVA_CONTIG,
+			rte_mem_page_size());
+	if (!st->mz) {
+		CMD_LOG(ERR, "Failed to reserve %u state chunks of %u bytes",
+				nb_chunks, chunk_size);
+		rte_free(st);
+		rte_errno = ENOMEM;
+		return NULL;
+	}
+
+	st->priv = priv;
+	st->vdev_id = vdev_id;
+	st->dir = dir;
+	st->chunk_size = chunk_size;
+	st->nb_chunks = nb_chunks;
+	st->start_cycles = rte_get_timer_cycles();
+	return st;
+}
+
+void
+virtio_vdpa_state_stream_destroy(struct virtio_vdpa_state_stream *st)
+{
+	if (!st)
+		return;
+	rte_memzone_free(st->mz);
+	rte_free(st);
+}
+
+static inline uint16_t
+virtio_vdpa_state_stream_chunk(struct virtio_vdpa_state_stream *st,
+		uint16_t n)
+{
+	return (st->tail + n) % st->nb_chunks;
+}
+
+static inline void *
+virtio_vdpa_state_stream_addr(struct virtio_vdpa_state_stream *st,
+		uint16_t chunk)
+{
+	return (uint8_t *)st->mz->addr + (size_t)chunk * st->chunk_size;
+}
+
+/*
+ * The ring is full of other commands: reap them until a slot frees,
+ * spinning first then sleeping, for a bounded time.
+ */
+static int
+virtio_vdpa_admin_cmd_submit_wait(struct virtio_vdpa_pf_priv *priv,
+		const struct virtio_vdpa_admin_cmd *cmd)
+{
+	uint64_t start = rte_get_timer_cycles();
+	uint64_t hz = rte_get_timer_hz();
+	uint64_t elapsed_us;
+	int ret;
+
+	while ((ret = virtio_vdpa_admin_cmd_submit(priv, cmd, NULL, NULL)) ==
+			-EAGAIN) {
+		virtio_vdpa_admin_cmd_poll(priv, UINT16_MAX);
+		elapsed_us = (rte_get_timer_cycles() - start) * US_PER_S / hz;
+		if (elapsed_us >= VIRTIO_VDPA_MI_CMD_SUBMIT_TIMEOUT_MS * 1000) {
+			CMD_LOG(ERR, "Admin queue full for %u ms, vdev_id: %u",
+					VIRTIO_VDPA_MI_CMD_SUBMIT_TIMEOUT_MS,
+					cmd->vdev_id);
+			return -ETIMEDOUT;
+		}
+		if (elapsed_us < priv->aq_spin_usec)
+			rte_pause();
+		else
+			usleep(VIRTIO_VDPA_MI_CMD_POLL_USEC);
+	}
+	return ret;
+}
+
+/*
+ * Post one SAVE or RESTORE per chunk so the device works on all of them at
+ * once, then collect the statuses. Empty chunks are skipped. Returns how
+ * many chunks completed, the stream only moves on when all of them did.
+ */
+static int
+virtio_vdpa_state_stream_xfer(struct virtio_vdpa_state_stream *st,
+		uint16_t first, uint16_t nb)
+{
+	struct virtio_admin_migration_restore_internal_state_data rd;
+	struct virtio_admin_migration_save_internal_state_data sd;
+	struct virtio_vdpa_admin_cmd cmd = {0};
+	struct virtio_vdpa_admin_sge sge;
+	uint16_t k, chunk, done = 0;
+	uint64_t offset = st->offset;
+	int ret, err = 0;
+
+	cmd.class = VIRTIO_ADMIN_PCI_MIGRATION_CTRL;
+	cmd.per_vdev = true;
+	cmd.vdev_id = st->vdev_id;
+	for (k = 0; k < nb; k++) {
+		chunk = virtio_vdpa_state_stream_chunk(st, first + k);
+		sge.iova = st->mz->iova + (rte_iova_t)chunk * st->chunk_size;
+		sge.len = st->chunk_len[chunk];
+		st->tokens[k] = -1;
+		if (!sge.len) {
+			done++;
+			continue;
+		}
+		if (st->dir == VIRTIO_VDPA_STATE_SAVE) {
+			memset(&sd, 0, sizeof(sd));
+			sd.vdev_id = rte_cpu_to_le_16(st->vdev_id);
+			sd.offset = rte_cpu_to_le_64(offset);
+			sd.length = rte_cpu_to_le_64(sge.len);
+			cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_SAVE_INTERNAL_STATE;
+			cmd.data = &sd;
+			cmd.data_len = sizeof(sd);
+			cmd.num_out_data = 1;
+			cmd.out_data = &sge;
+		} else {
+			memset(&rd, 0, sizeof(rd));
+			rd.vdev_id = rte_cpu_to_le_16(st->vdev_id);
+			rd.offset = rte_cpu_to_le_64(offset);
+			rd.length = rte_cpu_to_le_64(sge.len);
+			cmd.cmd = VIRTIO_ADMIN_PCI_MIGRATION_RESTORE_INTERNAL_STATE;
+			cmd.data = &rd;
+			cmd.data_len = sizeof(rd);
+			cmd.num_in_data = 1;
+			cmd.in_data = &sge;
+		}
+		/* Ring full: stop here if we have work in flight, else reap others */
+		ret = virtio_vdpa_admin_cmd_submit(st->priv, &cmd, NULL, NULL);
+		if (ret == -EAGAIN && !done)
+			ret = virtio_vdpa_admin_cmd_submit_wait(st->priv, &cmd);
+		if (ret == -EAGAIN)
+			break;
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		st->tokens[k] = ret;
+		offset += sge.len;
+		done++;
+	}
+
+	/* Every posted command must be reaped, even after a failure */
+	for (k = 0; k < done; k++) {
+		if (st->tokens[k] < 0)
+			continue;
+		ret = virtio_vdpa_admin_cmd_wait(st->priv, st->tokens[k]);
+		if (ret && !err) {
+			CMD_LOG(ERR, "State chunk %u of the batch at offset %" PRIu64 " failed, status %d, vdev_id: %u",
+					k, st->offset, ret, st->vdev_id);
+			err = ret > 0 ? -EIO : ret;
+		}
+	}
+	if (err)
+		return err;
+
+	st->bytes += offset - st->offset;
+	st->offset = offset;
+	return done;
+}
+
+int
+virtio_vdpa_state_stream_save(struct virtio_vdpa_state_stream *st,
+		struct iovec *iov, uint16_t max_iov)
+{
+	struct virtio_admin_migration_get_internal_state_pending_bytes_result res;
+	uint16_t k, nb = 0, chunk;
+	uint64_t remain;
+	int ret;
+
+	if (st->dir != VIRTIO_VDPA_STATE_SAVE)
+		return -EINVAL;
+
+	/* Ask the device again once everything it announced is read */
+	if (st->offset >= st->total) {
+		ret = virtio_vdpa_cmd_get_internal_pending_bytes(st->priv,
+				st->vdev_id, &res);
+		if (ret)
+			return ret > 0 ? -EIO : ret;
+		if (res.pending_bytes <= st->offset)
+			return 0;
+		st->total = res.pending_bytes;
+	}
+
+	remain = st->total - st->offset;
+	while (nb < max_iov && st->nb_busy + nb < st->nb_chunks && remain) {
+		chunk = virtio_vdpa_state_stream_chunk(st, st->nb_busy + nb);
+		st->chunk_len[chunk] = RTE_MIN((uint64_t)st->chunk_size, remain);
+		remain -= st->chunk_len[chunk];
+		nb++;
+	}
+	if (!nb)
+		return -ENOBUFS;
+
+	ret = virtio_vdpa_state_stream_xfer(st, st->nb_busy, nb);
+	if (ret < 0)
 		return ret;
+
+	for (k = 0; k < ret; k++) {
+		chunk = virtio_vdpa_state_stream_chunk(st, st->nb_busy + k);
+		iov[k].iov_base = virtio_vdpa_state_stream_addr(st, chunk);
+		iov[k].iov_len = st->chunk_len[chunk];
+	}
+	st->nb_busy += ret;
+	return ret;
+}
+
+int
+virtio_vdpa_state_stream_restore_get(struct virtio_vdpa_state_stream *st,
+		struct iovec *iov, uint16_t max_iov)
+{
+	uint16_t k, chunk;
+
+	if (st->dir != VIRTIO_VDPA_STATE_RESTORE)
+		return -EINVAL;
+
+	for (k = 0; k < max_iov && st->nb_busy < st->nb_chunks; k++) {
+		chunk = virtio_vdpa_state_stream_chunk(st, st->nb_busy++);
+		iov[k].iov_base = virtio_vdpa_state_stream_addr(st, chunk);
+		iov[k].iov_len = st->chunk_size;
+	}
+
+	return k;
+}
+
+int
+virtio_vdpa_state_stream_restore_put(struct virtio_vdpa_state_stream *st,
+		const struct iovec *iov, uint16_t nb_iov)
+{
+	uint16_t k, done = 0;
+	int ret;
+
+	if (st->dir != VIRTIO_VDPA_STATE_RESTORE || nb_iov > st->nb_busy)
+		return -EINVAL;
+
+	for (k = 0; k < nb_iov; k++) {
+		if (iov[k].iov_base != virtio_vdpa_state_stream_addr(st,
+				virtio_vdpa_state_stream_chunk(st, k)) ||
+		    iov[k].iov_len > st->chunk_size)
+			return -EINVAL;
+		st->chunk_len[virtio_vdpa_state_stream_chunk(st, k)] = iov[k].iov_len;
 	}
 
-	res = (struct virtio_admin_migration_get_internal_state_pending_bytes_result *)
-			rte_mem_iova2virt(dat_ctrl.out_data[0].iova);
-	result->pending_bytes = rte_le_to_cpu_64(res->pending_bytes);
+	while (done < nb_iov) {
+		ret = virtio_vdpa_state_stream_xfer(st, done, nb_iov - done);
+		if (ret < 0)
+			return ret;
+		done += ret;
+	}
 
+	/* Chunks got but not filled go back unused */
+	virtio_vdpa_state_stream_release(st, st->nb_busy);
 	return 0;
 }
 
+void
+virtio_vdpa_state_stream_release(struct virtio_vdpa_state_stream *st,
+		uint16_t nb_iov)
+{
+	nb_iov = RTE_MIN(nb_iov, st->nb_busy);
+	st->tail = virtio_vdpa_state_stream_chunk(st, nb_iov);
+	st->nb_busy -= nb_iov;
+}
+
+void
+virtio_vdpa_state_stream_stats_get(struct virtio_vdpa_state_stream *st,
+		struct virtio_vdpa_state_stream_stats *stats)
+{
+	uint64_t cycles = rte_get_timer_cycles() - st->start_cycles;
+	uint64_t hz = rte_get_timer_hz();
+
+	stats->bytes = st->bytes;
+	stats->pending_bytes = st->total > st->offset ? st->total - st->offset : 0;
+	stats->elapsed_us = cycles * US_PER_S / hz;
+	stats->bytes_per_sec = cycles ? (uint64_t)((double)st->bytes * hz / cycles) : 0;
+}
+
+int
+virtio_vdpa_state_precopy(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint64_t threshold, uint32_t max_rounds,
+		virtio_vdpa_state_sink_t sink, void *arg)
+{
+	struct virtio_admin_migration_get_internal_state_pending_bytes_result res;
+	struct iovec iov[VIRTIO_VDPA_MI_PRECOPY_NB_CHUNKS];
+	struct virtio_vdpa_state_stream *st;
+	uint32_t round;
+	int nb, k, ret = 0;
+
+	RTE_VERIFY(priv);
+
+	if (!virtio_with_feature(&priv->vpdev->hw,
+			VIRTIO_F_ADMIN_MIGRATION_DYNAMIC_INTERNAL_STATE_TRACK)) {
+		CMD_LOG(INFO, "host does not support dynamic internal state tracking");
+		return -ENOTSUP;
+	}
+
+	st = virtio_vdpa_state_stream_create(priv, vdev_id, VIRTIO_VDPA_STATE_SAVE,
+			VIRTIO_VDPA_MI_PRECOPY_CHUNK_SZ, VIRTIO_VDPA_MI_PRECOPY_NB_CHUNKS);
+	if (!st)
+		return -rte_errno;
+
+	for (round = 0; round < max_rounds; round++) {
+		ret = virtio_vdpa_cmd_get_internal_pending_bytes(priv, vdev_id, &res);
+		if (ret) {
+			ret = ret > 0 ? -EIO : ret;
+			break;
+		}
+		if (res.pending_bytes <= threshold)
+			break;
+
+		/*
+		 * A round reads the delta announced at its start, whatever
+		 * the running VF changes meanwhile is left to the next round.
+		 */
+		st->offset = 0;
+		st->total = res.pending_bytes;
+		while (!ret && st->offset < st->total) {
+			nb = virtio_vdpa_state_stream_save(st, iov, RTE_DIM(iov));
+			if (nb <= 0) {
+				ret = nb ? nb : -EIO;
+				break;
+			}
+			for (k = 0; k < nb && !ret; k++)
+				ret = sink(iov[k].iov_base, iov[k].iov_len,
+					k == nb - 1 && st->offset >= st->total, arg);
+			virtio_vdpa_state_stream_release(st, nb);
+		}
+		if (ret)
+			break;
+		CMD_LOG(DEBUG, "vdev %u pre-copy round %u sent %" PRIu64 " bytes",
+				vdev_id, round, st->total);
+	}
+
+	virtio_vdpa_state_stream_destroy(st);
+	if (ret) {
+		CMD_LOG(ERR, "vdev %u state pre-copy failed in round %u: %d",
+				vdev_id, round, ret);
+		return ret;
+	}
+	return round;
+}
+
 int
 virtio_vdpa_cmd_dirty_page_identity(struct virtio_vdpa_pf_priv *priv,
 		struct virtio_admin_dirty_page_identity_result *result)
 {
-	struct virtio_admin_dirty_page_identity_result *res;
+	struct virtio_admin_dirty_page_identity_result res;
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -482,31 +1574,23 @@ virtio_vdpa_cmd_dirty_page_identity(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_IDENTITY;
-	dlen[0] = 0;
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = hw->avq->virtio_admin_hdr_mem
-				+ sizeof(struct virtio_admin_ctrl_hdr)
-				+ sizeof(ctrl->status);
-	dat_ctrl.out_data[0].len = sizeof(*result);
+	cmd.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_IDENTITY;
+	cmd.result = &res;
+	cmd.result_len = sizeof(res);
 
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 0);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret);
+				cmd.class, cmd.cmd, ret);
 		return ret;
 	}
 
-	res = (struct virtio_admin_dirty_page_identity_result *)
-			rte_mem_iova2virt(dat_ctrl.out_data[0].iova);
 	result->log_max_pages_track_pull_bitmap_mode =
-			rte_le_to_cpu_16(res->log_max_pages_track_pull_bitmap_mode);
+			rte_le_to_cpu_16(res.log_max_pages_track_pull_bitmap_mode);
 	result->log_max_pages_track_pull_bytemap_mode =
-			rte_le_to_cpu_16(res->log_max_pages_track_pull_bytemap_mode);
-	result->max_track_ranges = rte_le_to_cpu_32(res->max_track_ranges);
+			rte_le_to_cpu_16(res.log_max_pages_track_pull_bytemap_mode);
+	result->max_track_ranges = rte_le_to_cpu_32(res.max_track_ranges);
 
 	return 0;
 }
@@ -521,11 +1605,11 @@ virtio_vdpa_cmd_dirty_page_start_track(struct virtio_vdpa_pf_priv *priv,
 		int num_sges,
 		struct virtio_sge data[])
 {
+	uint8_t buf[sizeof(struct virtio_admin_dirty_page_start_track_data) +
+		    sizeof(struct virtio_sge) * VIRTIO_VDPA_MI_MAX_SGES];
 	struct virtio_admin_dirty_page_start_track_data *sd;
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_ctrl *ctrl;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	int ret, i;
 
 	RTE_VERIFY(priv);
@@ -536,11 +1620,12 @@ virtio_vdpa_cmd_dirty_page_start_track(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_START_TRACK;
-	sd = (struct virtio_admin_dirty_page_start_track_data *)&ctrl->data[0];
+	cmd.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_START_TRACK;
+	sd = (struct virtio_admin_dirty_page_start_track_data *)buf;
 	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
 	sd->track_mode = rte_cpu_to_le_16((uint16_t)track_mode);
 	sd->vdev_host_page_size = rte_cpu_to_le_32(vdev_host_page_size);
 	sd->vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
@@ -550,14 +1635,13 @@ virtio_vdpa_cmd_dirty_page_start_track(struct virtio_vdpa_pf_priv *priv,
 		sd->sges[i].len = rte_cpu_to_le_32(data[i].len);
 		sd->sges[i].reserved = 0;
 	}
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 0;
-	dlen[0] = sizeof(*sd) + sizeof(struct virtio_sge) * num_sges;
+	cmd.data = sd;
+	cmd.data_len = sizeof(*sd) + sizeof(struct virtio_sge) * num_sges;
 
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
@@ -568,11 +1652,9 @@ int
 virtio_vdpa_cmd_dirty_page_stop_track(struct virtio_vdpa_pf_priv *priv,
 		uint16_t vdev_id, uint64_t vdev_host_range_addr)
 {
-	struct virtio_admin_dirty_page_stop_track_data *sd;
+	struct virtio_admin_dirty_page_stop_track_data sd = {0};
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -582,20 +1664,19 @@ virtio_vdpa_cmd_dirty_page_stop_track(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_STOP_TRACK;
-	sd = (struct virtio_admin_dirty_page_stop_track_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	sd->vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
-	dlen[0] = sizeof(*sd);
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 0;
+	cmd.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_STOP_TRACK;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	sd.vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
 
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
@@ -609,12 +1690,10 @@ virtio_vdpa_cmd_dirty_page_get_map_pending_bytes(
 		uint64_t vdev_host_range_addr,
 		struct virtio_admin_dirty_page_get_map_pending_bytes_result *result)
 {
-	struct virtio_admin_dirty_page_get_map_pending_bytes_result *res;
-	struct virtio_admin_dirty_page_get_map_pending_bytes_data *sd;
+	struct virtio_admin_dirty_page_get_map_pending_bytes_result res;
+	struct virtio_admin_dirty_page_get_map_pending_bytes_data sd = {0};
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -624,30 +1703,24 @@ virtio_vdpa_cmd_dirty_page_get_map_pending_bytes(
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_GET_MAP_PENDING_BYTES;
-	sd = (struct virtio_admin_dirty_page_get_map_pending_bytes_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	sd->vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
-	dlen[0] = sizeof(*sd);
-
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = hw->avq->virtio_admin_hdr_mem
-			+ sizeof(struct virtio_admin_ctrl_hdr)
-			+ sizeof(ctrl->status) + dlen[0];
-	dat_ctrl.out_data[0].len = sizeof(*result);
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	cmd.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_GET_MAP_PENDING_BYTES;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	sd.vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
+	cmd.result = &res;
+	cmd.result_len = sizeof(res);
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev_id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
-	res = (struct virtio_admin_dirty_page_get_map_pending_bytes_result *)
-			rte_mem_iova2virt(dat_ctrl.out_data[0].iova);
-	result->pending_bytes = rte_le_to_cpu_64(res->pending_bytes);
+	result->pending_bytes = rte_le_to_cpu_64(res.pending_bytes);
 
 	return 0;
 }
@@ -660,11 +1733,10 @@ virtio_vdpa_cmd_dirty_page_report_map(struct virtio_vdpa_pf_priv *priv,
 		uint64_t vdev_host_range_addr,
 		rte_iova_t data)
 {
-	struct virtio_admin_dirty_page_report_map_data *sd;
+	struct virtio_admin_dirty_page_report_map_data sd = {0};
 	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtio_admin_data_ctrl dat_ctrl;
-	struct virtio_admin_ctrl *ctrl;
-	int dlen[1];
+	struct virtio_vdpa_admin_cmd cmd = {0};
+	struct virtio_vdpa_admin_sge sge;
 	int ret;
 
 	RTE_VERIFY(priv);
@@ -674,24 +1746,25 @@ virtio_vdpa_cmd_dirty_page_report_map(struct virtio_vdpa_pf_priv *priv,
 		return -ENOTSUP;
 	}
 
-	ctrl = virtnet_get_aq_hdr_addr(hw->avq);
-	ctrl->hdr.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
-	ctrl->hdr.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_REPORT_MAP;
-	sd = (struct virtio_admin_dirty_page_report_map_data *)&ctrl->data[0];
-	sd->vdev_id = rte_cpu_to_le_16(vdev_id);
-	sd->offset = rte_cpu_to_le_64(offset);
-	sd->length = rte_cpu_to_le_64(length);
-	sd->vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
-	dlen[0] = sizeof(*sd);
-	dat_ctrl.num_in_data = 0;
-	dat_ctrl.num_out_data = 1;
-	dat_ctrl.out_data[0].iova = data;
-	dat_ctrl.out_data[0].len = length;
-
-	ret = virtio_vdpa_send_admin_command(hw->avq, ctrl, &dat_ctrl, dlen, 1);
+	cmd.class = VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL;
+	cmd.cmd = VIRTIO_ADMIN_PCI_DIRTY_PAGE_REPORT_MAP;
+	sd.vdev_id = rte_cpu_to_le_16(vdev_id);
+	cmd.per_vdev = true;
+	cmd.vdev_id = vdev_id;
+	sd.offset = rte_cpu_to_le_64(offset);
+	sd.length = rte_cpu_to_le_64(length);
+	sd.vdev_host_range_addr = rte_cpu_to_le_64(vdev_host_range_addr);
+	cmd.data = &sd;
+	cmd.data_len = sizeof(sd);
+	sge.iova = data;
+	sge.len = length;
+	cmd.num_out_data = 1;
+	cmd.out_data = &sge;
+
+	ret = virtio_vdpa_admin_cmd_exec(priv, &cmd);
 	if (ret) {
 		CMD_LOG(ERR, "Failed to run class %u, cmd %u, status %d, vdev id: %u",
-				ctrl->hdr.class, ctrl->hdr.cmd, ret, vdev_id);
+				cmd.class, cmd.cmd, ret, vdev_id);
 		return ret;
 	}
 
@@ -715,14 +1788,23 @@ virtio_vdpa_init_vring(struct virtqueue *vq)
 	vq->vq_desc_tail_idx = (uint16_t)(vq->vq_nentries - 1);
 	vq->vq_free_cnt = vq->vq_nentries;
 	memset(vq->vq_descx, 0, sizeof(struct vq_desc_extra) * vq->vq_nentries);
-	vr = &vq->vq_split.ring;
+	if (virtio_with_packed_queue(vq->hw)) {
+		vring_init_packed(&vq->vq_packed.ring, ring_mem,
+				  VIRTIO_VRING_ALIGN, size);
+		vring_desc_init_packed(vq, size);
+		vq->vq_packed.used_wrap_counter = 1;
+		vq->vq_packed.cached_flags = VRING_PACKED_DESC_F_AVAIL;
+		vq->vq_packed.event_flags_shadow = 0;
+	} else {
+		vr = &vq->vq_split.ring;
 
-	vring_init_split(vr, ring_mem, VIRTIO_VRING_ALIGN, size);
-	vring_desc_init_split(vr->desc, size);
+		vring_init_split(vr, ring_mem, VIRTIO_VRING_ALIGN, size);
+		vring_desc_init_split(vr->desc, size);
+	}
 	/*
 	 * Disable device(host) interrupting guest
 	 */
-	virtqueue_disable_intr_split(vq);
+	virtqueue_disable_intr(vq);
 }
 
 static void
@@ -730,10 +1812,12 @@ virtio_vdpa_destroy_aq_ctl(struct virtadmin_ctl *ctl)
 {
 	rte_memzone_free(ctl->mz);
 	rte_memzone_free(ctl->virtio_admin_hdr_mz);
+	rte_free(ctl->slots);
 }
 
 static int
-virtio_vdpa_init_admin_queue(struct virtio_vdpa_pf_priv *priv)
+virtio_vdpa_init_admin_queue(struct virtio_vdpa_pf_priv *priv,
+		struct virtio_vdpa_admin_queue *aq)
 {
 	const struct rte_memzone *mz = NULL, *hdr_mz = NULL;
 	int numa_node = priv->pdev->device.numa_node;
@@ -746,12 +1830,12 @@ virtio_vdpa_init_admin_queue(struct virtio_vdpa_pf_priv *priv)
 	unsigned int vq_size, size;
 	struct virtqueue *vq;
 	size_t sz_hdr_mz = 0;
-	uint16_t queue_idx;
+	uint16_t queue_idx, i;
 	int ret;
 
 	DRV_LOG(INFO, "setting up admin queue on NUMA node %d", numa_node);
 
-	queue_idx = priv->dev_ops->get_adminq_idx(priv);
+	queue_idx = aq->qidx;
 	vq_size = virtio_pci_dev_queue_size_get(vpdev, queue_idx);
 	DRV_LOG(INFO, "admin queue idx %u, queue size %u", queue_idx, vq_size);
 
@@ -767,7 +1851,7 @@ virtio_vdpa_init_admin_queue(struct virtio_vdpa_pf_priv *priv)
 		DRV_LOG(ERR, "can not allocate admin q %u", queue_idx);
 		return -ENOMEM;
 	}
-	hw->vqs[priv->dev_ops->get_adminq_idx(priv)] = vq;
+	hw->vqs[queue_idx] = vq;
 
 	vq->hw = hw;
 	vq->vq_queue_index = queue_idx;
@@ -779,127 +1863,378 @@ virtio_vdpa_init_admin_queue(struct virtio_vdpa_pf_priv *priv)
 	size = vring_size(hw, vq_size, VIRTIO_VRING_ALIGN);
 	vq->vq_ring_size = RTE_ALIGN_CEIL(size, VIRTIO_VRING_ALIGN);
 
-	mz = rte_memzone_reserve_aligned(vq_name, vq->vq_ring_size,
-			numa_node, RTE_MEMZONE_IOVA_CONTIG,
-			VIRTIO_VRING_ALIGN);
-	if (mz == NULL) {
-		if (rte_errno == EEXIST)
-			mz = rte_memzone_lookup(vq_name);
-		if (mz == NULL) {
-			ret = -ENOMEM;
-			goto err_ret;
+	mz = rte_memzone_reserve_aligned(vq_name, vq->vq_ring_size,
+			numa_node, RTE_MEMZONE_IOVA_CONTIG,
+			VIRTIO_VRING_ALIGN);
+	if (mz == NULL) {
+		if (rte_errno == EEXIST)
+			mz = rte_memzone_lookup(vq_name);
+		if (mz == NULL) {
+			ret = -ENOMEM;
+			goto err_ret;
+		}
+	}
+
+	memset(mz->addr, 0, mz->len);
+
+	vq->vq_ring_mem = mz->iova;
+	vq->vq_ring_virt_mem = mz->addr;
+
+	virtio_vdpa_init_vring(vq);
+
+	avq = &vq->aq;
+	avq->mz = mz;
+	avq->indirect = virtio_with_feature(hw, VIRTIO_F_ADMIN_VQ_INDIRECT_DESC);
+	avq->in_order = virtio_with_feature(hw, VIRTIO_F_ADMIN_VQ_IN_ORDER);
+	DRV_LOG(INFO, "admin queue %u: %s ring, indirect %s, in order %s",
+		queue_idx, virtio_with_packed_queue(hw) ? "packed" : "split",
+		avq->indirect ? "on" : "off", avq->in_order ? "on" : "off");
+
+	/*
+	 * A direct chain needs at least header and status descriptors, so no
+	 * more than half of the ring can be in flight, an indirect one takes a
+	 * single descriptor. Give every in-flight command its own slot for
+	 * header, data, result, status and indirect table.
+	 */
+	avq->nr_slots = avq->indirect ? vq_size : RTE_MAX(vq_size / 2, 1U);
+	avq->slots = rte_zmalloc_socket(NULL,
+			sizeof(*avq->slots) * avq->nr_slots +
+			sizeof(*avq->free_slots) * avq->nr_slots +
+			sizeof(*avq->inflight) * avq->nr_slots,
+			RTE_CACHE_LINE_SIZE, numa_node);
+	if (avq->slots == NULL) {
+		DRV_LOG(ERR, "can not allocate admin q %u command slots", queue_idx);
+		ret = -ENOMEM;
+		goto err_free_mz;
+	}
+	avq->free_slots = (uint16_t *)(avq->slots + avq->nr_slots);
+	avq->inflight = avq->free_slots + avq->nr_slots;
+	for (i = 0; i < avq->nr_slots; i++)
+		avq->free_slots[i] = avq->nr_slots - i - 1;
+	avq->nr_free_slots = avq->nr_slots;
+	rte_spinlock_init(&avq->lock);
+
+	sz_hdr_mz = (size_t)VIRTIO_VDPA_MI_CMD_SLOT_SZ * avq->nr_slots;
+	snprintf(vq_hdr_name, sizeof(vq_hdr_name), "vdev%d_aq%u_hdr",
+			vpdev->vfio_dev_fd, queue_idx);
+	hdr_mz = rte_memzone_reserve_aligned(vq_hdr_name, sz_hdr_mz,
+			numa_node, RTE_MEMZONE_IOVA_CONTIG,
+			RTE_CACHE_LINE_SIZE);
+	if (hdr_mz == NULL) {
+		if (rte_errno == EEXIST)
+			hdr_mz = rte_memzone_lookup(vq_hdr_name);
+		if (hdr_mz == NULL) {
+			ret = -ENOMEM;
+			goto err_free_slots;
+		}
+	}
+	avq->virtio_admin_hdr_mz = hdr_mz;
+	avq->virtio_admin_hdr_mem = hdr_mz->iova;
+	memset(avq->virtio_admin_hdr_mz->addr, 0, hdr_mz->len);
+
+	aq->avq = avq;
+	if (aq->id == 0)
+		hw->avq = avq;
+
+	vr_info.size  = vq_size;
+	if (virtio_with_packed_queue(hw)) {
+		vr_info.desc  = (uint64_t)(uintptr_t)vq->vq_packed.ring.desc;
+		vr_info.avail = (uint64_t)(uintptr_t)vq->vq_packed.ring.driver;
+		vr_info.used  = (uint64_t)(uintptr_t)vq->vq_packed.ring.device;
+	} else {
+		vr_info.desc  = (uint64_t)(uintptr_t)vq->vq_split.ring.desc;
+		vr_info.avail = (uint64_t)(uintptr_t)vq->vq_split.ring.avail;
+		vr_info.used  = (uint64_t)(uintptr_t)vq->vq_split.ring.used;
+	}
+	ret = virtio_pci_dev_queue_set(vpdev, queue_idx, &vr_info);
+	if (ret) {
+		DRV_LOG(ERR, "setup_queue %u failed", queue_idx);
+		ret = -EINVAL;
+		goto err_clean_avq;
+	}
+
+	return 0;
+
+err_clean_avq:
+	aq->avq = NULL;
+	if (aq->id == 0)
+		hw->avq = NULL;
+	rte_memzone_free(hdr_mz);
+err_free_slots:
+	rte_free(avq->slots);
+err_free_mz:
+	rte_memzone_free(mz);
+err_ret:
+	hw->vqs[queue_idx] = NULL;
+	rte_free(vq);
+	return ret;
+}
+
+static void
+virtio_vdpa_admin_queue_free(struct virtio_vdpa_pf_priv *priv)
+{
+	struct virtio_hw *hw = &priv->vpdev->hw;
+	struct virtio_vdpa_admin_queue *aq;
+	uint16_t i;
+
+	if (hw->vqs == NULL)
+		return;
+
+	for (i = 0; i < priv->hw_nr_virtqs; i++) {
+		aq = &priv->aqs[i];
+		if (aq->avq) {
+			virtio_vdpa_destroy_aq_ctl(aq->avq);
+			aq->avq = NULL;
+		}
+		if (hw->vqs[aq->qidx]) {
+			rte_free(hw->vqs[aq->qidx]);
+			hw->vqs[aq->qidx] = NULL;
+		}
+	}
+	hw->avq = NULL;
+	priv->hw_nr_virtqs = 0;
+	rte_free(hw->vqs);
+	hw->vqs = NULL;
+}
+
+/*
+ * Admin queues sit at consecutive indexes from get_adminq_idx(), up to
+ * aq_num of them are used as long as the device reports a queue size.
+ */
+static int
+virtio_vdpa_admin_queue_alloc(struct virtio_vdpa_pf_priv *priv,
+		uint16_t aq_num)
+{
+	uint16_t adminq_idx = priv->dev_ops->get_adminq_idx(priv);
+	struct virtio_hw *hw = &priv->vpdev->hw;
+	struct virtio_vdpa_admin_queue *aq;
+	uint16_t i;
+	int ret;
+
+	for (i = 1; i < aq_num; i++) {
+		if (!virtio_pci_dev_queue_size_get(priv->vpdev, adminq_idx + i)) {
+			DRV_LOG(INFO, "%s exposes %u admin queues, %u requested",
+					priv->pdev->device.name, i, aq_num);
+			aq_num = i;
+			break;
+		}
+	}
+
+	hw->vqs = rte_zmalloc(NULL, sizeof(struct virtqueue *) * (adminq_idx + aq_num), 0);
+	if (!hw->vqs) {
+		DRV_LOG(ERR, "failed to allocate vqs");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < aq_num; i++) {
+		aq = &priv->aqs[i];
+		aq->priv = priv;
+		aq->id = i;
+		aq->qidx = adminq_idx + i;
+		priv->hw_nr_virtqs = i + 1;
+		ret = virtio_vdpa_init_admin_queue(priv, aq);
+		if (ret) {
+			DRV_LOG(ERR, "Failed to init admin queue %u for virtio device",
+					aq->qidx);
+			virtio_vdpa_admin_queue_free(priv);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void
+virtio_vdpa_admin_queue_intr_handler(void *cb_arg)
+{
+	struct virtio_vdpa_admin_queue *aq = cb_arg;
+	uint64_t buf;
+	int nbytes;
+
+	do {
+		nbytes = read(rte_intr_fd_get(aq->intr_handle), &buf, 8);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EWOULDBLOCK && errno != EAGAIN)
+				DRV_LOG(ERR, "%s failed to read admin queue %u eventfd: %s",
+						aq->priv->pdev->device.name, aq->qidx,
+						strerror(errno));
+		}
+		break;
+	} while (1);
+
+	if (aq->avq)
+		virtio_vdpa_admin_queue_poll(aq, UINT16_MAX);
+}
+
+static void
+virtio_vdpa_admin_queue_intr_unbind(struct virtio_vdpa_admin_queue *aq)
+{
+	struct rte_intr_handle *intr_handle = aq->intr_handle;
+	int retries = VIRTIO_VDPA_MI_INTR_RETRIES;
+	int ret = -EAGAIN;
+	int fd;
+
+	if (!intr_handle)
+		return;
+
+	fd = rte_intr_fd_get(intr_handle);
+	while (retries-- && ret == -EAGAIN) {
+		ret = rte_intr_callback_unregister(intr_handle,
+				virtio_vdpa_admin_queue_intr_handler, aq);
+		if (ret == -EAGAIN) {
+			DRV_LOG(DEBUG, "%s try again to unregister admin queue fd %d, retries = %d",
+					aq->priv->pdev->device.name, fd, retries);
+			usleep(VIRTIO_VDPA_MI_INTR_RETRIES_USEC);
 		}
 	}
+	virtio_pci_dev_interrupt_disable(aq->priv->vpdev, aq->qidx + 1);
+	close(fd);
+	rte_intr_instance_free(intr_handle);
+	aq->intr_handle = NULL;
+}
 
-	memset(mz->addr, 0, mz->len);
+static void
+virtio_vdpa_admin_queue_intr_teardown(struct virtio_vdpa_pf_priv *priv)
+{
+	uint16_t i;
 
-	vq->vq_ring_mem = mz->iova;
-	vq->vq_ring_virt_mem = mz->addr;
+	if (priv->aq_wait_mode == VIRTIO_VDPA_ADMIN_WAIT_POLL)
+		return;
 
-	virtio_vdpa_init_vring(vq);
+	for (i = 0; i < priv->hw_nr_virtqs; i++)
+		virtio_vdpa_admin_queue_intr_unbind(&priv->aqs[i]);
+	virtio_pci_dev_interrupts_free(priv->vpdev);
+	priv->aq_wait_mode = VIRTIO_VDPA_ADMIN_WAIT_POLL;
+}
 
-	avq = &vq->aq;
-	avq->mz = mz;
+static int
+virtio_vdpa_admin_queue_intr_bind(struct virtio_vdpa_admin_queue *aq)
+{
+	struct virtio_vdpa_pf_priv *priv = aq->priv;
+	uint16_t vec = aq->qidx + 1;
+	struct rte_intr_handle *intr_handle;
+	int efd, ret;
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		DRV_LOG(ERR, "%s failed to create admin queue eventfd: %s",
+				priv->pdev->device.name, strerror(errno));
+		return -errno;
+	}
 
-	/* Allocate a page for admin vq command, data and status */
-	sz_hdr_mz = rte_mem_page_size();
+	intr_handle = rte_intr_instance_alloc(RTE_INTR_INSTANCE_F_SHARED);
+	if (!intr_handle) {
+		DRV_LOG(ERR, "%s fail to allocate admin queue intr_handle",
+				priv->pdev->device.name);
+		ret = -ENOMEM;
+		goto err_close_fd;
+	}
 
-	if (sz_hdr_mz) {
-		snprintf(vq_hdr_name, sizeof(vq_hdr_name), "vdev%d_aq%u_hdr",
-				vpdev->vfio_dev_fd, queue_idx);
-		hdr_mz = rte_memzone_reserve_aligned(vq_hdr_name, sz_hdr_mz,
-				numa_node, RTE_MEMZONE_IOVA_CONTIG,
-				RTE_CACHE_LINE_SIZE);
-		if (hdr_mz == NULL) {
-			if (rte_errno == EEXIST)
-				hdr_mz = rte_memzone_lookup(vq_hdr_name);
-			if (hdr_mz == NULL) {
-				ret = -ENOMEM;
-				goto err_free_mz;
-			}
-		}
-		avq->virtio_admin_hdr_mz = hdr_mz;
-		avq->virtio_admin_hdr_mem = hdr_mz->iova;
-		memset(avq->virtio_admin_hdr_mz->addr, 0, rte_mem_page_size());
-	} else {
-		DRV_LOG(ERR, "rte mem page size is zero");
+	if (rte_intr_fd_set(intr_handle, efd) ||
+	    rte_intr_type_set(intr_handle, RTE_INTR_HANDLE_EXT)) {
 		ret = -EINVAL;
-		goto err_free_mz;
+		goto err_free_handle;
 	}
 
-	hw->avq = avq;
+	ret = virtio_pci_dev_interrupt_enable(priv->vpdev, efd, vec);
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to bind MSI-X vector %u to admin queue %u",
+				priv->pdev->device.name, vec, aq->qidx);
+		goto err_free_handle;
+	}
 
-	vr_info.size  = vq_size;
-	vr_info.desc  = (uint64_t)(uintptr_t)vq->vq_split.ring.desc;
-	vr_info.avail = (uint64_t)(uintptr_t)vq->vq_split.ring.avail;
-	vr_info.used  = (uint64_t)(uintptr_t)vq->vq_split.ring.used;
-	ret = virtio_pci_dev_queue_set(vpdev, queue_idx, &vr_info);
+	ret = rte_intr_callback_register(intr_handle,
+			virtio_vdpa_admin_queue_intr_handler, aq);
 	if (ret) {
-		DRV_LOG(ERR, "setup_queue %u failed", queue_idx);
-		ret = -EINVAL;
-		goto err_clean_avq;
+		DRV_LOG(ERR, "%s failed to register admin queue %u interrupt",
+				priv->pdev->device.name, aq->qidx);
+		goto err_disable_vec;
 	}
 
+	aq->intr_handle = intr_handle;
+	virtqueue_enable_intr(virtnet_aq_to_vq(aq->avq));
+	DRV_LOG(INFO, "%s admin queue %u uses MSI-X vector %u fd %d",
+			priv->pdev->device.name, aq->qidx, vec, efd);
 	return 0;
 
-err_clean_avq:
-	hw->avq = NULL;
-	rte_memzone_free(hdr_mz);
-err_free_mz:
-	rte_memzone_free(mz);
-err_ret:
-	hw->vqs[0] = NULL;
-	rte_free(vq);
+err_disable_vec:
+	virtio_pci_dev_interrupt_disable(priv->vpdev, vec);
+err_free_handle:
+	rte_intr_instance_free(intr_handle);
+err_close_fd:
+	close(efd);
 	return ret;
 }
 
-static void
-virtio_vdpa_admin_queue_free(struct virtio_vdpa_pf_priv *priv)
+/*
+ * Bind a dedicated MSI-X vector to each admin queue. Vector 0 is the config
+ * vector and vector N belongs to queue N - 1, so admin queue q gets vector
+ * q + 1. Without them commands keep being polled.
+ */
+static int
+virtio_vdpa_admin_queue_intr_setup(struct virtio_vdpa_pf_priv *priv)
 {
-	uint16_t nr_vq = priv->hw_nr_virtqs;
-	struct virtio_hw *hw = &priv->vpdev->hw;
-	struct virtqueue *vq;
+	uint16_t nvec_req = priv->aqs[priv->hw_nr_virtqs - 1].qidx + 2;
 	uint16_t i;
+	int nvec, ret;
 
-	if (hw->vqs == NULL)
-		return;
+	nvec = virtio_pci_dev_interrupts_num_get(priv->vpdev);
+	if (nvec < nvec_req) {
+		DRV_LOG(INFO, "%s has %d MSI-X vectors, admin queues need %u, using polling",
+				priv->pdev->device.name, nvec, nvec_req);
+		return -ENOTSUP;
+	}
 
-	if (hw->avq) {
-		virtio_vdpa_destroy_aq_ctl(hw->avq);
-		hw->avq = NULL;
+	ret = virtio_pci_dev_interrupts_alloc(priv->vpdev, nvec_req);
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to alloc %u MSI-X vectors",
+				priv->pdev->device.name, nvec_req);
+		return ret;
 	}
 
-	for (i = 0; i < nr_vq; i++) {
-		vq = hw->vqs[i];
-		if (vq) {
-			rte_free(vq);
-			hw->vqs[i] = NULL;
+	for (i = 0; i < priv->hw_nr_virtqs; i++) {
+		ret = virtio_vdpa_admin_queue_intr_bind(&priv->aqs[i]);
+		if (ret) {
+			while (i--)
+				virtio_vdpa_admin_queue_intr_unbind(&priv->aqs[i]);
+			virtio_pci_dev_interrupts_free(priv->vpdev);
+			return ret;
 		}
 	}
-	rte_free(hw->vqs);
-	hw->vqs = NULL;
+
+	return 0;
 }
 
 static int
-virtio_vdpa_admin_queue_alloc(struct virtio_vdpa_pf_priv *priv)
+virtio_vdpa_mi_aq_wait_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
 {
-	struct virtio_hw *hw = &priv->vpdev->hw;
-	int ret;
+	if (strcmp(value, "poll") == 0)
+		*(int *)ret_val = VIRTIO_VDPA_ADMIN_WAIT_POLL;
+	else if (strcmp(value, "intr") == 0)
+		*(int *)ret_val = VIRTIO_VDPA_ADMIN_WAIT_INTR;
+	else if (strcmp(value, "adaptive") == 0)
+		*(int *)ret_val = VIRTIO_VDPA_ADMIN_WAIT_ADAPTIVE;
+	else
+		return -EINVAL;
 
-	priv->hw_nr_virtqs = 1;
-	hw->vqs = rte_zmalloc(NULL, sizeof(struct virtqueue *) * (priv->dev_ops->get_adminq_idx(priv) + 1), 0);
-	if (!hw->vqs) {
-		DRV_LOG(ERR, "failed to allocate vqs");
-		return -ENOMEM;
-	}
+	return 0;
+}
 
-	ret = virtio_vdpa_init_admin_queue(priv);
-	if (ret) {
-		DRV_LOG(ERR, "Failed to init admin queue for virtio device");
-		rte_free(hw->vqs);
-		hw->vqs = NULL;
-		return ret;
-	}
+static int
+virtio_vdpa_mi_u32_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	char *end;
+	unsigned long v;
+
+	errno = 0;
+	v = strtoul(value, &end, 0);
+	if (errno || *end != '\0' || v > UINT32_MAX)
+		return -EINVAL;
+	*(uint32_t *)ret_val = v;
 
 	return 0;
 }
@@ -916,7 +2251,8 @@ static int vdpa_mi_check_handler(__rte_unused const char *key,
 }
 
 static int
-virtio_pci_devargs_parse(struct rte_devargs *devargs, int *vdpa)
+virtio_pci_devargs_parse(struct rte_devargs *devargs,
+		struct virtio_vdpa_mi_devargs *args)
 {
 	struct rte_kvargs *kvlist;
 	int ret = 0;
@@ -935,11 +2271,37 @@ virtio_pci_devargs_parse(struct rte_devargs *devargs, int *vdpa)
 		 * vdpa=1
 		 */
 		ret = rte_kvargs_process(kvlist, VIRTIO_ARG_VDPA,
-					 vdpa_mi_check_handler, vdpa);
+					 vdpa_mi_check_handler, &args->vdpa);
 		if (ret < 0)
 			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_ARG_VDPA);
 	}
 
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_MI_ARG_AQ_WAIT) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_MI_ARG_AQ_WAIT,
+					 virtio_vdpa_mi_aq_wait_handler, &args->aq_wait);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_MI_ARG_AQ_WAIT);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_MI_ARG_AQ_SPIN_US) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_MI_ARG_AQ_SPIN_US,
+					 virtio_vdpa_mi_u32_handler, &args->aq_spin_usec);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_MI_ARG_AQ_SPIN_US);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_MI_ARG_AQ_NUM) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_MI_ARG_AQ_NUM,
+					 virtio_vdpa_mi_u32_handler, &args->aq_num);
+		if (ret < 0 || args->aq_num == 0 ||
+		    args->aq_num > VIRTIO_VDPA_MI_MAX_ADMIN_QUEUES) {
+			DRV_LOG(ERR, "Failed to parse %s, valid range is 1-%d",
+				VIRTIO_VDPA_MI_ARG_AQ_NUM,
+				VIRTIO_VDPA_MI_MAX_ADMIN_QUEUES);
+			ret = -EINVAL;
+		}
+	}
+
 	rte_kvargs_free(kvlist);
 
 	return ret;
@@ -981,50 +2343,48 @@ static struct virtio_vdpa_dev_ops virtio_vdpa_blk_dev_ops = {
 	.get_adminq_idx = virtio_vdpa_blk_dev_get_adminq_idx,
 };
 
-static int
-virtio_vdpa_mi_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
-		struct rte_pci_device *pci_dev)
+static struct virtio_vdpa_pf_priv *
+virtio_vdpa_mi_priv_alloc(void)
 {
-	char devname[RTE_DEV_NAME_MAX_LEN] = {0};
-	struct virtio_vdpa_pf_priv *priv = NULL;
-	int vdpa = 0, ret;
-	uint64_t features;
-
-	RTE_VERIFY(rte_eal_iova_mode() == RTE_IOVA_VA);
-
-	ret = virtio_pci_devargs_parse(pci_dev->device.devargs, &vdpa);
-	if (ret < 0) {
-		DRV_LOG(ERR, "Devargs parsing is failed");
-		return ret;
-	}
-	/* virtio vdpa pmd skips probe if device needs to work in none vdpa mode */
-	if (vdpa != 1)
-		return 1;
+	struct virtio_vdpa_pf_priv *priv;
+	int i;
 
 	priv = rte_zmalloc("virtio vdpa pf device private", sizeof(*priv), RTE_CACHE_LINE_SIZE);
 	if (!priv) {
 		DRV_LOG(ERR, "Failed to allocate private memory");
 		rte_errno = ENOMEM;
-		return -rte_errno;
+		return NULL;
 	}
 
-	rte_pci_device_name(&pci_dev->addr, devname, RTE_DEV_NAME_MAX_LEN);
+	for (i = 0; i < VIRTIO_VDPA_MI_MAX_ADMIN_QUEUES; i++) {
+		pthread_mutex_init(&priv->aqs[i].wait_lock, NULL);
+		pthread_cond_init(&priv->aqs[i].wait_cond, NULL);
+	}
+	return priv;
+}
 
-	priv->pdev = pci_dev;
+static void
+virtio_vdpa_mi_priv_free(struct virtio_vdpa_pf_priv *priv)
+{
+	int i;
 
-	priv->vpdev = virtio_pci_dev_alloc(pci_dev);
-	if (priv->vpdev == NULL) {
-		DRV_LOG(ERR, "%s failed to alloc virito pci dev", devname);
-		rte_errno = rte_errno ? rte_errno : ENODEV;
-		goto error;
+	for (i = 0; i < VIRTIO_VDPA_MI_MAX_ADMIN_QUEUES; i++) {
+		pthread_cond_destroy(&priv->aqs[i].wait_cond);
+		pthread_mutex_destroy(&priv->aqs[i].wait_lock);
 	}
+	rte_free(priv);
+}
 
-	priv->vfio_dev_fd = rte_intr_dev_fd_get(pci_dev->intr_handle);
-	if (priv->vfio_dev_fd < 0) {
-		DRV_LOG(ERR, "%s failed to get vfio dev fd", devname);
-		rte_errno = rte_errno ? rte_errno : ENODEV;
-		goto err_free_pci_dev;
-	}
+/*
+ * Negotiate, set up the admin queues and start the device behind
+ * priv->vpdev, whatever transport it uses. Sets rte_errno on failure.
+ */
+static int
+virtio_vdpa_mi_dev_start(struct virtio_vdpa_pf_priv *priv,
+		const struct virtio_vdpa_mi_devargs *args)
+{
+	uint64_t features;
+	int ret;
 
 	if (priv->pdev->id.device_id == VIRTIO_PCI_MODERN_DEVICEID_NET) {
 		priv->dev_ops = &virtio_vdpa_net_dev_ops;
@@ -1037,7 +2397,7 @@ virtio_vdpa_mi_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 					priv->pdev->device.name,
 					priv->pdev->id.device_id);
 		rte_errno = rte_errno ? rte_errno : EOPNOTSUPP;
-		goto err_free_pci_dev;
+		return -rte_errno;
 	}
 
 	virtio_pci_dev_features_get(priv->vpdev, &priv->device_features);
@@ -1047,17 +2407,26 @@ virtio_vdpa_mi_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 				", required: 0x%" PRIx64, priv->device_features,
 				features);
 		rte_errno = rte_errno ? rte_errno : EOPNOTSUPP;
-		goto err_free_pci_dev;
+		return -rte_errno;
 	}
+	features |= priv->device_features & VIRTIO_VDPA_MI_OPTIONAL_FEATURES;
 	features = virtio_pci_dev_features_set(priv->vpdev, features);
 	priv->vpdev->hw.weak_barriers = !virtio_with_feature(&priv->vpdev->hw, VIRTIO_F_ORDER_PLATFORM);
 	virtio_pci_dev_set_status(priv->vpdev, VIRTIO_CONFIG_STATUS_FEATURES_OK);
 
-	ret = virtio_vdpa_admin_queue_alloc(priv);
+	ret = virtio_vdpa_admin_queue_alloc(priv, args->aq_num);
 	if (ret) {
 		DRV_LOG(ERR, "Failed to alloc admin queue for vDPA device");
 		rte_errno = rte_errno ? rte_errno : -ret;
-		goto err_free_pci_dev;
+		return -rte_errno;
+	}
+
+	priv->aq_wait_mode = VIRTIO_VDPA_ADMIN_WAIT_POLL;
+	if (args->aq_wait != VIRTIO_VDPA_ADMIN_WAIT_POLL &&
+	    !virtio_vdpa_admin_queue_intr_setup(priv)) {
+		priv->aq_wait_mode = args->aq_wait;
+		priv->aq_spin_usec = args->aq_wait == VIRTIO_VDPA_ADMIN_WAIT_INTR ?
+				0 : args->aq_spin_usec;
 	}
 
 	/* Start the device */
@@ -1067,11 +2436,71 @@ virtio_vdpa_mi_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 	TAILQ_INSERT_TAIL(&virtio_mi_priv_list, priv, next);
 	pthread_mutex_unlock(&mi_priv_list_lock);
 	return 0;
+}
+
+static void
+virtio_vdpa_mi_dev_close(struct virtio_vdpa_pf_priv *priv)
+{
+	virtio_vdpa_admin_queue_intr_teardown(priv);
+	virtio_vdpa_admin_queue_free(priv);
+	virtio_pci_dev_reset(priv->vpdev);
+	virtio_pci_dev_free(priv->vpdev);
+	virtio_vdpa_mi_priv_free(priv);
+}
+
+static int
+virtio_vdpa_mi_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
+		struct rte_pci_device *pci_dev)
+{
+	char devname[RTE_DEV_NAME_MAX_LEN] = {0};
+	struct virtio_vdpa_pf_priv *priv = NULL;
+	struct virtio_vdpa_mi_devargs args = {
+		.aq_wait = VIRTIO_VDPA_ADMIN_WAIT_ADAPTIVE,
+		.aq_spin_usec = VIRTIO_VDPA_MI_CMD_SPIN_USEC,
+		.aq_num = 1,
+	};
+	int ret;
+
+	RTE_VERIFY(rte_eal_iova_mode() == RTE_IOVA_VA);
+
+	ret = virtio_pci_devargs_parse(pci_dev->device.devargs, &args);
+	if (ret < 0) {
+		DRV_LOG(ERR, "Devargs parsing is failed");
+		return ret;
+	}
+	/* virtio vdpa pmd skips probe if device needs to work in none vdpa mode */
+	if (args.vdpa != 1)
+		return 1;
+
+	priv = virtio_vdpa_mi_priv_alloc();
+	if (!priv)
+		return -rte_errno;
+
+	rte_pci_device_name(&pci_dev->addr, devname, RTE_DEV_NAME_MAX_LEN);
+
+	priv->pdev = pci_dev;
+	priv->vpdev = virtio_pci_dev_alloc(pci_dev);
+	if (priv->vpdev == NULL) {
+		DRV_LOG(ERR, "%s failed to alloc virito pci dev", devname);
+		rte_errno = rte_errno ? rte_errno : ENODEV;
+		goto error;
+	}
+
+	priv->vfio_dev_fd = rte_intr_dev_fd_get(pci_dev->intr_handle);
+	if (priv->vfio_dev_fd < 0) {
+		DRV_LOG(ERR, "%s failed to get vfio dev fd", devname);
+		rte_errno = rte_errno ? rte_errno : ENODEV;
+		goto err_free_pci_dev;
+	}
+
+	if (virtio_vdpa_mi_dev_start(priv, &args))
+		goto err_free_pci_dev;
+	return 0;
 
 err_free_pci_dev:
 	virtio_pci_dev_free(priv->vpdev);
 error:
-	rte_free(priv);
+	virtio_vdpa_mi_priv_free(priv);
 	return -rte_errno;
 }
 
@@ -1091,15 +2520,112 @@ virtio_vdpa_mi_dev_remove(struct rte_pci_device *pci_dev)
 	}
 	pthread_mutex_unlock(&mi_priv_list_lock);
 
-	if (found) {
-		virtio_vdpa_admin_queue_free(priv);
-		virtio_pci_dev_reset(priv->vpdev);
-		virtio_pci_dev_free(priv->vpdev);
-		rte_free(priv);
+	if (found)
+		virtio_vdpa_mi_dev_close(priv);
+	return 0;
+}
+
+/*
+ * Software PF: the same driver on top of the device model in sw_pf.c, for
+ * live migration tests and benchmarks without hardware. Admin commands are
+ * polled, they complete when the queue is notified.
+ */
+static int
+virtio_vdpa_mi_sw_probe(struct rte_vdev_device *vdev)
+{
+	const char *name = rte_vdev_device_name(vdev);
+	char bdf[RTE_DEV_NAME_MAX_LEN] = {0};
+	struct virtio_vdpa_pf_priv *priv;
+	struct virtio_vdpa_mi_devargs args = {
+		.aq_num = 1,
+	};
+	int ret;
+
+	if (rte_eal_iova_mode() != RTE_IOVA_VA) {
+		DRV_LOG(ERR, "%s needs IOVA as VA", name);
+		return -ENOTSUP;
+	}
+
+	ret = virtio_pci_devargs_parse(vdev->device.devargs, &args);
+	if (ret < 0) {
+		DRV_LOG(ERR, "Devargs parsing is failed");
+		return ret;
+	}
+	args.aq_wait = VIRTIO_VDPA_ADMIN_WAIT_POLL;
+
+	priv = virtio_vdpa_mi_priv_alloc();
+	if (!priv)
+		return -rte_errno;
+
+	priv->vpdev = virtio_sw_pf_create(name, rte_vdev_device_args(vdev));
+	if (priv->vpdev == NULL) {
+		DRV_LOG(ERR, "%s failed to create software PF", name);
+		rte_errno = rte_errno ? rte_errno : ENODEV;
+		goto error;
+	}
+	priv->pdev = VTPCI_DEV(&priv->vpdev->hw);
+	priv->vfio_dev_fd = priv->vpdev->vfio_dev_fd;
+
+	rte_pci_device_name(&priv->pdev->addr, bdf, sizeof(bdf));
+	if (rte_vdpa_get_mi_by_bdf(bdf)) {
+		DRV_LOG(ERR, "%s address %s is in use", name, bdf);
+		rte_errno = EEXIST;
+		goto err_free_pci_dev;
+	}
+
+	if (virtio_vdpa_mi_dev_start(priv, &args))
+		goto err_free_pci_dev;
+	return 0;
+
+err_free_pci_dev:
+	virtio_pci_dev_free(priv->vpdev);
+error:
+	virtio_vdpa_mi_priv_free(priv);
+	return -rte_errno;
+}
+
+static int
+virtio_vdpa_mi_sw_remove(struct rte_vdev_device *vdev)
+{
+	const char *name = rte_vdev_device_name(vdev);
+	struct virtio_vdpa_pf_priv *priv = NULL;
+	int found = 0;
+
+	pthread_mutex_lock(&mi_priv_list_lock);
+	TAILQ_FOREACH(priv, &virtio_mi_priv_list, next) {
+		if (virtio_sw_pf_is_sw(priv->vpdev) &&
+		    !strcmp(priv->pdev->device.name, name)) {
+			found = 1;
+			TAILQ_REMOVE(&virtio_mi_priv_list, priv, next);
+			break;
+		}
 	}
+	pthread_mutex_unlock(&mi_priv_list_lock);
+
+	if (!found)
+		return -ENODEV;
+	virtio_vdpa_mi_dev_close(priv);
 	return 0;
 }
 
+int
+virtio_vdpa_sw_pf_vf_run(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint64_t state_bytes)
+{
+	RTE_VERIFY(priv);
+
+	return virtio_sw_pf_vf_run(priv->vpdev, vdev_id, state_bytes);
+}
+
+int
+virtio_vdpa_sw_pf_vf_dirty(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint64_t addr, uint64_t len)
+{
+	RTE_VERIFY(priv);
+
+	return virtio_sw_pf_vf_dirty(priv->vpdev, vdev_id, addr, len);
+}
+
 struct virtio_vdpa_pf_priv *
 rte_vdpa_get_mi_by_bdf(const char *bdf)
 {
@@ -1189,4 +2715,23 @@ static struct rte_pci_driver virtio_vdpa_mi_driver = {
 
 RTE_PMD_REGISTER_PCI(VIRTIO_VDPA_MI_DRIVER_NAME, virtio_vdpa_mi_driver);
 RTE_PMD_REGISTER_PCI_TABLE(VIRTIO_VDPA_MI_DRIVER_NAME, pci_id_virtio_mi_map);
+RTE_PMD_REGISTER_PARAM_STRING(VIRTIO_VDPA_MI_DRIVER_NAME,
+	VIRTIO_VDPA_MI_ARG_AQ_WAIT "=poll|intr|adaptive "
+	VIRTIO_VDPA_MI_ARG_AQ_SPIN_US "=<uint32> "
+	VIRTIO_VDPA_MI_ARG_AQ_NUM "=<1-8>");
 RTE_PMD_REGISTER_KMOD_DEP(VIRTIO_VDPA_MI_DRIVER_NAME, "* vfio-pci");
+
+static struct rte_vdev_driver virtio_vdpa_mi_sw_driver = {
+	.probe = virtio_vdpa_mi_sw_probe,
+	.remove = virtio_vdpa_mi_sw_remove,
+};
+
+#define VIRTIO_VDPA_MI_SW_DRIVER_NAME vdpa_virtio_mi_sw
+
+RTE_PMD_REGISTER_VDEV(VIRTIO_VDPA_MI_SW_DRIVER_NAME, virtio_vdpa_mi_sw_driver);
+RTE_PMD_REGISTER_PARAM_STRING(VIRTIO_VDPA_MI_SW_DRIVER_NAME,
+	VIRTIO_VDPA_MI_ARG_AQ_NUM "=<1-8> "
+	VIRTIO_SW_PF_ARG_ADDR "=<PCI address> "
+	VIRTIO_SW_PF_ARG_NUM_VFS "=<uint16> "
+	VIRTIO_SW_PF_ARG_STATE_SIZE "=<uint32> "
+	VIRTIO_SW_PF_ARG_FEATURES "=<uint64>");
@@ -0,0 +1,1045 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <rte_malloc.h>
+#include <rte_log.h>
+#include <rte_errno.h>
+#include <rte_string_fns.h>
+#include <rte_bus_pci.h>
+#include <rte_kvargs.h>
+#include <rte_spinlock.h>
+#include <rte_ether.h>
+
+#include <virtqueue.h>
+#include <virtio_admin.h>
+#include <virtio_api.h>
+
+#include "sw_pf.h"
+
+RTE_LOG_REGISTER(virtio_sw_pf_logtype, pmd.vdpa.virtio, NOTICE);
+#define DRV_LOG(level, fmt, args...) \
+	rte_log(RTE_LOG_ ## level, virtio_sw_pf_logtype, \
+		"VIRTIO SW PF %s(): " fmt "\n", __func__, ##args)
+
+#define VIRTIO_SW_PF_NB_DATA_QUEUES 2
+#define VIRTIO_SW_PF_NB_QUEUES \
+	(VIRTIO_SW_PF_NB_DATA_QUEUES + VIRTIO_SW_PF_NB_ADMIN_QUEUES)
+#define VIRTIO_SW_PF_QUEUE_SIZE 256
+#define VIRTIO_SW_PF_NUM_VFS 16
+#define VIRTIO_SW_PF_STATE_SIZE 4096
+#define VIRTIO_SW_PF_MAX_STATE_SIZE (64 * 1024 * 1024)
+#define VIRTIO_SW_PF_MAX_RANGES 16
+#define VIRTIO_SW_PF_LOG_MAX_PAGES 20
+/* Descriptors of one command, indirect tables included */
+#define VIRTIO_SW_PF_MAX_BUFS 64
+#define VIRTIO_SW_PF_REPORT_BURST 256
+
+#define VIRTIO_SW_PF_FEATURES \
+	((1ULL << VIRTIO_F_VERSION_1) | \
+	 (1ULL << VIRTIO_F_ADMIN_VQ) | \
+	 (1ULL << VIRTIO_F_ADMIN_VQ_INDIRECT_DESC) | \
+	 (1ULL << VIRTIO_F_ADMIN_VQ_IN_ORDER) | \
+	 (1ULL << VIRTIO_F_ADMIN_MIGRATION) | \
+	 (1ULL << VIRTIO_F_ADMIN_MIGRATION_DYNAMIC_INTERNAL_STATE_TRACK) | \
+	 (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BITMAP_TRACK) | \
+	 (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BYTEMAP_TRACK))
+
+/* Offset of the command data in the device readable bytes */
+#define VIRTIO_SW_PF_DATA_OFF sizeof(struct virtio_admin_ctrl_hdr)
+
+struct virtio_sw_pf_range {
+	uint64_t addr;
+	uint64_t len;
+	uint64_t nr_pages;
+	uint64_t nr_dirty; /* pages set in map */
+	uint32_t page_size;
+	uint16_t mode;
+	uint8_t *map; /* one byte per page, packed on report in bitmap mode */
+};
+
+struct virtio_sw_pf_vf {
+	uint8_t *state;
+	uint64_t state_delta; /* prefix changed since it was last read */
+	uint32_t gen;
+	uint16_t status;
+	uint16_t nr_ranges;
+	struct virtio_sw_pf_range ranges[VIRTIO_SW_PF_MAX_RANGES];
+};
+
+struct virtio_sw_pf_queue {
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t size;
+	uint16_t last_avail_idx;
+	bool enabled;
+};
+
+struct virtio_sw_pf {
+	struct virtio_pci_dev vpdev; /* first, virtio_pci_dev_free() frees all */
+	struct rte_pci_device pdev;
+	char name[RTE_DEV_NAME_MAX_LEN];
+	struct virtio_net_config net_cfg;
+	uint64_t features;
+	uint64_t driver_features;
+	uint8_t status;
+	struct virtio_sw_pf_queue queues[VIRTIO_SW_PF_NB_QUEUES];
+	rte_spinlock_t lock; /* VF models, shared by all admin queues */
+	uint32_t state_size;
+	uint16_t num_vfs;
+	struct virtio_sw_pf_vf *vfs;
+};
+
+struct virtio_sw_pf_buf {
+	uint8_t *addr;
+	uint32_t len;
+};
+
+/* Device view of one command: readable then writable bytes */
+struct virtio_sw_pf_req {
+	struct virtio_sw_pf_buf rd[VIRTIO_SW_PF_MAX_BUFS];
+	struct virtio_sw_pf_buf wr[VIRTIO_SW_PF_MAX_BUFS];
+	uint16_t nb_rd;
+	uint16_t nb_wr;
+	uint64_t rd_len;
+	uint64_t out_len; /* writable bytes before the status */
+	uint64_t written;
+};
+
+struct virtio_sw_pf_args {
+	struct rte_pci_addr addr;
+	bool has_addr;
+	uint32_t num_vfs;
+	uint32_t state_size;
+	uint64_t features;
+};
+
+static const struct virtio_ops virtio_sw_pf_ops;
+static uint16_t virtio_sw_pf_count;
+
+#define virtio_sw_pf_get(hwp) container_of(hwp, struct virtio_sw_pf, vpdev.hw)
+
+static bool
+virtio_sw_pf_req_read(const struct virtio_sw_pf_req *req, uint64_t off,
+		void *dst, uint64_t len)
+{
+	uint64_t n;
+	uint16_t i;
+
+	if (off > req->rd_len || len > req->rd_len - off)
+		return false;
+	for (i = 0; i < req->nb_rd && len; i++) {
+		if (off >= req->rd[i].len) {
+			off -= req->rd[i].len;
+			continue;
+		}
+		n = RTE_MIN(len, req->rd[i].len - off);
+		memcpy(dst, req->rd[i].addr + off, n);
+		dst = RTE_PTR_ADD(dst, n);
+		len -= n;
+		off = 0;
+	}
+	return true;
+}
+
+static bool
+virtio_sw_pf_req_write(struct virtio_sw_pf_req *req, uint64_t off,
+		const void *src, uint64_t len)
+{
+	uint64_t n, end = off + len;
+	uint16_t i;
+
+	if (off > req->out_len || len > req->out_len - off)
+		return false;
+	for (i = 0; i < req->nb_wr && len; i++) {
+		if (off >= req->wr[i].len) {
+			off -= req->wr[i].len;
+			continue;
+		}
+		n = RTE_MIN(len, req->wr[i].len - off);
+		memcpy(req->wr[i].addr + off, src, n);
+		src = RTE_PTR_ADD(src, n);
+		len -= n;
+		off = 0;
+	}
+	req->written = RTE_MAX(req->written, end);
+	return true;
+}
+
+/* Collect the chain at head, IOVAs are VAs */
+static int
+virtio_sw_pf_req_parse(const struct virtio_sw_pf_queue *q, uint16_t head,
+		struct virtio_sw_pf_req *req)
+{
+	const struct vring_desc *desc = q->desc, *d;
+	uint32_t max = q->size, idx = head, n = 0;
+	struct virtio_sw_pf_buf *buf;
+
+	req->nb_rd = 0;
+	req->nb_wr = 0;
+	req->rd_len = 0;
+	req->out_len = 0;
+	req->written = 0;
+
+	if (desc[head].flags & VRING_DESC_F_INDIRECT) {
+		if (!desc[head].len || desc[head].len % sizeof(*desc))
+			return -EINVAL;
+		max = desc[head].len / sizeof(*desc);
+		desc = (const struct vring_desc *)(uintptr_t)desc[head].addr;
+		idx = 0;
+	}
+
+	while (1) {
+		if (idx >= max || n++ >= max)
+			return -EINVAL;
+		d = &desc[idx];
+		if (d->flags & VRING_DESC_F_INDIRECT)
+			return -EINVAL;
+		if (d->flags & VRING_DESC_F_WRITE) {
+			if (req->nb_wr == VIRTIO_SW_PF_MAX_BUFS)
+				return -E2BIG;
+			buf = &req->wr[req->nb_wr++];
+			req->out_len += d->len;
+		} else {
+			/* Readable buffers all come first */
+			if (req->nb_wr || req->nb_rd == VIRTIO_SW_PF_MAX_BUFS)
+				return -EINVAL;
+			buf = &req->rd[req->nb_rd++];
+			req->rd_len += d->len;
+		}
+		buf->addr = (uint8_t *)(uintptr_t)d->addr;
+		buf->len = d->len;
+		if (!(d->flags & VRING_DESC_F_NEXT))
+			break;
+		idx = d->next;
+	}
+
+	if (!req->nb_wr || !req->wr[req->nb_wr - 1].len ||
+	    req->rd_len < VIRTIO_SW_PF_DATA_OFF)
+		return -EINVAL;
+	/* The last writable byte is the status */
+	req->out_len--;
+	return 0;
+}
+
+static struct virtio_sw_pf_vf *
+virtio_sw_pf_vf_get(struct virtio_sw_pf *sw, uint16_t vdev_id)
+{
+	if (vdev_id == 0 || vdev_id > sw->num_vfs)
+		return NULL;
+	return &sw->vfs[vdev_id - 1];
+}
+
+static void
+virtio_sw_pf_state_fill(struct virtio_sw_pf *sw, uint16_t vdev_id,
+		uint64_t len)
+{
+	struct virtio_sw_pf_vf *vf = &sw->vfs[vdev_id - 1];
+	uint64_t i;
+
+	for (i = 0; i < len; i++)
+		vf->state[i] = (uint8_t)(vdev_id + i * 7 + vf->gen * 13);
+	vf->state_delta = RTE_MAX(vf->state_delta, len);
+}
+
+/* RUNNING <-> QUIESCED <-> FREEZED, a reset goes back to INIT */
+static bool
+virtio_sw_pf_status_valid(uint16_t from, uint16_t to)
+{
+	switch (to) {
+	case VIRTIO_S_INIT:
+		return true;
+	case VIRTIO_S_RUNNING:
+		return from != VIRTIO_S_FREEZED;
+	case VIRTIO_S_QUIESCED:
+		return from != VIRTIO_S_INIT;
+	case VIRTIO_S_FREEZED:
+		return from == VIRTIO_S_QUIESCED || from == VIRTIO_S_FREEZED;
+	default:
+		return false;
+	}
+}
+
+static uint8_t
+virtio_sw_pf_migration_cmd(struct virtio_sw_pf *sw, uint8_t cmd,
+		struct virtio_sw_pf_req *req)
+{
+	union {
+		struct virtio_admin_migration_get_internal_status_data status;
+		struct virtio_admin_migration_modify_internal_status_data modify;
+		struct virtio_admin_migration_get_internal_state_pending_bytes_data pending;
+		struct virtio_admin_migration_save_internal_state_data save;
+		struct virtio_admin_migration_restore_internal_state_data restore;
+	} d;
+	struct virtio_admin_migration_get_internal_state_pending_bytes_result pending;
+	struct virtio_admin_migration_get_internal_status_result status;
+	struct virtio_admin_migration_identity_result id;
+	struct virtio_sw_pf_vf *vf;
+	uint16_t vdev_id, to;
+	uint64_t off, len;
+
+	if (cmd == VIRTIO_ADMIN_PCI_MIGRATION_IDENTITY) {
+		memset(&id, 0, sizeof(id));
+		id.major_ver = rte_cpu_to_le_16(1);
+		return virtio_sw_pf_req_write(req, 0, &id, sizeof(id)) ?
+			VIRTIO_ADMIN_STATUS_COMMON_OK :
+			VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+	}
+
+	/* Every other command starts with vdev_id */
+	memset(&d, 0, sizeof(d));
+	if (!virtio_sw_pf_req_read(req, VIRTIO_SW_PF_DATA_OFF, &d,
+			RTE_MIN(sizeof(d), req->rd_len - VIRTIO_SW_PF_DATA_OFF)) ||
+	    req->rd_len - VIRTIO_SW_PF_DATA_OFF < sizeof(uint16_t))
+		return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+	vdev_id = rte_le_to_cpu_16(d.status.vdev_id);
+	vf = virtio_sw_pf_vf_get(sw, vdev_id);
+	if (!vf)
+		return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+
+	switch (cmd) {
+	case VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATUS:
+		memset(&status, 0, sizeof(status));
+		status.internal_status = rte_cpu_to_le_16(vf->status);
+		if (!virtio_sw_pf_req_write(req, 0, &status, sizeof(status)))
+			return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+		break;
+	case VIRTIO_ADMIN_PCI_MIGRATION_MODIFY_INTERNAL_STATUS:
+		to = rte_le_to_cpu_16(d.modify.internal_status);
+		if (!virtio_sw_pf_status_valid(vf->status, to)) {
+			DRV_LOG(ERR, "%s vdev %u can not go from status %u to %u",
+					sw->name, vdev_id, vf->status, to);
+			return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+		}
+		if (to == VIRTIO_S_INIT && vf->status != VIRTIO_S_INIT) {
+			vf->gen++;
+			virtio_sw_pf_state_fill(sw, vdev_id, sw->state_size);
+		}
+		vf->status = to;
+		break;
+	case VIRTIO_ADMIN_PCI_MIGRATION_GET_INTERNAL_STATE_PENDING_BYTES:
+		/* Frozen, or without tracking, the whole state is pending */
+		memset(&pending, 0, sizeof(pending));
+		if (vf->status == VIRTIO_S_FREEZED ||
+		    !(sw->driver_features &
+		      (1ULL << VIRTIO_F_ADMIN_MIGRATION_DYNAMIC_INTERNAL_STATE_TRACK)))
+			pending.pending_bytes = rte_cpu_to_le_64(sw->state_size);
+		else
+			pending.pending_bytes = rte_cpu_to_le_64(vf->state_delta);
+		if (!virtio_sw_pf_req_write(req, 0, &pending, sizeof(pending)))
+			return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+		break;
+	case VIRTIO_ADMIN_PCI_MIGRATION_SAVE_INTERNAL_STATE:
+		off = rte_le_to_cpu_64(d.save.offset);
+		len = rte_le_to_cpu_64(d.save.length);
+		if (off > sw->state_size || len > sw->state_size - off)
+			return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+		if (!virtio_sw_pf_req_write(req, 0, vf->state + off, len))
+			return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+		if (vf->status != VIRTIO_S_FREEZED && off + len >= vf->state_delta)
+			vf->state_delta = 0;
+		break;
+	case VIRTIO_ADMIN_PCI_MIGRATION_RESTORE_INTERNAL_STATE:
+		off = rte_le_to_cpu_64(d.restore.offset);
+		len = rte_le_to_cpu_64(d.restore.length);
+		if (vf->status == VIRTIO_S_RUNNING ||
+		    off > sw->state_size || len > sw->state_size - off)
+			return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+		if (!virtio_sw_pf_req_read(req, VIRTIO_SW_PF_DATA_OFF +
+				sizeof(d.restore), vf->state + off, len))
+			return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+		break;
+	default:
+		return VIRTIO_ADMIN_STATUS_COMMON_INVALID_COMMAND;
+	}
+
+	return VIRTIO_ADMIN_STATUS_COMMON_OK;
+}
+
+static struct virtio_sw_pf_range *
+virtio_sw_pf_range_get(struct virtio_sw_pf_vf *vf, uint64_t addr)
+{
+	uint16_t i;
+
+	for (i = 0; i < vf->nr_ranges; i++)
+		if (vf->ranges[i].addr == addr)
+			return &vf->ranges[i];
+	return NULL;
+}
+
+static uint64_t
+virtio_sw_pf_range_map_len(const struct virtio_sw_pf_range *range)
+{
+	/* Bitmaps are made of 64 bit words */
+	if (range->mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP)
+		return range->nr_pages;
+	return RTE_ALIGN_CEIL(range->nr_pages, 64) / 8;
+}
+
+static uint64_t
+virtio_sw_pf_range_pending(const struct virtio_sw_pf_range *range)
+{
+	uint64_t i, bytes = 0;
+
+	if (range->mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP || !range->nr_dirty)
+		return range->nr_dirty;
+	for (i = 0; i < range->nr_pages; i += 8)
+		if (memchr(range->map + i, 1, RTE_MIN(8ULL, range->nr_pages - i)))
+			bytes++;
+	return bytes;
+}
+
+/* Copy out and clear map bytes [off, off + len) */
+static bool
+virtio_sw_pf_range_report(struct virtio_sw_pf_range *range,
+		struct virtio_sw_pf_req *req, uint64_t off, uint64_t len)
+{
+	uint8_t buf[VIRTIO_SW_PF_REPORT_BURST];
+	uint64_t done, n, i, page, k;
+
+	for (done = 0; done < len; done += n) {
+		n = RTE_MIN(len - done, (uint64_t)sizeof(buf));
+		memset(buf, 0, n);
+		for (i = 0; i < n; i++) {
+			if (range->mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP) {
+				page = off + done + i;
+				buf[i] = range->map[page];
+				range->nr_dirty -= range->map[page];
+				range->map[page] = 0;
+				continue;
+			}
+			for (k = 0; k < 8; k++) {
+				page = (off + done + i) * 8 + k;
+				if (page >= range->nr_pages)
+					break;
+				buf[i] |= range->map[page] << k;
+				range->nr_dirty -= range->map[page];
+				range->map[page] = 0;
+			}
+		}
+		if (!virtio_sw_pf_req_write(req, done, buf, n))
+			return false;
+	}
+	return true;
+}
+
+static uint8_t
+virtio_sw_pf_dirty_start(struct virtio_sw_pf *sw, struct virtio_sw_pf_vf *vf,
+		const struct virtio_admin_dirty_page_start_track_data *d)
+{
+	struct virtio_sw_pf_range *range;
+	uint16_t mode = rte_le_to_cpu_16(d->track_mode);
+	uint32_t page_size = rte_le_to_cpu_32(d->vdev_host_page_size);
+	uint64_t addr = rte_le_to_cpu_64(d->vdev_host_range_addr);
+	uint64_t len = rte_le_to_cpu_64(d->range_length);
+
+	if ((mode != VIRTIO_M_DIRTY_TRACK_PULL_BITMAP &&
+	     mode != VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP) ||
+	    !(sw->features & (1ULL << (mode == VIRTIO_M_DIRTY_TRACK_PULL_BITMAP ?
+			VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BITMAP_TRACK :
+			VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BYTEMAP_TRACK))) ||
+	    !rte_is_power_of_2(page_size) || !len ||
+	    (addr | len) & (page_size - 1) ||
+	    len / page_size > (1ULL << VIRTIO_SW_PF_LOG_MAX_PAGES) ||
+	    vf->nr_ranges == VIRTIO_SW_PF_MAX_RANGES ||
+	    virtio_sw_pf_range_get(vf, addr))
+		return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+
+	range = &vf->ranges[vf->nr_ranges];
+	range->map = rte_zmalloc(NULL, len / page_size, 0);
+	if (!range->map)
+		return VIRTIO_ADMIN_STATUS_COMMON_DEVICE_INTERNAL_ERR;
+	range->addr = addr;
+	range->len = len;
+	range->page_size = page_size;
+	range->nr_pages = len / page_size;
+	range->nr_dirty = 0;
+	range->mode = mode;
+	vf->nr_ranges++;
+	return VIRTIO_ADMIN_STATUS_COMMON_OK;
+}
+
+static uint8_t
+virtio_sw_pf_dirty_cmd(struct virtio_sw_pf *sw, uint8_t cmd,
+		struct virtio_sw_pf_req *req)
+{
+	union {
+		struct virtio_admin_dirty_page_start_track_data start;
+		struct virtio_admin_dirty_page_stop_track_data stop;
+		struct virtio_admin_dirty_page_get_map_pending_bytes_data pending;
+		struct virtio_admin_dirty_page_report_map_data report;
+	} d;
+	struct virtio_admin_dirty_page_get_map_pending_bytes_result pending;
+	struct virtio_admin_dirty_page_identity_result id;
+	struct virtio_sw_pf_range *range;
+	struct virtio_sw_pf_vf *vf;
+	uint64_t addr, off, len;
+
+	if (cmd == VIRTIO_ADMIN_PCI_DIRTY_PAGE_IDENTITY) {
+		id.log_max_pages_track_pull_bitmap_mode =
+				rte_cpu_to_le_16(VIRTIO_SW_PF_LOG_MAX_PAGES);
+		id.log_max_pages_track_pull_bytemap_mode =
+				rte_cpu_to_le_16(VIRTIO_SW_PF_LOG_MAX_PAGES);
+		id.max_track_ranges = rte_cpu_to_le_32(VIRTIO_SW_PF_MAX_RANGES);
+		return virtio_sw_pf_req_write(req, 0, &id, sizeof(id)) ?
+			VIRTIO_ADMIN_STATUS_COMMON_OK :
+			VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+	}
+
+	memset(&d, 0, sizeof(d));
+	if (!virtio_sw_pf_req_read(req, VIRTIO_SW_PF_DATA_OFF, &d,
+			RTE_MIN(sizeof(d), req->rd_len - VIRTIO_SW_PF_DATA_OFF)) ||
+	    req->rd_len - VIRTIO_SW_PF_DATA_OFF < sizeof(uint16_t))
+		return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+	vf = virtio_sw_pf_vf_get(sw, rte_le_to_cpu_16(d.start.vdev_id));
+	if (!vf)
+		return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+
+	if (cmd == VIRTIO_ADMIN_PCI_DIRTY_PAGE_START_TRACK)
+		return virtio_sw_pf_dirty_start(sw, vf, &d.start);
+
+	switch (cmd) {
+	case VIRTIO_ADMIN_PCI_DIRTY_PAGE_STOP_TRACK:
+		addr = d.stop.vdev_host_range_addr;
+		break;
+	case VIRTIO_ADMIN_PCI_DIRTY_PAGE_GET_MAP_PENDING_BYTES:
+		addr = d.pending.vdev_host_range_addr;
+		break;
+	case VIRTIO_ADMIN_PCI_DIRTY_PAGE_REPORT_MAP:
+		addr = d.report.vdev_host_range_addr;
+		break;
+	default:
+		return VIRTIO_ADMIN_STATUS_COMMON_INVALID_COMMAND;
+	}
+	range = virtio_sw_pf_range_get(vf, rte_le_to_cpu_64(addr));
+	if (!range)
+		return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+
+	switch (cmd) {
+	case VIRTIO_ADMIN_PCI_DIRTY_PAGE_STOP_TRACK:
+		rte_free(range->map);
+		*range = vf->ranges[--vf->nr_ranges];
+		break;
+	case VIRTIO_ADMIN_PCI_DIRTY_PAGE_GET_MAP_PENDING_BYTES:
+		pending.pending_bytes =
+				rte_cpu_to_le_64(virtio_sw_pf_range_pending(range));
+		if (!virtio_sw_pf_req_write(req, 0, &pending, sizeof(pending)))
+			return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+		break;
+	default:
+		off = rte_le_to_cpu_64(d.report.offset);
+		len = rte_le_to_cpu_64(d.report.length);
+		if (off > virtio_sw_pf_range_map_len(range) ||
+		    len > virtio_sw_pf_range_map_len(range) - off)
+			return VIRTIO_ADMIN_STATUS_COMMON_ERR;
+		if (!virtio_sw_pf_range_report(range, req, off, len))
+			return VIRTIO_ADMIN_STATUS_COMMON_DATA_TRANSFER_ERR;
+		break;
+	}
+
+	return VIRTIO_ADMIN_STATUS_COMMON_OK;
+}
+
+static uint8_t
+virtio_sw_pf_cmd_run(struct virtio_sw_pf *sw, struct virtio_sw_pf_req *req)
+{
+	struct virtio_admin_ctrl_hdr hdr;
+	uint8_t status;
+
+	virtio_sw_pf_req_read(req, 0, &hdr, sizeof(hdr));
+
+	rte_spinlock_lock(&sw->lock);
+	if (hdr.class == VIRTIO_ADMIN_PCI_MIGRATION_CTRL &&
+	    (sw->features & (1ULL << VIRTIO_F_ADMIN_MIGRATION)))
+		status = virtio_sw_pf_migration_cmd(sw, hdr.cmd, req);
+	else if (hdr.class == VIRTIO_ADMIN_PCI_DIRTY_PAGE_TRACK_CTRL &&
+		 (sw->features &
+		  ((1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BITMAP_TRACK) |
+		   (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PULL_BYTEMAP_TRACK))))
+		status = virtio_sw_pf_dirty_cmd(sw, hdr.cmd, req);
+	else
+		status = VIRTIO_ADMIN_STATUS_COMMON_INVALID_CLASS;
+	rte_spinlock_unlock(&sw->lock);
+
+	DRV_LOG(DEBUG, "%s class %u cmd %u status %u", sw->name,
+			hdr.class, hdr.cmd, status);
+	return status;
+}
+
+/* Run every command made available since the last notify */
+static void
+virtio_sw_pf_queue_process(struct virtio_sw_pf *sw, struct virtio_sw_pf_queue *q)
+{
+	uint16_t avail_idx, used_idx, head, mask = q->size - 1;
+	struct virtio_sw_pf_req req;
+	struct vring_used_elem *uep;
+	uint32_t len;
+
+	avail_idx = __atomic_load_n(&q->avail->idx, __ATOMIC_ACQUIRE);
+	used_idx = q->used->idx;
+	while (q->last_avail_idx != avail_idx) {
+		head = q->avail->ring[q->last_avail_idx++ & mask];
+		len = 0;
+		if (head >= q->size || virtio_sw_pf_req_parse(q, head, &req)) {
+			DRV_LOG(ERR, "%s malformed admin command at head %u",
+					sw->name, head);
+		} else {
+			req.wr[req.nb_wr - 1].addr[req.wr[req.nb_wr - 1].len - 1] =
+					virtio_sw_pf_cmd_run(sw, &req);
+			len = req.written + sizeof(virtio_admin_ctrl_ack);
+		}
+		uep = &q->used->ring[used_idx++ & mask];
+		uep->id = head;
+		uep->len = len;
+	}
+	__atomic_store_n(&q->used->idx, used_idx, __ATOMIC_RELEASE);
+}
+
+static void
+virtio_sw_pf_read_dev_cfg(struct virtio_hw *hw, size_t offset,
+		void *dst, int length)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+
+	if (offset + length > sizeof(sw->net_cfg)) {
+		DRV_LOG(ERR, "%s config read beyond %zu bytes", sw->name,
+				sizeof(sw->net_cfg));
+		return;
+	}
+	memcpy(dst, (uint8_t *)&sw->net_cfg + offset, length);
+}
+
+static void
+virtio_sw_pf_write_dev_cfg(struct virtio_hw *hw, size_t offset,
+		const void *src, int length)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+
+	if (offset + length > sizeof(sw->net_cfg)) {
+		DRV_LOG(ERR, "%s config write beyond %zu bytes", sw->name,
+				sizeof(sw->net_cfg));
+		return;
+	}
+	memcpy((uint8_t *)&sw->net_cfg + offset, src, length);
+}
+
+static uint8_t
+virtio_sw_pf_get_status(struct virtio_hw *hw)
+{
+	return virtio_sw_pf_get(hw)->status;
+}
+
+static void
+virtio_sw_pf_set_status(struct virtio_hw *hw, uint8_t status)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+	uint16_t i;
+
+	if (status == VIRTIO_CONFIG_STATUS_RESET) {
+		for (i = 0; i < VIRTIO_SW_PF_NB_QUEUES; i++)
+			sw->queues[i].enabled = false;
+		sw->driver_features = 0;
+	}
+	sw->status = status;
+}
+
+static uint64_t
+virtio_sw_pf_get_features(struct virtio_hw *hw)
+{
+	return virtio_sw_pf_get(hw)->features;
+}
+
+static void
+virtio_sw_pf_set_features(struct virtio_hw *hw, uint64_t features)
+{
+	virtio_sw_pf_get(hw)->driver_features = features;
+}
+
+static int
+virtio_sw_pf_features_ok(struct virtio_hw *hw)
+{
+	if (!virtio_with_feature(hw, VIRTIO_F_VERSION_1)) {
+		DRV_LOG(ERR, "Version 1+ required with modern devices");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static uint8_t
+virtio_sw_pf_get_isr(struct virtio_hw *hw __rte_unused)
+{
+	return 0;
+}
+
+/* No MSI-X, admin commands are polled */
+static uint16_t
+virtio_sw_pf_set_config_irq(struct virtio_hw *hw __rte_unused,
+		uint16_t vec __rte_unused)
+{
+	return VIRTIO_MSI_NO_VECTOR;
+}
+
+static uint16_t
+virtio_sw_pf_set_queue_irq(struct virtio_hw *hw __rte_unused,
+		struct virtqueue *vq __rte_unused, uint16_t vec __rte_unused)
+{
+	return VIRTIO_MSI_NO_VECTOR;
+}
+
+static uint16_t
+virtio_sw_pf_get_queue_num(struct virtio_hw *hw __rte_unused)
+{
+	return VIRTIO_SW_PF_NB_DATA_QUEUES;
+}
+
+static uint16_t
+virtio_sw_pf_get_queue_size(struct virtio_hw *hw __rte_unused,
+		uint16_t queue_id)
+{
+	return queue_id < VIRTIO_SW_PF_NB_QUEUES ? VIRTIO_SW_PF_QUEUE_SIZE : 0;
+}
+
+static int
+virtio_sw_pf_setup_queue(struct virtio_hw *hw, struct virtqueue *vq)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+	struct virtio_sw_pf_queue *q;
+
+	if (vq->vq_queue_index >= VIRTIO_SW_PF_NB_QUEUES ||
+	    !rte_is_power_of_2(vq->vq_nentries) ||
+	    vq->vq_nentries > VIRTIO_SW_PF_QUEUE_SIZE) {
+		DRV_LOG(ERR, "%s can not set up queue %u of size %u", sw->name,
+				vq->vq_queue_index, vq->vq_nentries);
+		return -EINVAL;
+	}
+	if (virtio_with_packed_queue(hw)) {
+		DRV_LOG(ERR, "%s only has split rings", sw->name);
+		return -ENOTSUP;
+	}
+
+	q = &sw->queues[vq->vq_queue_index];
+	/* As on a real device, a running queue is reset before it is set */
+	if (q->enabled && (sw->status & VIRTIO_CONFIG_STATUS_DRIVER_OK)) {
+		DRV_LOG(ERR, "%s queue %u is enabled", sw->name,
+				vq->vq_queue_index);
+		return -EBUSY;
+	}
+	q->desc = (struct vring_desc *)(uintptr_t)vq->vq_ring_mem;
+	q->avail = (struct vring_avail *)(uintptr_t)vq->vq_avail_mem;
+	q->used = (struct vring_used *)(uintptr_t)vq->vq_used_mem;
+	q->size = vq->vq_nentries;
+	q->last_avail_idx = 0;
+	q->enabled = true;
+	return 0;
+}
+
+/*
+ * Disabling a queue of a running device stands for a per-queue reset,
+ * which completes at once here: the queue is back to defaults.
+ */
+static int
+virtio_sw_pf_del_queue(struct virtio_hw *hw, struct virtqueue *vq)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+
+	if (vq->vq_queue_index >= VIRTIO_SW_PF_NB_QUEUES)
+		return -EINVAL;
+	memset(&sw->queues[vq->vq_queue_index], 0,
+	       sizeof(sw->queues[vq->vq_queue_index]));
+	return 0;
+}
+
+/* The doorbell runs the admin commands in the calling thread */
+static void
+virtio_sw_pf_notify_queue(struct virtio_hw *hw, struct virtqueue *vq)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+	struct virtio_sw_pf_queue *q;
+
+	if (vq->vq_queue_index < VIRTIO_SW_PF_NB_DATA_QUEUES ||
+	    vq->vq_queue_index >= VIRTIO_SW_PF_NB_QUEUES)
+		return;
+	q = &sw->queues[vq->vq_queue_index];
+	if (!q->enabled || !(sw->status & VIRTIO_CONFIG_STATUS_DRIVER_OK)) {
+		DRV_LOG(ERR, "%s queue %u notified before it is live",
+				sw->name, vq->vq_queue_index);
+		return;
+	}
+	virtio_sw_pf_queue_process(sw, q);
+}
+
+static void
+virtio_sw_pf_intr_detect(struct virtio_hw *hw)
+{
+	virtio_pci_get_dev(hw)->msix_status = VIRTIO_MSIX_NONE;
+	hw->intr_lsc = 0;
+}
+
+static int
+virtio_sw_pf_dev_close(struct virtio_hw *hw)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(hw);
+	struct virtio_sw_pf_vf *vf;
+	uint16_t i, r;
+
+	for (i = 0; sw->vfs && i < sw->num_vfs; i++) {
+		vf = &sw->vfs[i];
+		for (r = 0; r < vf->nr_ranges; r++)
+			rte_free(vf->ranges[r].map);
+		rte_free(vf->state);
+	}
+	rte_free(sw->vfs);
+	sw->vfs = NULL;
+	if (sw->vpdev.vfio_dev_fd >= 0)
+		close(sw->vpdev.vfio_dev_fd);
+	sw->vpdev.vfio_dev_fd = -1;
+	return 0;
+}
+
+static const struct virtio_ops virtio_sw_pf_ops = {
+	.read_dev_cfg   = virtio_sw_pf_read_dev_cfg,
+	.write_dev_cfg  = virtio_sw_pf_write_dev_cfg,
+	.get_status     = virtio_sw_pf_get_status,
+	.set_status     = virtio_sw_pf_set_status,
+	.get_features   = virtio_sw_pf_get_features,
+	.set_features   = virtio_sw_pf_set_features,
+	.features_ok    = virtio_sw_pf_features_ok,
+	.get_isr        = virtio_sw_pf_get_isr,
+	.set_config_irq = virtio_sw_pf_set_config_irq,
+	.set_queue_irq  = virtio_sw_pf_set_queue_irq,
+	.get_queue_num  = virtio_sw_pf_get_queue_num,
+	.get_queue_size = virtio_sw_pf_get_queue_size,
+	.setup_queue    = virtio_sw_pf_setup_queue,
+	.del_queue      = virtio_sw_pf_del_queue,
+	.notify_queue   = virtio_sw_pf_notify_queue,
+	.intr_detect    = virtio_sw_pf_intr_detect,
+	.dev_close      = virtio_sw_pf_dev_close,
+};
+
+static int
+virtio_sw_pf_addr_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	struct virtio_sw_pf_args *args = ret_val;
+
+	if (rte_pci_addr_parse(value, &args->addr))
+		return -EINVAL;
+	args->has_addr = true;
+	return 0;
+}
+
+static int
+virtio_sw_pf_u64_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(value, &end, 0);
+	if (errno || *end != '\0')
+		return -EINVAL;
+	*(uint64_t *)ret_val = v;
+
+	return 0;
+}
+
+static int
+virtio_sw_pf_args_parse(const char *str, struct virtio_sw_pf_args *args)
+{
+	struct rte_kvargs *kvlist;
+	uint64_t num_vfs = args->num_vfs, state_size = args->state_size;
+	int ret;
+
+	if (str == NULL || str[0] == '\0')
+		return 0;
+
+	kvlist = rte_kvargs_parse(str, NULL);
+	if (kvlist == NULL) {
+		DRV_LOG(ERR, "Error when parsing param");
+		return -EINVAL;
+	}
+
+	ret = rte_kvargs_process(kvlist, VIRTIO_SW_PF_ARG_ADDR,
+				 virtio_sw_pf_addr_handler, args);
+	if (!ret)
+		ret = rte_kvargs_process(kvlist, VIRTIO_SW_PF_ARG_NUM_VFS,
+					 virtio_sw_pf_u64_handler, &num_vfs);
+	if (!ret)
+		ret = rte_kvargs_process(kvlist, VIRTIO_SW_PF_ARG_STATE_SIZE,
+					 virtio_sw_pf_u64_handler, &state_size);
+	if (!ret)
+		ret = rte_kvargs_process(kvlist, VIRTIO_SW_PF_ARG_FEATURES,
+					 virtio_sw_pf_u64_handler, &args->features);
+	rte_kvargs_free(kvlist);
+
+	if (ret || !num_vfs || num_vfs > UINT16_MAX || !state_size ||
+	    state_size > VIRTIO_SW_PF_MAX_STATE_SIZE) {
+		DRV_LOG(ERR, "Invalid devargs %s", str);
+		return -EINVAL;
+	}
+	args->num_vfs = num_vfs;
+	args->state_size = state_size;
+	return 0;
+}
+
+struct virtio_pci_dev *
+virtio_sw_pf_create(const char *name, const char *str)
+{
+	struct virtio_sw_pf_args args = {
+		.num_vfs = VIRTIO_SW_PF_NUM_VFS,
+		.state_size = VIRTIO_SW_PF_STATE_SIZE,
+		.features = VIRTIO_SW_PF_FEATURES,
+	};
+	struct virtio_sw_pf *sw;
+	struct virtio_hw *hw;
+	uint16_t i, n;
+
+	if (virtio_sw_pf_args_parse(str, &args)) {
+		rte_errno = EINVAL;
+		return NULL;
+	}
+	if (!args.has_addr) {
+		/* Keep clear of real functions with the last PCI domain */
+		n = __atomic_fetch_add(&virtio_sw_pf_count, 1, __ATOMIC_RELAXED);
+		args.addr.domain = 0xffff;
+		args.addr.bus = 0xff;
+		args.addr.devid = n % 32;
+		args.addr.function = (n / 32) % 8;
+	}
+
+	sw = rte_zmalloc("virtio sw pf", sizeof(*sw), RTE_CACHE_LINE_SIZE);
+	if (sw == NULL) {
+		DRV_LOG(ERR, "Failed to allocate %s", name);
+		rte_errno = ENOMEM;
+		return NULL;
+	}
+
+	strlcpy(sw->name, name, sizeof(sw->name));
+	sw->pdev.device.name = sw->name;
+	sw->pdev.device.numa_node = SOCKET_ID_ANY;
+	sw->pdev.addr = args.addr;
+	sw->pdev.id.vendor_id = VIRTIO_PCI_VENDORID;
+	sw->pdev.id.device_id = VIRTIO_PCI_MODERN_DEVICEID_NET;
+	sw->net_cfg.max_virtqueue_pairs = 1;
+	sw->features = args.features | (1ULL << VIRTIO_F_VERSION_1) |
+			(1ULL << VIRTIO_F_ADMIN_VQ);
+	sw->state_size = args.state_size;
+	sw->num_vfs = args.num_vfs;
+	rte_spinlock_init(&sw->lock);
+
+	hw = &sw->vpdev.hw;
+	VTPCI_DEV(hw) = &sw->pdev;
+	VIRTIO_OPS(hw) = &virtio_sw_pf_ops;
+	sw->vpdev.modern = true;
+	sw->vpdev.dev_cfg = &sw->net_cfg;
+	/* Stands in for the VFIO device fd, which names the queue memzones */
+	sw->vpdev.vfio_dev_fd = eventfd(0, EFD_CLOEXEC);
+	if (sw->vpdev.vfio_dev_fd < 0) {
+		DRV_LOG(ERR, "%s failed to create device fd", name);
+		rte_errno = errno;
+		goto error;
+	}
+
+	sw->vfs = rte_zmalloc(NULL, sizeof(*sw->vfs) * sw->num_vfs, 0);
+	if (sw->vfs == NULL) {
+		rte_errno = ENOMEM;
+		goto error;
+	}
+	for (i = 0; i < sw->num_vfs; i++) {
+		sw->vfs[i].state = rte_malloc(NULL, sw->state_size, 0);
+		if (sw->vfs[i].state == NULL) {
+			DRV_LOG(ERR, "%s failed to allocate VF %u state", name, i + 1);
+			rte_errno = ENOMEM;
+			goto error;
+		}
+		sw->vfs[i].status = VIRTIO_S_RUNNING;
+		virtio_sw_pf_state_fill(sw, i + 1, sw->state_size);
+	}
+
+	/* Same steps as virtio_pci_dev_alloc() */
+	virtio_pci_dev_reset(&sw->vpdev);
+	virtio_pci_dev_set_status(&sw->vpdev, VIRTIO_CONFIG_STATUS_ACK);
+	virtio_pci_dev_set_status(&sw->vpdev, VIRTIO_CONFIG_STATUS_DRIVER);
+	sw->vpdev.device_features = sw->features;
+	hw->guest_features = sw->features;
+
+	DRV_LOG(INFO, "%s created as " PCI_PRI_FMT ", %u VFs, %u bytes state",
+			name, args.addr.domain, args.addr.bus, args.addr.devid,
+			args.addr.function, sw->num_vfs, sw->state_size);
+	return &sw->vpdev;
+
+error:
+	virtio_sw_pf_dev_close(hw);
+	rte_free(sw);
+	return NULL;
+}
+
+bool
+virtio_sw_pf_is_sw(struct virtio_pci_dev *vpdev)
+{
+	return VIRTIO_OPS(&vpdev->hw) == &virtio_sw_pf_ops;
+}
+
+int
+virtio_sw_pf_vf_run(struct virtio_pci_dev *vpdev, uint16_t vdev_id,
+		uint64_t state_bytes)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(&vpdev->hw);
+	struct virtio_sw_pf_vf *vf;
+
+	if (!virtio_sw_pf_is_sw(vpdev))
+		return -ENOTSUP;
+	vf = virtio_sw_pf_vf_get(sw, vdev_id);
+	if (!vf)
+		return -EINVAL;
+
+	rte_spinlock_lock(&sw->lock);
+	if (vf->status != VIRTIO_S_RUNNING) {
+		rte_spinlock_unlock(&sw->lock);
+		return -EBUSY;
+	}
+	vf->gen++;
+	virtio_sw_pf_state_fill(sw, vdev_id, RTE_MIN(state_bytes,
+			(uint64_t)sw->state_size));
+	rte_spinlock_unlock(&sw->lock);
+	return 0;
+}
+
+int
+virtio_sw_pf_vf_dirty(struct virtio_pci_dev *vpdev, uint16_t vdev_id,
+		uint64_t addr, uint64_t len)
+{
+	struct virtio_sw_pf *sw = virtio_sw_pf_get(&vpdev->hw);
+	struct virtio_sw_pf_range *range;
+	struct virtio_sw_pf_vf *vf;
+	uint64_t first, last, page;
+	uint16_t i;
+
+	if (!virtio_sw_pf_is_sw(vpdev))
+		return -ENOTSUP;
+	vf = virtio_sw_pf_vf_get(sw, vdev_id);
+	if (!vf || !len || addr + len < addr)
+		return -EINVAL;
+
+	rte_spinlock_lock(&sw->lock);
+	for (i = 0; i < vf->nr_ranges; i++) {
+		range = &vf->ranges[i];
+		if (addr >= range->addr + range->len ||
+		    addr + len <= range->addr)
+			continue;
+		first = (RTE_MAX(addr, range->addr) - range->addr) /
+				range->page_size;
+		last = (RTE_MIN(addr + len, range->addr + range->len) - 1 -
+				range->addr) / range->page_size;
+		for (page = first; page <= last; page++) {
+			range->nr_dirty += !range->map[page];
+			range->map[page] = 1;
+		}
+	}
+	rte_spinlock_unlock(&sw->lock);
+	return 0;
+}
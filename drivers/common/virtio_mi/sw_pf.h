@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#ifndef _VIRTIO_SW_PF_H_
+#define _VIRTIO_SW_PF_H_
+
+#include <stdint.h>
+
+#include <rte_compat.h>
+
+#include <virtio_pci.h>
+
+/*
+ * Software model of a virtio net PF with admin queues. It stands behind the
+ * same struct virtio_pci_dev the PCI transport fills, with its own virtio_ops:
+ * common config registers are plain fields, a queue notify runs the admin
+ * commands found on the ring inline, and each VF has a synthetic internal
+ * state and dirty page maps. Rings and buffers are dereferenced as VAs.
+ *
+ * Devargs, all optional:
+ *   addr=<PCI address> the BDF the PF is looked up with,
+ *   num_vfs=<n> managed VFs, vdev_id 1 to n,
+ *   state_size=<bytes> internal state of each VF,
+ *   features=<mask> features offered, VIRTIO_F_ADMIN_VQ is always set.
+ */
+#define VIRTIO_SW_PF_ARG_ADDR "addr"
+#define VIRTIO_SW_PF_ARG_NUM_VFS "num_vfs"
+#define VIRTIO_SW_PF_ARG_STATE_SIZE "state_size"
+#define VIRTIO_SW_PF_ARG_FEATURES "features"
+
+/* Exposed admin queues, the driver uses as many as it asks for */
+#define VIRTIO_SW_PF_NB_ADMIN_QUEUES 8
+
+/*
+ * Create the device, its pci_dev stands for the PCI function: name and
+ * addr are set, numa node is SOCKET_ID_ANY. virtio_pci_dev_free() destroys it.
+ */
+__rte_internal struct virtio_pci_dev *
+virtio_sw_pf_create(const char *name, const char *args);
+/* Whether vpdev comes from virtio_sw_pf_create() */
+bool
+virtio_sw_pf_is_sw(struct virtio_pci_dev *vpdev);
+/*
+ * VF activity: rewrite the first bytes of its internal state, the model
+ * keeps changed state at the front so a pending delta is always a prefix.
+ */
+int
+virtio_sw_pf_vf_run(struct virtio_pci_dev *vpdev, uint16_t vdev_id,
+		uint64_t state_bytes);
+/* VF DMA: mark [addr, addr + len) dirty in the ranges it overlaps */
+int
+virtio_sw_pf_vf_dirty(struct virtio_pci_dev *vpdev, uint16_t vdev_id,
+		uint64_t addr, uint64_t len);
+
+#endif /* _VIRTIO_SW_PF_H_ */
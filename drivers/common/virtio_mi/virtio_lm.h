@@ -5,12 +5,62 @@
 #ifndef _VIRTIO_LM_H_
 #define _VIRTIO_LM_H_
 
+#include <stdbool.h>
+#include <sys/uio.h>
+
 struct virtio_vdpa_pf_priv;
 
 struct virtio_vdpa_pf_info {
 	char pf_name[RTE_DEV_NAME_MAX_LEN];
 };
 
+struct virtio_vdpa_admin_sge {
+	rte_iova_t iova;
+	uint32_t len;
+};
+
+/*
+ * Admin command for the asynchronous submit API.
+ * data is copied into a per command DMA slot at submit time, result is
+ * copied back from it at completion time, so result must stay valid until
+ * the command completes. in_data/out_data describe extra device
+ * readable/writable buffers, they must stay valid until completion as well.
+ * Commands with per_vdev set are kept ordered with the other commands of
+ * the same vdev_id, others run on the admin queue of the calling lcore.
+ */
+struct virtio_vdpa_admin_cmd {
+	uint8_t class;
+	uint8_t cmd;
+	bool per_vdev;
+	uint16_t vdev_id;
+	uint16_t data_len;
+	const void *data;
+	uint16_t result_len;
+	void *result;
+	uint16_t num_in_data;
+	uint16_t num_out_data;
+	const struct virtio_vdpa_admin_sge *in_data;
+	const struct virtio_vdpa_admin_sge *out_data;
+};
+
+/*
+ * Completion callback, status is the admin status returned by the device
+ * (VIRTIO_ADMIN_STATUS_COMMON_OK on success).
+ * It is called from whichever thread reaps the admin queue, without the
+ * admin queue lock held.
+ */
+typedef void (*virtio_vdpa_admin_cmd_cb)(struct virtio_vdpa_pf_priv *priv,
+		int token, int status, void *cb_arg);
+
+__rte_internal int
+virtio_vdpa_admin_cmd_submit(struct virtio_vdpa_pf_priv *priv,
+		const struct virtio_vdpa_admin_cmd *cmd,
+		virtio_vdpa_admin_cmd_cb cb, void *cb_arg);
+__rte_internal int
+virtio_vdpa_admin_cmd_poll(struct virtio_vdpa_pf_priv *priv, uint16_t max);
+__rte_internal int
+virtio_vdpa_admin_cmd_wait(struct virtio_vdpa_pf_priv *priv, int token);
+
 __rte_internal int
 virtio_vdpa_cmd_identity(struct virtio_vdpa_pf_priv *priv,
 		struct virtio_admin_migration_identity_result *result);
@@ -60,6 +110,131 @@ virtio_vdpa_cmd_dirty_page_report_map(struct virtio_vdpa_pf_priv *priv,
 		uint64_t length,
 		uint64_t vdev_host_range_addr,
 		rte_iova_t data);
+/*
+ * Fold a device dirty bytemap, a byte per page, into the vhost log bitmap
+ * from page first_page on and clear the bytemap in the same pass.
+ * Returns the number of dirty pages.
+ */
+__rte_internal uint64_t
+virtio_vdpa_dirty_bytemap_merge(uint8_t *bytemap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page);
+/* Same for a device dirty bitmap, which is left as is */
+__rte_internal uint64_t
+virtio_vdpa_dirty_bitmap_merge(const uint64_t *bitmap, uint64_t nr_pages,
+		uint64_t *log, uint64_t first_page);
+enum virtio_vdpa_batch_op {
+	VIRTIO_VDPA_BATCH_SET_STATUS,
+	VIRTIO_VDPA_BATCH_SAVE_STATE,
+};
+
+/*
+ * One request of a batch, status is used by SET_STATUS, offset, length and
+ * out_data by SAVE_STATE. result is filled in as the single command
+ * helpers would return it.
+ */
+struct virtio_vdpa_batch_req {
+	enum virtio_vdpa_batch_op op;
+	uint16_t vdev_id;
+	enum virtio_internal_status status;
+	uint64_t offset;
+	uint64_t length;
+	rte_iova_t out_data;
+	int result;
+};
+
+/*
+ * Run nb_reqs requests for VFs of the same PF, posting as many as the
+ * admin queue holds behind one doorbell.
+ * Returns the number of failed requests, or a negative errno if the batch
+ * could not run at all.
+ */
+__rte_internal int
+virtio_vdpa_cmd_batch(struct virtio_vdpa_pf_priv *priv,
+		struct virtio_vdpa_batch_req *reqs, uint16_t nb_reqs);
+enum virtio_vdpa_state_stream_dir {
+	VIRTIO_VDPA_STATE_SAVE,
+	VIRTIO_VDPA_STATE_RESTORE,
+};
+
+struct virtio_vdpa_state_stream;
+
+struct virtio_vdpa_state_stream_stats {
+	uint64_t bytes; /* State bytes moved so far */
+	uint64_t pending_bytes; /* State bytes left, as announced by the device */
+	uint64_t elapsed_us;
+	uint64_t bytes_per_sec;
+};
+
+/*
+ * Device internal state is moved through a ring of nb_chunks IOVA
+ * contiguous chunk_size buffers. Chunks are handed out as iovecs that the
+ * migration transport reads or fills in place, and returned in order.
+ */
+__rte_internal struct virtio_vdpa_state_stream *
+virtio_vdpa_state_stream_create(struct virtio_vdpa_pf_priv *priv,
+		uint16_t vdev_id, enum virtio_vdpa_state_stream_dir dir,
+		uint32_t chunk_size, uint16_t nb_chunks);
+__rte_internal void
+virtio_vdpa_state_stream_destroy(struct virtio_vdpa_state_stream *st);
+/*
+ * Save the next state chunks, returns how many iovecs were filled, 0 once
+ * the device has no more pending bytes, -ENOBUFS when every chunk is
+ * still owned by the caller.
+ */
+__rte_internal int
+virtio_vdpa_state_stream_save(struct virtio_vdpa_state_stream *st,
+		struct iovec *iov, uint16_t max_iov);
+/* Give back the nb_iov oldest chunks returned by save or restore_get */
+__rte_internal void
+virtio_vdpa_state_stream_release(struct virtio_vdpa_state_stream *st,
+		uint16_t nb_iov);
+/* Get empty chunks to receive state into */
+__rte_internal int
+virtio_vdpa_state_stream_restore_get(struct virtio_vdpa_state_stream *st,
+		struct iovec *iov, uint16_t max_iov);
+/*
+ * Push the nb_iov oldest chunks from restore_get to the device, iov_len
+ * gives the bytes received in each and empty ones are skipped. Every chunk
+ * from restore_get is released on success, those past nb_iov unused.
+ */
+__rte_internal int
+virtio_vdpa_state_stream_restore_put(struct virtio_vdpa_state_stream *st,
+		const struct iovec *iov, uint16_t nb_iov);
+__rte_internal void
+virtio_vdpa_state_stream_stats_get(struct virtio_vdpa_state_stream *st,
+		struct virtio_vdpa_state_stream_stats *stats);
+
+/*
+ * Receives pre-copied state, last is set on the final piece of a delta.
+ * A non-zero return aborts the pre-copy.
+ */
+typedef int (*virtio_vdpa_state_sink_t)(const void *buf, size_t len,
+		bool last, void *arg);
+/*
+ * Save internal state deltas while the VF keeps running, until the device
+ * reports at most threshold pending bytes or max_rounds deltas were sent.
+ * Needs VIRTIO_F_ADMIN_MIGRATION_DYNAMIC_INTERNAL_STATE_TRACK. The caller
+ * then freezes the VF and saves what is left as usual.
+ * Returns the number of deltas sent, or a negative errno.
+ */
+__rte_internal int
+virtio_vdpa_state_precopy(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint64_t threshold, uint32_t max_rounds,
+		virtio_vdpa_state_sink_t sink, void *arg);
+
+/*
+ * Drive the VFs of a software PF, created with
+ * rte_vdev_init("vdpa_virtio_mi_sw<n>", ...), as a guest would: rewrite
+ * state_bytes of the VF internal state, or mark guest memory dirty in the
+ * ranges being tracked. -ENOTSUP on a real PF.
+ */
+__rte_internal int
+virtio_vdpa_sw_pf_vf_run(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint64_t state_bytes);
+__rte_internal int
+virtio_vdpa_sw_pf_vf_dirty(struct virtio_vdpa_pf_priv *priv, uint16_t vdev_id,
+		uint64_t addr, uint64_t len);
+
 struct virtio_vdpa_pf_priv *
 rte_vdpa_get_mi_by_bdf(const char *bdf);
 int
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (c) 2022 NVIDIA Corporation & Affiliates
+ */
+
+#ifndef _RTE_VDPA_VIRTIO_H_
+#define _RTE_VDPA_VIRTIO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rte_compat.h>
+
+/*
+ * Get the device state a VF saved when it was stopped for migration.
+ * len gives the size of buf and returns the state size. Returns -ENOENT
+ * if no state was saved, -ENOSPC if buf is too small.
+ */
+__rte_experimental
+int
+rte_vdpa_vf_dev_state_get(const char *vf_name, void *buf, size_t *len);
+/*
+ * Set the device state a VF restores before its next DRIVER_OK, a NULL
+ * buf drops it. Returns -EBUSY if the VF is already configured.
+ */
+__rte_experimental
+int
+rte_vdpa_vf_dev_state_set(const char *vf_name, const void *buf, size_t len);
+/*
+ * Queue one more piece of state behind those already set, pieces are
+ * restored in order. Used for the deltas sent by a source pre-copy,
+ * followed by the state it saved once stopped.
+ */
+__rte_experimental
+int
+rte_vdpa_vf_dev_state_append(const char *vf_name, const void *buf, size_t len);
+
+/*
+ * Receives pre-copied state, last is set on the final piece of a delta.
+ * A non-zero return aborts the pre-copy.
+ */
+typedef int (*rte_vdpa_vf_state_sink_t)(const void *buf, size_t len,
+		bool last, void *arg);
+/*
+ * Send device state deltas to sink while the VF keeps passing traffic,
+ * until at most threshold bytes are pending or max_rounds deltas were
+ * sent. Each delta is appended on the destination in order. Run it before
+ * the VF is stopped so the stop-copy only carries what is left.
+ * Returns the number of deltas sent, -ENOTSUP if the device does not
+ * track its internal state while running.
+ */
+__rte_experimental
+int
+rte_vdpa_vf_dev_state_precopy(const char *vf_name, uint64_t threshold,
+		uint32_t max_rounds, rte_vdpa_vf_state_sink_t sink, void *arg);
+
+/*
+ * Serve the VFs to a new instance of the application on a unix socket at
+ * path, for a restart that keeps their datapath running. The new instance
+ * probes the VFs with the handover=<path> devarg and takes each over with
+ * its VFIO fds, IOMMU mappings and queues. A VF handed over is only
+ * detached here from then on: closed or removed, it is neither reset nor
+ * unmapped. Serve while no migration runs, vhost-user messages for a VF
+ * must not race with its hand-over.
+ * Returns -EEXIST if already listening.
+ */
+__rte_experimental
+int
+rte_vdpa_vf_handover_listen(const char *path);
+/* Returns 1 once the VF is driven by the new instance, 0 before */
+__rte_experimental
+int
+rte_vdpa_vf_handed_over(const char *vf_name);
+
+#endif /* _RTE_VDPA_VIRTIO_H_ */
@@ -2,15 +2,29 @@
  * Copyright (c) 2022 NVIDIA Corporation & Affiliates
  */
 #include <unistd.h>
+#include <libgen.h>
 #include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <rte_alarm.h>
 #include <rte_malloc.h>
+#include <rte_memzone.h>
+#include <rte_service.h>
+#include <rte_service_component.h>
 #include <rte_vfio.h>
 #include <rte_vhost.h>
 #include <rte_vdpa.h>
 #include <vdpa_driver.h>
 #include <rte_kvargs.h>
+#include <rte_string_fns.h>
+#include <rte_telemetry.h>
 
 #include <virtio_api.h>
+#include <virtio_lm.h>
+
+#include "rte_vdpa_virtio.h"
 
 enum {
 	VIRTIO_VDPA_NOTIFIER_STATE_DISABLED,
@@ -18,6 +32,23 @@ enum {
 	VIRTIO_VDPA_NOTIFIER_STATE_ERR
 };
 
+/*
+ * Driver side counters of one virtq, latencies in microseconds. kicks and
+ * notifier_changes are bumped from the relay service lcores too, they are
+ * only accessed with relaxed atomics.
+ */
+struct virtio_vdpa_vq_stats {
+	uint64_t kicks; /* Guest kicks relayed to the doorbell */
+	uint64_t notifier_changes;
+	uint64_t intr_binds; /* MSI-X vector bound to the guest callfd */
+	uint64_t enables;
+	uint64_t disables;
+	uint64_t enable_last_us;
+	uint64_t enable_max_us;
+	uint64_t disable_last_us;
+	uint64_t disable_max_us;
+};
+
 struct virtio_vdpa_vring_info {
 	uint64_t desc;
 	uint64_t avail;
@@ -25,9 +56,144 @@ struct virtio_vdpa_vring_info {
 	uint16_t size;
 	uint16_t index;
 	uint8_t notifier_state;
+	bool notifier_pending; /* Host notifier enable posted to the alarm thread */
 	bool enable;
+	bool intr_bound; /* MSI-X vector bound to the guest callfd */
+	uint16_t avail_pos; /* Packed: next avail slot, wrap counter in bit 15 */
+	struct rte_vhost_vring ring; /* Host view of the rings */
 	struct rte_intr_handle *intr_handle;
+	struct virtio_vdpa_relay *relay; /* Set when kicks go through a relay */
+	int kickfd;
+	struct virtio_vdpa_vq_stats stats;
+	struct virtio_vdpa_priv *priv;
+};
+
+/*
+ * Polls the kickfds of many virtqs from a service lcore, so doorbells
+ * do not all funnel through the EAL interrupt thread.
+ */
+struct virtio_vdpa_relay {
+	int epfd;
+	uint32_t service_id;
+	uint32_t lcore_id;
+	uint32_t nr_fds; /* Kickfds relayed, new ones go to the least loaded */
+	uint64_t epoch; /* Bumped after each poll, lets removal wait it out */
+};
+
+#define VIRTIO_VDPA_RELAY_BURST 64
+
+/* vhost keeps a packed ring position with its wrap counter in bit 15 */
+#define VIRTIO_VDPA_PACKED_WRAP (1 << 15)
+#define VIRTIO_VDPA_PACKED_IDX_MASK (VIRTIO_VDPA_PACKED_WRAP - 1)
+
+/* One guest memory range the parent PF tracks writes of this VF to */
+struct virtio_vdpa_dirty_range {
+	uint64_t addr; /* Range start, guest physical address */
+	uint64_t len;
+	uint64_t cursor; /* Map offset the next window starts at */
+	const struct rte_memzone *mz; /* Map windows are pulled through it */
+};
+
+/* Syncs every nr_dirty_workers-th range, starting from range id */
+struct virtio_vdpa_dirty_worker {
 	struct virtio_vdpa_priv *priv;
+	pthread_t tid;
+	uint32_t id;
+};
+
+#define VIRTIO_VDPA_DIRTY_MAX_WORKERS 8
+
+/* One guest memory region, the index is sorted by host virtual address */
+struct virtio_vdpa_mem_region {
+	uint64_t hva;
+	uint64_t gpa;
+	uint64_t size;
+};
+
+/* One piece of a region to map, large regions are split across workers */
+struct virtio_vdpa_dma_chunk {
+	struct virtio_vdpa_mem_region reg;
+	uint32_t region; /* Index of the region in the table being mapped */
+	bool mapped;
+};
+
+/* Shared by the workers of one map */
+struct virtio_vdpa_dma_job {
+	struct virtio_vdpa_priv *priv;
+	struct virtio_vdpa_dma_chunk *chunks;
+	uint32_t nr_chunks;
+	uint32_t next; /* Next chunk to take */
+	uint64_t total; /* Bytes to map */
+	uint64_t done;
+	uint64_t *region_cycles; /* Spent on the chunks of each region */
+	int err;
+};
+
+struct virtio_vdpa_dma_stats {
+	uint64_t mapped_bytes; /* In the IOMMU now */
+	uint64_t last_map_bytes; /* New to the last map */
+	uint64_t last_map_us;
+	uint64_t slowest_region_us;
+	uint64_t progress_bytes; /* Of the map running or last run */
+	uint64_t progress_total;
+	uint32_t last_map_regions;
+	uint32_t last_unmap_regions;
+};
+
+#define VIRTIO_VDPA_DMA_MAX_WORKERS 16
+#define VIRTIO_VDPA_DMA_CHUNK_SZ (1ULL << 30)
+
+/*
+ * Hand-over of a VF to a new instance, over a unix socket: the new one
+ * asks for a VF by name, the running one answers with a header carrying
+ * the VFIO container, group and device fds, then the rings and IOMMU
+ * mappings of the VF, and gives the VF up once the new one acknowledges.
+ */
+#define VIRTIO_VDPA_HANDOVER_VERSION 1
+#define VIRTIO_VDPA_HANDOVER_TIMEOUT_SEC 5
+#define VIRTIO_VDPA_HANDOVER_MAX_ENTRIES 1024
+#define VIRTIO_VDPA_HANDOVER_PATH_LEN \
+	sizeof(((struct sockaddr_un *)NULL)->sun_path)
+
+enum {
+	VIRTIO_VDPA_HANDOVER_FD_CONTAINER,
+	VIRTIO_VDPA_HANDOVER_FD_GROUP,
+	VIRTIO_VDPA_HANDOVER_FD_DEVICE,
+	VIRTIO_VDPA_HANDOVER_NB_FDS,
+};
+
+struct virtio_vdpa_handover_req {
+	uint32_t version;
+	char name[RTE_DEV_NAME_MAX_LEN];
+};
+
+struct virtio_vdpa_handover_hdr {
+	uint32_t version;
+	int32_t result; /* Negative errno, then neither fds nor body follow */
+	uint64_t guest_features;
+	uint8_t running; /* Configured, its queues pass traffic */
+	uint16_t nr_vrings; /* Body: the vrings, then the DMA regions */
+	uint32_t nr_dma_regions;
+};
+
+/* A vring as programmed in the device */
+struct virtio_vdpa_handover_vring {
+	uint64_t desc;
+	uint64_t avail;
+	uint64_t used;
+	uint16_t size;
+	uint8_t enable;
+};
+
+struct virtio_vdpa_devargs {
+	int vdpa;
+	enum virtio_dirty_track_mode dirty_mode;
+	bool doorbell_relay;
+	uint16_t dma_workers;
+	bool dma_prepin;
+	bool async_probe;
+	bool lazy_alloc;
+	char handover[VIRTIO_VDPA_HANDOVER_PATH_LEN];
 };
 
 #define VIRTIO_VDPA_DRIVER_NAME vdpa_virtio
@@ -37,14 +203,16 @@ struct virtio_vdpa_vring_info {
 				 (1ULL << VHOST_USER_PROTOCOL_F_HOST_NOTIFIER) | \
 				 (1ULL << VHOST_USER_PROTOCOL_F_STATUS) | \
 				 (1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+				 (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD) | \
 				 (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))
-/*				   (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD) | \
- *				 (1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+/*				 (1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
  *				 (1ULL << VHOST_USER_PROTOCOL_F_NET_MTU) | \
  *				 (1ULL << VHOST_USER_PROTOCOL_F_STATUS))
  */
 struct virtio_vdpa_priv {
 	TAILQ_ENTRY(virtio_vdpa_priv) next;
+	TAILQ_ENTRY(virtio_vdpa_priv) probe_next; /* Queued to probe workers */
+	int probe_state;
 	struct rte_pci_device *pdev;
 	struct rte_vdpa_device *vdev;
 	struct virtio_pci_dev *vpdev;
@@ -58,11 +226,73 @@ struct virtio_vdpa_priv {
 	uint16_t nr_virtqs;   /* Number of vq vhost enabled */
 	uint16_t hw_nr_virtqs; /* Number of vq device supported */
 	bool configured;
+	bool lazy_alloc; /* Queues and MSI-X allocated on first vhost use */
+	bool res_allocated;
+	bool doorbell_relay; /* Relay kicks from service lcores */
+	struct virtio_vdpa_mem_region *mem_regions; /* Cached guest memory */
+	uint32_t nr_mem_regions;
+	struct virtio_vdpa_mem_region *dma_regions; /* Mapped in the IOMMU */
+	uint32_t nr_dma_regions;
+	uint16_t dma_workers; /* Map chunks in parallel when more than one */
+	bool dma_prepin; /* Map from the first vring enable, not DRIVER_OK */
+	bool prepin_running;
+	pthread_t prepin_tid;
+	struct virtio_vdpa_mem_region *prepin_regions;
+	uint32_t nr_prepin_regions;
+	struct virtio_vdpa_dma_stats dma_stats;
+	char pf_name[RTE_DEV_NAME_MAX_LEN]; /* Parent PF, empty if not a VF */
+	uint16_t vf_id; /* Admin command member id on the parent PF */
+	struct virtio_vdpa_pf_priv *pf_priv;
+	enum virtio_dirty_track_mode dirty_map_mode; /* Preferred, from devargs */
+	enum virtio_dirty_track_mode dirty_mode; /* In use while tracking */
+	struct virtio_vdpa_dirty_range *dirty_ranges;
+	uint32_t nr_dirty_ranges;
+	struct virtio_vdpa_dirty_worker dirty_workers[VIRTIO_VDPA_DIRTY_MAX_WORKERS];
+	uint32_t nr_dirty_workers;
+	bool dirty_tracking;
+	void *state; /* Device state saved on stop or to restore on config */
+	size_t state_len;
+	size_t *state_segs; /* Lengths of the pieces restored one by one */
+	uint16_t nr_state_segs;
+	bool reset_quiesced; /* Closed quiesced, runs again at config */
+	char handover_path[VIRTIO_VDPA_HANDOVER_PATH_LEN]; /* To adopt from */
+	bool vfio_adopted; /* VFIO fds handed over, unknown to EAL */
+	bool adopted; /* Runs as handed over until configured */
+	bool handed_over; /* Driven by a new instance now */
+	struct virtio_vdpa_handover_vring *handover_vrings;
+	uint16_t nr_handover_vrings;
+	struct virtio_vdpa_mem_region *handover_dma; /* Known by GPA only */
+	uint32_t nr_handover_dma;
 };
 
 #define VIRTIO_VDPA_INTR_RETRIES_USEC 1000
 #define VIRTIO_VDPA_INTR_RETRIES 256
 
+#define VIRTIO_VDPA_DIRTY_PAGE_SIZE 4096 /* vhost log granularity */
+#define VIRTIO_VDPA_DIRTY_SYNC_USEC 100000U /* Initial, adapts to dirty rate */
+#define VIRTIO_VDPA_DIRTY_SYNC_MIN_USEC 10000U
+#define VIRTIO_VDPA_DIRTY_SYNC_MAX_USEC 1000000U
+#define VIRTIO_VDPA_DIRTY_MAP_SZ (1ULL << 20)
+
+#define VIRTIO_VDPA_STATE_CHUNK_SZ (64 * 1024)
+#define VIRTIO_VDPA_STATE_NB_CHUNKS 4
+
+#define VIRTIO_VDPA_ARG_DIRTY_MAP "dirty_map"
+#define VIRTIO_VDPA_ARG_DOORBELL_RELAY "doorbell_relay"
+#define VIRTIO_VDPA_ARG_DMA_WORKERS "dma_workers"
+#define VIRTIO_VDPA_ARG_DMA_PREPIN "dma_prepin"
+#define VIRTIO_VDPA_ARG_ASYNC_PROBE "async_probe"
+#define VIRTIO_VDPA_ARG_LAZY_ALLOC "lazy_alloc"
+#define VIRTIO_VDPA_ARG_HANDOVER "handover"
+
+#define VIRTIO_VDPA_PROBE_MAX_WORKERS 32
+
+enum {
+	VIRTIO_VDPA_PROBE_DONE,
+	VIRTIO_VDPA_PROBE_PENDING,
+	VIRTIO_VDPA_PROBE_FAILED,
+};
+
 RTE_LOG_REGISTER(virtio_vdpa_logtype, pmd.vdpa.virtio, NOTICE);
 #define DRV_LOG(level, fmt, args...) \
 	rte_log(RTE_LOG_ ## level, virtio_vdpa_logtype, \
@@ -72,6 +302,34 @@ static TAILQ_HEAD(virtio_vdpa_privs, virtio_vdpa_priv) virtio_priv_list =
 						  TAILQ_HEAD_INITIALIZER(virtio_priv_list);
 static pthread_mutex_t priv_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Devices probed with async_probe are registered right away and the rest
+ * of their init runs on probe workers, which exit once no job is left.
+ */
+static TAILQ_HEAD(, virtio_vdpa_priv) virtio_probe_jobs =
+						  TAILQ_HEAD_INITIALIZER(virtio_probe_jobs);
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t nr_probe_workers;
+
+/* Returns once the device init is over, 0 if it succeeded */
+static int
+virtio_vdpa_probe_wait(struct virtio_vdpa_priv *priv)
+{
+	int state;
+
+	if (__atomic_load_n(&priv->probe_state, __ATOMIC_ACQUIRE) ==
+			VIRTIO_VDPA_PROBE_DONE)
+		return 0;
+
+	pthread_mutex_lock(&probe_lock);
+	while (priv->probe_state == VIRTIO_VDPA_PROBE_PENDING)
+		pthread_cond_wait(&probe_cond, &probe_lock);
+	state = priv->probe_state;
+	pthread_mutex_unlock(&probe_lock);
+	return state == VIRTIO_VDPA_PROBE_DONE ? 0 : -ENODEV;
+}
+
 static struct virtio_vdpa_priv *
 virtio_vdpa_find_priv_resource_by_vdev(const struct rte_vdpa_device *vdev)
 {
@@ -86,7 +344,7 @@ virtio_vdpa_find_priv_resource_by_vdev(const struct rte_vdpa_device *vdev)
 		}
 	}
 	pthread_mutex_unlock(&priv_list_lock);
-	if (!found) {
+	if (!found || virtio_vdpa_probe_wait(priv)) {
 		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
 		rte_errno = ENODEV;
 		return NULL;
@@ -94,6 +352,132 @@ virtio_vdpa_find_priv_resource_by_vdev(const struct rte_vdpa_device *vdev)
 	return priv;
 }
 
+/*
+ * Runs on the EAL alarm thread. Setting up the host notifier is a blocking
+ * vhost-user request, a relay lcore posts it here rather than stall every
+ * other virtq it polls.
+ */
+static void
+virtio_vdpa_notifier_enable(void *arg)
+{
+	struct virtio_vdpa_vring_info *virtq = arg;
+	struct virtio_vdpa_priv *priv = virtq->priv;
+	uint8_t state;
+
+	__atomic_store_n(&virtq->notifier_pending, false, __ATOMIC_RELEASE);
+	if (!priv->configured || !virtq->enable ||
+	    __atomic_load_n(&virtq->notifier_state, __ATOMIC_ACQUIRE) !=
+	    VIRTIO_VDPA_NOTIFIER_STATE_DISABLED)
+		return;
+
+	__atomic_fetch_add(&virtq->stats.notifier_changes, 1, __ATOMIC_RELAXED);
+	if (rte_vhost_host_notifier_ctrl(priv->vid, virtq->index, true)) {
+		DRV_LOG(ERR,  "%s failed to set notify ctrl virtq %d: %s",
+				priv->vdev->device->name, virtq->index, strerror(errno));
+		state = VIRTIO_VDPA_NOTIFIER_STATE_ERR;
+	} else
+		state = VIRTIO_VDPA_NOTIFIER_STATE_ENABLED;
+	__atomic_store_n(&virtq->notifier_state, state, __ATOMIC_RELEASE);
+	DRV_LOG(INFO, "%s virtq %u notifier state is %s",
+					priv->vdev->device->name,
+					virtq->index,
+					state == VIRTIO_VDPA_NOTIFIER_STATE_ENABLED ?
+					"enabled" : "disabled");
+}
+
+static void
+virtio_vdpa_queues_free(struct virtio_vdpa_priv *priv)
+{
+	uint16_t nr_vq = priv->hw_nr_virtqs;
+	struct virtio_vdpa_vring_info *vr;
+	uint16_t i;
+
+	if (priv->vrings) {
+		for (i = 0; i < nr_vq; i++) {
+			vr = priv->vrings[i];
+			if (!vr)
+				continue;
+			rte_eal_alarm_cancel(virtio_vdpa_notifier_enable, vr);
+			rte_free(vr);
+			priv->vrings[i] = NULL;
+		}
+		rte_free(priv->vrings);
+		priv->vrings = NULL;
+	}
+
+	virtio_pci_dev_queues_free(priv->vpdev, nr_vq);
+}
+
+static int
+virtio_vdpa_queues_alloc(struct virtio_vdpa_priv *priv)
+{
+	uint16_t nr_vq = priv->hw_nr_virtqs;
+	struct virtio_vdpa_vring_info *vr;
+	uint16_t i;
+	int ret;
+
+	ret = virtio_pci_dev_queues_alloc(priv->vpdev, nr_vq);
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to alloc virtio device queues",
+					priv->vdev->device->name);
+		return ret;
+	}
+
+	priv->vrings = rte_zmalloc(NULL,
+							sizeof(struct virtio_vdpa_vring_info *) * nr_vq,
+							0);
+	if (!priv->vrings) {
+		virtio_vdpa_queues_free(priv);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_vq; i++) {
+		vr = rte_zmalloc_socket(NULL, sizeof(struct virtio_vdpa_vring_info),
+								RTE_CACHE_LINE_SIZE,
+								priv->pdev->device.numa_node);
+		if (vr == NULL) {
+			virtio_vdpa_queues_free(priv);
+			return -ENOMEM;
+		}
+		priv->vrings[i] = vr;
+		priv->vrings[i]->index = i;
+		priv->vrings[i]->priv = priv;
+		priv->vrings[i]->kickfd = -1;
+	}
+	return 0;
+}
+
+/* Queues and MSI-X vectors, from probe or on first vhost use if lazy */
+static int
+virtio_vdpa_dev_res_alloc(struct virtio_vdpa_priv *priv)
+{
+	const char *devname = priv->pdev->device.name;
+	int ret;
+
+	if (priv->res_allocated)
+		return 0;
+
+	ret = virtio_vdpa_queues_alloc(priv);
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to alloc vDPA device queues ret:%d",
+					devname, ret);
+		return ret;
+	}
+
+	/* An adopted device keeps its MSI-X, vectors are bound at config */
+	ret = priv->adopted ? 0 :
+		virtio_pci_dev_interrupts_alloc(priv->vpdev, priv->nvec);
+	if (ret) {
+		DRV_LOG(ERR, "%s error alloc virtio dev interrupts ret:%d %s",
+					devname, ret, strerror(errno));
+		virtio_vdpa_queues_free(priv);
+		return -EINVAL;
+	}
+
+	priv->res_allocated = true;
+	return 0;
+}
+
 static int
 virtio_vdpa_vqs_max_get(struct rte_vdpa_device *vdev, uint32_t *queue_num)
 {
@@ -123,6 +507,9 @@ virtio_vdpa_features_get(struct rte_vdpa_device *vdev, uint64_t *features)
 
 	virtio_pci_dev_features_get(priv->vpdev, features);
 	*features |= (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+	/* Dirty pages are tracked by the parent PF */
+	if (priv->pf_name[0])
+		*features |= (1ULL << VHOST_F_LOG_ALL);
 
 	return 0;
 }
@@ -142,33 +529,200 @@ virtio_vdpa_protocol_features_get(struct rte_vdpa_device *vdev,
 	return 0;
 }
 
-static uint64_t
-virtio_vdpa_hva_to_gpa(int vid, uint64_t hva)
+static void
+virtio_vdpa_mem_index_free(struct virtio_vdpa_priv *priv)
 {
+	rte_free(priv->mem_regions);
+	priv->mem_regions = NULL;
+	priv->nr_mem_regions = 0;
+}
+
+static int
+virtio_vdpa_mem_region_cmp(const void *a, const void *b)
+{
+	const struct virtio_vdpa_mem_region *ra = a, *rb = b;
+
+	return ra->hva < rb->hva ? -1 : ra->hva > rb->hva;
+}
+
+/* Copy the vhost memory table into an array sorted by host address */
+static int
+virtio_vdpa_mem_table_get(struct virtio_vdpa_priv *priv,
+		struct virtio_vdpa_mem_region **out, uint32_t *nr)
+{
+	struct virtio_vdpa_mem_region *regions;
 	struct rte_vhost_memory *mem = NULL;
-	struct rte_vhost_mem_region *reg;
 	uint32_t i;
-	uint64_t gpa = 0;
+	int ret;
 
-	if (rte_vhost_get_mem_table(vid, &mem) < 0) {
-		if (mem)
-			free(mem);
-		DRV_LOG(ERR, "Virtio dev %d get mem table fail", vid);
-		return 0;
+	ret = rte_vhost_get_mem_table(priv->vid, &mem);
+	if (ret < 0) {
+		DRV_LOG(ERR, "%s failed to get VM memory layout ret:%d",
+					priv->vdev->device->name, ret);
+		free(mem);
+		return ret;
 	}
 
+	regions = rte_malloc(NULL, sizeof(*regions) * RTE_MAX(mem->nregions, 1U), 0);
+	if (!regions) {
+		free(mem);
+		return -ENOMEM;
+	}
 	for (i = 0; i < mem->nregions; i++) {
-		reg = &mem->regions[i];
+		regions[i].hva = mem->regions[i].host_user_addr;
+		regions[i].gpa = mem->regions[i].guest_phys_addr;
+		regions[i].size = mem->regions[i].size;
+	}
+	qsort(regions, mem->nregions, sizeof(*regions),
+			virtio_vdpa_mem_region_cmp);
+
+	*out = regions;
+	*nr = mem->nregions;
+	free(mem);
+	return 0;
+}
+
+/*
+ * Keep one sorted copy of the vhost memory table, so vring programming
+ * and dirty tracking don't copy it again for every lookup. It is dropped
+ * when the device is closed, the memory table only changes behind a
+ * configured device after a close.
+ */
+static int
+virtio_vdpa_mem_index_build(struct virtio_vdpa_priv *priv)
+{
+	struct virtio_vdpa_mem_region *regions;
+	uint32_t nr;
+	int ret;
+
+	ret = virtio_vdpa_mem_table_get(priv, &regions, &nr);
+	if (ret)
+		return ret;
 
-		if (hva >= reg->host_user_addr &&
-				hva < reg->host_user_addr + reg->size) {
-			gpa = hva - reg->host_user_addr + reg->guest_phys_addr;
+	virtio_vdpa_mem_index_free(priv);
+	priv->mem_regions = regions;
+	priv->nr_mem_regions = nr;
+	return 0;
+}
+
+static const struct virtio_vdpa_mem_region *
+virtio_vdpa_mem_region_find(const struct virtio_vdpa_mem_region *regions,
+		uint32_t nr, uint64_t hva)
+{
+	const struct virtio_vdpa_mem_region *reg;
+	uint32_t lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		reg = &regions[mid];
+		if (hva < reg->hva)
+			hi = mid;
+		else if (hva - reg->hva >= reg->size)
+			lo = mid + 1;
+		else
+			return reg;
+	}
+	return NULL;
+}
+
+static const struct virtio_vdpa_mem_region *
+virtio_vdpa_mem_index_find(struct virtio_vdpa_priv *priv, uint64_t hva)
+{
+	return virtio_vdpa_mem_region_find(priv->mem_regions,
+			priv->nr_mem_regions, hva);
+}
+
+/* Whether regions holds exactly reg, same addresses and size */
+static bool
+virtio_vdpa_mem_region_has(const struct virtio_vdpa_mem_region *regions,
+		uint32_t nr, const struct virtio_vdpa_mem_region *reg)
+{
+	const struct virtio_vdpa_mem_region *r;
+
+	r = virtio_vdpa_mem_region_find(regions, nr, reg->hva);
+	return r && r->hva == reg->hva && r->gpa == reg->gpa &&
+		r->size == reg->size;
+}
+
+static uint64_t
+virtio_vdpa_hva_to_gpa(struct virtio_vdpa_priv *priv, uint64_t hva)
+{
+	const struct virtio_vdpa_mem_region *reg = NULL;
+
+	if (priv->mem_regions)
+		reg = virtio_vdpa_mem_index_find(priv, hva);
+	/* A miss may come from a table set after the index was built */
+	if (!reg) {
+		if (virtio_vdpa_mem_index_build(priv))
+			return 0;
+		reg = virtio_vdpa_mem_index_find(priv, hva);
+		if (!reg)
+			return 0;
+	}
+	return hva - reg->hva + reg->gpa;
+}
+
+/*
+ * Walk a packed ring from a known position over the slots the driver has
+ * made available in the current lap. The device only flips the used bit,
+ * so slots it already consumed are passed over as well.
+ */
+static uint16_t
+virtio_vdpa_packed_avail_pos(const struct rte_vhost_vring *vq, uint16_t pos)
+{
+	uint16_t idx = pos & VIRTIO_VDPA_PACKED_IDX_MASK;
+	bool wrap = !!(pos & VIRTIO_VDPA_PACKED_WRAP);
+	uint16_t flags;
+	uint32_t n;
+
+	for (n = 0; n < vq->size; n++) {
+		flags = __atomic_load_n(&vq->desc_packed[idx].flags,
+				__ATOMIC_ACQUIRE);
+		if (!!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) != wrap)
 			break;
+		if (++idx >= vq->size) {
+			idx = 0;
+			wrap = !wrap;
 		}
 	}
+	return idx | (wrap ? VIRTIO_VDPA_PACKED_WRAP : 0);
+}
 
-	free(mem);
-	return gpa;
+/* Ring the device doorbell for a guest kick */
+static void
+virtio_vdpa_virtq_kick(struct virtio_vdpa_vring_info *virtq)
+{
+	struct virtio_vdpa_priv *priv = virtq->priv;
+
+	/* A relayed kick carries no data, tell the device where the driver is */
+	if (priv->guest_features & (1ULL << VIRTIO_F_NOTIFICATION_DATA)) {
+		if (priv->guest_features & (1ULL << VIRTIO_F_RING_PACKED)) {
+			virtq->avail_pos = virtio_vdpa_packed_avail_pos(&virtq->ring,
+					virtq->avail_pos);
+			virtio_pci_dev_queue_avail_set(priv->vpdev, virtq->index,
+					virtq->avail_pos & VIRTIO_VDPA_PACKED_IDX_MASK,
+					!!(virtq->avail_pos & VIRTIO_VDPA_PACKED_WRAP));
+		} else {
+			virtio_pci_dev_queue_avail_set(priv->vpdev, virtq->index,
+					__atomic_load_n(&virtq->ring.avail->idx,
+						__ATOMIC_ACQUIRE), false);
+		}
+	}
+	virtio_pci_dev_queue_notify(priv->vpdev, virtq->index);
+	__atomic_fetch_add(&virtq->stats.kicks, 1, __ATOMIC_RELAXED);
+	/* One enable in flight per virtq, later kicks until then just ring */
+	if (__atomic_load_n(&virtq->notifier_state, __ATOMIC_ACQUIRE) ==
+	    VIRTIO_VDPA_NOTIFIER_STATE_DISABLED &&
+	    !__atomic_exchange_n(&virtq->notifier_pending, true,
+				 __ATOMIC_ACQ_REL) &&
+	    rte_eal_alarm_set(1, virtio_vdpa_notifier_enable, virtq)) {
+		DRV_LOG(ERR, "%s virtq %u failed to post notifier enable",
+				priv->vdev->device->name, virtq->index);
+		__atomic_store_n(&virtq->notifier_pending, false,
+				 __ATOMIC_RELEASE);
+	}
+	DRV_LOG(DEBUG, "%s ring virtq %u doorbell",
+					priv->vdev->device->name, virtq->index);
 }
 
 static void
@@ -197,40 +751,195 @@ virtio_vdpa_virtq_handler(void *cb_arg)
 		}
 		break;
 	} while (1);
-	virtio_pci_dev_queue_notify(priv->vpdev, virtq->index);
-	if (virtq->notifier_state == VIRTIO_VDPA_NOTIFIER_STATE_DISABLED) {
-		if (rte_vhost_host_notifier_ctrl(priv->vid, virtq->index, true)) {
-			DRV_LOG(ERR,  "%s failed to set notify ctrl virtq %d: %s",
-					priv->vdev->device->name, virtq->index, strerror(errno));
-			virtq->notifier_state = VIRTIO_VDPA_NOTIFIER_STATE_ERR;
-		} else
-			virtq->notifier_state = VIRTIO_VDPA_NOTIFIER_STATE_ENABLED;
-		DRV_LOG(INFO, "%s virtq %u notifier state is %s",
-						priv->vdev->device->name,
-						virtq->index,
-						virtq->notifier_state ==
-						VIRTIO_VDPA_NOTIFIER_STATE_ENABLED ? "enabled" :
-									"disabled");
+	virtio_vdpa_virtq_kick(virtq);
+}
+
+static struct virtio_vdpa_relay virtio_vdpa_relays[RTE_MAX_LCORE];
+static uint32_t virtio_vdpa_nr_relays;
+static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int32_t
+virtio_vdpa_relay_run(void *arg)
+{
+	struct epoll_event evs[VIRTIO_VDPA_RELAY_BURST];
+	struct virtio_vdpa_relay *relay = arg;
+	struct virtio_vdpa_vring_info *virtq;
+	uint64_t buf;
+	int i, n;
+
+	n = epoll_wait(relay->epfd, evs, RTE_DIM(evs), 0);
+	/*
+	 * Drain all ready kickfds before ringing doorbells. One eventfd read
+	 * folds every kick since the last poll into a single MMIO write.
+	 */
+	for (i = 0; i < n; i++) {
+		virtq = evs[i].data.ptr;
+		if (read(virtq->kickfd, &buf, sizeof(buf)) != sizeof(buf))
+			evs[i].data.ptr = NULL;
 	}
-	DRV_LOG(DEBUG, "%s ring virtq %u doorbell",
-					priv->vdev->device->name, virtq->index);
+	for (i = 0; i < n; i++) {
+		virtq = evs[i].data.ptr;
+		if (virtq && virtq->priv->configured && virtq->enable)
+			virtio_vdpa_virtq_kick(virtq);
+	}
+	__atomic_fetch_add(&relay->epoch, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void
+virtio_vdpa_relay_release(struct virtio_vdpa_relay *relay)
+{
+	rte_service_runstate_set(relay->service_id, 0);
+	rte_service_component_runstate_set(relay->service_id, 0);
+	rte_service_map_lcore_set(relay->service_id, relay->lcore_id, 0);
+	rte_service_component_unregister(relay->service_id);
+	close(relay->epfd);
 }
 
+/* One relay per service lcore, kept until the process exits */
 static int
-virtio_vdpa_virtq_doorbell_relay_disable(struct virtio_vdpa_priv *priv,
-														int vq_idx)
+virtio_vdpa_relays_init(void)
 {
-	int ret = -EAGAIN;
-	struct rte_intr_handle *intr_handle;
-	int retries = VIRTIO_VDPA_INTR_RETRIES;
+	uint32_t lcores[RTE_MAX_LCORE];
+	struct virtio_vdpa_relay *relay;
+	struct rte_service_spec spec;
+	int nr, i, ret = 0;
+
+	nr = rte_service_lcore_list(lcores, RTE_DIM(lcores));
+	if (nr <= 0) {
+		DRV_LOG(ERR, "No service lcore to relay doorbells on");
+		return -ENODEV;
+	}
 
-	intr_handle = priv->vrings[vq_idx]->intr_handle;
-	if (rte_intr_fd_get(intr_handle) != -1) {
-		while (retries-- && ret == -EAGAIN) {
-			ret = rte_intr_callback_unregister(intr_handle,
-							virtio_vdpa_virtq_handler,
-							priv->vrings[vq_idx]);
-			if (ret == -EAGAIN) {
+	for (i = 0; i < nr; i++) {
+		relay = &virtio_vdpa_relays[i];
+		relay->lcore_id = lcores[i];
+		relay->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (relay->epfd < 0) {
+			ret = -errno;
+			break;
+		}
+		memset(&spec, 0, sizeof(spec));
+		snprintf(spec.name, sizeof(spec.name), "vdpa_virtio_relay%u",
+				lcores[i]);
+		spec.callback = virtio_vdpa_relay_run;
+		spec.callback_userdata = relay;
+		spec.socket_id = rte_lcore_to_socket_id(lcores[i]);
+		ret = rte_service_component_register(&spec, &relay->service_id);
+		if (ret) {
+			close(relay->epfd);
+			break;
+		}
+		virtio_vdpa_nr_relays++;
+		rte_service_component_runstate_set(relay->service_id, 1);
+		rte_service_runstate_set(relay->service_id, 1);
+		ret = rte_service_map_lcore_set(relay->service_id, lcores[i], 1);
+		if (ret)
+			break;
+		ret = rte_service_lcore_start(lcores[i]);
+		if (ret == -EALREADY)
+			ret = 0;
+		if (ret)
+			break;
+		DRV_LOG(INFO, "Doorbell relay on service lcore %u", lcores[i]);
+	}
+
+	if (ret) {
+		DRV_LOG(ERR, "Failed to set up doorbell relay on lcore %u ret:%d",
+					lcores[i], ret);
+		while (virtio_vdpa_nr_relays)
+			virtio_vdpa_relay_release(
+				&virtio_vdpa_relays[--virtio_vdpa_nr_relays]);
+	}
+	return ret;
+}
+
+static int
+virtio_vdpa_relay_attach(struct virtio_vdpa_vring_info *virtq, int kickfd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = virtq,
+	};
+	struct virtio_vdpa_relay *relay;
+	uint32_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&relay_lock);
+	if (!virtio_vdpa_nr_relays)
+		ret = virtio_vdpa_relays_init();
+	if (ret)
+		goto out;
+
+	relay = &virtio_vdpa_relays[0];
+	for (i = 1; i < virtio_vdpa_nr_relays; i++)
+		if (virtio_vdpa_relays[i].nr_fds < relay->nr_fds)
+			relay = &virtio_vdpa_relays[i];
+
+	virtq->kickfd = kickfd;
+	if (epoll_ctl(relay->epfd, EPOLL_CTL_ADD, kickfd, &ev)) {
+		ret = -errno;
+		goto out;
+	}
+	relay->nr_fds++;
+	virtq->relay = relay;
+out:
+	pthread_mutex_unlock(&relay_lock);
+	return ret;
+}
+
+static void
+virtio_vdpa_relay_detach(struct virtio_vdpa_vring_info *virtq)
+{
+	struct virtio_vdpa_relay *relay = virtq->relay;
+	uint64_t epoch, waits = 0;
+
+	pthread_mutex_lock(&relay_lock);
+	if (epoll_ctl(relay->epfd, EPOLL_CTL_DEL, virtq->kickfd, NULL))
+		DRV_LOG(DEBUG, "%s virtq %u kickfd %d already gone from relay",
+				virtq->priv->vdev->device->name, virtq->index,
+				virtq->kickfd);
+	relay->nr_fds--;
+	pthread_mutex_unlock(&relay_lock);
+
+	/*
+	 * A poll in flight may still hold the virtq and kick it, it can not
+	 * be let go before that poll completes or the service stops.
+	 */
+	epoch = __atomic_load_n(&relay->epoch, __ATOMIC_ACQUIRE);
+	while (rte_service_may_be_active(relay->service_id) == 1 &&
+	       __atomic_load_n(&relay->epoch, __ATOMIC_ACQUIRE) == epoch) {
+		if (++waits == VIRTIO_VDPA_INTR_RETRIES)
+			DRV_LOG(WARNING, "%s virtq %u waits for relay lcore %u",
+					virtq->priv->vdev->device->name,
+					virtq->index, relay->lcore_id);
+		usleep(VIRTIO_VDPA_INTR_RETRIES_USEC);
+	}
+
+	virtq->relay = NULL;
+	virtq->kickfd = -1;
+}
+
+static int
+virtio_vdpa_virtq_doorbell_relay_disable(struct virtio_vdpa_priv *priv,
+														int vq_idx)
+{
+	int ret = -EAGAIN;
+	struct rte_intr_handle *intr_handle;
+	int retries = VIRTIO_VDPA_INTR_RETRIES;
+
+	if (priv->vrings[vq_idx]->relay) {
+		virtio_vdpa_relay_detach(priv->vrings[vq_idx]);
+		return 0;
+	}
+
+	intr_handle = priv->vrings[vq_idx]->intr_handle;
+	if (rte_intr_fd_get(intr_handle) != -1) {
+		while (retries-- && ret == -EAGAIN) {
+			ret = rte_intr_callback_unregister(intr_handle,
+							virtio_vdpa_virtq_handler,
+							priv->vrings[vq_idx]);
+			if (ret == -EAGAIN) {
 				DRV_LOG(DEBUG, "%s try again to unregister fd %d "
 				"of virtq %d interrupt, retries = %d",
 				priv->vdev->device->name,
@@ -256,6 +965,15 @@ virtio_vdpa_virtq_doorbell_relay_enable(struct virtio_vdpa_priv *priv, int vq_id
 	if (ret)
 		return ret;
 
+	if (priv->doorbell_relay) {
+		ret = virtio_vdpa_relay_attach(priv->vrings[vq_idx], vq.kickfd);
+		if (ret)
+			DRV_LOG(ERR, "%s failed to relay virtq %d kickfd %d ret:%d",
+						priv->vdev->device->name, vq_idx,
+						vq.kickfd, ret);
+		return ret;
+	}
+
 	intr_handle = rte_intr_instance_alloc(RTE_INTR_INSTANCE_F_SHARED);
 	if (intr_handle == NULL) {
 		DRV_LOG(ERR, "%s fail to allocate intr_handle",
@@ -300,9 +1018,18 @@ virtio_vdpa_virtq_doorbell_relay_enable(struct virtio_vdpa_priv *priv, int vq_id
 	return -EINVAL;
 }
 
+static void
+virtio_vdpa_vq_latency_update(uint64_t start, uint64_t *last, uint64_t *max)
+{
+	*last = (rte_get_timer_cycles() - start) * US_PER_S / rte_get_timer_hz();
+	*max = RTE_MAX(*max, *last);
+}
+
 static int
 virtio_vdpa_virtq_disable(struct virtio_vdpa_priv *priv, int vq_idx)
 {
+	struct virtio_vdpa_vq_stats *stats = &priv->vrings[vq_idx]->stats;
+	uint64_t start = rte_get_timer_cycles();
 	int ret;
 
 	ret = virtio_vdpa_virtq_doorbell_relay_disable(priv, vq_idx);
@@ -312,42 +1039,66 @@ virtio_vdpa_virtq_disable(struct virtio_vdpa_priv *priv, int vq_idx)
 		return ret;
 	}
 
-	virtio_pci_dev_queue_del(priv->vpdev, vq_idx);
-
-	ret = virtio_pci_dev_interrupt_disable(priv->vpdev, vq_idx + 1);
-	if (ret) {
-		DRV_LOG(ERR, "%s virtq %d interrupt disabel failed",
-						priv->vdev->device->name, vq_idx);
-		return ret;
+	/*
+	 * A device under reset has dropped its queues already, an adopted
+	 * one runs them until it is configured or reset.
+	 */
+	if (!virtio_pci_dev_reset_pending(priv->vpdev) && !priv->adopted) {
+		ret = virtio_pci_dev_queue_del(priv->vpdev, vq_idx);
+		if (ret) {
+			DRV_LOG(ERR, "%s virtq %d delete failed ret:%d",
+						priv->vdev->device->name, vq_idx, ret);
+			return ret;
+		}
 	}
-	priv->vrings[vq_idx]->notifier_state = VIRTIO_VDPA_NOTIFIER_STATE_DISABLED;
+
+	if (priv->vrings[vq_idx]->intr_bound) {
+		ret = virtio_pci_dev_interrupt_disable(priv->vpdev, vq_idx + 1);
+		if (ret) {
+			DRV_LOG(ERR, "%s virtq %d interrupt disabel failed",
+							priv->vdev->device->name, vq_idx);
+			return ret;
+		}
+		priv->vrings[vq_idx]->intr_bound = false;
+	}
+	/* Kicks are off, drop a notifier enable they posted and not yet run */
+	rte_eal_alarm_cancel(virtio_vdpa_notifier_enable, priv->vrings[vq_idx]);
+	__atomic_store_n(&priv->vrings[vq_idx]->notifier_pending, false,
+			 __ATOMIC_RELEASE);
+	if (priv->vrings[vq_idx]->notifier_state != VIRTIO_VDPA_NOTIFIER_STATE_DISABLED)
+		__atomic_fetch_add(&stats->notifier_changes, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&priv->vrings[vq_idx]->notifier_state,
+			 VIRTIO_VDPA_NOTIFIER_STATE_DISABLED, __ATOMIC_RELEASE);
 	priv->vrings[vq_idx]->enable = false;
+	stats->disables++;
+	virtio_vdpa_vq_latency_update(start, &stats->disable_last_us,
+			&stats->disable_max_us);
 	return 0;
 }
 
 static int
 virtio_vdpa_virtq_enable(struct virtio_vdpa_priv *priv, int vq_idx)
 {
+	struct virtio_vdpa_vq_stats *stats = &priv->vrings[vq_idx]->stats;
+	uint64_t start = rte_get_timer_cycles();
 	int ret;
 	int vid;
 	struct rte_vhost_vring vq;
-	struct virtio_pci_dev_vring_info vring_info;
+	uint16_t last_avail, last_used;
+	bool packed;
 	uint64_t gpa;
 
 	vid = priv->vid;
+	packed = !!(priv->guest_features & (1ULL << VIRTIO_F_RING_PACKED));
 
 	ret = rte_vhost_get_vhost_vring(vid, vq_idx, &vq);
 	if (ret)
 		return ret;
 
-	ret = virtio_pci_dev_interrupt_enable(priv->vpdev, vq.callfd, vq_idx + 1);
-	if (ret) {
-		DRV_LOG(ERR, "%s virtq interrupt enable failed ret:%d",
-						priv->vdev->device->name, ret);
-		return ret;
-	}
-
-	gpa = virtio_vdpa_hva_to_gpa(vid, (uint64_t)(uintptr_t)vq.desc);
+	/* Packed rings put descriptors and both event areas in the same slots */
+	gpa = virtio_vdpa_hva_to_gpa(priv, packed ?
+			(uint64_t)(uintptr_t)vq.desc_packed :
+			(uint64_t)(uintptr_t)vq.desc);
 	if (gpa == 0) {
 		DRV_LOG(ERR, "Dev %s fail to get GPA for descriptor ring %d",
 						priv->vdev->device->name, vq_idx);
@@ -356,9 +1107,10 @@ virtio_vdpa_virtq_enable(struct virtio_vdpa_priv *priv, int vq_idx)
 	DRV_LOG(DEBUG, "%s virtq %d desc addr%"PRIx64,
 					priv->vdev->device->name, vq_idx, gpa);
 	priv->vrings[vq_idx]->desc = gpa;
-	vring_info.desc = gpa;
 
-	gpa = virtio_vdpa_hva_to_gpa(vid, (uint64_t)(uintptr_t)vq.avail);
+	gpa = virtio_vdpa_hva_to_gpa(priv, packed ?
+			(uint64_t)(uintptr_t)vq.driver_event :
+			(uint64_t)(uintptr_t)vq.avail);
 	if (gpa == 0) {
 		DRV_LOG(ERR, "%s fail to get GPA for available ring",
 					priv->vdev->device->name);
@@ -366,9 +1118,10 @@ virtio_vdpa_virtq_enable(struct virtio_vdpa_priv *priv, int vq_idx)
 	}
 	DRV_LOG(DEBUG, "Virtq %d avail addr%"PRIx64, vq_idx, gpa);
 	priv->vrings[vq_idx]->avail = gpa;
-	vring_info.avail = gpa;
 
-	gpa = virtio_vdpa_hva_to_gpa(vid, (uint64_t)(uintptr_t)vq.used);
+	gpa = virtio_vdpa_hva_to_gpa(priv, packed ?
+			(uint64_t)(uintptr_t)vq.device_event :
+			(uint64_t)(uintptr_t)vq.used);
 	if (gpa == 0) {
 		DRV_LOG(ERR, "%s fail to get GPA for used ring",
 					priv->vdev->device->name);
@@ -376,17 +1129,17 @@ virtio_vdpa_virtq_enable(struct virtio_vdpa_priv *priv, int vq_idx)
 	}
 	DRV_LOG(DEBUG, "Virtq %d used addr%"PRIx64, vq_idx, gpa);
 	priv->vrings[vq_idx]->used = gpa;
-	vring_info.used = gpa;
 
 	/* TO_DO: need to check vq_size not exceed hw limit */
 	priv->vrings[vq_idx]->size = vq.size;
-	vring_info.size = vq.size;
-
 	DRV_LOG(DEBUG, "Virtq %d nr_entrys:%d", vq_idx, vq.size);
-	if (virtio_pci_dev_queue_set(priv->vpdev, vq_idx, &vring_info)) {
-		DRV_LOG(ERR, "%s setup_queue failed", priv->vdev->device->name);
-		return -EINVAL;
-	}
+
+	/* Where the rings start, packed ones with their wrap counters */
+	ret = rte_vhost_get_vring_base(vid, vq_idx, &last_avail, &last_used);
+	if (ret)
+		return ret;
+	priv->vrings[vq_idx]->avail_pos = last_avail;
+	priv->vrings[vq_idx]->ring = vq;
 
 	ret = virtio_vdpa_virtq_doorbell_relay_enable(priv, vq_idx);
 	if (ret) {
@@ -395,246 +1148,1410 @@ virtio_vdpa_virtq_enable(struct virtio_vdpa_priv *priv, int vq_idx)
 		return ret;
 	}
 
+	/* The device queue is programmed with the others at configuration */
 	priv->vrings[vq_idx]->enable = true;
-	virtio_pci_dev_queue_notify(priv->vpdev, vq_idx);
+	stats->enables++;
+	virtio_vdpa_vq_latency_update(start, &stats->enable_last_us,
+			&stats->enable_max_us);
 	return 0;
 }
 
+/*
+ * The container is driven directly rather than through EAL, which
+ * serializes every map under one lock and would leave the dma_workers
+ * pinning one chunk at a time. A container handed over is unknown to EAL
+ * anyway. The mappings are tracked in dma_regions.
+ */
 static int
-virtio_vdpa_vring_state_set(int vid, int vq_idx, int state)
+virtio_vdpa_vfio_dma_map(int container_fd,
+		const struct virtio_vdpa_mem_region *reg, bool map)
 {
-	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
-	struct virtio_vdpa_priv *priv =
-		virtio_vdpa_find_priv_resource_by_vdev(vdev);
-	int ret = 0;
-
-	if (priv == NULL) {
-		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
-		return -ENODEV;
-	}
-	if (vq_idx >= (int)priv->hw_nr_virtqs) {
-		DRV_LOG(ERR, "Too big vq_idx: %d", vq_idx);
-		return -E2BIG;
-	}
-
-	/* TO_DO: check if vid set here is suitable */
-	priv->vid = vid;
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.iova = reg->gpa,
+		.size = reg->size,
+	};
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.vaddr = reg->hva,
+		.iova = reg->gpa,
+		.size = reg->size,
+	};
+
+	if (ioctl(container_fd, map ? VFIO_IOMMU_MAP_DMA : VFIO_IOMMU_UNMAP_DMA,
+		  map ? (void *)&dma_map : (void *)&dma_unmap))
+		return -errno;
+	return 0;
+}
 
-	if (virtio_pci_dev_get_status(priv->vpdev) &
-		VIRTIO_CONFIG_STATUS_DRIVER_OK) {
-		DRV_LOG(ERR, "Can not set vring state when driver ok vDPA device: %s",
-						vdev->device->name);
-		return -EINVAL;
-	}
+static int
+virtio_vdpa_dma_region_map(struct virtio_vdpa_priv *priv,
+		const struct virtio_vdpa_mem_region *reg, bool map)
+{
+	int ret;
 
-	/* If vq is already enabled, and enable again means parameter change, so,
-	 * we disable vq first, then enable
-	 */
-	if (!state && priv->vrings[vq_idx]->enable)
-		ret = virtio_vdpa_virtq_disable(priv, vq_idx);
-	else if (state && !priv->vrings[vq_idx]->enable)
-		ret = virtio_vdpa_virtq_enable(priv, vq_idx);
-	else if (state && priv->vrings[vq_idx]->enable) {
-		ret = virtio_vdpa_virtq_disable(priv, vq_idx);
-		if (ret) {
-			DRV_LOG(ERR, "%s fail to disable vring,ret:%d vring:%d state:%d",
-						priv->vdev->device->name, ret, vq_idx, state);
-			return ret;
-		}
-		ret = virtio_vdpa_virtq_enable(priv, vq_idx);
-	}
-	if (ret) {
-		DRV_LOG(ERR, "%s fail to set vring state, ret:%d vq_idx:%d state:%d",
-					priv->vdev->device->name, ret, vq_idx, state);
-		return ret;
-	}
+	DRV_LOG(INFO, "%s, region: HVA 0x%" PRIx64 ", "
+		"GPA 0x%" PRIx64 ", size 0x%" PRIx64 ".",
+		map ? "DMA map" : "DMA unmap", reg->hva, reg->gpa, reg->size);
 
-	DRV_LOG(INFO, "VDPA device %s vid:%d  set vring %d state %d",
-					priv->vdev->device->name, vid, vq_idx, state);
-	return 0;
+	ret = virtio_vdpa_vfio_dma_map(priv->vfio_container_fd, reg, map);
+	if (ret < 0)
+		DRV_LOG(ERR, "%s DMA %s failed ret:%d", priv->vdev->device->name,
+					map ? "map" : "unmap", ret);
+	return ret;
 }
 
+/* Release every IOMMU mapping of the device */
 static int
 virtio_vdpa_dma_unmap(struct virtio_vdpa_priv *priv)
 {
 	uint32_t i;
-	int ret;
-	struct rte_vhost_memory *mem = NULL;
-	int vfio_container_fd;
-
-	ret = rte_vhost_get_mem_table(priv->vid, &mem);
-	if (ret < 0) {
-		DRV_LOG(ERR, "%s failed to get VM memory layout ret:%d",
-					priv->vdev->device->name, ret);
-		goto exit;
-	}
+	int ret = 0;
 
-	vfio_container_fd = priv->vfio_container_fd;
+	for (i = 0; i < priv->nr_dma_regions; i++)
+		if (virtio_vdpa_dma_region_map(priv, &priv->dma_regions[i], false))
+			ret = -EIO;
 
-	for (i = 0; i < mem->nregions; i++) {
-		struct rte_vhost_mem_region *reg;
+	rte_free(priv->dma_regions);
+	priv->dma_regions = NULL;
+	priv->nr_dma_regions = 0;
+	return ret;
+}
 
-		reg = &mem->regions[i];
-		DRV_LOG(INFO, "%s, region %u: HVA 0x%" PRIx64 ", "
-			"GPA 0x%" PRIx64 ", size 0x%" PRIx64 ".",
-			"DMA unmap", i,
-			reg->host_user_addr, reg->guest_phys_addr, reg->size);
+static void
+virtio_vdpa_dma_job_run(struct virtio_vdpa_dma_job *job)
+{
+	struct virtio_vdpa_priv *priv = job->priv;
+	struct virtio_vdpa_dma_chunk *chunk;
+	uint64_t start, done, step;
+	uint32_t idx;
+	int ret;
 
-		ret = rte_vfio_container_dma_unmap(vfio_container_fd,
-			reg->host_user_addr, reg->guest_phys_addr,
-			reg->size);
+	while (!__atomic_load_n(&job->err, __ATOMIC_RELAXED)) {
+		idx = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (idx >= job->nr_chunks)
+			break;
+		chunk = &job->chunks[idx];
+		start = rte_get_timer_cycles();
+		ret = virtio_vdpa_dma_region_map(priv, &chunk->reg, true);
 		if (ret < 0) {
-			DRV_LOG(ERR, "%s DMA unmap failed ret:%d",
-						priv->vdev->device->name, ret);
-			goto exit;
+			__atomic_store_n(&job->err, ret, __ATOMIC_RELAXED);
+			break;
 		}
+		chunk->mapped = true;
+		__atomic_fetch_add(&job->region_cycles[chunk->region],
+				rte_get_timer_cycles() - start, __ATOMIC_RELAXED);
+
+		done = __atomic_add_fetch(&job->done, chunk->reg.size,
+				__ATOMIC_RELAXED);
+		__atomic_store_n(&priv->dma_stats.progress_bytes, done,
+				__ATOMIC_RELAXED);
+		step = job->total / 10;
+		if (step && done / step != (done - chunk->reg.size) / step)
+			DRV_LOG(INFO, "%s DMA map %" PRIu64 "%% done, %" PRIu64
+					"/%" PRIu64 " MB", priv->vdev->device->name,
+					done * 100 / job->total, done >> 20,
+					job->total >> 20);
 	}
+}
 
-exit:
-	free(mem);
-	return ret;
+static void *
+virtio_vdpa_dma_worker(void *arg)
+{
+	virtio_vdpa_dma_job_run(arg);
+	return NULL;
 }
 
+/* Split the regions to map into chunks the workers take in turn */
 static int
-virtio_vdpa_dma_map(struct virtio_vdpa_priv *priv)
+virtio_vdpa_dma_job_init(struct virtio_vdpa_priv *priv,
+		struct virtio_vdpa_dma_job *job,
+		const struct virtio_vdpa_mem_region *regions, uint32_t nr)
 {
-	uint32_t i = 0, j;
-	int ret;
-	struct rte_vhost_memory *mem = NULL;
-	struct rte_vhost_mem_region *reg;
-	int vfio_container_fd = priv->vfio_container_fd;
-
-	ret = rte_vhost_get_mem_table(priv->vid, &mem);
-	if (ret < 0) {
-		DRV_LOG(ERR, "%s failed to get VM memory layout ret:%d",
-					priv->vdev->device->name, ret);
-		goto exit;
+	uint64_t chunk_sz, off;
+	uint32_t i, n = 0;
+
+	chunk_sz = priv->dma_workers > 1 ? VIRTIO_VDPA_DMA_CHUNK_SZ : UINT64_MAX;
+	for (i = 0; i < nr; i++)
+		if (!virtio_vdpa_mem_region_has(priv->dma_regions,
+				priv->nr_dma_regions, &regions[i]))
+			n += regions[i].size / chunk_sz +
+				!!(regions[i].size % chunk_sz);
+
+	job->priv = priv;
+	job->chunks = rte_zmalloc(NULL, sizeof(*job->chunks) * RTE_MAX(n, 1U), 0);
+	job->region_cycles = rte_zmalloc(NULL,
+			sizeof(*job->region_cycles) * RTE_MAX(nr, 1U), 0);
+	if (!job->chunks || !job->region_cycles) {
+		rte_free(job->chunks);
+		rte_free(job->region_cycles);
+		return -ENOMEM;
 	}
 
-	for (i = 0; i < mem->nregions; i++) {
-		reg = &mem->regions[i];
-		DRV_LOG(INFO, "%s, region %u: HVA 0x%" PRIx64 ", "
-			"GPA 0x%" PRIx64 ", size 0x%" PRIx64 ".",
-			"DMA map", i,
-			reg->host_user_addr, reg->guest_phys_addr, reg->size);
-
-		ret = rte_vfio_container_dma_map(vfio_container_fd,
-			reg->host_user_addr, reg->guest_phys_addr,
-			reg->size);
-		if (ret < 0) {
-			DRV_LOG(ERR, "%s DMA map failed ret:%d",
-						priv->vdev->device->name, ret);
-			goto exit;
+	for (i = 0; i < nr; i++) {
+		if (virtio_vdpa_mem_region_has(priv->dma_regions,
+				priv->nr_dma_regions, &regions[i]))
+			continue;
+		for (off = 0; off < regions[i].size; off += chunk_sz) {
+			struct virtio_vdpa_dma_chunk *chunk =
+				&job->chunks[job->nr_chunks++];
+
+			chunk->region = i;
+			chunk->reg.hva = regions[i].hva + off;
+			chunk->reg.gpa = regions[i].gpa + off;
+			chunk->reg.size = RTE_MIN(chunk_sz, regions[i].size - off);
 		}
+		job->total += regions[i].size;
 	}
-	free(mem);
-	return ret;
+	return 0;
+}
 
-exit:
-	for (j = 0; j < i; j++) {
-		reg = &mem->regions[j];
-		DRV_LOG(INFO, "%s, region %u: HVA 0x%" PRIx64 ", "
-			"GPA 0x%" PRIx64 ", size 0x%" PRIx64 ".",
-			"DMA unmap", j,
-			reg->host_user_addr, reg->guest_phys_addr, reg->size);
-
-		ret = rte_vfio_container_dma_unmap(vfio_container_fd,
-			reg->host_user_addr, reg->guest_phys_addr,
-			reg->size);
-		if (ret < 0) {
-			DRV_LOG(ERR, "%s DMA unmap failed ret:%d",
-						priv->vdev->device->name, ret);
+/*
+ * IOMMU mappings handed over are known by guest address only. Those the
+ * memory table still has are kept under their new host address, the
+ * others are unmapped.
+ */
+static void
+virtio_vdpa_handover_dma_fixup(struct virtio_vdpa_priv *priv,
+		const struct virtio_vdpa_mem_region *regions, uint32_t nr)
+{
+	struct virtio_vdpa_mem_region *reg;
+	uint32_t i, k, kept = 0;
+
+	for (i = 0; i < priv->nr_handover_dma; i++) {
+		reg = &priv->handover_dma[i];
+		for (k = 0; k < nr; k++)
+			if (regions[k].gpa == reg->gpa &&
+			    regions[k].size == reg->size)
+				break;
+		if (k == nr) {
+			virtio_vdpa_dma_region_map(priv, reg, false);
+			continue;
 		}
+		reg->hva = regions[k].hva;
+		priv->handover_dma[kept++] = *reg;
 	}
+	qsort(priv->handover_dma, kept, sizeof(*priv->handover_dma),
+			virtio_vdpa_mem_region_cmp);
 
-	free(mem);
-	return ret;
+	rte_free(priv->dma_regions);
+	priv->dma_regions = priv->handover_dma;
+	priv->nr_dma_regions = kept;
+	priv->handover_dma = NULL;
+	priv->nr_handover_dma = 0;
 }
 
+/*
+ * Bring the IOMMU in line with the regions, a sorted memory table copy
+ * owned by the call from then on. Mappings are kept when the device
+ * closes, so only regions that went away are unmapped and only new ones
+ * are mapped. Hotplug and reconnects over unchanged memory then don't
+ * repin the whole guest. New regions are split in chunks pinned by
+ * dma_workers threads.
+ */
 static int
-virtio_vdpa_features_set(int vid)
+virtio_vdpa_dma_map_regions(struct virtio_vdpa_priv *priv,
+		struct virtio_vdpa_mem_region *regions, uint32_t nr)
 {
-	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
-	struct virtio_vdpa_priv *priv =
-		virtio_vdpa_find_priv_resource_by_vdev(vdev);
-	uint64_t log_base, log_size;
-	uint64_t features;
+	struct virtio_vdpa_dma_stats *stats = &priv->dma_stats;
+	pthread_t tids[VIRTIO_VDPA_DMA_MAX_WORKERS];
+	struct virtio_vdpa_dma_job job = { 0 };
+	uint64_t start = rte_get_timer_cycles(), us, bytes = 0;
+	uint32_t i, w, nr_workers, nr_unmap = 0, nr_map = 0, kept = 0;
+	char name[RTE_MAX_THREAD_NAME_LEN];
 	int ret;
 
-	if (priv == NULL) {
-		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
-		return -ENODEV;
+	if (priv->handover_dma)
+		virtio_vdpa_handover_dma_fixup(priv, regions, nr);
+
+	/* Unmap first, a resized region may reuse the address of its old self */
+	for (i = 0; i < priv->nr_dma_regions; i++) {
+		if (virtio_vdpa_mem_region_has(regions, nr, &priv->dma_regions[i]))
+			continue;
+		virtio_vdpa_dma_region_map(priv, &priv->dma_regions[i], false);
+		nr_unmap++;
 	}
-	priv->vid = vid;
-	ret = rte_vhost_get_negotiated_features(vid, &features);
+
+	ret = virtio_vdpa_dma_job_init(priv, &job, regions, nr);
 	if (ret) {
-		DRV_LOG(ERR, "%s failed to get negotiated features",
-					priv->vdev->device->name);
+		rte_free(regions);
 		return ret;
 	}
-	if (RTE_VHOST_NEED_LOG(features)) {
-		ret = rte_vhost_get_log_base(vid, &log_base, &log_size);
+	__atomic_store_n(&stats->progress_total, job.total, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->progress_bytes, 0, __ATOMIC_RELAXED);
+
+	/* The calling thread is a worker too */
+	nr_workers = RTE_MIN((uint32_t)priv->dma_workers, job.nr_chunks);
+	for (w = 1; w < nr_workers; w++) {
+		snprintf(name, sizeof(name), "vdpa-dma-%d-%u", priv->vid, w);
+		ret = rte_ctrl_thread_create(&tids[w], name, NULL,
+				virtio_vdpa_dma_worker, &job);
 		if (ret) {
-			DRV_LOG(ERR, "%s failed to get log base",
-						priv->vdev->device->name);
-			return ret;
+			DRV_LOG(WARNING, "%s DMA map with %u workers, failed to create more ret:%d",
+						priv->vdev->device->name, w, ret);
+			break;
 		}
-		/* TO_DO: add log op */
 	}
+	nr_workers = w;
+	virtio_vdpa_dma_job_run(&job);
+	for (w = 1; w < nr_workers; w++)
+		pthread_join(tids[w], NULL);
+	ret = job.err;
 
-	/* TO_DO: check why --- */
-	features |= (1ULL << VIRTIO_F_IOMMU_PLATFORM);
-	priv->guest_features = virtio_pci_dev_features_set(priv->vpdev, features);
-	DRV_LOG(INFO, "%s vid %d hw feature is %" PRIx64 "guest feature is %" PRIx64,
-					priv->vdev->device->name, vid,
-					priv->guest_features, features);
-
-	return 0;
+	if (ret < 0) {
+		/* Start over from nothing mapped on the next attempt */
+		for (i = 0; i < job.nr_chunks; i++)
+			if (job.chunks[i].mapped)
+				virtio_vdpa_dma_region_map(priv, &job.chunks[i].reg,
+						false);
+		for (i = 0; i < priv->nr_dma_regions; i++)
+			if (virtio_vdpa_mem_region_has(regions, nr,
+					&priv->dma_regions[i]))
+				priv->dma_regions[kept++] = priv->dma_regions[i];
+		priv->nr_dma_regions = kept;
+		virtio_vdpa_dma_unmap(priv);
+		rte_free(regions);
+		goto out;
+	}
+
+	stats->slowest_region_us = 0;
+	for (i = 0; i < nr; i++) {
+		bytes += regions[i].size;
+		if (!job.region_cycles[i])
+			continue;
+		nr_map++;
+		us = job.region_cycles[i] * US_PER_S / rte_get_timer_hz();
+		stats->slowest_region_us = RTE_MAX(stats->slowest_region_us, us);
+		DRV_LOG(INFO, "%s DMA mapped HVA 0x%" PRIx64 " GPA 0x%" PRIx64
+				" size 0x%" PRIx64 " in %" PRIu64 " us",
+				priv->vdev->device->name, regions[i].hva,
+				regions[i].gpa, regions[i].size, us);
+	}
+
+	rte_free(priv->dma_regions);
+	priv->dma_regions = regions;
+	priv->nr_dma_regions = nr;
+	stats->mapped_bytes = bytes;
+	stats->last_map_bytes = job.total;
+	stats->last_map_regions = nr_map;
+	stats->last_unmap_regions = nr_unmap;
+	stats->last_map_us = (rte_get_timer_cycles() - start) * US_PER_S /
+			rte_get_timer_hz();
+	DRV_LOG(INFO, "%s DMA mapped %u regions, %u unmapped, %u kept, %" PRIu64
+			" MB in %" PRIu64 " us with %u workers",
+			priv->vdev->device->name, nr_map, nr_unmap, nr - nr_map,
+			job.total >> 20, stats->last_map_us, nr_workers);
+out:
+	rte_free(job.chunks);
+	rte_free(job.region_cycles);
+	return ret;
 }
 
 static int
-virtio_vdpa_dev_close(int vid)
+virtio_vdpa_dma_map(struct virtio_vdpa_priv *priv)
 {
-	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
-	struct virtio_vdpa_priv *priv =
-		virtio_vdpa_find_priv_resource_by_vdev(vdev);
-	int ret, i;
+	struct virtio_vdpa_mem_region *regions;
+	uint32_t nr;
+	int ret;
 
-	if (priv == NULL) {
-		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
-		return -ENODEV;
-	}
+	ret = virtio_vdpa_mem_table_get(priv, &regions, &nr);
+	if (ret)
+		return ret;
+	return virtio_vdpa_dma_map_regions(priv, regions, nr);
+}
 
-	/* Suspend */
-	/* Set_vring_base */
+static void *
+virtio_vdpa_dma_prepin_thread(void *arg)
+{
+	struct virtio_vdpa_priv *priv = arg;
 
-	ret = virtio_pci_dev_interrupt_disable(priv->vpdev, 0);
-	if (ret) {
-		DRV_LOG(ERR, "%s error disabling virtio dev interrupts: %d (%s)",
-				priv->vdev->device->name,
-				ret, strerror(errno));
-		return ret;
-	}
+	virtio_vdpa_dma_map_regions(priv, priv->prepin_regions,
+			priv->nr_prepin_regions);
+	priv->prepin_regions = NULL;
+	return NULL;
+}
 
-	virtio_pci_dev_reset(priv->vpdev);
+/*
+ * Start pinning guest memory while vhost-user still sets the vrings up,
+ * the first vring enable is the earliest the driver hears of the memory
+ * table. Configuration waits for it and maps whatever changed since.
+ */
+static void
+virtio_vdpa_dma_prepin_start(struct virtio_vdpa_priv *priv)
+{
+	char name[RTE_MAX_THREAD_NAME_LEN];
+	int ret;
 
-	ret = virtio_vdpa_dma_unmap(priv);
+	if (!priv->dma_prepin || priv->prepin_running || priv->configured)
+		return;
+	if (virtio_vdpa_mem_table_get(priv, &priv->prepin_regions,
+			&priv->nr_prepin_regions))
+		return;
+
+	snprintf(name, sizeof(name), "vdpa-prepin-%d", priv->vid);
+	ret = rte_ctrl_thread_create(&priv->prepin_tid, name, NULL,
+			virtio_vdpa_dma_prepin_thread, priv);
 	if (ret) {
-		DRV_LOG(ERR, "%s fail to do dma map: %d",
+		DRV_LOG(WARNING, "%s failed to start DMA pre-pin ret:%d",
 					priv->vdev->device->name, ret);
+		rte_free(priv->prepin_regions);
+		priv->prepin_regions = NULL;
+		return;
 	}
+	priv->prepin_running = true;
+}
 
-	/* Disable all queues */
-	for (i = 0; i < priv->nr_virtqs; i++) {
-		if (priv->vrings[i]->enable)
-			virtio_vdpa_vring_state_set(vid, i, 0);
-	}
+static void
+virtio_vdpa_dma_prepin_wait(struct virtio_vdpa_priv *priv)
+{
+	if (!priv->prepin_running)
+		return;
+	pthread_join(priv->prepin_tid, NULL);
+	priv->prepin_running = false;
+}
 
-	/* Tell the host we've noticed this device. */
-	virtio_pci_dev_set_status(priv->vpdev, VIRTIO_CONFIG_STATUS_ACK);
+/*
+ * Change one vring of a running device while the others keep forwarding.
+ * Disabling resets the queue alone, enabling binds its vector and programs
+ * it in the device straight away.
+ */
+static int
+virtio_vdpa_virtq_live_set(struct virtio_vdpa_priv *priv, int vq_idx, int state)
+{
+	struct virtio_vdpa_vring_info *virtq = priv->vrings[vq_idx];
+	struct virtio_pci_dev_vring_info vring_info;
+	struct rte_vhost_vring vq;
+	int ret;
+
+	if (virtq->enable) {
+		ret = virtio_vdpa_virtq_disable(priv, vq_idx);
+		if (ret || !state)
+			return ret;
+	}
+	if (!state)
+		return 0;
+
+	if (vq_idx + 1 >= priv->nvec) {
+		DRV_LOG(ERR, "%s no interrupt vector left for virtq %d",
+					priv->vdev->device->name, vq_idx);
+		return -E2BIG;
+	}
+	ret = rte_vhost_get_vhost_vring(priv->vid, vq_idx, &vq);
+	if (ret)
+		return ret;
+
+	ret = virtio_vdpa_virtq_enable(priv, vq_idx);
+	if (ret)
+		return ret;
+
+	ret = virtio_pci_dev_interrupt_enable(priv->vpdev, vq.callfd, vq_idx + 1);
+	if (ret) {
+		DRV_LOG(ERR, "%s virtq %d interrupt enable failed",
+					priv->vdev->device->name, vq_idx);
+		goto err;
+	}
+	virtq->intr_bound = true;
+	virtq->stats.intr_binds++;
+
+	vring_info.desc = virtq->desc;
+	vring_info.avail = virtq->avail;
+	vring_info.used = virtq->used;
+	vring_info.size = virtq->size;
+	ret = virtio_pci_dev_queue_set(priv->vpdev, vq_idx, &vring_info);
+	if (ret) {
+		DRV_LOG(ERR, "%s setup_queue %d failed",
+					priv->vdev->device->name, vq_idx);
+		goto err;
+	}
+
+	if (vq_idx >= priv->nr_virtqs)
+		priv->nr_virtqs = vq_idx + 1;
+	virtio_pci_dev_queue_notify(priv->vpdev, vq_idx);
+	return 0;
+
+err:
+	virtio_vdpa_virtq_disable(priv, vq_idx);
+	return ret;
+}
+
+static int
+virtio_vdpa_vring_state_set(int vid, int vq_idx, int state)
+{
+	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+	int ret = 0;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+	if (vq_idx >= (int)priv->hw_nr_virtqs) {
+		DRV_LOG(ERR, "Too big vq_idx: %d", vq_idx);
+		return -E2BIG;
+	}
+	if (priv->handed_over)
+		return -EBUSY;
+	ret = virtio_vdpa_dev_res_alloc(priv);
+	if (ret)
+		return ret;
+
+	/* TO_DO: check if vid set here is suitable */
+	priv->vid = vid;
+
+	/* Queues can go while the device resets, not come back */
+	if (virtio_pci_dev_reset_pending(priv->vpdev)) {
+		if (!state)
+			return priv->vrings[vq_idx]->enable ?
+				virtio_vdpa_virtq_disable(priv, vq_idx) : 0;
+		virtio_pci_dev_reset_wait(priv->vpdev);
+	}
+
+	/* An adopted device runs already, its vrings are matched at config */
+	if (!priv->adopted && (virtio_pci_dev_get_status(priv->vpdev) &
+		VIRTIO_CONFIG_STATUS_DRIVER_OK)) {
+		if (!priv->vpdev->queue_reset) {
+			DRV_LOG(ERR, "Can not set vring state when driver ok vDPA device: %s",
+							vdev->device->name);
+			return -EINVAL;
+		}
+		ret = virtio_vdpa_virtq_live_set(priv, vq_idx, state);
+		if (ret) {
+			DRV_LOG(ERR, "%s fail to set live vring state, ret:%d vq_idx:%d state:%d",
+						vdev->device->name, ret, vq_idx, state);
+			return ret;
+		}
+		DRV_LOG(INFO, "VDPA device %s vid:%d  set live vring %d state %d",
+						vdev->device->name, vid, vq_idx, state);
+		return 0;
+	}
+
+	/* If vq is already enabled, and enable again means parameter change, so,
+	 * we disable vq first, then enable
+	 */
+	if (state)
+		virtio_vdpa_dma_prepin_start(priv);
+
+	if (!state && priv->vrings[vq_idx]->enable)
+		ret = virtio_vdpa_virtq_disable(priv, vq_idx);
+	else if (state && !priv->vrings[vq_idx]->enable)
+		ret = virtio_vdpa_virtq_enable(priv, vq_idx);
+	else if (state && priv->vrings[vq_idx]->enable) {
+		ret = virtio_vdpa_virtq_disable(priv, vq_idx);
+		if (ret) {
+			DRV_LOG(ERR, "%s fail to disable vring,ret:%d vring:%d state:%d",
+						priv->vdev->device->name, ret, vq_idx, state);
+			return ret;
+		}
+		ret = virtio_vdpa_virtq_enable(priv, vq_idx);
+	}
+	if (ret) {
+		DRV_LOG(ERR, "%s fail to set vring state, ret:%d vq_idx:%d state:%d",
+					priv->vdev->device->name, ret, vq_idx, state);
+		return ret;
+	}
+
+	DRV_LOG(INFO, "VDPA device %s vid:%d  set vring %d state %d",
+					priv->vdev->device->name, vid, vq_idx, state);
+	return 0;
+}
+
+static int
+virtio_vdpa_pf_name_get(const char *vf_name, char *pf_name, size_t len,
+		uint16_t *vf_id)
+{
+	const char *sysfs = rte_pci_get_sysfs_path();
+	char path[PATH_MAX], link[PATH_MAX];
+	ssize_t n;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s/physfn", sysfs, vf_name);
+	n = readlink(path, link, sizeof(link) - 1);
+	if (n < 0)
+		return -errno;
+	link[n] = '\0';
+	strlcpy(pf_name, basename(link), len);
+
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path), "%s/%s/virtfn%d", sysfs, pf_name, i);
+		n = readlink(path, link, sizeof(link) - 1);
+		if (n < 0)
+			break;
+		link[n] = '\0';
+		if (!strcmp(basename(link), vf_name)) {
+			/* SR-IOV group member ids start from 1 */
+			*vf_id = i + 1;
+			return 0;
+		}
+	}
+
+	pf_name[0] = '\0';
+	return -ENODEV;
+}
+
+static struct virtio_vdpa_pf_priv *
+virtio_vdpa_pf_priv_get(struct virtio_vdpa_priv *priv)
+{
+	if (!priv->pf_priv && priv->pf_name[0])
+		priv->pf_priv = rte_vdpa_get_mi_by_bdf(priv->pf_name);
+	return priv->pf_priv;
+}
+
+static void
+virtio_vdpa_dirty_ranges_free(struct virtio_vdpa_priv *priv)
+{
+	uint32_t i;
+
+	for (i = 0; i < priv->nr_dirty_ranges; i++)
+		rte_memzone_free(priv->dirty_ranges[i].mz);
+	rte_free(priv->dirty_ranges);
+	priv->dirty_ranges = NULL;
+	priv->nr_dirty_ranges = 0;
+}
+
+static int
+virtio_vdpa_dirty_ranges_build(struct virtio_vdpa_priv *priv,
+		uint32_t max_ranges)
+{
+	const struct virtio_vdpa_mem_region *reg;
+	struct virtio_vdpa_dirty_range *range;
+	uint64_t start, end;
+	uint32_t i, nr;
+	int ret;
+
+	if (!priv->mem_regions) {
+		ret = virtio_vdpa_mem_index_build(priv);
+		if (ret)
+			return ret;
+	}
+	if (!priv->nr_mem_regions || !max_ranges)
+		return -EINVAL;
+
+	/* Track one range spanning all regions if the PF can't track each */
+	nr = priv->nr_mem_regions <= max_ranges ? priv->nr_mem_regions : 1;
+	priv->dirty_ranges = rte_zmalloc(NULL, sizeof(*range) * nr, 0);
+	if (!priv->dirty_ranges)
+		return -ENOMEM;
+	priv->nr_dirty_ranges = nr;
+
+	for (i = 0; i < priv->nr_mem_regions; i++) {
+		reg = &priv->mem_regions[i];
+		range = &priv->dirty_ranges[nr == priv->nr_mem_regions ? i : 0];
+		start = RTE_ALIGN_FLOOR(reg->gpa, VIRTIO_VDPA_DIRTY_PAGE_SIZE);
+		end = RTE_ALIGN_CEIL(reg->gpa + reg->size,
+				VIRTIO_VDPA_DIRTY_PAGE_SIZE);
+		if (range->len) {
+			start = RTE_MIN(start, range->addr);
+			end = RTE_MAX(end, range->addr + range->len);
+		}
+		range->addr = start;
+		range->len = end - start;
+	}
+
+	return 0;
+}
+
+/* Map bytes with a dirty page in a bitmap window, as pending bytes count */
+static uint64_t
+virtio_vdpa_dirty_bitmap_bytes(const uint8_t *map, uint64_t len)
+{
+	uint64_t i, bytes = 0;
+
+	for (i = 0; i < len; i++)
+		bytes += !!map[i];
+	return bytes;
+}
+
+/*
+ * Pull the dirty map of a range from the parent PF into the vhost log. A
+ * range without pending map bytes is skipped. Otherwise windows are
+ * fetched from where its previous sync stopped until as many dirty map
+ * bytes as were pending are found or the whole map was covered: the
+ * pending count says how much is dirty, not where. A full sync fetches the
+ * map from start to end. Returns the pending bytes seen.
+ */
+static uint64_t
+virtio_vdpa_dirty_range_sync(struct virtio_vdpa_priv *priv,
+		struct virtio_vdpa_dirty_range *range, uint64_t *log,
+		uint64_t log_size, bool full)
+{
+	struct virtio_admin_dirty_page_get_map_pending_bytes_result pending;
+	bool bytemap = priv->dirty_mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP;
+	uint64_t first, nr_pages, map_len, off, len, seen = 0;
+	uint64_t target = UINT64_MAX, found = 0, covered = 0;
+	int ret;
+
+	first = range->addr / VIRTIO_VDPA_DIRTY_PAGE_SIZE;
+	nr_pages = range->len / VIRTIO_VDPA_DIRTY_PAGE_SIZE;
+	if (((first + nr_pages - 1) / 64 + 1) * 8 > log_size) {
+		DRV_LOG(ERR, "%s range 0x%" PRIx64 " is beyond log size 0x%"
+				PRIx64, priv->vdev->device->name,
+				range->addr, log_size);
+		return 0;
+	}
+
+	map_len = bytemap ? nr_pages : RTE_ALIGN_CEIL(nr_pages, 64) / 8;
+	if (full) {
+		range->cursor = 0;
+	} else {
+		ret = virtio_vdpa_cmd_dirty_page_get_map_pending_bytes(
+				priv->pf_priv, priv->vf_id, range->addr, &pending);
+		if (ret) {
+			DRV_LOG(ERR, "%s failed to get pending bytes of range 0x%"
+					PRIx64 " ret:%d", priv->vdev->device->name,
+					range->addr, ret);
+		} else {
+			if (!pending.pending_bytes)
+				return 0;
+			seen = pending.pending_bytes;
+			target = pending.pending_bytes;
+		}
+	}
+
+	/* Bitmap windows stay whole 64 bit words, as the map and cursor are */
+	while (covered < map_len && found < target) {
+		off = range->cursor;
+		len = RTE_MIN(map_len - off, VIRTIO_VDPA_DIRTY_MAP_SZ);
+		ret = virtio_vdpa_cmd_dirty_page_report_map(priv->pf_priv,
+				priv->vf_id, off, len, range->addr, range->mz->iova);
+		if (ret) {
+			DRV_LOG(ERR, "%s failed to report dirty map of range 0x%"
+					PRIx64 " ret:%d", priv->vdev->device->name,
+					range->addr, ret);
+			break;
+		}
+		if (bytemap) {
+			found += virtio_vdpa_dirty_bytemap_merge(range->mz->addr,
+					len, log, first + off);
+		} else {
+			found += virtio_vdpa_dirty_bitmap_bytes(range->mz->addr,
+					len);
+			virtio_vdpa_dirty_bitmap_merge(range->mz->addr,
+					RTE_MIN(len * 8, nr_pages - off * 8), log,
+					first + off * 8);
+		}
+		covered += len;
+		range->cursor = (off + len) % map_len;
+	}
+
+	return seen;
+}
+
+static uint64_t
+virtio_vdpa_dirty_sync(struct virtio_vdpa_dirty_worker *worker, bool full)
+{
+	struct virtio_vdpa_priv *priv = worker->priv;
+	uint64_t log_base, log_size, total = 0;
+	uint32_t i;
+
+	if (rte_vhost_get_log_base(priv->vid, &log_base, &log_size) ||
+	    !log_base)
+		return 0;
+
+	for (i = worker->id; i < priv->nr_dirty_ranges;
+	     i += priv->nr_dirty_workers)
+		total += virtio_vdpa_dirty_range_sync(priv,
+				&priv->dirty_ranges[i],
+				(uint64_t *)(uintptr_t)log_base, log_size, full);
+
+	return total;
+}
+
+static void *
+virtio_vdpa_dirty_thread(void *arg)
+{
+	struct virtio_vdpa_dirty_worker *worker = arg;
+	struct virtio_vdpa_priv *priv = worker->priv;
+	uint64_t interval = VIRTIO_VDPA_DIRTY_SYNC_USEC;
+	uint64_t slept, pending;
+
+	while (__atomic_load_n(&priv->dirty_tracking, __ATOMIC_ACQUIRE)) {
+		for (slept = 0; slept < interval &&
+		     __atomic_load_n(&priv->dirty_tracking, __ATOMIC_ACQUIRE);
+		     slept += VIRTIO_VDPA_DIRTY_SYNC_MIN_USEC)
+			usleep(VIRTIO_VDPA_DIRTY_SYNC_MIN_USEC);
+
+		pending = virtio_vdpa_dirty_sync(worker, false);
+		/* Come back sooner if more than a window piled up, later if idle */
+		if (pending > VIRTIO_VDPA_DIRTY_MAP_SZ)
+			interval = RTE_MAX(interval / 2,
+					VIRTIO_VDPA_DIRTY_SYNC_MIN_USEC);
+		else if (!pending)
+			interval = RTE_MIN(interval * 2,
+					VIRTIO_VDPA_DIRTY_SYNC_MAX_USEC);
+	}
+
+	/* Tracking stops, report what the device wrote since the last pull */
+	virtio_vdpa_dirty_sync(worker, true);
+
+	return NULL;
+}
+
+static uint64_t
+virtio_vdpa_dirty_max_pages(uint16_t log_max_pages)
+{
+	return log_max_pages < 64 ? 1ULL << log_max_pages : UINT64_MAX;
+}
+
+static int
+virtio_vdpa_dirty_track_start(struct virtio_vdpa_priv *priv)
+{
+	struct virtio_admin_dirty_page_identity_result id;
+	struct virtio_vdpa_dirty_range *range;
+	struct virtio_vdpa_dirty_worker *worker;
+	char name[RTE_MAX_THREAD_NAME_LEN];
+	char mz_name[RTE_MEMZONE_NAMESIZE];
+	uint64_t pages = 0;
+	uint32_t i = 0, w;
+	int ret;
+
+	if (priv->dirty_tracking)
+		return 0;
+
+	if (!priv->pf_name[0]) {
+		DRV_LOG(ERR, "%s is not a VF, can't track dirty pages",
+					priv->vdev->device->name);
+		return -ENOTSUP;
+	}
+
+	if (!virtio_vdpa_pf_priv_get(priv)) {
+		DRV_LOG(ERR, "%s parent PF %s is not managed",
+					priv->vdev->device->name, priv->pf_name);
+		return -ENODEV;
+	}
+
+	ret = virtio_vdpa_cmd_dirty_page_identity(priv->pf_priv, &id);
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to get dirty page identity ret:%d",
+					priv->vdev->device->name, ret);
+		return ret;
+	}
+
+	ret = virtio_vdpa_dirty_ranges_build(priv, id.max_track_ranges);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < priv->nr_dirty_ranges; i++)
+		pages += priv->dirty_ranges[i].len / VIRTIO_VDPA_DIRTY_PAGE_SIZE;
+	i = 0;
+
+	/* Fall back to the bitmap if a bytemap can't cover the guest */
+	priv->dirty_mode = priv->dirty_map_mode;
+	if (priv->dirty_mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP &&
+	    pages > virtio_vdpa_dirty_max_pages(
+			id.log_max_pages_track_pull_bytemap_mode))
+		priv->dirty_mode = VIRTIO_M_DIRTY_TRACK_PULL_BITMAP;
+	if (priv->dirty_mode == VIRTIO_M_DIRTY_TRACK_PULL_BITMAP &&
+	    pages > virtio_vdpa_dirty_max_pages(
+			id.log_max_pages_track_pull_bitmap_mode)) {
+		DRV_LOG(ERR, "%s %" PRIu64 " guest pages exceed PF tracking limit",
+					priv->vdev->device->name, pages);
+		ret = -E2BIG;
+		goto err;
+	}
+
+	for (i = 0; i < priv->nr_dirty_ranges; i++) {
+		range = &priv->dirty_ranges[i];
+		snprintf(mz_name, sizeof(mz_name), "vdev%d_dirty%u",
+				priv->vfio_dev_fd, i);
+		range->mz = rte_memzone_reserve_aligned(mz_name,
+				VIRTIO_VDPA_DIRTY_MAP_SZ, priv->pdev->device.numa_node,
+				RTE_MEMZONE_IOVA_CONTIG, RTE_CACHE_LINE_SIZE);
+		if (!range->mz) {
+			DRV_LOG(ERR, "%s failed to reserve dirty map of range %u",
+						priv->vdev->device->name, i);
+			ret = -ENOMEM;
+			i = 0;
+			goto err;
+		}
+	}
+
+	for (i = 0; i < priv->nr_dirty_ranges; i++) {
+		range = &priv->dirty_ranges[i];
+		ret = virtio_vdpa_cmd_dirty_page_start_track(priv->pf_priv,
+				priv->vf_id, priv->dirty_mode,
+				VIRTIO_VDPA_DIRTY_PAGE_SIZE, range->addr, range->len,
+				0, NULL);
+		if (ret) {
+			DRV_LOG(ERR, "%s failed to start tracking range 0x%" PRIx64
+					" len 0x%" PRIx64 " ret:%d",
+					priv->vdev->device->name, range->addr,
+					range->len, ret);
+			goto err;
+		}
+	}
+
+	/* Ranges are pulled and merged into the log concurrently */
+	priv->nr_dirty_workers = RTE_MIN(priv->nr_dirty_ranges,
+			(uint32_t)VIRTIO_VDPA_DIRTY_MAX_WORKERS);
+	__atomic_store_n(&priv->dirty_tracking, true, __ATOMIC_RELEASE);
+	for (w = 0; w < priv->nr_dirty_workers; w++) {
+		worker = &priv->dirty_workers[w];
+		worker->priv = priv;
+		worker->id = w;
+		snprintf(name, sizeof(name), "vdpa-dirty-%d-%u", priv->vid, w);
+		ret = rte_ctrl_thread_create(&worker->tid, name, NULL,
+				virtio_vdpa_dirty_thread, worker);
+		if (ret) {
+			DRV_LOG(ERR, "%s failed to create dirty sync thread ret:%d",
+						priv->vdev->device->name, ret);
+			__atomic_store_n(&priv->dirty_tracking, false,
+					__ATOMIC_RELEASE);
+			while (w--)
+				pthread_join(priv->dirty_workers[w].tid, NULL);
+			priv->nr_dirty_workers = 0;
+			goto err;
+		}
+	}
+
+	DRV_LOG(INFO, "%s vid %d dirty page tracking started on %s, %u ranges, %u threads, %s",
+				priv->vdev->device->name, priv->vid, priv->pf_name,
+				priv->nr_dirty_ranges, priv->nr_dirty_workers,
+				priv->dirty_mode == VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP ?
+				"bytemap" : "bitmap");
+	return 0;
+
+err:
+	while (i--)
+		virtio_vdpa_cmd_dirty_page_stop_track(priv->pf_priv, priv->vf_id,
+				priv->dirty_ranges[i].addr);
+	virtio_vdpa_dirty_ranges_free(priv);
+	return ret;
+}
+
+static void
+virtio_vdpa_dirty_track_stop(struct virtio_vdpa_priv *priv)
+{
+	uint32_t i;
+	int ret;
+
+	if (!priv->dirty_tracking)
+		return;
+
+	/* Each worker reports what the device wrote since its last pull */
+	__atomic_store_n(&priv->dirty_tracking, false, __ATOMIC_RELEASE);
+	for (i = 0; i < priv->nr_dirty_workers; i++)
+		pthread_join(priv->dirty_workers[i].tid, NULL);
+	priv->nr_dirty_workers = 0;
+
+	for (i = 0; i < priv->nr_dirty_ranges; i++) {
+		ret = virtio_vdpa_cmd_dirty_page_stop_track(priv->pf_priv,
+				priv->vf_id, priv->dirty_ranges[i].addr);
+		if (ret)
+			DRV_LOG(ERR, "%s failed to stop tracking range 0x%" PRIx64
+					" ret:%d", priv->vdev->device->name,
+					priv->dirty_ranges[i].addr, ret);
+	}
+	virtio_vdpa_dirty_ranges_free(priv);
+
+	DRV_LOG(INFO, "%s vid %d dirty page tracking stopped",
+				priv->vdev->device->name, priv->vid);
+}
+
+/* Driver side status of a device fresh from reset */
+static void
+virtio_vdpa_dev_status_init(struct virtio_pci_dev *vpdev)
+{
+	/* Tell the host we've noticed this device. */
+	virtio_pci_dev_set_status(vpdev, VIRTIO_CONFIG_STATUS_ACK);
 
 	/* Tell the host we've known how to drive the device. */
-	virtio_pci_dev_set_status(priv->vpdev, VIRTIO_CONFIG_STATUS_DRIVER);
+	virtio_pci_dev_set_status(vpdev, VIRTIO_CONFIG_STATUS_DRIVER);
+}
+
+/*
+ * Give up on running the device as it was handed over, when the new
+ * vhost-user session does not set it up the same: it is reset and set up
+ * from scratch like any other.
+ */
+static int
+virtio_vdpa_handover_abort(struct virtio_vdpa_priv *priv)
+{
+	DRV_LOG(WARNING, "%s differs from its hand-over, reset",
+				priv->vdev->device->name);
+	virtio_pci_dev_reset(priv->vpdev);
+	virtio_vdpa_dev_status_init(priv->vpdev);
+	priv->adopted = false;
+	rte_free(priv->handover_vrings);
+	priv->handover_vrings = NULL;
+	priv->nr_handover_vrings = 0;
+	if (!priv->res_allocated)
+		return 0;
+	return virtio_pci_dev_interrupts_alloc(priv->vpdev, priv->nvec);
+}
+
+static int
+virtio_vdpa_features_set(int vid)
+{
+	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+	uint64_t log_base, log_size;
+	uint64_t features, dev_features;
+	int ret;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+	if (priv->handed_over)
+		return -EBUSY;
+	priv->vid = vid;
+	ret = virtio_vdpa_dev_res_alloc(priv);
+	if (ret)
+		return ret;
+	virtio_pci_dev_reset_wait(priv->vpdev);
+	ret = rte_vhost_get_negotiated_features(vid, &features);
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to get negotiated features",
+					priv->vdev->device->name);
+		return ret;
+	}
+	if (RTE_VHOST_NEED_LOG(features)) {
+		ret = rte_vhost_get_log_base(vid, &log_base, &log_size);
+		if (ret) {
+			DRV_LOG(ERR, "%s failed to get log base",
+						priv->vdev->device->name);
+			return ret;
+		}
+		ret = virtio_vdpa_dirty_track_start(priv);
+		if (ret)
+			return ret;
+	} else {
+		virtio_vdpa_dirty_track_stop(priv);
+	}
+
+	/* TO_DO: check why --- */
+	features |= (1ULL << VIRTIO_F_IOMMU_PLATFORM);
+	virtio_pci_dev_features_get(priv->vpdev, &dev_features);
+	if (priv->adopted && (features & dev_features) != priv->guest_features) {
+		ret = virtio_vdpa_handover_abort(priv);
+		if (ret)
+			return ret;
+	}
+	/* An adopted device has them negotiated already */
+	if (!priv->adopted)
+		priv->guest_features = virtio_pci_dev_features_set(priv->vpdev,
+				features);
+	/* A VF has no admin queue, bit 40 is per-queue reset there */
+	virtio_pci_dev_queue_reset_enable(priv->vpdev,
+			!!(priv->guest_features & (1ULL << VIRTIO_F_RING_RESET)));
+	DRV_LOG(INFO, "%s vid %d hw feature is %" PRIx64 "guest feature is %" PRIx64,
+					priv->vdev->device->name, vid,
+					priv->guest_features, features);
+
+	return 0;
+}
+
+static int
+virtio_vdpa_dev_status_set(struct virtio_vdpa_priv *priv,
+		enum virtio_internal_status status)
+{
+	int ret;
+
+	ret = virtio_vdpa_cmd_set_status(priv->pf_priv, priv->vf_id, status);
+	if (ret)
+		DRV_LOG(ERR, "%s failed to move to internal status %d ret:%d",
+					priv->vdev->device->name, status, ret);
+	return ret;
+}
+
+/* Stop the device in place, it masters no more DMA once freezed */
+static int
+virtio_vdpa_dev_freeze(struct virtio_vdpa_priv *priv)
+{
+	int ret;
+
+	ret = virtio_vdpa_dev_status_set(priv, VIRTIO_S_QUIESCED);
+	if (ret)
+		return ret;
+	return virtio_vdpa_dev_status_set(priv, VIRTIO_S_FREEZED);
+}
+
+static void
+virtio_vdpa_dev_state_free(struct virtio_vdpa_priv *priv)
+{
+	rte_free(priv->state);
+	rte_free(priv->state_segs);
+	priv->state = NULL;
+	priv->state_len = 0;
+	priv->state_segs = NULL;
+	priv->nr_state_segs = 0;
+}
+
+/* Add a piece of state, pre-copied deltas come before the final state */
+static int
+virtio_vdpa_dev_state_append(struct virtio_vdpa_priv *priv, const void *buf,
+		size_t len)
+{
+	size_t *segs;
+	void *state;
+
+	if (priv->nr_state_segs == UINT16_MAX)
+		return -ENOSPC;
+	segs = rte_realloc(priv->state_segs,
+			(priv->nr_state_segs + 1) * sizeof(*segs), 0);
+	if (!segs)
+		return -ENOMEM;
+	priv->state_segs = segs;
+	state = rte_realloc(priv->state, priv->state_len + len, 0);
+	if (!state)
+		return -ENOMEM;
+	memcpy(RTE_PTR_ADD(state, priv->state_len), buf, len);
+	priv->state = state;
+	priv->state_len += len;
+	segs[priv->nr_state_segs++] = len;
+	return 0;
+}
+
+static int
+virtio_vdpa_dev_state_save(struct virtio_vdpa_priv *priv)
+{
+	struct iovec iov[VIRTIO_VDPA_STATE_NB_CHUNKS];
+	struct virtio_vdpa_state_stream *st;
+	int nb, k, ret = 0;
+	void *buf;
+
+	virtio_vdpa_dev_state_free(priv);
+	st = virtio_vdpa_state_stream_create(priv->pf_priv, priv->vf_id,
+			VIRTIO_VDPA_STATE_SAVE, VIRTIO_VDPA_STATE_CHUNK_SZ,
+			VIRTIO_VDPA_STATE_NB_CHUNKS);
+	if (!st)
+		return -rte_errno;
+
+	while ((nb = virtio_vdpa_state_stream_save(st, iov, RTE_DIM(iov))) > 0) {
+		for (k = 0; k < nb && !ret; k++) {
+			buf = rte_realloc(priv->state,
+					priv->state_len + iov[k].iov_len, 0);
+			if (!buf) {
+				ret = -ENOMEM;
+				break;
+			}
+			memcpy(RTE_PTR_ADD(buf, priv->state_len), iov[k].iov_base,
+					iov[k].iov_len);
+			priv->state = buf;
+			priv->state_len += iov[k].iov_len;
+		}
+		virtio_vdpa_state_stream_release(st, nb);
+		if (ret)
+			break;
+	}
+	if (nb < 0)
+		ret = nb;
+	virtio_vdpa_state_stream_destroy(st);
+	if (!ret && priv->state) {
+		priv->state_segs = rte_malloc(NULL, sizeof(*priv->state_segs), 0);
+		if (priv->state_segs) {
+			priv->state_segs[0] = priv->state_len;
+			priv->nr_state_segs = 1;
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+
+	if (ret) {
+		DRV_LOG(ERR, "%s failed to save device state ret:%d",
+					priv->vdev->device->name, ret);
+		virtio_vdpa_dev_state_free(priv);
+		return ret;
+	}
+
+	DRV_LOG(INFO, "%s saved %zu bytes device state",
+				priv->vdev->device->name, priv->state_len);
+	return 0;
+}
+
+static int
+virtio_vdpa_dev_state_restore_seg(struct virtio_vdpa_priv *priv,
+		const void *buf, size_t len)
+{
+	struct iovec iov[VIRTIO_VDPA_STATE_NB_CHUNKS];
+	struct virtio_vdpa_state_stream *st;
+	size_t off = 0;
+	int nb, k, ret = 0;
+
+	st = virtio_vdpa_state_stream_create(priv->pf_priv, priv->vf_id,
+			VIRTIO_VDPA_STATE_RESTORE, VIRTIO_VDPA_STATE_CHUNK_SZ,
+			VIRTIO_VDPA_STATE_NB_CHUNKS);
+	if (!st)
+		return -rte_errno;
+
+	while (off < len) {
+		nb = virtio_vdpa_state_stream_restore_get(st, iov, RTE_DIM(iov));
+		if (nb <= 0) {
+			ret = nb ? nb : -ENOBUFS;
+			break;
+		}
+		/* Only filled chunks are pushed, the others go back unused */
+		for (k = 0; k < nb && off < len; k++) {
+			iov[k].iov_len = RTE_MIN(iov[k].iov_len, len - off);
+			memcpy(iov[k].iov_base, RTE_PTR_ADD(buf, off),
+					iov[k].iov_len);
+			off += iov[k].iov_len;
+		}
+		ret = virtio_vdpa_state_stream_restore_put(st, iov, k);
+		if (ret)
+			break;
+	}
+	virtio_vdpa_state_stream_destroy(st);
+	return ret;
+}
+
+static int
+virtio_vdpa_dev_state_restore(struct virtio_vdpa_priv *priv)
+{
+	size_t off = 0;
+	uint16_t i;
+	int ret;
+
+	if (!virtio_vdpa_pf_priv_get(priv)) {
+		DRV_LOG(ERR, "%s parent PF %s is not managed",
+					priv->vdev->device->name, priv->pf_name);
+		return -ENODEV;
+	}
+
+	ret = virtio_vdpa_dev_freeze(priv);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < priv->nr_state_segs; i++) {
+		ret = virtio_vdpa_dev_state_restore_seg(priv,
+				RTE_PTR_ADD(priv->state, off), priv->state_segs[i]);
+		if (ret) {
+			DRV_LOG(ERR, "%s failed to restore device state piece %u ret:%d",
+						priv->vdev->device->name, i, ret);
+			return ret;
+		}
+		off += priv->state_segs[i];
+	}
+
+	ret = virtio_vdpa_dev_status_set(priv, VIRTIO_S_QUIESCED);
+	if (ret)
+		return ret;
+	ret = virtio_vdpa_dev_status_set(priv, VIRTIO_S_RUNNING);
+	if (ret)
+		return ret;
+
+	DRV_LOG(INFO, "%s restored %zu bytes device state in %u pieces",
+				priv->vdev->device->name, priv->state_len,
+				priv->nr_state_segs);
+	virtio_vdpa_dev_state_free(priv);
+	return 0;
+}
+
+/*
+ * Hand the ring indexes of the stopped device back to vhost. A ring has no
+ * requests in flight once the device is quiesced, so both are the used
+ * index of a split ring. A packed ring has no used index, its device is
+ * wherever the driver stopped making slots available, wrap counter in
+ * bit 15 as vhost keeps it.
+ */
+static void
+virtio_vdpa_vring_base_sync(struct virtio_vdpa_priv *priv)
+{
+	struct rte_vhost_vring vq;
+	uint16_t idx;
+	int i;
+
+	for (i = 0; i < priv->nr_virtqs; i++) {
+		if (!priv->vrings[i]->enable ||
+		    rte_vhost_get_vhost_vring(priv->vid, i, &vq) || !vq.used)
+			continue;
+		if (priv->guest_features & (1ULL << VIRTIO_F_RING_PACKED))
+			idx = virtio_vdpa_packed_avail_pos(&vq,
+					priv->vrings[i]->avail_pos);
+		else
+			idx = __atomic_load_n(&vq.used->idx, __ATOMIC_ACQUIRE);
+		rte_vhost_set_vring_base(priv->vid, i, idx, idx);
+		DRV_LOG(DEBUG, "%s vid %d virtq %d base %u",
+					priv->vdev->device->name, priv->vid, i, idx);
+	}
+}
+
+/*
+ * Bind the config vector and the callfds of all enabled virtqs with one
+ * VFIO call, which programs their MSI-X vectors too, then set the queues
+ * up in the device. Vectors must be in place before a queue is enabled.
+ */
+static int
+virtio_vdpa_virtqs_setup(struct virtio_vdpa_priv *priv)
+{
+	struct virtio_pci_dev_vring_info vring_info;
+	struct virtio_vdpa_vring_info *virtq;
+	struct rte_vhost_vring vq;
+	int *fds, ret = 0;
+	uint16_t i;
+
+	fds = rte_malloc(NULL, sizeof(*fds) * (priv->nr_virtqs + 1), 0);
+	if (!fds)
+		return -ENOMEM;
+
+	fds[0] = rte_intr_fd_get(priv->pdev->intr_handle);
+	for (i = 0; i < priv->nr_virtqs; i++) {
+		fds[i + 1] = -1;
+		if (priv->vrings[i]->enable &&
+		    !rte_vhost_get_vhost_vring(priv->vid, i, &vq))
+			fds[i + 1] = vq.callfd;
+	}
+	ret = virtio_pci_dev_interrupts_set(priv->vpdev, fds, 0,
+			priv->nr_virtqs + 1);
+	rte_free(fds);
+	if (ret) {
+		DRV_LOG(ERR, "%s error enabling virtio dev interrupts: %d(%s)",
+				priv->vdev->device->name, ret, strerror(errno));
+		return ret;
+	}
+
+	for (i = 0; i < priv->nr_virtqs; i++) {
+		virtq = priv->vrings[i];
+		if (!virtq->enable)
+			continue;
+		virtq->intr_bound = true;
+		virtq->stats.intr_binds++;
+		vring_info.desc = virtq->desc;
+		vring_info.avail = virtq->avail;
+		vring_info.used = virtq->used;
+		vring_info.size = virtq->size;
+		/* An adopted device runs its queues already */
+		if (!priv->adopted &&
+		    virtio_pci_dev_queue_set(priv->vpdev, i, &vring_info)) {
+			DRV_LOG(ERR, "%s setup_queue %u failed",
+						priv->vdev->device->name, i);
+			return -EINVAL;
+		}
+		virtio_pci_dev_queue_notify(priv->vpdev, i);
+	}
+	return 0;
+}
+
+/* Unbind the config and all queue vectors with one VFIO call */
+static int
+virtio_vdpa_virtqs_intr_unbind(struct virtio_vdpa_priv *priv)
+{
+	int *fds, ret;
+	uint16_t i;
+
+	fds = rte_malloc(NULL, sizeof(*fds) * (priv->nr_virtqs + 1), 0);
+	if (!fds)
+		return -ENOMEM;
+	for (i = 0; i <= priv->nr_virtqs; i++)
+		fds[i] = -1;
+	ret = virtio_pci_dev_interrupts_set(priv->vpdev, fds, 0,
+			priv->nr_virtqs + 1);
+	rte_free(fds);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < priv->nr_virtqs; i++)
+		priv->vrings[i]->intr_bound = false;
+	return 0;
+}
+
+static void
+virtio_vdpa_dev_reset_done(struct virtio_pci_dev *vpdev, int status,
+		void *cb_arg)
+{
+	struct virtio_vdpa_priv *priv = cb_arg;
+
+	virtio_vdpa_dev_status_init(vpdev);
+	DRV_LOG(DEBUG, "%s background reset done: %d",
+				priv->vdev->device->name, status);
+}
+
+/*
+ * The device is driven by the instance it was handed over to: drop the
+ * driver side only, no reset, no queue or vector is touched.
+ */
+static void
+virtio_vdpa_handover_detach(struct virtio_vdpa_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < priv->nr_virtqs; i++) {
+		if (!priv->vrings[i]->enable)
+			continue;
+		virtio_vdpa_virtq_doorbell_relay_disable(priv, i);
+		priv->vrings[i]->enable = false;
+	}
+	virtio_vdpa_dirty_track_stop(priv);
+	virtio_vdpa_mem_index_free(priv);
+	priv->configured = 0;
+}
+
+static int
+virtio_vdpa_dev_close(int vid)
+{
+	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+	bool stopped = false;
+	int ret, i;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+	if (priv->handed_over) {
+		virtio_vdpa_handover_detach(priv);
+		DRV_LOG(INFO, "%s vid %d detached, handed over",
+					priv->vdev->device->name, vid);
+		return 0;
+	}
+
+	/*
+	 * Switchover: freeze the device in place so the final dirty sync
+	 * sees all of its writes, then keep its state for the destination.
+	 * Otherwise quiesce it through its PF when there is one.
+	 */
+	if (priv->dirty_tracking) {
+		ret = virtio_vdpa_dev_freeze(priv);
+		virtio_vdpa_dirty_track_stop(priv);
+		if (!ret) {
+			virtio_vdpa_dev_state_save(priv);
+			stopped = true;
+		}
+	} else if (virtio_vdpa_pf_priv_get(priv) &&
+		   !virtio_vdpa_cmd_set_status(priv->pf_priv, priv->vf_id,
+				VIRTIO_S_QUIESCED)) {
+		priv->reset_quiesced = true;
+		stopped = true;
+	}
+
+	ret = virtio_vdpa_virtqs_intr_unbind(priv);
+	if (ret) {
+		DRV_LOG(ERR, "%s error disabling virtio dev interrupts: %d (%s)",
+				priv->vdev->device->name,
+				ret, strerror(errno));
+		return ret;
+	}
+
+	/*
+	 * A stopped device moves its rings no more, their indexes are final
+	 * and the reset can complete in the background: the vhost-user thread
+	 * doesn't wait for it, later operations on this device do.
+	 */
+	if (stopped && virtio_pci_dev_reset_async(priv->vpdev,
+			virtio_vdpa_dev_reset_done, priv))
+		stopped = false;
+	if (!stopped)
+		virtio_pci_dev_reset(priv->vpdev);
+	virtio_vdpa_vring_base_sync(priv);
+
+	/*
+	 * IOMMU mappings stay for the next configuration to reuse, only the
+	 * lookup index goes as the memory table may change from now on.
+	 */
+	virtio_vdpa_mem_index_free(priv);
+
+	/* Disable all queues */
+	for (i = 0; i < priv->nr_virtqs; i++) {
+		if (priv->vrings[i]->enable)
+			virtio_vdpa_vring_state_set(vid, i, 0);
+	}
+
+	if (!stopped)
+		virtio_vdpa_dev_status_init(priv->vpdev);
 
 	priv->configured = 0;
 
@@ -642,23 +2559,82 @@ virtio_vdpa_dev_close(int vid)
 	return ret;
 }
 
+static int
+virtio_vdpa_migration_done(int vid)
+{
+	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+
+	virtio_vdpa_dirty_track_stop(priv);
+	return 0;
+}
+
+/* Whether vhost set the vrings up as the device runs them */
+static bool
+virtio_vdpa_handover_match(struct virtio_vdpa_priv *priv)
+{
+	struct virtio_vdpa_handover_vring *hv;
+	struct virtio_vdpa_vring_info *virtq;
+	bool enable;
+	uint16_t i;
+
+	for (i = 0; i < priv->nr_handover_vrings; i++) {
+		hv = &priv->handover_vrings[i];
+		virtq = i < priv->nr_virtqs ? priv->vrings[i] : NULL;
+		enable = virtq && virtq->enable;
+		if (enable != !!hv->enable)
+			return false;
+		if (enable && (virtq->desc != hv->desc ||
+		    virtq->avail != hv->avail || virtq->used != hv->used ||
+		    virtq->size != hv->size))
+			return false;
+	}
+	return true;
+}
+
 static int
 virtio_vdpa_dev_config(int vid)
 {
 	struct rte_vdpa_device *vdev = rte_vhost_get_vdpa_device(vid);
 	struct virtio_vdpa_priv *priv =
 		virtio_vdpa_find_priv_resource_by_vdev(vdev);
-	int ret, fd;
+	enum virtio_internal_status status;
+	uint64_t features;
+	int ret;
 
 	if (priv == NULL) {
 		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
 		return -ENODEV;
 	}
+	if (priv->handed_over)
+		return -EBUSY;
 	if (priv->configured) {
 		DRV_LOG(ERR, "%s vid %d already configured",
 					vdev->device->name, vid);
 		return -EBUSY;
 	}
+	ret = virtio_vdpa_dev_res_alloc(priv);
+	if (ret)
+		return ret;
+
+	virtio_pci_dev_reset_wait(priv->vpdev);
+	/* Quiesced at close, a state to restore sets the status itself */
+	if (priv->reset_quiesced) {
+		priv->reset_quiesced = false;
+		if (!priv->state &&
+		    !virtio_vdpa_cmd_get_status(priv->pf_priv, priv->vf_id,
+				&status) && status == VIRTIO_S_QUIESCED) {
+			ret = virtio_vdpa_dev_status_set(priv, VIRTIO_S_RUNNING);
+			if (ret)
+				return ret;
+		}
+	}
 
 	priv->nr_virtqs = rte_vhost_get_vring_num(vid);
 	if (priv->nvec <= (priv->nr_virtqs + 1)) {
@@ -668,24 +2644,60 @@ virtio_vdpa_dev_config(int vid)
 	}
 
 	priv->vid = vid;
+	virtio_vdpa_dma_prepin_wait(priv);
 	ret = virtio_vdpa_dma_map(priv);
 	if (ret) {
 		DRV_LOG(ERR, "%s fail to do dma map: %d",
 					vdev->device->name, ret);
 		return ret;
 	}
+	/* The table is final at configuration, refresh the index from it */
+	virtio_vdpa_mem_index_build(priv);
 
-	fd = rte_intr_fd_get(priv->pdev->intr_handle);
-	ret = virtio_pci_dev_interrupt_enable(priv->vpdev, fd, 0);
+	if (priv->adopted && !virtio_vdpa_handover_match(priv)) {
+		ret = virtio_vdpa_handover_abort(priv);
+		if (!ret)
+			ret = rte_vhost_get_negotiated_features(vid, &features);
+		if (ret)
+			return ret;
+		features |= (1ULL << VIRTIO_F_IOMMU_PLATFORM);
+		priv->guest_features = virtio_pci_dev_features_set(priv->vpdev,
+				features);
+	}
+
+	ret = virtio_vdpa_virtqs_setup(priv);
 	if (ret) {
-		DRV_LOG(ERR, "%s error enabling virtio dev interrupts: %d(%s)",
-				vdev->device->name, ret, strerror(errno));
-		rte_errno = rte_errno ? rte_errno : EINVAL;
+		virtio_vdpa_virtqs_intr_unbind(priv);
+		virtio_pci_dev_reset(priv->vpdev);
 		virtio_vdpa_dma_unmap(priv);
-		return -rte_errno;
+		return ret;
+	}
+
+	/* Handed over running, the device is left as it is */
+	if (priv->adopted) {
+		priv->adopted = false;
+		rte_free(priv->handover_vrings);
+		priv->handover_vrings = NULL;
+		priv->nr_handover_vrings = 0;
+		priv->configured = 1;
+		DRV_LOG(INFO, "%s vid %d resumed from hand-over",
+					vdev->device->name, vid);
+		return 0;
 	}
 
 	virtio_pci_dev_set_status(priv->vpdev, VIRTIO_CONFIG_STATUS_FEATURES_OK);
+
+	/* Resume where the source left off if it handed over its state */
+	if (priv->state) {
+		ret = virtio_vdpa_dev_state_restore(priv);
+		if (ret) {
+			virtio_vdpa_virtqs_intr_unbind(priv);
+			virtio_pci_dev_reset(priv->vpdev);
+			virtio_vdpa_dma_unmap(priv);
+			return ret;
+		}
+	}
+
 	/* Start the device */
 	virtio_pci_dev_set_status(priv->vpdev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
 	DRV_LOG(INFO, "%s vid %d move to driver ok", vdev->device->name, vid);
@@ -736,6 +2748,9 @@ virtio_vdpa_notify_area_get(int vid, int qid, uint64_t *offset, uint64_t *size)
 		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
 		return -ENODEV;
 	}
+	ret = virtio_vdpa_dev_res_alloc(priv);
+	if (ret)
+		return ret;
 
 	ret = virtio_pci_dev_notify_area_get(priv->vpdev, qid, offset, size);
 	if (ret) {
@@ -748,6 +2763,162 @@ virtio_vdpa_notify_area_get(int vid, int qid, uint64_t *offset, uint64_t *size)
 	return 0;
 }
 
+enum {
+	VIRTIO_VDPA_STATS_KICKS,
+	VIRTIO_VDPA_STATS_NOTIFIER_CHANGES,
+	VIRTIO_VDPA_STATS_NOTIFIER_STATE,
+	VIRTIO_VDPA_STATS_INTR_BINDS,
+	VIRTIO_VDPA_STATS_ENABLES,
+	VIRTIO_VDPA_STATS_DISABLES,
+	VIRTIO_VDPA_STATS_ENABLE_LAST_US,
+	VIRTIO_VDPA_STATS_ENABLE_MAX_US,
+	VIRTIO_VDPA_STATS_DISABLE_LAST_US,
+	VIRTIO_VDPA_STATS_DISABLE_MAX_US,
+	VIRTIO_VDPA_STATS_AVAIL_IDX,
+	VIRTIO_VDPA_STATS_USED_IDX,
+	VIRTIO_VDPA_STATS_OUTSTANDING,
+	VIRTIO_VDPA_STATS_MAX
+};
+
+static const char * const virtio_vdpa_stats_names[VIRTIO_VDPA_STATS_MAX] = {
+	"kicks",
+	"notifier_changes",
+	"notifier_state",
+	"intr_binds",
+	"enables",
+	"disables",
+	"enable_last_us",
+	"enable_max_us",
+	"disable_last_us",
+	"disable_max_us",
+	"avail_idx",
+	"used_idx",
+	"outstanding",
+};
+
+/*
+ * Ring indexes show how far the device got, a queue with outstanding
+ * descriptors and a used index that does not move is stuck. They are read
+ * from guest memory for split rings only.
+ */
+static void
+virtio_vdpa_vq_stats_fill(struct virtio_vdpa_priv *priv, int qid,
+		uint64_t values[VIRTIO_VDPA_STATS_MAX])
+{
+	struct virtio_vdpa_vring_info *virtq;
+	struct virtio_vdpa_vq_stats *stats;
+	struct rte_vhost_vring vq;
+	uint16_t avail, used;
+
+	memset(values, 0, sizeof(uint64_t) * VIRTIO_VDPA_STATS_MAX);
+	if (!priv->res_allocated)
+		return;
+	virtq = priv->vrings[qid];
+	stats = &virtq->stats;
+	values[VIRTIO_VDPA_STATS_KICKS] =
+		__atomic_load_n(&stats->kicks, __ATOMIC_RELAXED);
+	values[VIRTIO_VDPA_STATS_NOTIFIER_CHANGES] =
+		__atomic_load_n(&stats->notifier_changes, __ATOMIC_RELAXED);
+	values[VIRTIO_VDPA_STATS_NOTIFIER_STATE] =
+		__atomic_load_n(&virtq->notifier_state, __ATOMIC_RELAXED);
+	values[VIRTIO_VDPA_STATS_INTR_BINDS] = stats->intr_binds;
+	values[VIRTIO_VDPA_STATS_ENABLES] = stats->enables;
+	values[VIRTIO_VDPA_STATS_DISABLES] = stats->disables;
+	values[VIRTIO_VDPA_STATS_ENABLE_LAST_US] = stats->enable_last_us;
+	values[VIRTIO_VDPA_STATS_ENABLE_MAX_US] = stats->enable_max_us;
+	values[VIRTIO_VDPA_STATS_DISABLE_LAST_US] = stats->disable_last_us;
+	values[VIRTIO_VDPA_STATS_DISABLE_MAX_US] = stats->disable_max_us;
+
+	if (!priv->configured || !virtq->enable ||
+	    (priv->guest_features & (1ULL << VIRTIO_F_RING_PACKED)) ||
+	    rte_vhost_get_vhost_vring(priv->vid, qid, &vq))
+		return;
+	avail = __atomic_load_n(&vq.avail->idx, __ATOMIC_RELAXED);
+	used = __atomic_load_n(&vq.used->idx, __ATOMIC_RELAXED);
+	values[VIRTIO_VDPA_STATS_AVAIL_IDX] = avail;
+	values[VIRTIO_VDPA_STATS_USED_IDX] = used;
+	values[VIRTIO_VDPA_STATS_OUTSTANDING] = (uint16_t)(avail - used);
+}
+
+static int
+virtio_vdpa_stats_names_get(struct rte_vdpa_device *vdev,
+		struct rte_vdpa_stat_name *stats_names, unsigned int size)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+	unsigned int i;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+	if (!stats_names)
+		return VIRTIO_VDPA_STATS_MAX;
+	size = RTE_MIN(size, (unsigned int)VIRTIO_VDPA_STATS_MAX);
+	for (i = 0; i < size; i++)
+		strlcpy(stats_names[i].name, virtio_vdpa_stats_names[i],
+			RTE_VDPA_STATS_NAME_SIZE);
+	return size;
+}
+
+static int
+virtio_vdpa_stats_get(struct rte_vdpa_device *vdev, int qid,
+		struct rte_vdpa_stat *stats, unsigned int n)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+	uint64_t values[VIRTIO_VDPA_STATS_MAX];
+	unsigned int i;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+	if (qid < 0 || qid >= (int)priv->hw_nr_virtqs) {
+		DRV_LOG(ERR, "Too big vq_idx: %d", qid);
+		return -E2BIG;
+	}
+
+	virtio_vdpa_vq_stats_fill(priv, qid, values);
+	n = RTE_MIN(n, (unsigned int)VIRTIO_VDPA_STATS_MAX);
+	for (i = 0; i < n; i++) {
+		stats[i].id = i;
+		stats[i].value = values[i];
+	}
+	return n;
+}
+
+static int
+virtio_vdpa_stats_reset(struct rte_vdpa_device *vdev, int qid)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_vdev(vdev);
+	struct virtio_vdpa_vq_stats *stats;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid vDPA device: %s", vdev->device->name);
+		return -ENODEV;
+	}
+	if (qid < 0 || qid >= (int)priv->hw_nr_virtqs) {
+		DRV_LOG(ERR, "Too big vq_idx: %d", qid);
+		return -E2BIG;
+	}
+
+	if (!priv->res_allocated)
+		return 0;
+	stats = &priv->vrings[qid]->stats;
+	__atomic_store_n(&stats->kicks, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->notifier_changes, 0, __ATOMIC_RELAXED);
+	stats->intr_binds = 0;
+	stats->enables = 0;
+	stats->disables = 0;
+	stats->enable_last_us = 0;
+	stats->enable_max_us = 0;
+	stats->disable_last_us = 0;
+	stats->disable_max_us = 0;
+	return 0;
+}
+
 static struct rte_vdpa_dev_ops virtio_vdpa_ops = {
 	.get_queue_num = virtio_vdpa_vqs_max_get,
 	.get_features = virtio_vdpa_features_get,
@@ -756,13 +2927,13 @@ static struct rte_vdpa_dev_ops virtio_vdpa_ops = {
 	.dev_close = virtio_vdpa_dev_close,
 	.set_vring_state = virtio_vdpa_vring_state_set,
 	.set_features = virtio_vdpa_features_set,
-	.migration_done = NULL,
+	.migration_done = virtio_vdpa_migration_done,
 	.get_vfio_group_fd = virtio_vdpa_group_fd_get,
 	.get_vfio_device_fd = virtio_vdpa_device_fd_get,
 	.get_notify_area = virtio_vdpa_notify_area_get,
-	.get_stats_names = NULL,
-	.get_stats = NULL,
-	.reset_stats = NULL,
+	.get_stats_names = virtio_vdpa_stats_names_get,
+	.get_stats = virtio_vdpa_stats_get,
+	.reset_stats = virtio_vdpa_stats_reset,
 };
 
 static int vdpa_check_handler(__rte_unused const char *key,
@@ -777,7 +2948,81 @@ static int vdpa_check_handler(__rte_unused const char *key,
 }
 
 static int
-virtio_pci_devargs_parse(struct rte_devargs *devargs, int *vdpa)
+virtio_vdpa_dirty_map_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	enum virtio_dirty_track_mode *mode = ret_val;
+
+	if (strcmp(value, "bitmap") == 0)
+		*mode = VIRTIO_M_DIRTY_TRACK_PULL_BITMAP;
+	else if (strcmp(value, "bytemap") == 0)
+		*mode = VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+virtio_vdpa_doorbell_relay_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	bool *relay = ret_val;
+
+	if (strcmp(value, "service") == 0)
+		*relay = true;
+	else if (strcmp(value, "intr") == 0)
+		*relay = false;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+virtio_vdpa_dma_workers_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	unsigned long workers;
+	char *end;
+
+	errno = 0;
+	workers = strtoul(value, &end, 0);
+	if (errno || *end != '\0' || !workers ||
+	    workers > VIRTIO_VDPA_DMA_MAX_WORKERS)
+		return -EINVAL;
+	*(uint16_t *)ret_val = workers;
+	return 0;
+}
+
+static int
+virtio_vdpa_bool_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	if (strcmp(value, "1") == 0)
+		*(bool *)ret_val = true;
+	else if (strcmp(value, "0") == 0)
+		*(bool *)ret_val = false;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+virtio_vdpa_path_handler(__rte_unused const char *key,
+		const char *value, void *ret_val)
+{
+	if (value[0] == '\0' || strlcpy(ret_val, value,
+			VIRTIO_VDPA_HANDOVER_PATH_LEN) >= VIRTIO_VDPA_HANDOVER_PATH_LEN)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+virtio_pci_devargs_parse(struct rte_devargs *devargs,
+		struct virtio_vdpa_devargs *args)
 {
 	struct rte_kvargs *kvlist;
 	int ret = 0;
@@ -796,95 +3041,461 @@ virtio_pci_devargs_parse(struct rte_devargs *devargs, int *vdpa)
 		 * vdpa=1
 		 */
 		ret = rte_kvargs_process(kvlist, VIRTIO_ARG_VDPA,
-				vdpa_check_handler, vdpa);
+				vdpa_check_handler, &args->vdpa);
 		if (ret < 0)
 			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_ARG_VDPA);
 	}
 
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_DIRTY_MAP) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_DIRTY_MAP,
+				virtio_vdpa_dirty_map_handler, &args->dirty_mode);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_ARG_DIRTY_MAP);
+	}
+
+	if (ret >= 0 &&
+	    rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_DOORBELL_RELAY) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_DOORBELL_RELAY,
+				virtio_vdpa_doorbell_relay_handler,
+				&args->doorbell_relay);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s",
+					VIRTIO_VDPA_ARG_DOORBELL_RELAY);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_DMA_WORKERS) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_DMA_WORKERS,
+				virtio_vdpa_dma_workers_handler, &args->dma_workers);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_ARG_DMA_WORKERS);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_DMA_PREPIN) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_DMA_PREPIN,
+				virtio_vdpa_bool_handler, &args->dma_prepin);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_ARG_DMA_PREPIN);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_ASYNC_PROBE) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_ASYNC_PROBE,
+				virtio_vdpa_bool_handler, &args->async_probe);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_ARG_ASYNC_PROBE);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_LAZY_ALLOC) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_LAZY_ALLOC,
+				virtio_vdpa_bool_handler, &args->lazy_alloc);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_ARG_LAZY_ALLOC);
+	}
+
+	if (ret >= 0 && rte_kvargs_count(kvlist, VIRTIO_VDPA_ARG_HANDOVER) == 1) {
+		ret = rte_kvargs_process(kvlist, VIRTIO_VDPA_ARG_HANDOVER,
+				virtio_vdpa_path_handler, args->handover);
+		if (ret < 0)
+			DRV_LOG(ERR, "Failed to parse %s", VIRTIO_VDPA_ARG_HANDOVER);
+	}
+
 	rte_kvargs_free(kvlist);
 
 	return ret;
 }
 
+/* Undoes virtio_vdpa_dev_init(), whether it completed or not */
 static void
-virtio_vdpa_queues_free(struct virtio_vdpa_priv *priv)
+virtio_vdpa_dev_uninit(struct virtio_vdpa_priv *priv)
 {
-	uint16_t nr_vq = priv->hw_nr_virtqs;
-	struct virtio_vdpa_vring_info *vr;
-	uint16_t i;
+	/* Not known to EAL, VFIO fds taken over are ours to close */
+	if (priv->vfio_adopted) {
+		close(priv->vfio_group_fd);
+		close(priv->vfio_container_fd);
+		priv->vfio_group_fd = -1;
+		priv->vfio_container_fd = -1;
+		priv->vfio_adopted = false;
+	}
+	rte_free(priv->handover_vrings);
+	priv->handover_vrings = NULL;
+	rte_free(priv->handover_dma);
+	priv->handover_dma = NULL;
+	if (priv->res_allocated) {
+		if (virtio_pci_dev_interrupts_free(priv->vpdev))
+			DRV_LOG(ERR, "Error free virtio dev interrupts: %s",
+					strerror(errno));
+		virtio_vdpa_queues_free(priv);
+		priv->res_allocated = false;
+	}
+	if (priv->vpdev) {
+		virtio_pci_dev_free(priv->vpdev);
+		priv->vpdev = NULL;
+	}
+	priv->vfio_dev_fd = -1;
+}
 
-	if (priv->vrings) {
-		for (i = 0; i < nr_vq; i++) {
-			vr = priv->vrings[i];
-			if (!vr)
-				continue;
-			rte_free(vr);
-			priv->vrings[i] = NULL;
+static void
+virtio_vdpa_handover_fds_close(int *fds)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_VDPA_HANDOVER_NB_FDS; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+}
+
+/*
+ * Take the device over from the instance listening on handover_path: its
+ * VFIO container, group and device with the IOMMU mappings, MSI-X and
+ * queues they hold. -ENOENT when there is nothing to take over.
+ */
+static int
+virtio_vdpa_handover_adopt(struct virtio_vdpa_priv *priv)
+{
+	struct virtio_vdpa_handover_req req = {
+		.version = VIRTIO_VDPA_HANDOVER_VERSION,
+	};
+	struct timeval tv = { .tv_sec = VIRTIO_VDPA_HANDOVER_TIMEOUT_SEC };
+	int fds[VIRTIO_VDPA_HANDOVER_NB_FDS] = { -1, -1, -1 };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct virtio_vdpa_handover_vring *vrings = NULL;
+	struct virtio_vdpa_mem_region *dma = NULL;
+	const char *devname = priv->pdev->device.name;
+	struct virtio_vdpa_handover_hdr hdr;
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct virtio_pci_dev *vpdev;
+	struct cmsghdr *cmsg;
+	int sock, ret, ack;
+	ssize_t len;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sock < 0)
+		return -errno;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	strlcpy(addr.sun_path, priv->handover_path, sizeof(addr.sun_path));
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		DRV_LOG(INFO, "%s no instance to take over from at %s",
+					devname, priv->handover_path);
+		close(sock);
+		return -ENOENT;
+	}
+
+	strlcpy(req.name, devname, sizeof(req.name));
+	if (send(sock, &req, sizeof(req), 0) != sizeof(req)) {
+		ret = -errno;
+		close(sock);
+		return ret;
+	}
+	len = recvmsg(sock, &msg, 0);
+	if (len != sizeof(hdr) || hdr.version != VIRTIO_VDPA_HANDOVER_VERSION) {
+		close(sock);
+		return -EPROTO;
+	}
+	if (hdr.result) {
+		close(sock);
+		return hdr.result == -ENODEV ? -ENOENT : hdr.result;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		close(sock);
+		return -EPROTO;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (hdr.nr_vrings > VIRTIO_VDPA_HANDOVER_MAX_ENTRIES ||
+	    hdr.nr_dma_regions > VIRTIO_VDPA_HANDOVER_MAX_ENTRIES) {
+		ret = -E2BIG;
+		goto error;
+	}
+	if (hdr.nr_vrings)
+		vrings = rte_zmalloc(NULL, sizeof(*vrings) * hdr.nr_vrings, 0);
+	if (hdr.nr_dma_regions)
+		dma = rte_zmalloc(NULL, sizeof(*dma) * hdr.nr_dma_regions, 0);
+	if ((hdr.nr_vrings && vrings == NULL) ||
+	    (hdr.nr_dma_regions && dma == NULL)) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	/* The body follows only when there is one */
+	if (hdr.nr_vrings || hdr.nr_dma_regions) {
+		iov[0].iov_base = vrings;
+		iov[0].iov_len = sizeof(*vrings) * hdr.nr_vrings;
+		iov[1].iov_base = dma;
+		iov[1].iov_len = sizeof(*dma) * hdr.nr_dma_regions;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		len = recvmsg(sock, &msg, 0);
+		if (len != (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+			ret = -EPROTO;
+			goto error;
 		}
-		rte_free(priv->vrings);
-		priv->vrings = NULL;
 	}
 
-	virtio_pci_dev_queues_free(priv->vpdev, nr_vq);
+	/* Its queues run as they are, no reset */
+	vpdev = virtio_pci_dev_adopt(priv->pdev,
+			fds[VIRTIO_VDPA_HANDOVER_FD_DEVICE],
+			hdr.running ? hdr.guest_features : 0);
+	if (vpdev == NULL) {
+		ret = -rte_errno;
+		goto error;
+	}
+	ack = 0;
+	if (send(sock, &ack, sizeof(ack), 0) != sizeof(ack)) {
+		/* Still driven by the old instance, leave the device be */
+		ret = -errno;
+		virtio_pci_dev_free(vpdev);
+		fds[VIRTIO_VDPA_HANDOVER_FD_DEVICE] = -1;
+		goto error;
+	}
+	close(sock);
+
+	priv->vpdev = vpdev;
+	priv->vfio_container_fd = fds[VIRTIO_VDPA_HANDOVER_FD_CONTAINER];
+	priv->vfio_group_fd = fds[VIRTIO_VDPA_HANDOVER_FD_GROUP];
+	priv->vfio_dev_fd = fds[VIRTIO_VDPA_HANDOVER_FD_DEVICE];
+	priv->vfio_adopted = true;
+	/* Mappings are kept as long as the next memory table has them */
+	priv->handover_dma = dma;
+	priv->nr_handover_dma = hdr.nr_dma_regions;
+	if (hdr.running) {
+		priv->adopted = true;
+		priv->guest_features = hdr.guest_features;
+		priv->handover_vrings = vrings;
+		priv->nr_handover_vrings = hdr.nr_vrings;
+	} else {
+		rte_free(vrings);
+		virtio_pci_dev_reset(vpdev);
+		virtio_vdpa_dev_status_init(vpdev);
+	}
+	DRV_LOG(INFO, "%s taken over from %s, %s", devname,
+				priv->handover_path, hdr.running ? "running" : "idle");
+	return 0;
+
+error:
+	ack = ret;
+	send(sock, &ack, sizeof(ack), 0);
+	close(sock);
+	virtio_vdpa_handover_fds_close(fds);
+	rte_free(vrings);
+	rte_free(dma);
+	DRV_LOG(ERR, "%s failed to take over from %s ret:%d",
+				devname, priv->handover_path, ret);
+	return ret;
 }
 
+/* The queues of an adopted device must be the ones handed over */
 static int
-virtio_vdpa_queues_alloc(struct virtio_vdpa_priv *priv)
+virtio_vdpa_handover_queues_check(struct virtio_vdpa_priv *priv)
 {
-	uint16_t nr_vq = priv->hw_nr_virtqs;
-	struct virtio_vdpa_vring_info *vr;
+	struct virtio_pci_dev_vring_info vring_info;
+	struct virtio_vdpa_handover_vring *hv;
 	uint16_t i;
 	int ret;
 
-	ret = virtio_pci_dev_queues_alloc(priv->vpdev, nr_vq);
-	if (ret) {
-		DRV_LOG(ERR, "%s failed to alloc virtio device queues",
-					priv->vdev->device->name);
-		return ret;
-	}
+	if (priv->nr_handover_vrings != priv->hw_nr_virtqs)
+		return -EINVAL;
+	for (i = 0; i < priv->hw_nr_virtqs; i++) {
+		hv = &priv->handover_vrings[i];
+		ret = virtio_pci_dev_queue_attach(priv->vpdev, i, &vring_info);
+		if (ret < 0)
+			return ret;
+		if (ret != !!hv->enable)
+			return -EINVAL;
+		if (ret && (vring_info.desc != hv->desc ||
+		    vring_info.avail != hv->avail ||
+		    vring_info.used != hv->used ||
+		    vring_info.size != hv->size))
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * VFIO binding, BAR mapping, device reset and, unless lazy, queues and
+ * MSI-X: the slow part of the probe, safe to run for several devices at
+ * once. With a hand-over path, the device is taken over instead when an
+ * instance serves it there.
+ */
+static int
+virtio_vdpa_dev_init(struct virtio_vdpa_priv *priv)
+{
+	struct rte_pci_device *pci_dev = priv->pdev;
+	const char *devname = pci_dev->device.name;
+	int iommu_group_num;
+	int ret;
+
+	if (priv->handover_path[0]) {
+		ret = virtio_vdpa_handover_adopt(priv);
+		if (!ret)
+			goto vfio_done;
+		if (ret != -ENOENT)
+			return ret;
+	}
+
+	ret = rte_vfio_get_group_num(rte_pci_get_sysfs_path(), devname,
+			&iommu_group_num);
+	if (ret <= 0) {
+		DRV_LOG(ERR, "%s failed to get IOMMU group ret:%d", devname, ret);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		return -rte_errno;
+	}
+
+	virtio_pci_vfio_lock();
+	priv->vfio_container_fd = rte_vfio_container_create();
+	if (priv->vfio_container_fd >= 0)
+		priv->vfio_group_fd = rte_vfio_container_group_bind(
+				priv->vfio_container_fd, iommu_group_num);
+	virtio_pci_vfio_unlock();
+	if (priv->vfio_container_fd < 0) {
+		DRV_LOG(ERR, "%s failed to get container fd", devname);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+	if (priv->vfio_group_fd < 0) {
+		DRV_LOG(ERR, "%s failed to get group fd", devname);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+
+	priv->vpdev = virtio_pci_dev_alloc(pci_dev);
+	if (priv->vpdev == NULL) {
+		DRV_LOG(ERR, "%s failed to alloc virito pci dev", devname);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+
+	priv->vfio_dev_fd = rte_intr_dev_fd_get(pci_dev->intr_handle);
+	if (priv->vfio_dev_fd < 0) {
+		DRV_LOG(ERR, "%s failed to get vfio dev fd", devname);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+
+vfio_done:
+	priv->hw_nr_virtqs = virtio_pci_dev_nr_vq_get(priv->vpdev);
+	priv->nvec = virtio_pci_dev_interrupts_num_get(priv->vpdev);
+	if (priv->nvec <= 0) {
+		DRV_LOG(ERR, "%s error dev interrupts %d less than 0",
+					devname, priv->nvec);
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+
+	/* Queues of a running device are checked right away, never lazily */
+	if ((!priv->lazy_alloc || priv->adopted) &&
+	    virtio_vdpa_dev_res_alloc(priv)) {
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+	if (priv->adopted && virtio_vdpa_handover_queues_check(priv) &&
+	    virtio_vdpa_handover_abort(priv)) {
+		rte_errno = rte_errno ? rte_errno : EINVAL;
+		goto error;
+	}
+	return 0;
+
+error:
+	ret = -rte_errno;
+	virtio_vdpa_dev_uninit(priv);
+	return ret;
+}
+
+static void *
+virtio_vdpa_probe_worker(void *arg __rte_unused)
+{
+	struct virtio_vdpa_priv *priv;
+	int ret;
+
+	pthread_mutex_lock(&probe_lock);
+	while ((priv = TAILQ_FIRST(&virtio_probe_jobs)) != NULL) {
+		TAILQ_REMOVE(&virtio_probe_jobs, priv, probe_next);
+		pthread_mutex_unlock(&probe_lock);
+
+		ret = virtio_vdpa_dev_init(priv);
+		if (ret)
+			DRV_LOG(ERR, "%s async probe failed ret:%d, device unusable",
+						priv->pdev->device.name, ret);
+
+		pthread_mutex_lock(&probe_lock);
+		__atomic_store_n(&priv->probe_state, ret ?
+				VIRTIO_VDPA_PROBE_FAILED : VIRTIO_VDPA_PROBE_DONE,
+				__ATOMIC_RELEASE);
+		pthread_cond_broadcast(&probe_cond);
+	}
+	nr_probe_workers--;
+	pthread_mutex_unlock(&probe_lock);
+	return NULL;
+}
 
-	priv->vrings = rte_zmalloc(NULL,
-							sizeof(struct virtio_vdpa_vring_info *) * nr_vq,
-							0);
-	if (!priv->vrings) {
-		virtio_vdpa_queues_free(priv);
-		return -ENOMEM;
-	}
+/* Queues the device init, a worker is added per job up to the CPU count */
+static int
+virtio_vdpa_probe_submit(struct virtio_vdpa_priv *priv)
+{
+	char name[RTE_MAX_THREAD_NAME_LEN];
+	long max_workers;
+	pthread_t tid;
+	int ret = 0;
 
-	for (i = 0; i < nr_vq; i++) {
-		vr = rte_zmalloc_socket(NULL, sizeof(struct virtio_vdpa_vring_info),
-								RTE_CACHE_LINE_SIZE,
-								priv->pdev->device.numa_node);
-		if (vr == NULL) {
-			virtio_vdpa_queues_free(priv);
-			return -ENOMEM;
+	max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	max_workers = RTE_MAX(1L, RTE_MIN(max_workers,
+				(long)VIRTIO_VDPA_PROBE_MAX_WORKERS));
+
+	pthread_mutex_lock(&probe_lock);
+	priv->probe_state = VIRTIO_VDPA_PROBE_PENDING;
+	TAILQ_INSERT_TAIL(&virtio_probe_jobs, priv, probe_next);
+	if ((long)nr_probe_workers < max_workers) {
+		snprintf(name, sizeof(name), "vdpa-probe-%u", nr_probe_workers);
+		ret = rte_ctrl_thread_create(&tid, name, NULL,
+				virtio_vdpa_probe_worker, NULL);
+		if (!ret) {
+			pthread_detach(tid);
+			nr_probe_workers++;
+		} else if (nr_probe_workers) {
+			/* Running workers take the job */
+			ret = 0;
+		} else {
+			TAILQ_REMOVE(&virtio_probe_jobs, priv, probe_next);
+			priv->probe_state = VIRTIO_VDPA_PROBE_DONE;
 		}
-		priv->vrings[i] = vr;
-		priv->vrings[i]->index = i;
-		priv->vrings[i]->priv = priv;
 	}
-	return 0;
+	pthread_mutex_unlock(&probe_lock);
+	return ret;
 }
 
 static int
 virtio_vdpa_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 		struct rte_pci_device *pci_dev)
 {
-	int vdpa = 0;
+	struct virtio_vdpa_devargs args = {
+		.vdpa = 0,
+		.dirty_mode = VIRTIO_M_DIRTY_TRACK_PULL_BYTEMAP,
+		.dma_workers = 1,
+	};
 	int ret;
 	struct virtio_vdpa_priv *priv;
 	char devname[RTE_DEV_NAME_MAX_LEN] = {0};
-	int iommu_group_num;
 
 	rte_pci_device_name(&pci_dev->addr, devname, RTE_DEV_NAME_MAX_LEN);
 
-	ret = virtio_pci_devargs_parse(pci_dev->device.devargs, &vdpa);
+	ret = virtio_pci_devargs_parse(pci_dev->device.devargs, &args);
 	if (ret < 0) {
 		DRV_LOG(ERR, "Devargs parsing is failed %d dev:%s", ret, devname);
 		return ret;
 	}
 	/* Virtio vdpa pmd skips probe if device needs to work in none vdpa mode */
-	if (vdpa != 1)
+	if (args.vdpa != 1)
 		return 1;
 
 	priv = rte_zmalloc("virtio vdpa device private", sizeof(*priv),
@@ -896,50 +3507,24 @@ virtio_vdpa_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 		return -rte_errno;
 	}
 
+	priv->dirty_map_mode = args.dirty_mode;
+	priv->doorbell_relay = args.doorbell_relay;
+	priv->dma_workers = args.dma_workers;
+	priv->dma_prepin = args.dma_prepin;
+	priv->lazy_alloc = args.lazy_alloc;
+	strlcpy(priv->handover_path, args.handover, sizeof(priv->handover_path));
+	if (virtio_vdpa_pf_name_get(devname, priv->pf_name,
+			sizeof(priv->pf_name), &priv->vf_id))
+		DRV_LOG(INFO, "%s has no parent PF, dirty page log disabled",
+					devname);
+
 	/* TO_DO: need to confirm following: */
 	priv->vfio_dev_fd = -1;
 	priv->vfio_group_fd = -1;
 	priv->vfio_container_fd = -1;
-
-	ret = rte_vfio_get_group_num(rte_pci_get_sysfs_path(), devname,
-			&iommu_group_num);
-	if (ret <= 0) {
-		DRV_LOG(ERR, "%s failed to get IOMMU group ret:%d", devname, ret);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
-	}
-
-	priv->vfio_container_fd = rte_vfio_container_create();
-	if (priv->vfio_container_fd < 0) {
-		DRV_LOG(ERR, "%s failed to get container fd", devname);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
-	}
-
-	priv->vfio_group_fd = rte_vfio_container_group_bind(
-			priv->vfio_container_fd, iommu_group_num);
-	if (priv->vfio_group_fd < 0) {
-		DRV_LOG(ERR, "%s failed to get group fd", devname);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
-	}
-
 	priv->pdev = pci_dev;
 
-	priv->vpdev = virtio_pci_dev_alloc(pci_dev);
-	if (priv->vpdev == NULL) {
-		DRV_LOG(ERR, "%s failed to alloc virito pci dev", devname);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
-	}
-
-	priv->vfio_dev_fd = rte_intr_dev_fd_get(pci_dev->intr_handle);
-	if (priv->vfio_dev_fd < 0) {
-		DRV_LOG(ERR, "%s failed to get vfio dev fd", devname);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
-	}
-
+	/* Registered first, so the device is found while it is initialized */
 	priv->vdev = rte_vdpa_register_device(&pci_dev->device, &virtio_vdpa_ops);
 	if (priv->vdev == NULL) {
 		DRV_LOG(ERR, "%s failed to register vDPA device", devname);
@@ -947,30 +3532,16 @@ virtio_vdpa_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 		goto error;
 	}
 
-	priv->hw_nr_virtqs = virtio_pci_dev_nr_vq_get(priv->vpdev);
-	ret = virtio_vdpa_queues_alloc(priv);
-	if (ret) {
-		DRV_LOG(ERR, "%s failed to alloc vDPA device queues ret:%d",
-					devname, ret);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
-	}
-
-	priv->nvec = virtio_pci_dev_interrupts_num_get(priv->vpdev);
-	if (priv->nvec <= 0) {
-		DRV_LOG(ERR, "%s error dev interrupts %d less than 0",
-					devname, priv->nvec);
-		rte_errno = rte_errno ? rte_errno : EINVAL;
-		goto error;
+	if (args.async_probe && !virtio_vdpa_probe_submit(priv)) {
+		pthread_mutex_lock(&priv_list_lock);
+		TAILQ_INSERT_TAIL(&virtio_priv_list, priv, next);
+		pthread_mutex_unlock(&priv_list_lock);
+		return 0;
 	}
 
-	ret = virtio_pci_dev_interrupts_alloc(priv->vpdev, priv->nvec);
-	if (ret) {
-		DRV_LOG(ERR, "%s error alloc virtio dev interrupts ret:%d %s",
-					devname, ret, strerror(errno));
-		rte_errno = rte_errno ? rte_errno : EINVAL;
+	ret = virtio_vdpa_dev_init(priv);
+	if (ret)
 		goto error;
-	}
 
 	pthread_mutex_lock(&priv_list_lock);
 	TAILQ_INSERT_TAIL(&virtio_priv_list, priv, next);
@@ -978,8 +3549,9 @@ virtio_vdpa_dev_probe(struct rte_pci_driver *pci_drv __rte_unused,
 	return 0;
 
 error:
-	if (priv)
-		rte_free(priv);
+	if (priv->vdev)
+		rte_vdpa_unregister_device(priv->vdev);
+	rte_free(priv);
 	return -rte_errno;
 }
 
@@ -987,7 +3559,7 @@ static int
 virtio_vdpa_dev_remove(struct rte_pci_device *pci_dev)
 {
 	struct virtio_vdpa_priv *priv = NULL;
-	bool found = false, ret;
+	bool found = false;
 
 	pthread_mutex_lock(&priv_list_lock);
 	TAILQ_FOREACH(priv, &virtio_priv_list, next) {
@@ -998,26 +3570,444 @@ virtio_vdpa_dev_remove(struct rte_pci_device *pci_dev)
 		}
 	}
 	pthread_mutex_unlock(&priv_list_lock);
-	if (found) {
+	if (!found)
+		return -ENODEV;
+
+	if (virtio_vdpa_probe_wait(priv)) {
+		/* Init failed and cleaned up after itself */
+		rte_vdpa_unregister_device(priv->vdev);
+		rte_free(priv);
+		return 0;
+	}
+
+	/* Left running and mapped for the instance it was handed over to */
+	if (priv->handed_over) {
 		if (priv->configured)
-			virtio_vdpa_dev_close(priv->vid);
+			virtio_vdpa_handover_detach(priv);
+		virtio_vdpa_dev_state_free(priv);
+		virtio_vdpa_dma_prepin_wait(priv);
+		rte_vdpa_unregister_device(priv->vdev);
+		virtio_vdpa_queues_free(priv);
+		virtio_pci_dev_release(priv->vpdev);
+		rte_free(priv->dma_regions);
+		rte_free(priv);
+		return 0;
+	}
 
-		if (priv->vdev)
-			rte_vdpa_unregister_device(priv->vdev);
+	if (priv->configured)
+		virtio_vdpa_dev_close(priv->vid);
+	/* Adopted running but never configured again */
+	if (priv->adopted)
+		virtio_pci_dev_reset(priv->vpdev);
+	virtio_vdpa_dirty_track_stop(priv);
+	virtio_vdpa_dev_state_free(priv);
+	virtio_vdpa_mem_index_free(priv);
+	virtio_vdpa_dma_prepin_wait(priv);
+	/* The close reset may still run, DMA stops with it */
+	virtio_pci_dev_reset_wait(priv->vpdev);
+	virtio_vdpa_dma_unmap(priv);
+
+	if (priv->vdev)
+		rte_vdpa_unregister_device(priv->vdev);
+
+	virtio_vdpa_dev_uninit(priv);
+	rte_free(priv);
+	return 0;
+}
 
-		ret = virtio_pci_dev_interrupts_free(priv->vpdev);
-		if (ret) {
-			DRV_LOG(ERR, "Error free virtio dev interrupts: %s",
-					strerror(errno));
+static struct virtio_vdpa_priv *
+virtio_vdpa_find_priv_resource_by_name(const char *vf_name)
+{
+	struct virtio_vdpa_priv *priv;
+	struct rte_pci_addr addr;
+	bool found = false;
+
+	if (rte_pci_addr_parse(vf_name, &addr))
+		return NULL;
+
+	pthread_mutex_lock(&priv_list_lock);
+	TAILQ_FOREACH(priv, &virtio_priv_list, next) {
+		if (!rte_pci_addr_cmp(&priv->pdev->addr, &addr)) {
+			found = true;
+			break;
 		}
+	}
+	pthread_mutex_unlock(&priv_list_lock);
+	if (!found || virtio_vdpa_probe_wait(priv))
+		return NULL;
+	return priv;
+}
 
-		virtio_vdpa_queues_free(priv);
-		virtio_pci_dev_free(priv->vpdev);
+int
+rte_vdpa_vf_dev_state_get(const char *vf_name, void *buf, size_t *len)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_name(vf_name);
 
-		rte_free(priv);
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid VF: %s", vf_name);
+		return -ENODEV;
+	}
+	if (!priv->state)
+		return -ENOENT;
+	if (*len < priv->state_len) {
+		*len = priv->state_len;
+		return -ENOSPC;
+	}
+
+	memcpy(buf, priv->state, priv->state_len);
+	*len = priv->state_len;
+	return 0;
+}
+
+int
+rte_vdpa_vf_dev_state_set(const char *vf_name, const void *buf, size_t len)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_name(vf_name);
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid VF: %s", vf_name);
+		return -ENODEV;
+	}
+	if (priv->configured)
+		return -EBUSY;
+
+	virtio_vdpa_dev_state_free(priv);
+	if (!buf || !len)
+		return 0;
+	return virtio_vdpa_dev_state_append(priv, buf, len);
+}
+
+int
+rte_vdpa_vf_dev_state_append(const char *vf_name, const void *buf, size_t len)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_name(vf_name);
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid VF: %s", vf_name);
+		return -ENODEV;
+	}
+	if (priv->configured)
+		return -EBUSY;
+	if (!buf || !len)
+		return -EINVAL;
+	return virtio_vdpa_dev_state_append(priv, buf, len);
+}
+
+int
+rte_vdpa_vf_dev_state_precopy(const char *vf_name, uint64_t threshold,
+		uint32_t max_rounds, rte_vdpa_vf_state_sink_t sink, void *arg)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_name(vf_name);
+	int ret;
+
+	if (priv == NULL) {
+		DRV_LOG(ERR, "Invalid VF: %s", vf_name);
+		return -ENODEV;
+	}
+	if (!sink)
+		return -EINVAL;
+	if (!priv->configured)
+		return -EAGAIN;
+	if (!virtio_vdpa_pf_priv_get(priv)) {
+		DRV_LOG(ERR, "%s parent PF %s is not managed",
+					priv->vdev->device->name, priv->pf_name);
+		return -ENODEV;
+	}
+
+	ret = virtio_vdpa_state_precopy(priv->pf_priv, priv->vf_id, threshold,
+			max_rounds, sink, arg);
+	if (ret >= 0)
+		DRV_LOG(INFO, "%s pre-copied device state in %d rounds",
+					priv->vdev->device->name, ret);
+	return ret;
+}
+
+/* Answer one hand-over request, the VF is left running as it is */
+static void
+virtio_vdpa_handover_serve(int sock)
+{
+	struct virtio_vdpa_handover_hdr hdr = {
+		.version = VIRTIO_VDPA_HANDOVER_VERSION,
+	};
+	int fds[VIRTIO_VDPA_HANDOVER_NB_FDS];
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct virtio_vdpa_handover_vring *vrings = NULL;
+	struct virtio_vdpa_handover_req req;
+	struct virtio_vdpa_priv *priv = NULL;
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	int ack = -EIO;
+	uint16_t i;
+
+	if (recv(sock, &req, sizeof(req), 0) != sizeof(req) ||
+	    req.version != VIRTIO_VDPA_HANDOVER_VERSION) {
+		hdr.result = -EPROTO;
+		goto reply;
+	}
+	req.name[sizeof(req.name) - 1] = '\0';
+	priv = virtio_vdpa_find_priv_resource_by_name(req.name);
+	if (priv == NULL || priv->handed_over) {
+		hdr.result = -ENODEV;
+		goto reply;
+	}
+	/* A migration or a pre-pin in flight would be cut in the middle */
+	if (priv->dirty_tracking || priv->prepin_running) {
+		hdr.result = -EBUSY;
+		goto reply;
+	}
+
+	virtio_pci_dev_reset_wait(priv->vpdev);
+	hdr.guest_features = priv->guest_features;
+	hdr.running = priv->configured;
+	hdr.nr_dma_regions = priv->nr_dma_regions;
+	if (priv->configured) {
+		hdr.nr_vrings = priv->hw_nr_virtqs;
+		vrings = rte_zmalloc(NULL, sizeof(*vrings) * hdr.nr_vrings, 0);
+		if (vrings == NULL) {
+			hdr.result = -ENOMEM;
+			goto reply;
+		}
+		for (i = 0; i < priv->nr_virtqs; i++) {
+			if (!priv->vrings[i]->enable)
+				continue;
+			vrings[i].desc = priv->vrings[i]->desc;
+			vrings[i].avail = priv->vrings[i]->avail;
+			vrings[i].used = priv->vrings[i]->used;
+			vrings[i].size = priv->vrings[i]->size;
+			vrings[i].enable = 1;
+		}
+	}
+
+	fds[VIRTIO_VDPA_HANDOVER_FD_CONTAINER] = priv->vfio_container_fd;
+	fds[VIRTIO_VDPA_HANDOVER_FD_GROUP] = priv->vfio_group_fd;
+	fds[VIRTIO_VDPA_HANDOVER_FD_DEVICE] = priv->vfio_dev_fd;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+reply:
+	if (sendmsg(sock, &msg, 0) != sizeof(hdr) || hdr.result)
+		goto out;
+	if (hdr.nr_vrings || hdr.nr_dma_regions) {
+		iov[0].iov_base = vrings;
+		iov[0].iov_len = sizeof(*vrings) * hdr.nr_vrings;
+		iov[1].iov_base = priv->dma_regions;
+		iov[1].iov_len = sizeof(*priv->dma_regions) * hdr.nr_dma_regions;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		if (sendmsg(sock, &msg, 0) !=
+		    (ssize_t)(iov[0].iov_len + iov[1].iov_len))
+			goto out;
+	}
+	if (recv(sock, &ack, sizeof(ack), 0) != sizeof(ack))
+		ack = -EIO;
+	if (!ack)
+		__atomic_store_n(&priv->handed_over, true, __ATOMIC_RELEASE);
+
+out:
+	rte_free(vrings);
+	if (priv)
+		DRV_LOG(INFO, "%s hand-over %s: %d", priv->vdev->device->name,
+					ack ? "failed" : "done", hdr.result ? hdr.result : ack);
+}
+
+static void *
+virtio_vdpa_handover_thread(void *arg)
+{
+	struct timeval tv = { .tv_sec = VIRTIO_VDPA_HANDOVER_TIMEOUT_SEC };
+	int sock = (int)(intptr_t)arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			DRV_LOG(ERR, "Hand-over listener stopped: %s",
+						strerror(errno));
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		virtio_vdpa_handover_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int
+rte_vdpa_vf_handover_listen(const char *path)
+{
+	static pthread_mutex_t handover_lock = PTHREAD_MUTEX_INITIALIZER;
+	static int handover_sock = -1;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	pthread_t tid;
+	int sock, ret;
+
+	if (path == NULL ||
+	    strlcpy(addr.sun_path, path, sizeof(addr.sun_path)) >=
+			sizeof(addr.sun_path))
+		return -EINVAL;
+
+	pthread_mutex_lock(&handover_lock);
+	if (handover_sock >= 0) {
+		pthread_mutex_unlock(&handover_lock);
+		return -EEXIST;
+	}
+	sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sock < 0) {
+		ret = -errno;
+		goto error;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 1)) {
+		ret = -errno;
+		goto error;
+	}
+	ret = rte_ctrl_thread_create(&tid, "vdpa-handover", NULL,
+			virtio_vdpa_handover_thread, (void *)(intptr_t)sock);
+	if (ret)
+		goto error;
+	pthread_detach(tid);
+	handover_sock = sock;
+	pthread_mutex_unlock(&handover_lock);
+	DRV_LOG(INFO, "VFs are handed over at %s", path);
+	return 0;
+
+error:
+	DRV_LOG(ERR, "Failed to listen for hand-over at %s: %d", path, ret);
+	if (sock >= 0)
+		close(sock);
+	pthread_mutex_unlock(&handover_lock);
+	return ret;
+}
+
+int
+rte_vdpa_vf_handed_over(const char *vf_name)
+{
+	struct virtio_vdpa_priv *priv =
+		virtio_vdpa_find_priv_resource_by_name(vf_name);
+
+	if (priv == NULL)
+		return -ENODEV;
+	return __atomic_load_n(&priv->handed_over, __ATOMIC_ACQUIRE);
+}
+
+static int
+virtio_vdpa_tel_list(const char *cmd __rte_unused,
+		const char *params __rte_unused, struct rte_tel_data *d)
+{
+	char name[RTE_DEV_NAME_MAX_LEN];
+	struct virtio_vdpa_priv *priv;
+
+	rte_tel_data_start_array(d, RTE_TEL_STRING_VAL);
+	pthread_mutex_lock(&priv_list_lock);
+	TAILQ_FOREACH(priv, &virtio_priv_list, next) {
+		rte_pci_device_name(&priv->pdev->addr, name, sizeof(name));
+		rte_tel_data_add_array_string(d, name);
+	}
+	pthread_mutex_unlock(&priv_list_lock);
+	return 0;
+}
+
+/* Params are "<bdf>[,<qid>]", queues are summed up without a qid */
+static int
+virtio_vdpa_tel_stats(const char *cmd __rte_unused, const char *params,
+		struct rte_tel_data *d)
+{
+	uint64_t values[VIRTIO_VDPA_STATS_MAX], sum[VIRTIO_VDPA_STATS_MAX];
+	char name[RTE_DEV_NAME_MAX_LEN];
+	struct virtio_vdpa_priv *priv;
+	int qid = -1, first, last, i, k;
+	char *sep, *end;
+
+	if (params == NULL || strlcpy(name, params, sizeof(name)) >= sizeof(name))
+		return -EINVAL;
+	sep = strchr(name, ',');
+	if (sep) {
+		*sep++ = '\0';
+		qid = strtol(sep, &end, 0);
+		if (*sep == '\0' || *end != '\0' || qid < 0)
+			return -EINVAL;
+	}
+
+	priv = virtio_vdpa_find_priv_resource_by_name(name);
+	if (priv == NULL)
+		return -ENODEV;
+	if (qid >= (int)priv->hw_nr_virtqs)
+		return -E2BIG;
+	first = qid < 0 ? 0 : qid;
+	last = qid < 0 ? priv->hw_nr_virtqs - 1 : qid;
+
+	memset(sum, 0, sizeof(sum));
+	for (i = first; i <= last; i++) {
+		virtio_vdpa_vq_stats_fill(priv, i, values);
+		for (k = 0; k < VIRTIO_VDPA_STATS_MAX; k++)
+			sum[k] = qid < 0 ? sum[k] + values[k] : values[k];
 	}
 
-	return found ? 0 : -ENODEV;
+	rte_tel_data_start_dict(d);
+	rte_tel_data_add_dict_int(d, "configured", priv->configured);
+	rte_tel_data_add_dict_int(d, "nr_virtqs", priv->nr_virtqs);
+	for (k = 0; k < VIRTIO_VDPA_STATS_MAX; k++)
+		rte_tel_data_add_dict_u64(d, virtio_vdpa_stats_names[k], sum[k]);
+	return 0;
+}
+
+static int
+virtio_vdpa_tel_dma(const char *cmd __rte_unused, const char *params,
+		struct rte_tel_data *d)
+{
+	struct virtio_vdpa_dma_stats *stats;
+	struct virtio_vdpa_priv *priv;
+
+	if (params == NULL)
+		return -EINVAL;
+	priv = virtio_vdpa_find_priv_resource_by_name(params);
+	if (priv == NULL)
+		return -ENODEV;
+	stats = &priv->dma_stats;
+
+	rte_tel_data_start_dict(d);
+	rte_tel_data_add_dict_int(d, "workers", priv->dma_workers);
+	rte_tel_data_add_dict_int(d, "prepin", priv->dma_prepin);
+	rte_tel_data_add_dict_int(d, "regions", priv->nr_dma_regions);
+	rte_tel_data_add_dict_u64(d, "mapped_bytes", stats->mapped_bytes);
+	rte_tel_data_add_dict_u64(d, "progress_bytes",
+			__atomic_load_n(&stats->progress_bytes, __ATOMIC_RELAXED));
+	rte_tel_data_add_dict_u64(d, "progress_total",
+			__atomic_load_n(&stats->progress_total, __ATOMIC_RELAXED));
+	rte_tel_data_add_dict_u64(d, "last_map_bytes", stats->last_map_bytes);
+	rte_tel_data_add_dict_u64(d, "last_map_us", stats->last_map_us);
+	rte_tel_data_add_dict_u64(d, "slowest_region_us",
+			stats->slowest_region_us);
+	rte_tel_data_add_dict_int(d, "last_map_regions", stats->last_map_regions);
+	rte_tel_data_add_dict_int(d, "last_unmap_regions",
+			stats->last_unmap_regions);
+	return 0;
+}
+
+RTE_INIT(virtio_vdpa_telemetry_init)
+{
+	rte_telemetry_register_cmd("/vdpa/virtio/list", virtio_vdpa_tel_list,
+		"Returns the list of virtio vDPA devices. Takes no parameters");
+	rte_telemetry_register_cmd("/vdpa/virtio/stats", virtio_vdpa_tel_stats,
+		"Returns virtq counters of a device. Parameters: bdf[,qid]");
+	rte_telemetry_register_cmd("/vdpa/virtio/dma", virtio_vdpa_tel_dma,
+		"Returns guest memory DMA mapping stats of a device. Parameters: bdf");
 }
 
 /*
@@ -1037,4 +4027,13 @@ static struct rte_pci_driver virtio_vdpa_driver = {
 
 RTE_PMD_REGISTER_PCI(VIRTIO_VDPA_DRIVER_NAME, virtio_vdpa_driver);
 RTE_PMD_REGISTER_PCI_TABLE(VIRTIO_VDPA_DRIVER_NAME, pci_id_virtio_map);
+RTE_PMD_REGISTER_PARAM_STRING(VIRTIO_VDPA_DRIVER_NAME,
+	VIRTIO_ARG_VDPA "=" VIRTIO_ARG_VDPA_VALUE_VF " "
+	VIRTIO_VDPA_ARG_DIRTY_MAP "=bitmap|bytemap "
+	VIRTIO_VDPA_ARG_DOORBELL_RELAY "=intr|service "
+	VIRTIO_VDPA_ARG_DMA_WORKERS "=<1-16> "
+	VIRTIO_VDPA_ARG_DMA_PREPIN "=0|1 "
+	VIRTIO_VDPA_ARG_ASYNC_PROBE "=0|1 "
+	VIRTIO_VDPA_ARG_LAZY_ALLOC "=0|1 "
+	VIRTIO_VDPA_ARG_HANDOVER "=<path>");
 RTE_PMD_REGISTER_KMOD_DEP(VIRTIO_VDPA_DRIVER_NAME, "* vfio-pci");